@@ -0,0 +1,262 @@
+#define _GNU_SOURCE // syncfs
+#include "asyncwrite.h"
+#include "fileio.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+struct AsyncWriter
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work; // Writes were queued
+    pthread_cond_t room; // Writes were taken off the queue
+    AsyncWrite *head, *tail;
+    size_t queued;
+    uint64_t queued_bytes;
+    size_t in_progress;
+    uint32_t progress_ms;
+    async_write_progress_cb progress;
+    async_write_batch_cb batch_done;
+    async_write_done_cb done;
+    void *data;
+};
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Writes one write's data to its temporary file, reporting progress along
+// the way. Returns the open file, or -1 on error.
+static int write_out(AsyncWriter *writer, AsyncWrite *write)
+{
+    int fd = open(write->temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        perror("Async write open failed");
+        return -1;
+    }
+    while (write->written < write->len)
+    {
+        size_t left = write->len - write->written;
+        ssize_t n = pwrite(fd, write->data + write->written, left < ASYNC_WRITE_CHUNK ? left : ASYNC_WRITE_CHUNK,
+                           write->written);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            perror("Async write failed");
+            close(fd);
+            unlink(write->temp_path);
+            return -1;
+        }
+        write->written += n;
+        uint64_t now = now_ms();
+        if (write->written < write->len && now - write->last_report_ms >= writer->progress_ms)
+        {
+            writer->progress(write, writer->data);
+            write->last_report_ms = now;
+        }
+    }
+    return fd;
+}
+
+// Flushes the file system holding fd, or just the file if that fails
+static int flush_files(int fd)
+{
+    if (syncfs(fd) == 0)
+        return 0;
+    perror("syncfs failed");
+    return fsync(fd);
+}
+
+// Carries out a batch: every file is written, the batch is made durable
+// with one flush, the files are renamed into place and one more flush
+// makes the new names durable
+static void commit_batch(AsyncWriter *writer, AsyncWrite **batch, int count)
+{
+    int fds[ASYNC_WRITE_BATCH];
+    int outcome[ASYNC_WRITE_BATCH];
+    int any = -1;
+    for (int i = 0; i < count; i++)
+    {
+        fds[i] = write_out(writer, batch[i]);
+        outcome[i] = fds[i] >= 0 ? ASYNC_WRITE_SUCCEEDED : ASYNC_WRITE_FAILED;
+        if (fds[i] >= 0)
+            any = fds[i];
+    }
+    if (any >= 0 && flush_files(any) != 0)
+    {
+        // Each file on its own then, the one tried first included: its
+        // fsync() fallback may have failed
+        for (int i = 0; i < count; i++)
+        {
+            if (outcome[i] == ASYNC_WRITE_SUCCEEDED && fsync(fds[i]) != 0)
+            {
+                perror("Async write sync failed");
+                unlink(batch[i]->temp_path);
+                outcome[i] = ASYNC_WRITE_FAILED;
+            }
+        }
+    }
+    int renamed = -1;
+    for (int i = 0; i < count; i++)
+    {
+        if (outcome[i] != ASYNC_WRITE_SUCCEEDED)
+            continue;
+        if (rename(batch[i]->temp_path, batch[i]->path) != 0)
+        {
+            perror("Async write rename failed");
+            unlink(batch[i]->temp_path);
+            outcome[i] = ASYNC_WRITE_FAILED;
+            continue;
+        }
+        renamed = fds[i];
+    }
+    if (renamed >= 0 && flush_files(renamed) != 0)
+    {
+        // Each directory on its own then
+        for (int i = 0; i < count; i++)
+        {
+            if (outcome[i] == ASYNC_WRITE_SUCCEEDED && sync_parent_directory(batch[i]->path) != 0)
+            {
+                perror("Async write directory sync failed");
+                outcome[i] = ASYNC_WRITE_UNSYNCED;
+            }
+        }
+    }
+    if (writer->batch_done)
+        writer->batch_done(batch, outcome, count, writer->data);
+    for (int i = 0; i < count; i++)
+    {
+        if (fds[i] >= 0)
+            close(fds[i]);
+        writer->done(batch[i], outcome[i], writer->data);
+        free(batch[i]->data);
+        free(batch[i]);
+    }
+}
+
+static void *io_thread(void *arg)
+{
+    AsyncWriter *writer = (AsyncWriter *)arg;
+    AsyncWrite *batch[ASYNC_WRITE_BATCH];
+    while (1)
+    {
+        pthread_mutex_lock(&writer->lock);
+        while (writer->head == NULL)
+            pthread_cond_wait(&writer->work, &writer->lock);
+        int count = 0;
+        while (writer->head != NULL && count < ASYNC_WRITE_BATCH)
+        {
+            AsyncWrite *write = writer->head;
+            writer->head = write->next;
+            if (writer->head == NULL)
+                writer->tail = NULL;
+            writer->queued--;
+            writer->queued_bytes -= write->len;
+            batch[count++] = write;
+        }
+        writer->in_progress += count;
+        pthread_cond_broadcast(&writer->room);
+        pthread_mutex_unlock(&writer->lock);
+
+        commit_batch(writer, batch, count);
+
+        pthread_mutex_lock(&writer->lock);
+        writer->in_progress -= count;
+        pthread_mutex_unlock(&writer->lock);
+    }
+    return NULL;
+}
+
+AsyncWriter *async_writer_create(int threads, uint32_t progress_ms, async_write_progress_cb progress,
+                                 async_write_batch_cb batch_done, async_write_done_cb done, void *data)
+{
+    AsyncWriter *writer = (AsyncWriter *)calloc(1, sizeof(AsyncWriter));
+    if (!writer)
+        return NULL;
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->work, NULL);
+    pthread_cond_init(&writer->room, NULL);
+    writer->progress_ms = progress_ms;
+    writer->progress = progress;
+    writer->batch_done = batch_done;
+    writer->done = done;
+    writer->data = data;
+    if (threads <= 0)
+        threads = ASYNC_WRITE_THREADS;
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, io_thread, writer) != 0)
+        {
+            perror("Failed to start async write thread");
+            if (i == 0)
+            {
+                free(writer);
+                return NULL;
+            }
+            break;
+        }
+        pthread_detach(thread);
+    }
+    return writer;
+}
+
+int async_writer_submit(AsyncWriter *writer, const char *path, const char *data, size_t len, uint64_t session_token,
+                        void *owner, uint64_t seq)
+{
+    size_t path_len = strlen(path);
+    AsyncWrite *write = (AsyncWrite *)malloc(sizeof(AsyncWrite) + 2 * path_len + sizeof(".writing") + 1);
+    char *copy = (char *)malloc(len ? len : 1);
+    if (!write || !copy)
+    {
+        perror("Failed to allocate async write");
+        free(write);
+        free(copy);
+        return -1;
+    }
+    memcpy(copy, data, len);
+    memcpy(write->path, path, path_len + 1);
+    write->temp_path = write->path + path_len + 1;
+    sprintf(write->temp_path, "%s.writing", path);
+    write->next = NULL;
+    write->data = copy;
+    write->len = len;
+    write->written = 0;
+    write->session_token = session_token;
+    write->owner = owner;
+    write->seq = seq;
+    write->last_report_ms = now_ms();
+
+    pthread_mutex_lock(&writer->lock);
+    while (writer->queued >= ASYNC_WRITE_MAX_QUEUED ||
+           (writer->queued > 0 && writer->queued_bytes + len > ASYNC_WRITE_MAX_QUEUED_BYTES))
+        pthread_cond_wait(&writer->room, &writer->lock);
+    if (writer->tail)
+        writer->tail->next = write;
+    else
+        writer->head = write;
+    writer->tail = write;
+    writer->queued++;
+    writer->queued_bytes += len;
+    pthread_cond_signal(&writer->work);
+    pthread_mutex_unlock(&writer->lock);
+    return 0;
+}
+
+size_t async_writer_pending(AsyncWriter *writer)
+{
+    pthread_mutex_lock(&writer->lock);
+    size_t pending = writer->queued + writer->in_progress;
+    pthread_mutex_unlock(&writer->lock);
+    return pending;
+}
@@ -0,0 +1,71 @@
+#ifndef ASYNCWRITE_H
+#define ASYNCWRITE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Asynchronous writes for the storage server. An accepted write is queued
+// and carried out by a small pool of I/O threads rather than a thread of
+// its own. A thread takes the writes waiting, up to ASYNC_WRITE_BATCH of
+// them, writes each one to "<path>.writing" (the temporary name
+// synchronous writes use too), makes the whole batch durable with one
+// syncfs(), renames the files into place and syncs once more for the new
+// names: two flushes per batch however many writes it holds (group
+// commit). A file keeps its old content until its write is durable.
+//
+// The queue is bounded in writes and in bytes. Submitting to a full queue
+// waits for room, which holds the writing client back. Progress is
+// reported at most once per interval for each write.
+
+#define ASYNC_WRITE_THREADS 2
+#define ASYNC_WRITE_MAX_QUEUED 1024                  // Writes waiting
+#define ASYNC_WRITE_MAX_QUEUED_BYTES (256ULL << 20)  // Bytes waiting; a larger write is let in alone
+#define ASYNC_WRITE_BATCH 64                         // Most writes made durable together
+#define ASYNC_WRITE_CHUNK (1 << 20)                  // Bytes written between progress checks
+#define ASYNC_WRITE_PROGRESS_MS 1000
+
+typedef struct AsyncWriter AsyncWriter;
+
+typedef struct AsyncWrite
+{
+    struct AsyncWrite *next;
+    char *data;
+    size_t len;
+    size_t written;
+    uint64_t session_token; // Of the client that asked for the write
+    void *owner;            // The caller's, e.g. the file's access control
+    uint64_t seq;           // The caller's, e.g. the write's journal record
+    uint64_t last_report_ms;
+    char *temp_path;        // Points past path
+    char path[];
+} AsyncWrite;
+
+// Reports how far a write got. Called from an I/O thread.
+typedef void (*async_write_progress_cb)(const AsyncWrite *write, void *data);
+// How a write ended
+#define ASYNC_WRITE_FAILED 0    // The file kept its old content
+#define ASYNC_WRITE_SUCCEEDED 1 // The new content is durable in place
+#define ASYNC_WRITE_UNSYNCED 2  // The new content is in place, but its name may not survive a crash
+
+// Called once a write has ended with one of the outcomes above. The write
+// is freed when it returns.
+typedef void (*async_write_done_cb)(const AsyncWrite *write, int outcome, void *data);
+// Called once per batch with the outcome of each of its writes, before the
+// done callback of any of them, so that the batch can be recorded at once
+typedef void (*async_write_batch_cb)(AsyncWrite *const *writes, const int *outcomes, int count, void *data);
+
+// Starts threads I/O threads (0 for ASYNC_WRITE_THREADS). progress_ms is
+// the least time between two progress reports of a write. batch_done may
+// be NULL. Returns NULL on failure.
+AsyncWriter *async_writer_create(int threads, uint32_t progress_ms, async_write_progress_cb progress,
+                                 async_write_batch_cb batch_done, async_write_done_cb done, void *data);
+
+// Queues a write of a copy of data over path, waiting while the queue is
+// full. Returns 0, or -1 if out of memory.
+int async_writer_submit(AsyncWriter *writer, const char *path, const char *data, size_t len, uint64_t session_token,
+                        void *owner, uint64_t seq);
+
+// Writes queued or being written
+size_t async_writer_pending(AsyncWriter *writer);
+
+#endif // ASYNCWRITE_H
@@ -0,0 +1,276 @@
+#include "cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+typedef struct CacheEntry
+{
+    struct CacheEntry *hash_next; // Bucket chain
+    struct CacheEntry *lru_prev;  // Towards the most recently used entry
+    struct CacheEntry *lru_next;  // Towards the least recently used entry
+    uint64_t hash;
+    int server_handle;
+    size_t key_len;
+    char key[];
+} CacheEntry;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    CacheEntry **buckets;
+    size_t bucket_mask;
+    CacheEntry *lru_head; // Most recently used
+    CacheEntry *lru_tail; // Least recently used, evicted first
+    size_t count;
+    size_t capacity;
+} CacheShard;
+
+struct LocationCache
+{
+    CacheShard *shards;
+    int shard_count;
+};
+
+// FNV-1a; the high bits pick the shard and the low bits the bucket
+static uint64_t hash_path(const char *path, size_t len)
+{
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)path[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static CacheShard *shard_for(LocationCache *cache, uint64_t hash)
+{
+    return &cache->shards[(hash >> 48) % (uint64_t)cache->shard_count];
+}
+
+static void lru_unlink(CacheShard *shard, CacheEntry *entry)
+{
+    if (entry->lru_prev)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        shard->lru_head = entry->lru_next;
+    if (entry->lru_next)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        shard->lru_tail = entry->lru_prev;
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_push_front(CacheShard *shard, CacheEntry *entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head)
+        shard->lru_head->lru_prev = entry;
+    shard->lru_head = entry;
+    if (!shard->lru_tail)
+        shard->lru_tail = entry;
+}
+
+// Returns the bucket slot that points at the entry, or at NULL if absent
+static CacheEntry **find_slot(CacheShard *shard, uint64_t hash, const char *path, size_t len)
+{
+    CacheEntry **slot = &shard->buckets[hash & shard->bucket_mask];
+    while (*slot)
+    {
+        CacheEntry *e = *slot;
+        if (e->hash == hash && e->key_len == len && memcmp(e->key, path, len) == 0)
+            return slot;
+        slot = &e->hash_next;
+    }
+    return slot;
+}
+
+static void unlink_and_free(CacheShard *shard, CacheEntry *entry)
+{
+    CacheEntry **slot = &shard->buckets[entry->hash & shard->bucket_mask];
+    while (*slot != entry)
+        slot = &(*slot)->hash_next;
+    *slot = entry->hash_next;
+    lru_unlink(shard, entry);
+    shard->count--;
+    free(entry);
+}
+
+LocationCache *location_cache_create(size_t capacity, int shard_count)
+{
+    if (shard_count < 1)
+        shard_count = 1;
+    if (capacity < (size_t)shard_count)
+        capacity = shard_count;
+    LocationCache *cache = calloc(1, sizeof(LocationCache));
+    if (!cache)
+    {
+        perror("Failed to allocate location cache");
+        return NULL;
+    }
+    cache->shards = calloc(shard_count, sizeof(CacheShard));
+    if (!cache->shards)
+    {
+        perror("Failed to allocate location cache shards");
+        free(cache);
+        return NULL;
+    }
+    cache->shard_count = shard_count;
+    size_t per_shard = (capacity + shard_count - 1) / shard_count;
+    size_t buckets = 16;
+    while (buckets < per_shard)
+        buckets <<= 1;
+    for (int i = 0; i < shard_count; i++)
+    {
+        CacheShard *shard = &cache->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->capacity = per_shard;
+        shard->bucket_mask = buckets - 1;
+        shard->buckets = calloc(buckets, sizeof(CacheEntry *));
+        if (!shard->buckets)
+        {
+            perror("Failed to allocate location cache buckets");
+            location_cache_destroy(cache);
+            return NULL;
+        }
+    }
+    return cache;
+}
+
+void location_cache_destroy(LocationCache *cache)
+{
+    if (!cache)
+        return;
+    for (int i = 0; i < cache->shard_count; i++)
+    {
+        CacheShard *shard = &cache->shards[i];
+        CacheEntry *e = shard->lru_head;
+        while (e)
+        {
+            CacheEntry *next = e->lru_next;
+            free(e);
+            e = next;
+        }
+        free(shard->buckets);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    free(cache->shards);
+    free(cache);
+}
+
+// Returns the cached server handle and marks the entry most recently used,
+// or -1 if the path is not cached
+int location_cache_lookup(LocationCache *cache, const char *path)
+{
+    size_t len = strlen(path);
+    uint64_t hash = hash_path(path, len);
+    CacheShard *shard = shard_for(cache, hash);
+    int handle = -1;
+    pthread_mutex_lock(&shard->lock);
+    CacheEntry *e = *find_slot(shard, hash, path, len);
+    if (e)
+    {
+        handle = e->server_handle;
+        if (shard->lru_head != e)
+        {
+            lru_unlink(shard, e);
+            lru_push_front(shard, e);
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return handle;
+}
+
+// Inserts or updates a path, evicting the least recently used entry of the
+// shard when it is full
+void location_cache_insert(LocationCache *cache, const char *path, int server_handle)
+{
+    size_t len = strlen(path);
+    uint64_t hash = hash_path(path, len);
+    CacheShard *shard = shard_for(cache, hash);
+    pthread_mutex_lock(&shard->lock);
+    CacheEntry **slot = find_slot(shard, hash, path, len);
+    if (*slot)
+    {
+        (*slot)->server_handle = server_handle;
+        lru_unlink(shard, *slot);
+        lru_push_front(shard, *slot);
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+    CacheEntry *e = malloc(sizeof(CacheEntry) + len + 1);
+    if (!e)
+    {
+        pthread_mutex_unlock(&shard->lock);
+        perror("Failed to allocate cache entry");
+        return;
+    }
+    e->hash = hash;
+    e->server_handle = server_handle;
+    e->key_len = len;
+    memcpy(e->key, path, len + 1);
+    e->hash_next = NULL;
+    *slot = e;
+    lru_push_front(shard, e);
+    shard->count++;
+    if (shard->count > shard->capacity)
+        unlink_and_free(shard, shard->lru_tail);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// Drops one path. Returns 1 if it was cached.
+int location_cache_remove(LocationCache *cache, const char *path)
+{
+    size_t len = strlen(path);
+    uint64_t hash = hash_path(path, len);
+    CacheShard *shard = shard_for(cache, hash);
+    pthread_mutex_lock(&shard->lock);
+    CacheEntry *e = *find_slot(shard, hash, path, len);
+    if (e)
+        unlink_and_free(shard, e);
+    pthread_mutex_unlock(&shard->lock);
+    return e != NULL;
+}
+
+// Drops a path and every cached path below it (directory delete). Paths hash
+// to unrelated shards, so every shard is scanned; this is rare compared to
+// lookups.
+size_t location_cache_remove_subtree(LocationCache *cache, const char *path)
+{
+    size_t len = strlen(path);
+    size_t removed = 0;
+    for (int i = 0; i < cache->shard_count; i++)
+    {
+        CacheShard *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        CacheEntry *e = shard->lru_head;
+        while (e)
+        {
+            CacheEntry *next = e->lru_next;
+            if (e->key_len >= len && memcmp(e->key, path, len) == 0 &&
+                (e->key[len] == '\0' || e->key[len] == '/' || (len > 0 && path[len - 1] == '/')))
+            {
+                unlink_and_free(shard, e);
+                removed++;
+            }
+            e = next;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    return removed;
+}
+
+size_t location_cache_size(LocationCache *cache)
+{
+    size_t total = 0;
+    for (int i = 0; i < cache->shard_count; i++)
+    {
+        pthread_mutex_lock(&cache->shards[i].lock);
+        total += cache->shards[i].count;
+        pthread_mutex_unlock(&cache->shards[i].lock);
+    }
+    return total;
+}
@@ -0,0 +1,21 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+
+// Location cache for the naming server: maps a path to the handle of the
+// storage server that holds it. Entries live in a hash table with an
+// intrusive LRU list, split into independently locked shards so lookups
+// from different client threads rarely contend.
+
+typedef struct LocationCache LocationCache;
+
+LocationCache *location_cache_create(size_t capacity, int shard_count);
+void location_cache_destroy(LocationCache *cache);
+int location_cache_lookup(LocationCache *cache, const char *path);
+void location_cache_insert(LocationCache *cache, const char *path, int server_handle);
+int location_cache_remove(LocationCache *cache, const char *path);
+size_t location_cache_remove_subtree(LocationCache *cache, const char *path);
+size_t location_cache_size(LocationCache *cache);
+
+#endif // CACHE_H
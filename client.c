@@ -9,11 +9,20 @@
 #include <netinet/in.h>
 #include <errno.h>
 #include <sys/select.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "protocol.h"
 
 #define BUFFER_SIZE 40960
 #define TIMEOUT_SECONDS 5
+#define LIST_PAGE_SIZE 1000 // Entries requested per LIST page
+#define MAX_REPLICAS 8      // Most replicas a LOCATION reply lists
+#define BATCH_MAX_LINES 4096 // Most operations read for one BATCH command
 
 int ns_sock;
+uint64_t session_token; // Assigned by the Naming Server, identifies us in write notifications
+uint32_t next_request_id = 1;
 int receiving_list = 0;
 bool running = true;
 
@@ -38,8 +47,6 @@ FileLockEntry file_lock_map[MAX_FILES];
 int file_lock_count = 0;
 pthread_mutex_t file_map_lock = PTHREAD_MUTEX_INITIALIZER;
 
-pthread_mutex_t latest_ip_mutex = PTHREAD_MUTEX_INITIALIZER;
-
 FileLock *get_file_lock(const char *path)
 {
     pthread_mutex_lock(&file_map_lock);
@@ -95,41 +102,83 @@ void read_file(const char *path)
     pthread_mutex_unlock(&file_lock->lock);
 }
 
+// The other replicas of a LOCATION reply: for a read, servers to fall back
+// on in turn; for a write, the chain a quorum write is pushed along
+typedef struct
+{
+    uint32_t quorum;
+    char ip[MAX_REPLICAS][INET_ADDRSTRLEN];
+    int port[MAX_REPLICAS];
+    int count;
+} ReplicaList;
+
+// Final reply to the request the main thread is waiting for, filled in by
+// the listener thread. For LOCATION the buffer holds the IP.
 char critical_response_buffer[BUFFER_SIZE];
+uint16_t critical_response_opcode;
+int critical_response_port;
+ReplicaList critical_response_replicas;
+char *critical_response_batch; // Payload of a BATCH_RESULT
+size_t critical_response_batch_len;
+uint32_t awaited_request_id;
 pthread_mutex_t response_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t response_cond = PTHREAD_COND_INITIALIZER;
 bool critical_response_received = false;
 
 void *listen_to_ns(void *arg);
-void connect_and_read_from_ss(const char *ss_ip, int ss_port, const char *file_path);
-void connect_and_write_to_ss(const char *ss_ip, int ss_port, const char *file_path, const char *data);
+int connect_to_ss(const char *ss_ip, int ss_port);
+int connect_and_read_from_ss(const char *ss_ip, int ss_port, const char *file_path, uint16_t opcode, uint64_t offset,
+                             uint64_t length);
+void connect_and_write_to_ss(const char *ss_ip, int ss_port, const char *file_path, const char *data, bool is_sync,
+                             const ReplicaList *replicas, uint16_t opcode, uint64_t offset);
 void connect_and_get_file_info(const char *ss_ip, int ss_port, const char *file_path);
 
-char latest_IP_and_things_recieved_from_the_ns[BUFFER_SIZE];
+// Prints the message string of an OK or ERROR reply
+void print_reply(const char *prefix, const ProtoMessage *msg)
+{
+    ProtoReader reader;
+    proto_reader_init(&reader, msg);
+    const char *message = proto_get_str(&reader);
+    printf("%s%s\n", prefix, message ? message : "");
+}
 
-void stream_from_server(const char *ss_ip, int ss_port, const char *file_path)
+// Opens a connection to a Storage Server, returns the socket or -1
+int connect_to_ss(const char *ss_ip, int ss_port)
 {
     int ss_sock;
     struct sockaddr_in ss_addr;
-    char buffer[BUFFER_SIZE] = {0};
     if ((ss_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
     {
         perror("Socket creation error");
-        return;
+        return -1;
     }
     ss_addr.sin_family = AF_INET;
     ss_addr.sin_port = htons(ss_port);
-    printf("IP: %s %d\n", ss_ip, ss_port);
-    inet_pton(AF_INET, ss_ip, &ss_addr.sin_addr);
+    if (inet_pton(AF_INET, ss_ip, &ss_addr.sin_addr) <= 0)
+    {
+        fprintf(stderr, "Invalid address or address not supported\n");
+        close(ss_sock);
+        return -1;
+    }
     if (connect(ss_sock, (struct sockaddr *)&ss_addr, sizeof(ss_addr)) < 0)
     {
-        perror("Storage Server Connection failed");
+        perror("SS Connection failed");
         close(ss_sock);
+        return -1;
+    }
+    return ss_sock;
+}
+
+void stream_from_server(const char *ss_ip, int ss_port, const char *file_path)
+{
+    printf("IP: %s %d\n", ss_ip, ss_port);
+    int ss_sock = connect_to_ss(ss_ip, ss_port);
+    if (ss_sock < 0)
+    {
         return;
     }
-    snprintf(buffer, sizeof(buffer), "STREAM %s", file_path);
-    send(ss_sock, buffer, strlen(buffer), 0);
-    printf("\nRequest sent to Storage Server to stream: %s\n", buffer);
+    proto_send_str(ss_sock, PROTO_STREAM, 0, file_path);
+    printf("\nRequest sent to Storage Server to stream: %s\n", file_path);
     FILE *audio_pipe = popen("mpv --no-terminal --ao=alsa -", "w");
     if (!audio_pipe)
     {
@@ -137,88 +186,295 @@ void stream_from_server(const char *ss_ip, int ss_port, const char *file_path)
         close(ss_sock);
         return;
     }
-    int bytes_read;
-    while ((bytes_read = recv(ss_sock, buffer, BUFFER_SIZE, 0)) > 0)
+    ProtoMessage msg = {0};
+    int res;
+    while ((res = proto_recv(ss_sock, &msg)) > 0 && msg.header.opcode == PROTO_DATA)
     {
-        if (bytes_read == 3 && strncmp(buffer, "EOF", 3) == 0)
-        {
-            break;
-        }
-        fwrite(buffer, 1, bytes_read, audio_pipe);
+        fwrite(msg.payload, 1, msg.header.payload_len, audio_pipe);
     }
-    if (bytes_read < 0)
+    if (res <= 0)
     {
         perror("Error receiving audio data");
     }
+    else if (msg.header.opcode == PROTO_ERROR)
+    {
+        print_reply("", &msg);
+    }
+    proto_message_free(&msg);
     pclose(audio_pipe);
     close(ss_sock);
     printf("Streaming ended.\n");
 }
 
-void *listen_to_ns(void *arg)
+// Hands the final reply of the awaited request to the main thread
+static void deliver_response(const ProtoMessage *msg)
 {
-    char buffer[BUFFER_SIZE] = {0};
-    int flag = 0;
-    while (running)
+    ProtoReader reader;
+    proto_reader_init(&reader, msg);
+    pthread_mutex_lock(&response_mutex);
+    if (msg->header.request_id == awaited_request_id)
     {
-        memset(buffer, 0, BUFFER_SIZE);
-        int bytes_read = read(ns_sock, buffer, BUFFER_SIZE - 1);
-        if (bytes_read > 0)
+        critical_response_opcode = msg->header.opcode;
+        critical_response_buffer[0] = '\0';
+        if (msg->header.opcode == PROTO_BATCH_RESULT)
         {
-            buffer[bytes_read] = '\0';
-            if (strstr(buffer, "File: ") != 0 || strstr(buffer, "Directory: ") != 0)
+            // Kept whole for the main thread to walk
+            char *copy = realloc(critical_response_batch, msg->header.payload_len + 1);
+            if (copy)
             {
-                printf("%s", buffer);
-                receiving_list = 1;
-                continue;
+                memcpy(copy, msg->payload, msg->header.payload_len);
+                critical_response_batch = copy;
             }
-            else if (strncmp(buffer, "EOF", 3) == 0)
-            {
-                printf("End of list.\n");
-                receiving_list = 0;
-            }
-            else if (strncmp("IP", buffer, 2) == 0 || strncmp("File not found in any storage server", buffer, 36) == 0 || strncmp("Unknown command", buffer, 15) == 0)
-            {
-                pthread_mutex_lock(&latest_ip_mutex);
-                strncpy(latest_IP_and_things_recieved_from_the_ns, buffer, BUFFER_SIZE - 1);
-                latest_IP_and_things_recieved_from_the_ns[BUFFER_SIZE - 1] = '\0';
-                pthread_mutex_unlock(&latest_ip_mutex);
-                continue;
-            }
-            else
-            {
-                printf("\n%s\n", buffer);
-            }
-            if (flag == 0)
+            critical_response_batch_len = copy ? msg->header.payload_len : 0;
+        }
+        // LIST_END carries the cursor of the next page, if any
+        else if (msg->header.opcode != PROTO_LIST_END || reader.pos < reader.end)
+        {
+            const char *str = proto_get_str(&reader);
+            snprintf(critical_response_buffer, sizeof(critical_response_buffer), "%s", str ? str : "");
+        }
+        if (msg->header.opcode == PROTO_LOCATION)
+        {
+            critical_response_port = proto_get_u32(&reader);
+            ReplicaList *replicas = &critical_response_replicas;
+            replicas->quorum = reader.pos < reader.end ? proto_get_u32(&reader) : 1;
+            replicas->count = 0;
+            while (reader.pos < reader.end && replicas->count < MAX_REPLICAS)
             {
-                printf("Enter a command: ");
+                const char *ip = proto_get_str(&reader);
+                uint32_t port = proto_get_u32(&reader);
+                if (!ip || reader.failed)
+                    break;
+                snprintf(replicas->ip[replicas->count], INET_ADDRSTRLEN, "%s", ip);
+                replicas->port[replicas->count++] = port;
             }
-            flag = 1;
-            fflush(stdout);
         }
-        else if (bytes_read == 0)
+        critical_response_received = true;
+        pthread_cond_signal(&response_cond);
+    }
+    pthread_mutex_unlock(&response_mutex);
+}
+
+void *listen_to_ns(void *arg)
+{
+    ProtoMessage msg = {0};
+    while (running)
+    {
+        if (proto_recv(ns_sock, &msg) <= 0)
         {
             printf("Naming Server connection closed.\n");
-            running = false;
             break;
         }
-        else
+        ProtoReader reader;
+        proto_reader_init(&reader, &msg);
+        switch (msg.header.opcode)
         {
-            perror("Error reading from Naming Server");
-            running = false;
-            pthread_mutex_unlock(&response_mutex);
+        case PROTO_LIST_ENTRY:
+        {
+            int is_directory = proto_get_u8(&reader);
+            const char *path = proto_get_str(&reader);
+            printf("%s: %s\n", is_directory ? "Directory" : "File", path ? path : "");
+            receiving_list = 1;
+            break;
+        }
+        case PROTO_LIST_END:
+            if (msg.header.payload_len == 0)
+                printf("End of list.\n");
+            receiving_list = 0;
+            deliver_response(&msg);
+            break;
+        case PROTO_COPY_PROGRESS:
+        {
+            uint64_t paths = proto_get_u64(&reader);
+            uint64_t bytes = proto_get_u64(&reader);
+            printf("COPY progress: %llu paths, %llu bytes\n", (unsigned long long)paths, (unsigned long long)bytes);
+            fflush(stdout);
+            break;
+        }
+        case PROTO_ASYNC_PROGRESS:
+        case PROTO_ASYNC_DONE:
+        case PROTO_ASYNC_UNSYNCED:
+        case PROTO_ASYNC_FAILED:
+        {
+            proto_get_u64(&reader);
+            const char *path = proto_get_str(&reader);
+            const char *status = msg.header.opcode == PROTO_ASYNC_PROGRESS   ? "ASYNC_WRITE_PROGRESS"
+                                 : msg.header.opcode == PROTO_ASYNC_DONE     ? "ASYNC_WRITE_SUCCESS"
+                                 : msg.header.opcode == PROTO_ASYNC_UNSYNCED ? "ASYNC_WRITE_SUCCESS_NOT_DURABLE"
+                                                                             : "ASYNC_WRITE_FAIL";
+            printf("\n%s %s\n", status, path ? path : "");
+            fflush(stdout);
+            break;
+        }
+        default:
+            deliver_response(&msg);
             break;
         }
     }
+    proto_message_free(&msg);
+    pthread_mutex_lock(&response_mutex);
+    running = false;
+    pthread_cond_signal(&response_cond);
+    pthread_mutex_unlock(&response_mutex);
     return NULL;
 }
 
+// Sends a request to the Naming Server and waits for its final reply.
+// Returns the reply opcode, or 0 if the connection was lost.
+uint16_t request_from_ns(uint16_t opcode, const ProtoWriter *request)
+{
+    pthread_mutex_lock(&response_mutex);
+    uint32_t request_id = next_request_id++;
+    awaited_request_id = request_id;
+    critical_response_received = false;
+    pthread_mutex_unlock(&response_mutex);
+
+    if (proto_send_writer(ns_sock, opcode, 0, request_id, request) < 0)
+    {
+        perror("Failed to send request to Naming Server");
+        return 0;
+    }
+
+    pthread_mutex_lock(&response_mutex);
+    while (!critical_response_received && running)
+    {
+        pthread_cond_wait(&response_cond, &response_mutex);
+    }
+    uint16_t reply = critical_response_received ? critical_response_opcode : 0;
+    pthread_mutex_unlock(&response_mutex);
+    return reply;
+}
+
+// Maps a command name to its request opcode, or 0 if it is unknown
+uint16_t command_opcode(const char *command)
+{
+    if (strcmp(command, "READ") == 0)
+        return PROTO_READ;
+    if (strcmp(command, "WRITE") == 0)
+        return PROTO_WRITE;
+    if (strcmp(command, "INFO") == 0)
+        return PROTO_INFO;
+    if (strcmp(command, "STREAM") == 0)
+        return PROTO_STREAM;
+    if (strcmp(command, "LIST") == 0)
+        return PROTO_LIST;
+    if (strcmp(command, "CREATE_DIC") == 0)
+        return PROTO_CREATE_DIR;
+    if (strcmp(command, "CREATE_F") == 0)
+        return PROTO_CREATE_FILE;
+    if (strcmp(command, "DELETE") == 0)
+        return PROTO_DELETE;
+    if (strcmp(command, "COPY") == 0)
+        return PROTO_COPY;
+    if (strcmp(command, "SET_REPLICATION") == 0)
+        return PROTO_SET_REPLICATION;
+    if (strcmp(command, "REPAIR_STATUS") == 0)
+        return PROTO_REPAIR_STATUS;
+    if (strcmp(command, "BATCH") == 0)
+        return PROTO_BATCH;
+    if (strcmp(command, "READ_RANGE") == 0)
+        return PROTO_READ_RANGE;
+    if (strcmp(command, "WRITE_RANGE") == 0)
+        return PROTO_WRITE_RANGE;
+    if (strcmp(command, "APPEND") == 0)
+        return PROTO_APPEND;
+    return 0;
+}
+
+// Reads "<COMMAND> <path>" lines up to an empty one and sends them to the
+// Naming Server as one BATCH, then prints the result of each. Creations
+// take the full path of the new file or directory. Returns -1 if the
+// connection was lost or input ended.
+int run_batch(ProtoWriter *request)
+{
+    char line[BUFFER_SIZE];
+    char commands[BATCH_MAX_LINES][16];
+    char *paths[BATCH_MAX_LINES];
+    uint32_t count = 0;
+    int res = 0;
+    ProtoWriter ops;
+    proto_writer_init(&ops);
+    printf("Enter one \"<COMMAND> <path>\" per line (READ, WRITE, INFO, STREAM, CREATE_F, CREATE_DIC, DELETE), "
+           "then an empty line:\n");
+    while (count < BATCH_MAX_LINES)
+    {
+        if (!fgets(line, BUFFER_SIZE, stdin))
+        {
+            res = -1;
+            break;
+        }
+        line[strcspn(line, "\n")] = 0;
+        if (line[0] == '\0')
+            break;
+        char *path = strchr(line, ' ');
+        if (path != NULL)
+            *path++ = '\0';
+        uint16_t opcode = command_opcode(line);
+        if (path == NULL || *path == '\0' || strlen(line) >= sizeof(commands[0]) ||
+            (opcode != PROTO_READ && opcode != PROTO_WRITE && opcode != PROTO_INFO && opcode != PROTO_STREAM &&
+             opcode != PROTO_CREATE_FILE && opcode != PROTO_CREATE_DIR && opcode != PROTO_DELETE))
+        {
+            printf("Skipped: %s\n", line);
+            continue;
+        }
+        strcpy(commands[count], line);
+        paths[count] = strdup(path);
+        proto_put_u32(&ops, opcode);
+        proto_put_str(&ops, path);
+        count++;
+    }
+    if (res == 0 && count > 0)
+    {
+        proto_writer_reset(request);
+        proto_put_u32(request, count);
+        proto_put_bytes(request, ops.data, ops.len);
+        printf("Request sent to Naming Server: BATCH of %u operations\n", count);
+        uint16_t reply = request_from_ns(PROTO_BATCH, request);
+        if (reply == 0)
+        {
+            res = -1;
+        }
+        else if (reply != PROTO_BATCH_RESULT)
+        {
+            printf("%s\n", critical_response_buffer);
+        }
+        else
+        {
+            ProtoReader reader = {critical_response_batch, critical_response_batch + critical_response_batch_len, 0};
+            uint32_t results = proto_get_u32(&reader);
+            for (uint32_t i = 0; i < results && i < count; i++)
+            {
+                uint16_t opcode = (uint16_t)proto_get_u32(&reader);
+                uint32_t len = proto_get_u32(&reader);
+                const char *body = proto_get_bytes(&reader, len);
+                if (!body)
+                    break;
+                ProtoReader result = {body, body + len, 0};
+                const char *str = proto_get_str(&result);
+                if (opcode == PROTO_LOCATION)
+                {
+                    uint32_t port = proto_get_u32(&result);
+                    printf("%s %s: IP: %s Port: %u\n", commands[i], paths[i], str ? str : "", port);
+                }
+                else
+                {
+                    printf("%s %s: %s%s\n", commands[i], paths[i], opcode == PROTO_ERROR ? "ERROR: " : "",
+                           str ? str : "");
+                }
+            }
+        }
+    }
+    for (uint32_t i = 0; i < count; i++)
+        free(paths[i]);
+    proto_writer_free(&ops);
+    return res;
+}
+
 pthread_t listener_thread;
 
 void send_request_to_ns(const char *naming_server_ip, int ns_port, const char *command, const char *file_path)
 {
     struct sockaddr_in ns_addr;
-    char buffer[BUFFER_SIZE] = {0};
     if ((ns_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
     {
         perror("Socket creation error");
@@ -233,27 +489,35 @@ void send_request_to_ns(const char *naming_server_ip, int ns_port, const char *c
         close(ns_sock);
         return;
     }
-    snprintf(buffer, sizeof(buffer), "CLIENT CONNECTING TO NAMING SERVER ...");
-    send(ns_sock, buffer, strlen(buffer), 0);
     printf("Connecting to Naming Server as client ...\n");
-    sleep(1);
+    ProtoMessage welcome = {0};
+    ProtoReader reader;
+    if (proto_send(ns_sock, PROTO_CLIENT_HELLO, 0, 0, NULL, 0) < 0 || proto_recv(ns_sock, &welcome) <= 0 ||
+        welcome.header.opcode != PROTO_WELCOME)
+    {
+        printf("Naming Server did not accept the connection\n");
+        proto_message_free(&welcome);
+        close(ns_sock);
+        return;
+    }
+    proto_reader_init(&reader, &welcome);
+    session_token = proto_get_u64(&reader);
+    proto_message_free(&welcome);
+    printf("Connected to Naming Server\n");
     pthread_create(&listener_thread, NULL, listen_to_ns, NULL);
     pthread_detach(listener_thread);
-    int flag = 0;
+    ProtoWriter request;
+    proto_writer_init(&request);
     while (running)
     {
         char command[BUFFER_SIZE];
         char file_path[BUFFER_SIZE];
-        int is_sync = 0;
+        bool is_sync = false;
         char file_name[BUFFER_SIZE];
-        if (flag == 1)
-        {
-            printf("\nEnter a command: ");
-        }
-        flag = 1;
+        printf("\nEnter a command: ");
         if (!fgets(command, BUFFER_SIZE, stdin)) {
             printf("Error reading command.\n");
-            continue;
+            break;
         }
         if (strcmp(command, "\n") == 0 || strcmp(command, " ") == 0)
         {
@@ -264,281 +528,367 @@ void send_request_to_ns(const char *naming_server_ip, int ns_port, const char *c
         if (strcmp(command, "EXIT") == 0)
         {
             printf("Exiting.\n");
+            proto_send(ns_sock, PROTO_STOP, 0, 0, NULL, 0);
             running = false;
             break;
         }
-        printf("Enter file path: ");
-        if (!fgets(file_path, BUFFER_SIZE, stdin)) {
-            printf("Error reading file path.\n");
+        uint16_t opcode = command_opcode(command);
+        if (opcode == 0)
+        {
+            printf("Unknown command: %s\n", command);
+            continue;
+        }
+        if (opcode == PROTO_BATCH)
+        {
+            if (run_batch(&request) < 0)
+                break;
             continue;
         }
-        file_path[strcspn(file_path, "\n")] = 0;
-        if (strcmp(command, "CREATE_DIC") == 0)
+        if (opcode == PROTO_REPAIR_STATUS)
         {
-            printf("Enter name of directory (without ./): ");
+            file_path[0] = '\0';
+        }
+        else
+        {
+            printf("Enter file path: ");
+            if (!fgets(file_path, BUFFER_SIZE, stdin)) {
+                printf("Error reading file path.\n");
+                break;
+            }
+            file_path[strcspn(file_path, "\n")] = 0;
+        }
+        if (opcode == PROTO_CREATE_DIR || opcode == PROTO_CREATE_FILE)
+        {
+            printf("Enter name of %s (without ./): ", opcode == PROTO_CREATE_DIR ? "directory" : "file");
             if (!fgets(file_name, BUFFER_SIZE, stdin)) {
-                printf("Error reading directory name.\n");
-                continue;
+                printf("Error reading name.\n");
+                break;
             }
             file_name[strcspn(file_name, "\n")] = 0;
             strncat(file_path, "/", BUFFER_SIZE - strlen(file_path) - 1);
             strncat(file_path, file_name, BUFFER_SIZE - strlen(file_path) - 1);
         }
-        else if (strcmp(command, "CREATE_F") == 0)
+        proto_writer_reset(&request);
+        if (opcode == PROTO_COPY)
         {
-            printf("Enter name of file (without ./): ");
-            if (!fgets(file_name, BUFFER_SIZE, stdin)) {
-                printf("Error reading file name.\n");
+            // Source and destination are given on one line
+            char *destination = strchr(file_path, ' ');
+            if (destination == NULL)
+            {
+                printf("Usage: <source> <destination>\n");
                 continue;
             }
-            file_name[strcspn(file_name, "\n")] = 0;
-            strncat(file_path, "/", BUFFER_SIZE - strlen(file_path) - 1);
-            strncat(file_path, file_name, BUFFER_SIZE - strlen(file_path) - 1);
+            *destination++ = '\0';
+            proto_put_str(&request, file_path);
+            proto_put_str(&request, destination);
         }
-        snprintf(buffer, sizeof(buffer), "%s %s", command, file_path);
-        send(ns_sock, buffer, strlen(buffer), 0);
-        printf("Request sent to Naming Server: %s\n", buffer);
-        sleep(0.7);
-        if (strstr(buffer, "Unknown command") != 0)
+        else if (opcode == PROTO_SET_REPLICATION)
         {
-            printf("Unknown command: %s\n", command);
-            continue;
+            char settings[BUFFER_SIZE];
+            unsigned int copies, write_quorum, read_quorum;
+            printf("Enter copies, write quorum and read quorum (0 0 0 to inherit): ");
+            if (!fgets(settings, BUFFER_SIZE, stdin)) {
+                printf("Error reading replication settings.\n");
+                break;
+            }
+            if (sscanf(settings, "%u %u %u", &copies, &write_quorum, &read_quorum) != 3)
+            {
+                printf("Usage: <copies> <write quorum> <read quorum>\n");
+                continue;
+            }
+            proto_put_str(&request, file_path);
+            proto_put_u32(&request, copies);
+            proto_put_u32(&request, write_quorum);
+            proto_put_u32(&request, read_quorum);
+        }
+        else
+        {
+            proto_put_str(&request, file_path);
+            if (opcode == PROTO_LIST)
+                proto_put_u32(&request, LIST_PAGE_SIZE);
         }
-        if (strcmp(command, "LIST") == 0 || strcmp(command, "CREATE_DIC") == 0 || strcmp(command, "CREATE_F") == 0 || strcmp(command, "DELETE") == 0 || strcmp(command, "COPY") == 0)
+        printf("Request sent to Naming Server: %s %s\n", command, file_path);
+        uint16_t reply = request_from_ns(opcode, &request);
+        // Fetch a long listing page by page, resuming after the last path
+        while (opcode == PROTO_LIST && reply == PROTO_LIST_END && critical_response_buffer[0] != '\0')
         {
+            char cursor[BUFFER_SIZE];
+            strcpy(cursor, critical_response_buffer);
+            proto_writer_reset(&request);
+            proto_put_str(&request, file_path);
+            proto_put_u32(&request, LIST_PAGE_SIZE);
+            proto_put_str(&request, cursor);
+            reply = request_from_ns(opcode, &request);
+        }
+        if (reply == 0)
+        {
+            break;
+        }
+        if (reply == PROTO_OK)
+        {
+            printf("%s\n", critical_response_buffer);
             continue;
         }
-        if (strstr(buffer, "File not found in any storage server") != 0)
+        if (reply == PROTO_ERROR)
         {
+            printf("%s\n", critical_response_buffer);
             continue;
         }
-        int bytes_read = 0;
-        sleep(1);
-        char local_latest_ip[BUFFER_SIZE];
-        pthread_mutex_lock(&latest_ip_mutex);
-        strncpy(local_latest_ip, latest_IP_and_things_recieved_from_the_ns, BUFFER_SIZE - 1);
-        local_latest_ip[BUFFER_SIZE - 1] = '\0';
-        pthread_mutex_unlock(&latest_ip_mutex);
-        int byts_read = strlen(local_latest_ip);
-        if (strncmp(local_latest_ip, "Unknown command", strlen("Unknown command")) == 0)
+        if (reply != PROTO_LOCATION)
         {
-            printf("Unknown command: %s\n", command);
             continue;
         }
-        printf("Naming Server sent the details of the storage server:\n%s\n", local_latest_ip);
-        bytes_read = 1;
-        if (byts_read > 0)
+        char ss_ip[INET_ADDRSTRLEN];
+        strncpy(ss_ip, critical_response_buffer, sizeof(ss_ip) - 1);
+        ss_ip[sizeof(ss_ip) - 1] = '\0';
+        int ss_port = critical_response_port;
+        ReplicaList replicas = critical_response_replicas;
+        printf("Naming Server sent the details of the storage server:\nIP: %s Port: %d\n", ss_ip, ss_port);
+        printf("Connecting to Storage Server at IP: %s, Port: %d\n", ss_ip, ss_port);
+        if (opcode == PROTO_READ)
         {
-            buffer[byts_read] = '\0';
-            if (strstr(local_latest_ip, "File not found in any storage server") != 0)
+            // Fall back on the other up-to-date replicas if one cannot serve it
+            int i = 0;
+            while (connect_and_read_from_ss(ss_ip, ss_port, file_path, PROTO_READ, 0, 0) < 0 && i < replicas.count)
             {
-                continue;
+                snprintf(ss_ip, sizeof(ss_ip), "%s", replicas.ip[i]);
+                ss_port = replicas.port[i++];
+                printf("Trying replica at IP: %s, Port: %d\n", ss_ip, ss_port);
             }
-            char ss_ip[INET_ADDRSTRLEN];
-            int ss_port;
-            sscanf(local_latest_ip, " IP: %s Port: %d", ss_ip, &ss_port);
-            printf("Connecting to Storage Server at IP: %s, Port: %d\n", ss_ip, ss_port);
-            if (strcmp(command, "READ") == 0)
-            {
-                connect_and_read_from_ss(ss_ip, ss_port, file_path);
+        }
+        else if (opcode == PROTO_WRITE)
+        {
+            char sync_flag[BUFFER_SIZE];
+            char data[BUFFER_SIZE];
+            printf("Do you want to write synchronously irrespective of time overhead? (yes/no): ");
+            if (!fgets(sync_flag, BUFFER_SIZE, stdin)) {
+                printf("Error reading sync flag.\n");
+                break;
             }
-            else if (strcmp(command, "WRITE") == 0)
+            sync_flag[strcspn(sync_flag, "\n")] = 0;
+            if (strcmp(sync_flag, "yes") == 0)
+                is_sync = true;
+            printf("Enter data to write (or @<local file> to upload a file): ");
+            if (!fgets(data, BUFFER_SIZE, stdin)) {
+                printf("Error reading data to write.\n");
+                break;
+            }
+            connect_and_write_to_ss(ss_ip, ss_port, file_path, data, is_sync, &replicas, PROTO_WRITE, 0);
+        }
+        else if (opcode == PROTO_READ_RANGE)
+        {
+            char range[BUFFER_SIZE];
+            unsigned long long offset, length;
+            printf("Enter offset and length (length 0 reads to the end): ");
+            if (!fgets(range, BUFFER_SIZE, stdin)) {
+                printf("Error reading range.\n");
+                break;
+            }
+            if (sscanf(range, "%llu %llu", &offset, &length) != 2)
             {
-                char sync_flag[BUFFER_SIZE];
-                printf("Do you want to write synchronously irrespective of time overhead? (yes/no): ");
-                if (!fgets(sync_flag, BUFFER_SIZE, stdin)) {
-                    printf("Error reading sync flag.\n");
-                    continue;
-                }
-                sync_flag[strcspn(sync_flag, "\n")] = 0;
-                if (strcmp(sync_flag, "yes") == 0)
-                    is_sync = 1;
-                memset(buffer, 0, sizeof(buffer));
-                if (is_sync)
-                {
-                    snprintf(buffer, sizeof(buffer), "--SYNC");
-                }
-                printf("Enter data to write: ");
-                if (!fgets(buffer + strlen(buffer), BUFFER_SIZE - strlen(buffer), stdin)) {
-                    printf("Error reading data to write.\n");
-                    continue;
-                }
-                connect_and_write_to_ss(ss_ip, ss_port, file_path, buffer);
+                printf("Usage: <offset> <length>\n");
+                continue;
             }
-            else if (strcmp(command, "INFO") == 0)
+            int i = 0;
+            while (connect_and_read_from_ss(ss_ip, ss_port, file_path, PROTO_READ_RANGE, offset, length) < 0 &&
+                   i < replicas.count)
             {
-                connect_and_get_file_info(ss_ip, ss_port, file_path);
+                snprintf(ss_ip, sizeof(ss_ip), "%s", replicas.ip[i]);
+                ss_port = replicas.port[i++];
+                printf("Trying replica at IP: %s, Port: %d\n", ss_ip, ss_port);
             }
-            else if (strcmp(command, "STREAM") == 0)
+        }
+        else if (opcode == PROTO_WRITE_RANGE || opcode == PROTO_APPEND)
+        {
+            char line[BUFFER_SIZE];
+            char data[BUFFER_SIZE];
+            unsigned long long offset = 0;
+            if (opcode == PROTO_WRITE_RANGE)
             {
-                char *ext = strrchr(file_path, '.');
-                if (ext == NULL || strcmp(ext, ".mp3") != 0)
-                {
-                    printf("Invalid file extension. Only .mp3 files are supported for streaming.\n");
-                    continue;
+                printf("Enter offset: ");
+                if (!fgets(line, BUFFER_SIZE, stdin)) {
+                    printf("Error reading offset.\n");
+                    break;
                 }
-                if (system("which mpv > /dev/null 2>&1") != 0) {
-                    printf("mpv is not installed. Please install mpv to use streaming.\n");
+                if (sscanf(line, "%llu", &offset) != 1)
+                {
+                    printf("Usage: <offset>\n");
                     continue;
                 }
-                stream_from_server(ss_ip, ss_port, file_path);
             }
-            else if (strcmp(command, "LIST") == 0)
-            {
-                printf("List of files in the directory:\n%s\n", local_latest_ip);
-                send(ns_sock, "LIST", strlen("LIST"), 0);
-                sleep(1);
+            printf("Enter data to write: ");
+            if (!fgets(data, BUFFER_SIZE, stdin)) {
+                printf("Error reading data to write.\n");
+                break;
             }
-            else
+            // A range overwrites exactly the bytes given; an append adds the line
+            if (opcode == PROTO_WRITE_RANGE)
+                data[strcspn(data, "\n")] = 0;
+            connect_and_write_to_ss(ss_ip, ss_port, file_path, data, true, &replicas, opcode, offset);
+        }
+        else if (opcode == PROTO_INFO)
+        {
+            connect_and_get_file_info(ss_ip, ss_port, file_path);
+        }
+        else if (opcode == PROTO_STREAM)
+        {
+            char *ext = strrchr(file_path, '.');
+            if (ext == NULL || strcmp(ext, ".mp3") != 0)
             {
-                printf("Wrong input command: %s\n", command);
+                printf("Invalid file extension. Only .mp3 files are supported for streaming.\n");
+                continue;
+            }
+            if (system("which mpv > /dev/null 2>&1") != 0) {
+                printf("mpv is not installed. Please install mpv to use streaming.\n");
+                continue;
             }
+            stream_from_server(ss_ip, ss_port, file_path);
         }
     }
+    proto_writer_free(&request);
     close(ns_sock);
 }
 
-void connect_and_read_from_ss(const char *ss_ip, int ss_port, const char *file_path)
+// Reads a file, or length bytes of it from offset for a READ_RANGE, and
+// prints it. Returns -1 if this server could not serve it.
+int connect_and_read_from_ss(const char *ss_ip, int ss_port, const char *file_path, uint16_t opcode, uint64_t offset,
+                             uint64_t length)
 {
-    int ss_sock;
-    struct sockaddr_in ss_addr;
-    char buffer[BUFFER_SIZE] = {0};
-    if ((ss_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    int ss_sock = connect_to_ss(ss_ip, ss_port);
+    if (ss_sock < 0)
     {
-        perror("Socket creation error");
-        return;
+        return -1;
     }
-    ss_addr.sin_family = AF_INET;
-    ss_addr.sin_port = htons(ss_port);
-    ss_addr.sin_addr.s_addr = inet_addr(ss_ip);
-    if (inet_pton(AF_INET, ss_ip, &ss_addr.sin_addr) <= 0)
+    ProtoWriter request;
+    proto_writer_init(&request);
+    proto_put_str(&request, file_path);
+    if (opcode == PROTO_READ_RANGE)
     {
-        fprintf(stderr, "Invalid address or address not supported\n");
-        close(ss_sock);
-        return;
+        proto_put_u64(&request, offset);
+        proto_put_u64(&request, length);
     }
-    if (connect(ss_sock, (struct sockaddr *)&ss_addr, sizeof(ss_addr)) < 0)
+    proto_send_writer(ss_sock, opcode, 0, 0, &request);
+    proto_writer_free(&request);
+    ProtoMessage msg = {0};
+    bool printed_header = false;
+    int res = -1;
+    while (proto_recv(ss_sock, &msg) > 0)
     {
-        perror("SS Connection failed");
-        close(ss_sock);
-        return;
-    }
-    snprintf(buffer, sizeof(buffer), "READ %s", file_path);
-    send(ss_sock, buffer, strlen(buffer), 0);
-    printf("File content:\n");
-    while (1)
-    {
-        int bytes_read = read(ss_sock, buffer, BUFFER_SIZE - 1);
-        if (bytes_read <= 0)
+        if (msg.header.opcode == PROTO_ERROR)
         {
+            print_reply("", &msg);
             break;
         }
-        buffer[bytes_read] = '\0';
-        if (strcmp(buffer, "Write in progress. Cannot read the file right now. Please try again later.\n") == 0)
+        if (msg.header.opcode != PROTO_DATA)
         {
-            printf("Write in progress. Cannot read the file right now. Please try again later.\n");
+            res = msg.header.opcode == PROTO_END ? 0 : -1;
             break;
         }
-        if (strcmp(buffer, "EOF\n") == 0)
+        if (!printed_header)
         {
-            break;
+            printf("File content:\n");
+            printed_header = true;
         }
-        printf("%s", buffer);
+        fwrite(msg.payload, 1, msg.header.payload_len, stdout);
     }
+    proto_message_free(&msg);
     close(ss_sock);
+    return res;
 }
 
-void connect_and_write_to_ss(const char *ss_ip, int ss_port, const char *file_path, const char *data)
+// Sends a WRITE, or a WRITE_RANGE at offset or an APPEND, of data
+void connect_and_write_to_ss(const char *ss_ip, int ss_port, const char *file_path, const char *data, bool is_sync,
+                             const ReplicaList *replicas, uint16_t opcode, uint64_t offset)
 {
-    int ss_sock;
-    struct sockaddr_in ss_addr;
-    char buffer[BUFFER_SIZE] = {0};
-    if ((ss_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    // "@<local file>" uploads that file, streamed in chunks, whatever its size
+    int local_fd = -1;
+    struct stat local_st;
+    if (opcode == PROTO_WRITE && data[0] == '@')
     {
-        perror("Socket creation error");
-        return;
+        char local_path[BUFFER_SIZE];
+        snprintf(local_path, sizeof(local_path), "%s", data + 1);
+        local_path[strcspn(local_path, "\n")] = 0;
+        local_fd = open(local_path, O_RDONLY);
+        if (local_fd < 0 || fstat(local_fd, &local_st) < 0)
+        {
+            perror("Error opening local file");
+            if (local_fd >= 0)
+                close(local_fd);
+            return;
+        }
+        is_sync = true; // Streamed writes are always synchronous
     }
-    ss_addr.sin_family = AF_INET;
-    ss_addr.sin_port = htons(ss_port);
-    if (inet_pton(AF_INET, ss_ip, &ss_addr.sin_addr) <= 0)
+    int ss_sock = connect_to_ss(ss_ip, ss_port);
+    if (ss_sock < 0)
     {
-        fprintf(stderr, "Invalid address or address not supported\n");
-        close(ss_sock);
+        if (local_fd >= 0)
+            close(local_fd);
         return;
     }
-    if (connect(ss_sock, (struct sockaddr *)&ss_addr, sizeof(ss_addr)) < 0)
+    ProtoWriter writer;
+    proto_writer_init(&writer);
+    proto_put_u64(&writer, session_token);
+    proto_put_str(&writer, file_path);
+    if (opcode == PROTO_WRITE_RANGE)
     {
-        perror("SS Connection failed");
-        close(ss_sock);
-        return;
+        proto_put_u64(&writer, offset);
     }
-    snprintf(buffer, sizeof(buffer), "WRITE %s %s", file_path, data);
-    send(ss_sock, buffer, strlen(buffer), 0);
-    sleep(1);
-    if (strncmp(data, "--SYNC", 6) != 0)
+    uint16_t flags = is_sync ? PROTO_FLAG_SYNC : 0;
+    // A synchronous write waits until the quorum holds it
+    if (is_sync && replicas->quorum > 1)
     {
-        size_t data_len = strlen(data);
-        size_t sent_bytes = 0;
-        while (sent_bytes < data_len)
+        flags |= PROTO_FLAG_QUORUM;
+        proto_put_u32(&writer, replicas->quorum);
+        proto_put_u32(&writer, replicas->count);
+        for (int i = 0; i < replicas->count; i++)
         {
-            size_t chunk_size = (data_len - sent_bytes > BUFFER_SIZE) ? BUFFER_SIZE : data_len - sent_bytes;
-            ssize_t bytes_sent = send(ss_sock, data + sent_bytes, chunk_size, 0);
-            if (bytes_sent < 0)
-            {
-                perror("Error sending data");
-                break;
-            }
-            sent_bytes += bytes_sent;
+            proto_put_str(&writer, replicas->ip[i]);
+            proto_put_u32(&writer, replicas->port[i]);
         }
     }
+    int res;
+    if (local_fd >= 0)
+    {
+        res = proto_send_writer(ss_sock, PROTO_WRITE, flags | PROTO_FLAG_STREAM, 0, &writer);
+        if (res == 0)
+            res = proto_send_file(ss_sock, 0, local_fd, 0, local_st.st_size);
+        if (res == 0)
+            res = proto_send(ss_sock, PROTO_END, 0, 0, NULL, 0);
+        close(local_fd);
+    }
     else
     {
-        send(ss_sock, data, strlen(data), 0);
+        proto_put_bytes(&writer, data, strlen(data));
+        res = proto_send_writer(ss_sock, opcode, flags, 0, &writer);
+    }
+    if (res < 0)
+    {
+        perror("Error sending data");
     }
-    sleep(0.4);
-    snprintf(data, sizeof(data), "EOF");
-    send(ss_sock, data, strlen(data), 0);
-    int bytes_read = read(ss_sock, buffer, BUFFER_SIZE - 1);
-    if (bytes_read > 0)
+    proto_writer_free(&writer);
+    ProtoMessage reply = {0};
+    if (proto_recv(ss_sock, &reply) > 0)
     {
-        buffer[bytes_read] = '\0';
-        printf("Storage Server response: %s\n", buffer);
+        print_reply("Storage Server response: ", &reply);
     }
+    proto_message_free(&reply);
     close(ss_sock);
 }
 
 void connect_and_get_file_info(const char *ss_ip, int ss_port, const char *file_path)
 {
-    int ss_sock;
-    struct sockaddr_in ss_addr;
-    char buffer[BUFFER_SIZE] = {0};
-    if ((ss_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    int ss_sock = connect_to_ss(ss_ip, ss_port);
+    if (ss_sock < 0)
     {
-        perror("Socket creation error");
-        return;
-    }
-    ss_addr.sin_family = AF_INET;
-    ss_addr.sin_port = htons(ss_port);
-    if (inet_pton(AF_INET, ss_ip, &ss_addr.sin_addr) <= 0)
-    {
-        fprintf(stderr, "Invalid address or address not supported\n");
-        close(ss_sock);
-        return;
-    }
-    if (connect(ss_sock, (struct sockaddr *)&ss_addr, sizeof(ss_addr)) < 0)
-    {
-        perror("SS Connection failed");
-        close(ss_sock);
         return;
     }
-    snprintf(buffer, sizeof(buffer), "INFO %s", file_path);
-    send(ss_sock, buffer, strlen(buffer), 0);
-    int bytes_read = read(ss_sock, buffer, BUFFER_SIZE - 1);
-    if (bytes_read > 0)
+    proto_send_str(ss_sock, PROTO_INFO, 0, file_path);
+    ProtoMessage reply = {0};
+    if (proto_recv(ss_sock, &reply) > 0)
     {
-        buffer[bytes_read] = '\0';
-        printf("File info from Storage Server: %s\n", buffer);
+        print_reply("File info from Storage Server: ", &reply);
     }
+    proto_message_free(&reply);
     close(ss_sock);
 }
 
@@ -0,0 +1,233 @@
+#include "connpool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+typedef struct
+{
+    int sock;
+    uint64_t idle_since_ms;
+} IdleConnection;
+
+typedef struct
+{
+    IdleConnection *idle; // Most recently released last
+    int idle_count;
+} Endpoint;
+
+struct ConnPool
+{
+    pthread_mutex_t lock;
+    Endpoint *endpoints; // By node
+    int endpoint_count;
+    int max_idle;
+    uint32_t idle_timeout_ms;
+    uint64_t opened;
+    uint64_t reused;
+};
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+ConnPool *connpool_create(int max_idle, uint32_t idle_timeout_ms)
+{
+    ConnPool *pool = (ConnPool *)calloc(1, sizeof(ConnPool));
+    if (!pool)
+        return NULL;
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->max_idle = max_idle > 0 ? max_idle : CONNPOOL_MAX_IDLE;
+    pool->idle_timeout_ms = idle_timeout_ms;
+    return pool;
+}
+
+void connpool_free(ConnPool *pool)
+{
+    if (!pool)
+        return;
+    for (int i = 0; i < pool->endpoint_count; i++)
+    {
+        for (int j = 0; j < pool->endpoints[i].idle_count; j++)
+            close(pool->endpoints[i].idle[j].sock);
+        free(pool->endpoints[i].idle);
+    }
+    free(pool->endpoints);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+// Called with the lock held
+static Endpoint *endpoint(ConnPool *pool, int node)
+{
+    if (node < 0)
+        return NULL;
+    if (node >= pool->endpoint_count)
+    {
+        int count = pool->endpoint_count ? pool->endpoint_count : 16;
+        while (count <= node)
+            count *= 2;
+        Endpoint *grown = (Endpoint *)realloc(pool->endpoints, count * sizeof(Endpoint));
+        if (!grown)
+            return NULL;
+        memset(grown + pool->endpoint_count, 0, (count - pool->endpoint_count) * sizeof(Endpoint));
+        pool->endpoints = grown;
+        pool->endpoint_count = count;
+    }
+    Endpoint *ep = &pool->endpoints[node];
+    if (!ep->idle)
+    {
+        ep->idle = (IdleConnection *)calloc(pool->max_idle, sizeof(IdleConnection));
+        if (!ep->idle)
+            return NULL;
+    }
+    return ep;
+}
+
+// An idle connection should have nothing to read: a readable one was closed
+// by the peer, failed, or got bytes nobody asked for
+static int is_healthy(int sock)
+{
+    struct pollfd pfd = {.fd = sock, .events = POLLIN};
+    if (poll(&pfd, 1, 0) != 0)
+        return 0;
+    int error = 0;
+    socklen_t len = sizeof(error);
+    return getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &len) == 0 && error == 0;
+}
+
+static int open_connection(const char *ip, int port)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+    {
+        perror("Socket creation failed");
+        return -1;
+    }
+    struct sockaddr_in server_addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = inet_addr(ip)};
+    if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    {
+        perror("Connection to server failed");
+        close(sock);
+        return -1;
+    }
+    // Pooled connections sit idle for a while; find out if the peer vanished
+    int on = 1;
+    int idle = CONNPOOL_KEEPALIVE_IDLE_SECONDS;
+    int interval = CONNPOOL_KEEPALIVE_INTERVAL_SECONDS;
+    int probes = CONNPOOL_KEEPALIVE_PROBES;
+    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes));
+    // Requests are small and may be pipelined; do not hold them back
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return sock;
+}
+
+// Closes the connections of an endpoint idle for too long. Called with the
+// lock held.
+static void expire_idle(ConnPool *pool, Endpoint *ep, uint64_t now)
+{
+    int kept = 0;
+    for (int i = 0; i < ep->idle_count; i++)
+    {
+        if (pool->idle_timeout_ms && now - ep->idle[i].idle_since_ms >= pool->idle_timeout_ms)
+            close(ep->idle[i].sock);
+        else
+            ep->idle[kept++] = ep->idle[i];
+    }
+    ep->idle_count = kept;
+}
+
+int connpool_acquire(ConnPool *pool, int node, const char *ip, int port)
+{
+    pthread_mutex_lock(&pool->lock);
+    Endpoint *ep = endpoint(pool, node);
+    if (ep)
+    {
+        expire_idle(pool, ep, now_ms());
+        // The most recently used connection is the likeliest to be alive
+        while (ep->idle_count > 0)
+        {
+            int sock = ep->idle[--ep->idle_count].sock;
+            if (is_healthy(sock))
+            {
+                pool->reused++;
+                pthread_mutex_unlock(&pool->lock);
+                return sock;
+            }
+            close(sock);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    int sock = open_connection(ip, port);
+    if (sock >= 0)
+    {
+        pthread_mutex_lock(&pool->lock);
+        pool->opened++;
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return sock;
+}
+
+void connpool_release(ConnPool *pool, int node, int sock, int reusable)
+{
+    if (sock < 0)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    Endpoint *ep = reusable ? endpoint(pool, node) : NULL;
+    if (ep)
+    {
+        uint64_t now = now_ms();
+        expire_idle(pool, ep, now);
+        if (ep->idle_count == pool->max_idle)
+        {
+            // Full: the oldest goes
+            close(ep->idle[0].sock);
+            memmove(ep->idle, ep->idle + 1, (ep->idle_count - 1) * sizeof(IdleConnection));
+            ep->idle_count--;
+        }
+        ep->idle[ep->idle_count].sock = sock;
+        ep->idle[ep->idle_count].idle_since_ms = now;
+        ep->idle_count++;
+        sock = -1;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (sock >= 0)
+        close(sock);
+}
+
+void connpool_forget(ConnPool *pool, int node)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (node >= 0 && node < pool->endpoint_count)
+    {
+        Endpoint *ep = &pool->endpoints[node];
+        for (int i = 0; i < ep->idle_count; i++)
+            close(ep->idle[i].sock);
+        ep->idle_count = 0;
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void connpool_stats(ConnPool *pool, uint64_t *opened, uint64_t *reused)
+{
+    pthread_mutex_lock(&pool->lock);
+    *opened = pool->opened;
+    *reused = pool->reused;
+    pthread_mutex_unlock(&pool->lock);
+}
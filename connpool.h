@@ -0,0 +1,45 @@
+#ifndef CONNPOOL_H
+#define CONNPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Pooled connections from the naming server to the storage servers' client
+// ports. A storage server serves any number of requests on one connection,
+// in order, so a connection given back after a complete exchange is kept
+// and handed out again instead of paying a TCP handshake (and leaving a
+// TIME_WAIT socket behind) for every file. Idle connections have TCP
+// keep-alive on, are closed after a while without use, and are checked
+// before reuse: one the peer closed, or that has unexpected bytes waiting,
+// is dropped and the next one (or a new connection) is tried.
+//
+// A leased connection belongs to its caller until it is released, so
+// concurrent copies use separate connections. Within one lease, requests
+// may be pipelined: replies come back in request order and carry the
+// request_id they answer.
+
+#define CONNPOOL_MAX_IDLE 4             // Idle connections kept per storage server
+#define CONNPOOL_IDLE_TIMEOUT_MS 30000  // Idle connections older than this are closed
+#define CONNPOOL_KEEPALIVE_IDLE_SECONDS 10
+#define CONNPOOL_KEEPALIVE_INTERVAL_SECONDS 5
+#define CONNPOOL_KEEPALIVE_PROBES 3
+
+typedef struct ConnPool ConnPool;
+
+// max_idle connections are kept per server, 0 for CONNPOOL_MAX_IDLE
+ConnPool *connpool_create(int max_idle, uint32_t idle_timeout_ms);
+void connpool_free(ConnPool *pool);
+
+// Returns a connected socket to the server known as node, at ip:port: a
+// healthy idle one if there is any, a new one otherwise. -1 on error.
+int connpool_acquire(ConnPool *pool, int node, const char *ip, int port);
+// Gives a leased socket back. Pass reusable = 0 if an exchange on it failed
+// or was left unfinished; it is closed instead of kept.
+void connpool_release(ConnPool *pool, int node, int sock, int reusable);
+// Closes the idle connections to a server that went down or registered again
+void connpool_forget(ConnPool *pool, int node);
+
+// Connections opened and leases served from the pool since it was created
+void connpool_stats(ConnPool *pool, uint64_t *opened, uint64_t *reused);
+
+#endif // CONNPOOL_H
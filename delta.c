@@ -0,0 +1,419 @@
+#include "delta.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define DELTA_READ_CHUNK (1 << 20)
+#define WEAK_TABLE_MIN 1024
+
+uint32_t delta_weak_hash(const unsigned char *data, size_t len)
+{
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        a += data[i];
+        b += (uint32_t)(len - i) * data[i];
+    }
+    return (a & 0xFFFF) | (b << 16);
+}
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xFF51AFD7ED558CCDULL;
+    k ^= k >> 33;
+    k *= 0xC4CEB9FE1A85EC53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+uint64_t delta_strong_hash(const void *data, size_t len, uint64_t seed)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    const uint64_t c1 = 0x87C37B91114253D5ULL;
+    const uint64_t c2 = 0x4CF5AD432745937FULL;
+    uint64_t h1 = seed, h2 = seed;
+    size_t blocks = len / 16;
+
+    for (size_t i = 0; i < blocks; i++)
+    {
+        uint64_t k1, k2;
+        memcpy(&k1, bytes + i * 16, 8);
+        memcpy(&k2, bytes + i * 16 + 8, 8);
+        k1 *= c1;
+        k1 = rotl64(k1, 31);
+        k1 *= c2;
+        h1 ^= k1;
+        h1 = rotl64(h1, 27);
+        h1 += h2;
+        h1 = h1 * 5 + 0x52DCE729;
+        k2 *= c2;
+        k2 = rotl64(k2, 33);
+        k2 *= c1;
+        h2 ^= k2;
+        h2 = rotl64(h2, 31);
+        h2 += h1;
+        h2 = h2 * 5 + 0x38495AB5;
+    }
+
+    const unsigned char *tail = bytes + blocks * 16;
+    uint64_t k1 = 0, k2 = 0;
+    switch (len & 15)
+    {
+    case 15: k2 ^= (uint64_t)tail[14] << 48; // fall through
+    case 14: k2 ^= (uint64_t)tail[13] << 40; // fall through
+    case 13: k2 ^= (uint64_t)tail[12] << 32; // fall through
+    case 12: k2 ^= (uint64_t)tail[11] << 24; // fall through
+    case 11: k2 ^= (uint64_t)tail[10] << 16; // fall through
+    case 10: k2 ^= (uint64_t)tail[9] << 8;   // fall through
+    case 9:
+        k2 ^= (uint64_t)tail[8];
+        k2 *= c2;
+        k2 = rotl64(k2, 33);
+        k2 *= c1;
+        h2 ^= k2;
+        // fall through
+    case 8: k1 ^= (uint64_t)tail[7] << 56; // fall through
+    case 7: k1 ^= (uint64_t)tail[6] << 48; // fall through
+    case 6: k1 ^= (uint64_t)tail[5] << 40; // fall through
+    case 5: k1 ^= (uint64_t)tail[4] << 32; // fall through
+    case 4: k1 ^= (uint64_t)tail[3] << 24; // fall through
+    case 3: k1 ^= (uint64_t)tail[2] << 16; // fall through
+    case 2: k1 ^= (uint64_t)tail[1] << 8;  // fall through
+    case 1:
+        k1 ^= (uint64_t)tail[0];
+        k1 *= c1;
+        k1 = rotl64(k1, 31);
+        k1 *= c2;
+        h1 ^= k1;
+    }
+
+    h1 ^= len;
+    h2 ^= len;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+    return h1 ^ h2;
+}
+
+// Reads up to len bytes at offset, retrying short reads. Returns the count read.
+static ssize_t read_at(int fd, void *buffer, size_t len, off_t offset)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t n = pread(fd, (char *)buffer + done, len - done, offset + done);
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+int delta_file_hash(int fd, uint64_t *hash)
+{
+    unsigned char *buffer = malloc(DELTA_READ_CHUNK);
+    if (!buffer)
+        return -1;
+    uint64_t h = 0;
+    off_t offset = 0;
+    ssize_t n;
+    while ((n = read_at(fd, buffer, DELTA_READ_CHUNK, offset)) > 0)
+    {
+        h = delta_strong_hash(buffer, n, h);
+        offset += n;
+    }
+    free(buffer);
+    if (n < 0)
+        return -1;
+    *hash = h;
+    return 0;
+}
+
+static uint32_t choose_block_size(uint64_t file_size)
+{
+    uint32_t block_size = DELTA_MIN_BLOCK;
+    while (file_size / block_size > DELTA_MAX_BLOCKS)
+        block_size *= 2;
+    return block_size;
+}
+
+int delta_signature_compute(int fd, DeltaSignature *sig)
+{
+    memset(sig, 0, sizeof(*sig));
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+    {
+        sig->block_size = DELTA_MIN_BLOCK;
+        return 0;
+    }
+    sig->file_size = st.st_size;
+    sig->block_size = choose_block_size(sig->file_size);
+    sig->block_count = (sig->file_size + sig->block_size - 1) / sig->block_size;
+    if (sig->block_count == 0)
+        return 0;
+    sig->blocks = malloc(sig->block_count * sizeof(DeltaBlock));
+    unsigned char *buffer = malloc(sig->block_size);
+    if (!sig->blocks || !buffer)
+    {
+        free(buffer);
+        delta_signature_free(sig);
+        return -1;
+    }
+    for (size_t i = 0; i < sig->block_count; i++)
+    {
+        ssize_t n = read_at(fd, buffer, sig->block_size, (off_t)i * sig->block_size);
+        if (n <= 0)
+        {
+            // The file shrank while being read; describe what was there
+            sig->block_count = i;
+            break;
+        }
+        sig->blocks[i].weak = delta_weak_hash(buffer, n);
+        sig->blocks[i].strong = delta_strong_hash(buffer, n, 0);
+    }
+    free(buffer);
+    return 0;
+}
+
+void delta_signature_free(DeltaSignature *sig)
+{
+    free(sig->blocks);
+    sig->blocks = NULL;
+    sig->block_count = 0;
+}
+
+void delta_signature_put(ProtoWriter *writer, const DeltaSignature *sig)
+{
+    proto_put_u32(writer, sig->block_size);
+    proto_put_u64(writer, sig->file_size);
+    for (size_t i = 0; i < sig->block_count; i++)
+    {
+        proto_put_u32(writer, sig->blocks[i].weak);
+        proto_put_u64(writer, sig->blocks[i].strong);
+    }
+}
+
+int delta_signature_get(ProtoReader *reader, DeltaSignature *sig)
+{
+    memset(sig, 0, sizeof(*sig));
+    sig->block_size = proto_get_u32(reader);
+    sig->file_size = proto_get_u64(reader);
+    if (reader->failed || sig->block_size == 0)
+        return -1;
+    size_t count = (size_t)(reader->end - reader->pos) / 12;
+    if (count == 0)
+        return 0;
+    sig->blocks = malloc(count * sizeof(DeltaBlock));
+    if (!sig->blocks)
+        return -1;
+    for (size_t i = 0; i < count; i++)
+    {
+        sig->blocks[i].weak = proto_get_u32(reader);
+        sig->blocks[i].strong = proto_get_u64(reader);
+    }
+    sig->block_count = count;
+    return reader->failed ? -1 : 0;
+}
+
+// Blocks indexed by weak checksum: table[] holds the first block of each
+// chain (+1, 0 for none), next[] links blocks with the same bucket
+typedef struct
+{
+    uint32_t *table;
+    uint32_t *next;
+    size_t mask;
+} WeakIndex;
+
+static int build_index(const DeltaSignature *sig, WeakIndex *index)
+{
+    size_t buckets = WEAK_TABLE_MIN;
+    while (buckets < sig->block_count * 2)
+        buckets *= 2;
+    index->mask = buckets - 1;
+    index->table = calloc(buckets, sizeof(uint32_t));
+    index->next = calloc(sig->block_count ? sig->block_count : 1, sizeof(uint32_t));
+    if (!index->table || !index->next)
+    {
+        free(index->table);
+        free(index->next);
+        return -1;
+    }
+    // Inserted backwards so chains list blocks in file order
+    for (size_t i = sig->block_count; i-- > 0;)
+    {
+        size_t b = (sig->blocks[i].weak * 0x9E3779B1u) & index->mask;
+        index->next[i] = index->table[b];
+        index->table[b] = (uint32_t)i + 1;
+    }
+    return 0;
+}
+
+// Returns the block at data matching weak, or -1. The block that would
+// extend the previous copy is preferred so runs stay contiguous.
+static long find_block(const DeltaSignature *sig, const WeakIndex *index, uint32_t weak, const unsigned char *data,
+                       size_t len, long preferred)
+{
+    uint64_t strong = 0;
+    int have_strong = 0;
+    long found = -1;
+    size_t b = (weak * 0x9E3779B1u) & index->mask;
+    for (uint32_t i = index->table[b]; i != 0; i = index->next[i - 1])
+    {
+        const DeltaBlock *block = &sig->blocks[i - 1];
+        size_t block_len = (size_t)(i - 1) + 1 == sig->block_count && sig->file_size % sig->block_size
+                               ? sig->file_size % sig->block_size
+                               : sig->block_size;
+        if (block->weak != weak || block_len != len)
+            continue;
+        if (!have_strong)
+        {
+            strong = delta_strong_hash(data, len, 0);
+            have_strong = 1;
+        }
+        if (block->strong == strong)
+        {
+            found = (long)i - 1;
+            if (found == preferred)
+                break;
+        }
+    }
+    return found;
+}
+
+int delta_generate(const unsigned char *data, size_t len, const DeltaSignature *sig, delta_literal_cb literal,
+                   delta_copy_cb copy, void *ctx)
+{
+    WeakIndex index;
+    if (sig->block_count == 0 || build_index(sig, &index) < 0)
+        return len ? literal(data, len, ctx) : 0;
+
+    const size_t block_size = sig->block_size;
+    size_t literal_start = 0, pos = 0;
+    long run_first = -1;
+    uint32_t run_count = 0;
+    int res = 0;
+    uint32_t a = 0, b = 0;
+    int rolling = 0;
+
+    while (res == 0 && pos < len)
+    {
+        size_t window = len - pos < block_size ? len - pos : block_size;
+        if (!rolling)
+        {
+            uint32_t weak = delta_weak_hash(data + pos, window);
+            a = weak & 0xFFFF;
+            b = weak >> 16;
+            rolling = 1;
+        }
+        long match = find_block(sig, &index, (a & 0xFFFF) | (b << 16), data + pos, window,
+                                run_first >= 0 ? run_first + (long)run_count : -1);
+        if (match >= 0)
+        {
+            if (pos > literal_start || (run_first >= 0 && match != run_first + (long)run_count))
+            {
+                if (run_first >= 0)
+                    res = copy((uint32_t)run_first, run_count, ctx);
+                if (res == 0 && pos > literal_start)
+                    res = literal(data + literal_start, pos - literal_start, ctx);
+                run_first = -1;
+            }
+            if (run_first < 0)
+            {
+                run_first = match;
+                run_count = 0;
+            }
+            run_count++;
+            pos += window;
+            literal_start = pos;
+            rolling = 0;
+            continue;
+        }
+        if (window < block_size)
+        {
+            // Only the last block can be short, and it did not match
+            break;
+        }
+        // Slide the window one byte
+        unsigned char out = data[pos];
+        if (pos + block_size < len)
+        {
+            unsigned char in = data[pos + block_size];
+            a = (a - out + in) & 0xFFFF;
+            b = (b - (uint32_t)block_size * out + a) & 0xFFFF;
+        }
+        else
+        {
+            rolling = 0; // The window now shrinks; recompute it
+        }
+        pos++;
+    }
+
+    if (res == 0 && run_first >= 0)
+        res = copy((uint32_t)run_first, run_count, ctx);
+    if (res == 0 && literal_start < len)
+        res = literal(data + literal_start, len - literal_start, ctx);
+    free(index.table);
+    free(index.next);
+    return res;
+}
+
+int delta_apply(ProtoReader *ops, int basis_fd, uint32_t block_size, FILE *out)
+{
+    unsigned char *buffer = NULL;
+    int res = 0;
+    while (res == 0 && ops->pos < ops->end)
+    {
+        uint8_t op = proto_get_u8(ops);
+        if (op == DELTA_OP_LITERAL)
+        {
+            uint32_t len = proto_get_u32(ops);
+            if (ops->failed || (size_t)(ops->end - ops->pos) < len)
+            {
+                res = -1;
+                break;
+            }
+            if (fwrite(ops->pos, 1, len, out) != len)
+                res = -1;
+            ops->pos += len;
+        }
+        else if (op == DELTA_OP_COPY)
+        {
+            uint32_t first = proto_get_u32(ops);
+            uint32_t count = proto_get_u32(ops);
+            if (ops->failed || basis_fd < 0)
+            {
+                res = -1;
+                break;
+            }
+            if (!buffer && !(buffer = malloc(block_size)))
+            {
+                res = -1;
+                break;
+            }
+            for (uint32_t i = 0; i < count && res == 0; i++)
+            {
+                ssize_t n = read_at(basis_fd, buffer, block_size, (off_t)(first + i) * block_size);
+                if (n <= 0 || fwrite(buffer, 1, n, out) != (size_t)n)
+                    res = -1;
+            }
+        }
+        else
+        {
+            res = -1;
+        }
+    }
+    free(buffer);
+    return ops->failed ? -1 : res;
+}
@@ -0,0 +1,70 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "protocol.h"
+
+// rsync-style delta transfer between replicas. The receiver describes its
+// current copy as a list of fixed-size blocks, each with a weak rolling
+// checksum and a strong hash. The sender slides a window over its file,
+// rolling the weak checksum one byte at a time; where it matches a block
+// (and the strong hash confirms it) the block is referenced instead of
+// sent, and everything else goes out as literal bytes.
+//
+// On the wire the signature is u32 block size, u64 file size, then
+// (u32 weak, u64 strong) per block. A delta is a sequence of operations,
+// (u8 DELTA_OP_LITERAL, u32 length, bytes) or
+// (u8 DELTA_OP_COPY, u32 first block, u32 block count).
+
+#define DELTA_MIN_BLOCK 2048
+#define DELTA_MAX_BLOCKS 32768 // Larger files get larger blocks
+
+enum
+{
+    DELTA_OP_LITERAL = 0,
+    DELTA_OP_COPY = 1
+};
+
+typedef struct
+{
+    uint32_t weak;
+    uint64_t strong;
+} DeltaBlock;
+
+typedef struct
+{
+    uint32_t block_size;
+    uint64_t file_size;
+    size_t block_count;
+    DeltaBlock *blocks;
+} DeltaSignature;
+
+// Receives one delta operation. Return non-zero to stop.
+typedef int (*delta_literal_cb)(const unsigned char *data, size_t len, void *ctx);
+typedef int (*delta_copy_cb)(uint32_t first_block, uint32_t block_count, void *ctx);
+
+uint32_t delta_weak_hash(const unsigned char *data, size_t len);
+// MurmurHash3 (x64, 128-bit) folded to 64 bits
+uint64_t delta_strong_hash(const void *data, size_t len, uint64_t seed);
+// Hash of a whole file, read from fd; used to verify a rebuilt replica
+int delta_file_hash(int fd, uint64_t *hash);
+
+// Describes the file open at fd (-1 for no file). Returns 0 on success.
+int delta_signature_compute(int fd, DeltaSignature *sig);
+void delta_signature_free(DeltaSignature *sig);
+void delta_signature_put(ProtoWriter *writer, const DeltaSignature *sig);
+int delta_signature_get(ProtoReader *reader, DeltaSignature *sig);
+
+// Walks data against a signature, calling copy for matched blocks
+// (consecutive ones merged) and literal for the bytes in between.
+// Returns 0, or the first non-zero callback result.
+int delta_generate(const unsigned char *data, size_t len, const DeltaSignature *sig, delta_literal_cb literal,
+                   delta_copy_cb copy, void *ctx);
+
+// Applies the operations in one DELTA payload, reading referenced blocks
+// from basis_fd and appending to out. Returns 0 on success, -1 on error.
+int delta_apply(ProtoReader *ops, int basis_fd, uint32_t block_size, FILE *out);
+
+#endif // DELTA_H
@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "delta.h"
+
+// Standalone test of the replica delta encoding:
+//   gcc -o delta_test delta_test.c delta.c protocol.c && ./delta_test
+
+#define BASIS_SIZE (300 * 1024)
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+    if (ok) {
+        printf("✅ %s\n", what);
+    } else {
+        printf("❌ %s\n", what);
+        failures++;
+    }
+}
+
+typedef struct {
+    ProtoWriter ops;
+    size_t literal_bytes;
+    size_t copied_blocks;
+} Ops;
+
+// Encoded the way a storage server sends them
+static int put_literal(const unsigned char *data, size_t len, void *ctx) {
+    Ops *o = (Ops *)ctx;
+    o->literal_bytes += len;
+    proto_put_u8(&o->ops, DELTA_OP_LITERAL);
+    proto_put_u32(&o->ops, len);
+    proto_put_bytes(&o->ops, data, len);
+    return 0;
+}
+
+static int put_copy(uint32_t first_block, uint32_t block_count, void *ctx) {
+    Ops *o = (Ops *)ctx;
+    o->copied_blocks += block_count;
+    proto_put_u8(&o->ops, DELTA_OP_COPY);
+    proto_put_u32(&o->ops, first_block);
+    proto_put_u32(&o->ops, block_count);
+    return 0;
+}
+
+static FILE *file_with(const unsigned char *data, size_t len) {
+    FILE *file = tmpfile();
+    if (len && fwrite(data, 1, len, file) != len) {
+        perror("fwrite");
+    }
+    fflush(file);
+    return file;
+}
+
+// Sends the signature of basis through the wire encoding, encodes target
+// against it and applies the delta to basis. Returns 1 if the result is
+// target byte for byte; *o tells how it was encoded.
+static int round_trip(const unsigned char *basis, size_t basis_len, const unsigned char *target, size_t target_len,
+                      Ops *o) {
+    FILE *basis_file = basis ? file_with(basis, basis_len) : NULL;
+    int basis_fd = basis_file ? fileno(basis_file) : -1;
+
+    DeltaSignature computed, received;
+    ProtoWriter wire;
+    proto_writer_init(&wire);
+    if (delta_signature_compute(basis_fd, &computed) != 0) {
+        return 0;
+    }
+    delta_signature_put(&wire, &computed);
+    ProtoReader reader = {wire.data, wire.data + wire.len, 0};
+    int ok = delta_signature_get(&reader, &received) == 0 && received.block_count == computed.block_count &&
+             received.block_size == computed.block_size && received.file_size == basis_len;
+    delta_signature_free(&computed);
+
+    memset(o, 0, sizeof(*o));
+    proto_writer_init(&o->ops);
+    ok = ok && delta_generate(target, target_len, &received, put_literal, put_copy, o) == 0;
+
+    FILE *out = tmpfile();
+    ProtoReader ops = {o->ops.data, o->ops.data + o->ops.len, 0};
+    ok = ok && delta_apply(&ops, basis_fd, received.block_size, out) == 0;
+    fflush(out);
+
+    unsigned char *rebuilt = malloc(target_len + 1);
+    long size = ftell(out);
+    rewind(out);
+    ok = ok && size == (long)target_len && fread(rebuilt, 1, target_len, out) == target_len &&
+         memcmp(rebuilt, target, target_len) == 0;
+
+    free(rebuilt);
+    fclose(out);
+    delta_signature_free(&received);
+    proto_writer_free(&o->ops);
+    proto_writer_free(&wire);
+    if (basis_file) {
+        fclose(basis_file);
+    }
+    return ok;
+}
+
+static void fill_random(unsigned char *data, size_t len, unsigned seed) {
+    for (size_t i = 0; i < len; i++) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = (unsigned char)(seed >> 16);
+    }
+}
+
+int main() {
+    printf("=== Delta Encoding Test ===\n");
+    unsigned char *basis = malloc(BASIS_SIZE);
+    fill_random(basis, BASIS_SIZE, 1);
+    Ops o;
+    char what[128];
+
+    printf("\n🔁 Round trips...\n");
+    check(round_trip(basis, BASIS_SIZE, basis, BASIS_SIZE, &o) && o.literal_bytes == 0,
+          "an unchanged file is sent as block references only");
+
+    // Bytes inserted, removed and overwritten at places that are not block
+    // aligned, and a new tail: the rolling checksum must find the shifted
+    // blocks again
+    unsigned char *target = malloc(BASIS_SIZE + 8192);
+    size_t len = 0;
+    memcpy(target, basis, 50000);
+    len = 50000;
+    memcpy(target + len, "INSERTED BYTES", 14);
+    len += 14;
+    memcpy(target + len, basis + 50000, 60000); // Shifted by 14
+    len += 60000;
+    memcpy(target + len, basis + 113333, 100000); // 3333 bytes removed
+    len += 100000;
+    fill_random(target + len, 777, 2); // Overwritten
+    len += 777;
+    memcpy(target + len, basis + 214110, BASIS_SIZE - 214110);
+    len += BASIS_SIZE - 214110;
+    fill_random(target + len, 5000, 3); // Appended
+    len += 5000;
+    int ok = round_trip(basis, BASIS_SIZE, target, len, &o);
+    check(ok, "an edited file is rebuilt byte for byte");
+    snprintf(what, sizeof(what), "only %zu of %zu bytes sent as literals", o.literal_bytes, len);
+    check(ok && o.literal_bytes < len / 10, what);
+
+    check(round_trip(basis, BASIS_SIZE, basis, BASIS_SIZE - 1000, &o), "a truncated file is rebuilt");
+    check(round_trip(basis, BASIS_SIZE, basis + 1, 4000, &o), "a short file shifted by one byte is rebuilt");
+    check(round_trip(basis, BASIS_SIZE, (const unsigned char *)"", 0, &o) && o.copied_blocks == 0,
+          "an emptied file is rebuilt");
+    check(round_trip(NULL, 0, target, len, &o) && o.literal_bytes == len, "a file with no basis is sent whole");
+    check(round_trip(basis, 100, target, 3000, &o), "a basis shorter than a block is handled");
+
+    FILE *empty = tmpfile();
+    DeltaSignature sig;
+    check(delta_signature_compute(fileno(empty), &sig) == 0 && sig.block_count == 0 && sig.block_size >= DELTA_MIN_BLOCK,
+          "an empty basis has no blocks");
+    delta_signature_free(&sig);
+    fclose(empty);
+
+    printf("\n#️⃣  Hashes...\n");
+    FILE *a = file_with(basis, BASIS_SIZE);
+    FILE *b = file_with(basis, BASIS_SIZE);
+    uint64_t ha = 0, hb = 1;
+    check(delta_file_hash(fileno(a), &ha) == 0 && delta_file_hash(fileno(b), &hb) == 0 && ha == hb,
+          "equal files hash equal");
+    fclose(b);
+    basis[BASIS_SIZE / 2] ^= 1;
+    b = file_with(basis, BASIS_SIZE);
+    check(delta_file_hash(fileno(b), &hb) == 0 && ha != hb, "one flipped bit changes the file hash");
+    fclose(a);
+    fclose(b);
+
+    free(target);
+    free(basis);
+    printf("\n%s %d failure(s)\n", failures ? "❌" : "🎉", failures);
+    return failures ? 1 : 0;
+}
@@ -4,8 +4,9 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include "protocol.h"
 
-#define BUFFER_SIZE 1024
+// gcc -o demo_test demo_test.c protocol.c
 
 void test_naming_server_connection() {
     printf("🔗 Testing Naming Server Connection...\n");
@@ -20,25 +21,30 @@ void test_naming_server_connection() {
         printf("✅ Successfully connected to Naming Server\n");
         
         // Send client identification
-        send(sock, "CLIENT CONNECTING TO NAMING SERVER ...", 38, 0);
+        proto_send(sock, PROTO_CLIENT_HELLO, 0, 0, NULL, 0);
         
-        char buffer[BUFFER_SIZE];
-        int bytes = recv(sock, buffer, BUFFER_SIZE - 1, 0);
-        if (bytes > 0) {
-            buffer[bytes] = '\0';
-            printf("✅ Naming Server Response: %s", buffer);
+        ProtoMessage msg = {0};
+        if (proto_recv(sock, &msg) > 0 && msg.header.opcode == PROTO_WELCOME) {
+            printf("✅ Naming Server accepted the client\n");
         }
         
-        // Send READ command
-        send(sock, "READ test_storage1/file1.txt", 28, 0);
-        sleep(1);
+        // Send READ request and wait for the reply to it
+        proto_send_str(sock, PROTO_READ, 1, "test_storage1/file1.txt");
+        int res;
+        while ((res = proto_recv(sock, &msg)) > 0 && msg.header.request_id != 1) {
+        }
         
-        bytes = recv(sock, buffer, BUFFER_SIZE - 1, 0);
-        if (bytes > 0) {
-            buffer[bytes] = '\0';
-            printf("✅ Storage Server Info: %s", buffer);
+        if (res > 0 && msg.header.opcode == PROTO_LOCATION) {
+            ProtoReader reader;
+            proto_reader_init(&reader, &msg);
+            const char *ip = proto_get_str(&reader);
+            uint32_t port = proto_get_u32(&reader);
+            if (ip && !reader.failed) {
+                printf("✅ Storage Server Info: IP: %s Port: %u\n", ip, port);
+            }
         }
         
+        proto_message_free(&msg);
         close(sock);
     } else {
         printf("❌ Failed to connect to Naming Server\n");
@@ -57,13 +63,22 @@ void test_storage_server_connection() {
     if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
         printf("✅ Successfully connected to Storage Server\n");
         
-        // Send READ command
-        send(sock, "READ test_storage1/file1.txt", 28, 0);
-        printf("✅ Sent READ command to Storage Server\n");
+        // Send READ request
+        proto_send_str(sock, PROTO_READ, 1, "test_storage1/file1.txt");
+        printf("✅ Sent READ request to Storage Server\n");
         
-        // Note: The storage server sends the file content, but it might be 
-        // sent immediately and the connection closed quickly
-        printf("✅ Storage Server accepted the READ request\n");
+        // The content comes back as DATA messages followed by END
+        ProtoMessage msg = {0};
+        size_t bytes = 0;
+        while (proto_recv(sock, &msg) > 0 && msg.header.opcode == PROTO_DATA) {
+            bytes += msg.header.payload_len;
+        }
+        if (msg.header.opcode == PROTO_END) {
+            printf("✅ Storage Server sent %zu bytes of the file\n", bytes);
+        } else {
+            printf("❌ Storage Server did not serve the READ request\n");
+        }
+        proto_message_free(&msg);
         
         close(sock);
     } else {
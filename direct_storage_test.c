@@ -4,63 +4,66 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include "protocol.h"
 
-#define BUFFER_SIZE 1024
+// gcc -o direct_storage_test direct_storage_test.c protocol.c
 
 int main() {
     printf("=== Direct Storage Server Test ===\n");
-    
+
     // Connect directly to storage server
     int sock = socket(AF_INET, SOCK_STREAM, 0);
     if (sock < 0) {
         perror("Socket creation failed");
         return 1;
     }
-    
+
     struct sockaddr_in ss_addr;
     ss_addr.sin_family = AF_INET;
     ss_addr.sin_port = htons(9091);  // Storage server port
     inet_pton(AF_INET, "172.18.246.198", &ss_addr.sin_addr);
-    
+
     if (connect(sock, (struct sockaddr *)&ss_addr, sizeof(ss_addr)) < 0) {
         perror("Connection to storage server failed");
         return 1;
     }
-    
+
     printf("✅ Connected to storage server\n");
-    
-    // Send READ command
-    printf("Sending READ command...\n");
-    send(sock, "READ test_storage1/file1.txt", 28, 0);
-    
-    // Read response
-    char buffer[BUFFER_SIZE];
+
+    // Send READ request
+    printf("Sending READ request...\n");
+    proto_send_str(sock, PROTO_READ, 1, "test_storage1/file1.txt");
+
+    // The content comes back as DATA messages followed by END
+    ProtoMessage msg = {0};
     printf("File content:\n");
     printf("--- START ---\n");
-    
-    int total_bytes = 0;
-    while (1) {
-        int bytes_read = recv(sock, buffer, BUFFER_SIZE - 1, 0);
-        if (bytes_read <= 0) {
-            printf("Connection closed or error (bytes_read: %d)\n", bytes_read);
+
+    size_t total_bytes = 0;
+    int res;
+    while ((res = proto_recv(sock, &msg)) > 0) {
+        if (msg.header.opcode == PROTO_END) {
+            printf("END received\n");
             break;
         }
-        
-        buffer[bytes_read] = '\0';
-        total_bytes += bytes_read;
-        
-        // Check for EOF marker
-        if (strncmp(buffer, "EOF", 3) == 0) {
-            printf("EOF marker received\n");
+        if (msg.header.opcode != PROTO_DATA) {
+            ProtoReader reader;
+            proto_reader_init(&reader, &msg);
+            const char *text = proto_get_str(&reader);
+            printf("Storage server replied: %s", text ? text : "(no message)\n");
             break;
         }
-        
-        printf("%s", buffer);
+        total_bytes += msg.header.payload_len;
+        fwrite(msg.payload, 1, msg.header.payload_len, stdout);
+    }
+    if (res <= 0) {
+        printf("Connection closed or error (res: %d)\n", res);
     }
-    
+    proto_message_free(&msg);
+
     printf("\n--- END ---\n");
-    printf("Total bytes received: %d\n", total_bytes);
-    
+    printf("Total bytes received: %zu\n", total_bytes);
+
     close(sock);
     printf("✅ Test completed\n");
     return 0;
@@ -0,0 +1,24 @@
+#ifndef FILEIO_H
+#define FILEIO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+// File helpers shared by the naming server's write-ahead log and the
+// storage server's journal and asynchronous writes: the CRC-32 their
+// records carry, complete vectored writes, and durable renames.
+
+// Continues a CRC-32 (IEEE 802.3) over data. Start with 0xFFFFFFFF and
+// invert the result.
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len);
+
+// Writes every byte, retrying short writes. The iovec array is consumed.
+// Returns 0 on success, -1 on error.
+int write_iov(int fd, struct iovec *iov, int iovcnt);
+
+// Flushes the directory holding path, making a file created or renamed
+// there durable. Returns 0 on success, -1 on error.
+int sync_parent_directory(const char *path);
+
+#endif // FILEIO_H
@@ -0,0 +1,49 @@
+#include "heartbeat.h"
+#include <math.h>
+#include <time.h>
+
+#define INTERVAL_WEIGHT 0.125 // Of each new interval in the moving averages
+
+uint64_t heartbeat_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void heartbeat_reset(HeartbeatHistory *history, uint64_t now_ms)
+{
+    history->last_ms = now_ms;
+    history->mean_ms = 0;
+    history->variance = 0;
+}
+
+void heartbeat_arrived(HeartbeatHistory *history, uint64_t now_ms)
+{
+    double interval = (double)(now_ms - history->last_ms);
+    history->last_ms = now_ms;
+    if (history->mean_ms == 0)
+    {
+        history->mean_ms = interval > 0 ? interval : 1;
+        return;
+    }
+    double diff = interval - history->mean_ms;
+    history->mean_ms += INTERVAL_WEIGHT * diff;
+    history->variance = (1 - INTERVAL_WEIGHT) * (history->variance + INTERVAL_WEIGHT * diff * diff);
+}
+
+double heartbeat_phi(const HeartbeatHistory *history, uint64_t now_ms)
+{
+    if (history->mean_ms == 0)
+        return 0;
+    double stddev = sqrt(history->variance);
+    if (stddev < HEARTBEAT_MIN_STDDEV_MS)
+        stddev = HEARTBEAT_MIN_STDDEV_MS;
+    // Logistic approximation of the normal distribution's tail, which stays
+    // accurate far out where 1 - CDF would round to zero
+    double y = ((double)(now_ms - history->last_ms) - history->mean_ms) / stddev;
+    double e = exp(-y * (1.5976 + 0.070566 * y * y));
+    if (y > 0)
+        return -log10(e / (1 + e));
+    return -log10(1 - 1 / (1 + e));
+}
@@ -0,0 +1,34 @@
+#ifndef HEARTBEAT_H
+#define HEARTBEAT_H
+
+#include <stdint.h>
+
+// Phi-accrual failure detection for the naming server. Each storage server
+// sends a heartbeat at a fixed interval; the detector keeps a moving
+// average and variance of the intervals it observed, and turns the time
+// since the last heartbeat into a suspicion level phi: -log10 of the
+// probability that a heartbeat this late is still to come from a live
+// server, assuming normally distributed intervals. phi 1 means a 10% chance
+// of being wrong, phi 8 one in 10^8. Unlike a fixed timeout, the threshold
+// adapts to the jitter each server actually shows.
+
+#define HEARTBEAT_MIN_STDDEV_MS 100.0 // Floor on the deviation, so a very regular server is not suspected at the first hiccup
+
+typedef struct
+{
+    uint64_t last_ms; // Arrival of the last heartbeat
+    double mean_ms;   // Moving average of the intervals, 0 until one was seen
+    double variance;  // Moving variance of the intervals
+} HeartbeatHistory;
+
+// Milliseconds on a monotonic clock
+uint64_t heartbeat_now_ms(void);
+
+// Starts a history at the first heartbeat from a server
+void heartbeat_reset(HeartbeatHistory *history, uint64_t now_ms);
+void heartbeat_arrived(HeartbeatHistory *history, uint64_t now_ms);
+
+// Suspicion level at now_ms; 0 until at least one interval was observed
+double heartbeat_phi(const HeartbeatHistory *history, uint64_t now_ms);
+
+#endif // HEARTBEAT_H
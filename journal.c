@@ -0,0 +1,420 @@
+#include "journal.h"
+#include "fileio.h"
+#include "protocol.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#define JOURNAL_MAGIC "SSJRN001"
+#define JOURNAL_FILE_HEADER 8
+#define JOURNAL_RECORD_HEADER 9 // u32 length, u32 CRC-32, u8 type
+
+enum
+{
+    JOURNAL_WRITE = 1, // u64 seq, str path, content
+    JOURNAL_APPLIED,   // u64 seq
+};
+
+struct Journal
+{
+    pthread_mutex_t lock;
+    pthread_cond_t synced_cond; // A flush finished
+    int fd;
+    size_t size;
+    uint64_t next_seq;
+    uint64_t appended;   // Records written so far, counted from 1
+    uint64_t synced;     // Records known to be on disk
+    int syncing;         // A thread is flushing
+    int failed;          // A write or flush failed; nothing more is acknowledged
+    uint64_t unapplied;  // Writes appended and still pending
+    char **unsynced;     // Paths of writes in place but maybe not durable, left without one
+    size_t unsynced_count;
+    size_t unsynced_capacity;
+    ProtoWriter frame;   // Record being framed, guarded by lock
+};
+
+typedef struct
+{
+    uint64_t seq;
+    const char *path;
+    const char *content;
+    size_t len;
+    int applied;
+    int superseded; // A later write in the journal replaces it
+} PendingWrite;
+
+// CRC-32 of the type and the payload, given in two parts
+static uint32_t record_crc(uint8_t type, const char *head, size_t head_len, const char *tail, size_t tail_len)
+{
+    uint32_t crc = crc32_update(0xFFFFFFFFu, &type, 1);
+    crc = crc32_update(crc, head, head_len);
+    return crc32_update(crc, tail, tail_len) ^ 0xFFFFFFFFu;
+}
+
+static PendingWrite *find_pending(PendingWrite *pending, size_t count, uint64_t seq)
+{
+    // Sequence numbers only grow within a journal
+    size_t lo = 0, hi = count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (pending[mid].seq < seq)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < count && pending[lo].seq == seq ? &pending[lo] : NULL;
+}
+
+static int compare_path_then_seq(const void *a, const void *b)
+{
+    const PendingWrite *x = *(const PendingWrite *const *)a;
+    const PendingWrite *y = *(const PendingWrite *const *)b;
+    int order = strcmp(x->path, y->path);
+    if (order != 0)
+        return order;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+// Marks every write followed by another one of the same path. A write
+// replaces the whole file, so replaying an older one that was left without
+// an applied record after a newer one that has one would undo the newer.
+// Returns 0, or -1 if out of memory.
+static int mark_superseded(PendingWrite *pending, size_t count)
+{
+    if (count < 2)
+        return 0;
+    PendingWrite **by_path = (PendingWrite **)malloc(count * sizeof(PendingWrite *));
+    if (!by_path)
+        return -1;
+    for (size_t i = 0; i < count; i++)
+        by_path[i] = &pending[i];
+    qsort(by_path, count, sizeof(PendingWrite *), compare_path_then_seq);
+    for (size_t i = 0; i + 1 < count; i++)
+    {
+        if (strcmp(by_path[i]->path, by_path[i + 1]->path) == 0)
+            by_path[i]->superseded = 1;
+    }
+    free(by_path);
+    return 0;
+}
+
+// Carries out the writes of the journal at path that were not applied.
+// Returns their number, or -1 if the file is not a journal.
+static long replay_file(const char *path, journal_replay_cb replay, void *data)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return errno == ENOENT ? 0 : -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size < JOURNAL_FILE_HEADER)
+    {
+        close(fd);
+        return 0;
+    }
+    char *map = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+    if (memcmp(map, JOURNAL_MAGIC, 8) != 0)
+    {
+        fprintf(stderr, "%s is not a storage server journal\n", path);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    PendingWrite *pending = NULL;
+    size_t count = 0, capacity = 0;
+    const char *pos = map + JOURNAL_FILE_HEADER;
+    const char *end = map + st.st_size;
+    while ((size_t)(end - pos) >= JOURNAL_RECORD_HEADER)
+    {
+        ProtoReader header = {pos, pos + JOURNAL_RECORD_HEADER, 0};
+        uint32_t len = proto_get_u32(&header);
+        uint32_t crc = proto_get_u32(&header);
+        uint8_t type = proto_get_u8(&header);
+        if (len == 0 || (size_t)(end - pos) - 8 < len)
+            break;
+        const char *payload = pos + JOURNAL_RECORD_HEADER;
+        if (record_crc(type, payload, len - 1, NULL, 0) != crc)
+            break;
+        ProtoReader record = {payload, payload + len - 1, 0};
+        uint64_t seq = proto_get_u64(&record);
+        if (type == JOURNAL_WRITE)
+        {
+            if (count == capacity)
+            {
+                capacity = capacity ? capacity * 2 : 64;
+                PendingWrite *grown = (PendingWrite *)realloc(pending, capacity * sizeof(PendingWrite));
+                if (!grown)
+                {
+                    perror("Failed to allocate journal replay");
+                    free(pending);
+                    munmap(map, st.st_size);
+                    return -1;
+                }
+                pending = grown;
+            }
+            PendingWrite *write = &pending[count];
+            write->seq = seq;
+            write->path = proto_get_str(&record);
+            write->content = proto_get_rest(&record, &write->len);
+            write->applied = 0;
+            write->superseded = 0;
+            if (!record.failed && write->path)
+                count++;
+        }
+        else if (type == JOURNAL_APPLIED)
+        {
+            PendingWrite *write = find_pending(pending, count, seq);
+            if (write)
+                write->applied = 1;
+        }
+        pos += 8 + len;
+    }
+    if (pos != end)
+        fprintf(stderr, "Ignoring %zu bytes of torn or corrupt records at the end of %s\n", (size_t)(end - pos), path);
+
+    if (mark_superseded(pending, count) < 0)
+    {
+        perror("Failed to allocate journal replay");
+        free(pending);
+        munmap(map, st.st_size);
+        return -1;
+    }
+    long replayed = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (pending[i].applied || pending[i].superseded)
+            continue;
+        replay(pending[i].path, pending[i].content, pending[i].len, data);
+        replayed++;
+    }
+    free(pending);
+    munmap(map, st.st_size);
+    return replayed;
+}
+
+static int start_over(Journal *journal)
+{
+    struct iovec iov = {JOURNAL_MAGIC, JOURNAL_FILE_HEADER};
+    if (ftruncate(journal->fd, 0) < 0 || write_iov(journal->fd, &iov, 1) < 0 || fdatasync(journal->fd) < 0)
+        return -1;
+    journal->size = JOURNAL_FILE_HEADER;
+    return 0;
+}
+
+Journal *journal_open(const char *path, journal_replay_cb replay, void *data, long *replayed)
+{
+    *replayed = replay_file(path, replay, data);
+    if (*replayed < 0)
+        return NULL;
+    // The replayed writes must be on disk before their records go
+    if (*replayed > 0)
+        sync();
+
+    Journal *journal = (Journal *)calloc(1, sizeof(Journal));
+    if (!journal)
+        return NULL;
+    pthread_mutex_init(&journal->lock, NULL);
+    pthread_cond_init(&journal->synced_cond, NULL);
+    proto_writer_init(&journal->frame);
+    journal->next_seq = 1;
+    journal->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (journal->fd < 0 || start_over(journal) < 0)
+    {
+        perror("Failed to open journal");
+        if (journal->fd >= 0)
+            close(journal->fd);
+        proto_writer_free(&journal->frame);
+        free(journal);
+        return NULL;
+    }
+    sync_parent_directory(path);
+    return journal;
+}
+
+// Appends one record. Called with the lock held. Returns its number among
+// the records appended, or 0 on error, in which case the journal is left
+// as it was.
+static uint64_t append_record(Journal *journal, uint8_t type, uint64_t seq, const char *path, const char *content,
+                              size_t len)
+{
+    ProtoWriter *frame = &journal->frame;
+    proto_writer_reset(frame);
+    proto_put_u32(frame, 0); // Length and CRC-32, filled in below
+    proto_put_u32(frame, 0);
+    proto_put_u8(frame, type);
+    proto_put_u64(frame, seq);
+    if (path)
+        proto_put_str(frame, path);
+    if (frame->failed || frame->len - JOURNAL_RECORD_HEADER + len + 1 > UINT32_MAX)
+        return 0;
+    ProtoWriter fields;
+    proto_writer_init(&fields);
+    proto_put_u32(&fields, frame->len - JOURNAL_RECORD_HEADER + len + 1);
+    proto_put_u32(&fields, record_crc(type, frame->data + JOURNAL_RECORD_HEADER, frame->len - JOURNAL_RECORD_HEADER,
+                                      content, len));
+    if (fields.failed)
+    {
+        proto_writer_free(&fields);
+        return 0;
+    }
+    memcpy(frame->data, fields.data, 8);
+    proto_writer_free(&fields);
+
+    struct iovec iov[2] = {{frame->data, frame->len}, {(void *)content, len}};
+    if (write_iov(journal->fd, iov, len ? 2 : 1) < 0)
+    {
+        perror("Failed to append to journal");
+        // Leave no partial record for the next one to follow
+        if (ftruncate(journal->fd, journal->size) < 0)
+            journal->failed = 1;
+        return 0;
+    }
+    journal->size += frame->len + len;
+    return ++journal->appended;
+}
+
+// Waits until record number n is on disk. The first thread to wait flushes
+// every record appended so far; those arriving meanwhile wait for it and
+// flush together next. Called with the lock held. Returns 0 on success, -1
+// on error.
+static int wait_synced(Journal *journal, uint64_t n)
+{
+    while (journal->synced < n && !journal->failed)
+    {
+        if (journal->syncing)
+        {
+            pthread_cond_wait(&journal->synced_cond, &journal->lock);
+            continue;
+        }
+        journal->syncing = 1;
+        uint64_t target = journal->appended;
+        pthread_mutex_unlock(&journal->lock);
+        int res = fdatasync(journal->fd);
+        pthread_mutex_lock(&journal->lock);
+        journal->syncing = 0;
+        if (res < 0)
+        {
+            perror("Failed to sync journal");
+            journal->failed = 1;
+        }
+        else if (target > journal->synced)
+        {
+            journal->synced = target;
+        }
+        pthread_cond_broadcast(&journal->synced_cond);
+    }
+    return journal->synced >= n ? 0 : -1;
+}
+
+int journal_append(Journal *journal, const char *path, const char *content, size_t len, uint64_t *seq)
+{
+    pthread_mutex_lock(&journal->lock);
+    if (journal->failed)
+    {
+        pthread_mutex_unlock(&journal->lock);
+        return -1;
+    }
+    *seq = journal->next_seq;
+    uint64_t n = append_record(journal, JOURNAL_WRITE, *seq, path, content, len);
+    if (n == 0)
+    {
+        pthread_mutex_unlock(&journal->lock);
+        return -1;
+    }
+    journal->next_seq++;
+    journal->unapplied++;
+    int res = wait_synced(journal, n);
+    pthread_mutex_unlock(&journal->lock);
+    return res;
+}
+
+// Makes the writes left without an applied record durable after all.
+// Called with the lock held. Returns 0 once none is left, -1 otherwise.
+static int sync_unsynced(Journal *journal)
+{
+    while (journal->unsynced_count > 0)
+    {
+        char *path = journal->unsynced[journal->unsynced_count - 1];
+        if (sync_parent_directory(path) != 0)
+            return -1;
+        free(path);
+        journal->unsynced_count--;
+    }
+    return 0;
+}
+
+int journal_unsynced(Journal *journal, const char *path)
+{
+    pthread_mutex_lock(&journal->lock);
+    if (journal->unsynced_count == journal->unsynced_capacity)
+    {
+        size_t capacity = journal->unsynced_capacity ? journal->unsynced_capacity * 2 : 16;
+        char **grown = (char **)realloc(journal->unsynced, capacity * sizeof(char *));
+        if (!grown)
+        {
+            pthread_mutex_unlock(&journal->lock);
+            return -1;
+        }
+        journal->unsynced = grown;
+        journal->unsynced_capacity = capacity;
+    }
+    char *copy = strdup(path);
+    if (!copy)
+    {
+        pthread_mutex_unlock(&journal->lock);
+        return -1;
+    }
+    journal->unsynced[journal->unsynced_count++] = copy;
+    journal->unapplied--;
+    pthread_mutex_unlock(&journal->lock);
+    return 0;
+}
+
+int journal_applied_batch(Journal *journal, const uint64_t *seqs, size_t count)
+{
+    if (count == 0)
+        return 0;
+    pthread_mutex_lock(&journal->lock);
+    journal->unapplied -= count;
+    uint64_t n = 0;
+    for (size_t i = 0; i < count && !journal->failed; i++)
+    {
+        n = append_record(journal, JOURNAL_APPLIED, seqs[i], NULL, NULL, 0);
+        if (n == 0)
+            break;
+    }
+    int res = n ? wait_synced(journal, n) : -1;
+    // Nothing left to replay: a large journal can be emptied. Appends wait
+    // for the lock, and a flush still running covers only applied writes.
+    // A write left unsynced keeps its record until its file is durable.
+    if (res == 0 && journal->unapplied == 0 && journal->size >= JOURNAL_COMPACT_BYTES && sync_unsynced(journal) == 0)
+    {
+        if (start_over(journal) < 0)
+        {
+            perror("Failed to empty journal");
+            journal->failed = 1;
+        }
+    }
+    pthread_mutex_unlock(&journal->lock);
+    return res;
+}
+
+int journal_applied(Journal *journal, uint64_t seq)
+{
+    return journal_applied_batch(journal, &seq, 1);
+}
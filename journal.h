@@ -0,0 +1,57 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Write-ahead journal for the storage server's asynchronous writes. An
+// accepted write is appended to the journal, and the client is only told
+// it was accepted once the record is on disk; the write is then carried out
+// in the background and an "applied" record is appended when the file holds
+// the new content. At startup every write without an applied record is
+// carried out again, in the order accepted, so a crash loses no write that
+// was acknowledged. A write followed in the journal by another one of the
+// same path is not: the later one replaces it.
+//
+// Appends are group-committed: records are written as they come and a
+// single fdatasync() covers every record appended while the previous one
+// ran, so concurrent writers share the cost of a flush. Once no write is
+// pending and the journal has grown past JOURNAL_COMPACT_BYTES, it is
+// emptied.
+//
+// The file starts with an 8-byte magic. Each record is u32 length | u32
+// CRC-32 | u8 type | payload, like the naming server's log. A torn or
+// corrupt tail (a crash in the middle of an append) is cut off at the last
+// good record.
+
+#define JOURNAL_COMPACT_BYTES (64 << 20) // Emptied once all is applied and it is this large
+
+typedef struct Journal Journal;
+
+// Called at startup for every write accepted but not applied before
+typedef void (*journal_replay_cb)(const char *path, const char *content, size_t len, void *data);
+
+// Replays the journal at path through replay, then empties it and opens it
+// for appending. *replayed is set to the number of writes replayed. Returns
+// NULL on error.
+Journal *journal_open(const char *path, journal_replay_cb replay, void *data, long *replayed);
+
+// Appends a write of content over path and waits until it is durable.
+// *seq is set to the number to pass to journal_applied(). Returns 0 on
+// success, -1 on error (nothing may then be acknowledged).
+int journal_append(Journal *journal, const char *path, const char *content, size_t len, uint64_t *seq);
+
+// Records that write seq is durable in its file, or failed for good, and
+// waits until that is durable too. Returns 0 on success, -1 on error.
+int journal_applied(Journal *journal, uint64_t seq);
+// The same for count writes at once, with a single flush
+int journal_applied_batch(Journal *journal, const uint64_t *seqs, size_t count);
+
+// Counts a write as no longer pending without an applied record, for one
+// whose new content is in place in path but may not be durable. It is
+// carried out again at the next start, unless the journal is emptied
+// before: that waits until the directory holding path could be synced.
+// Returns 0, or -1 if out of memory (the journal is then never emptied).
+int journal_unsynced(Journal *journal, const char *path);
+
+#endif // JOURNAL_H
@@ -0,0 +1,249 @@
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <strings.h>
+
+#define LOG_RING_SLOTS 4096              // Must be a power of two
+#define LOG_LINE_MAX 512                 // Longer messages are truncated
+#define LOG_BATCH_BYTES (256 * 1024)     // Written with one write()
+#define LOG_IDLE_SLEEP_MS 20             // Writer poll interval when the ring is empty
+#define LOG_DEFAULT_MAX_BYTES (16 << 20) // Rotate after this many bytes
+#define LOG_KEEP_FILES 4                 // path.1 ... path.4 are kept
+
+typedef struct
+{
+    _Atomic size_t sequence; // == position when free, position + 1 when filled
+    struct timespec time;
+    LogLevel level;
+    int len;
+    char text[LOG_LINE_MAX];
+} LogSlot;
+
+static LogSlot *ring;
+static _Atomic size_t enqueue_pos;
+static size_t dequeue_pos; // Only touched by the writer thread
+static _Atomic unsigned long dropped_count;
+static _Atomic int stopping;
+static LogLevel min_level = LOG_LEVEL_INFO;
+
+static pthread_t writer_thread;
+static char *log_path;
+static int log_fd = -1;
+static size_t log_size;
+static size_t max_bytes = LOG_DEFAULT_MAX_BYTES;
+
+static const char *level_names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+static LogLevel parse_level(const char *value)
+{
+    for (int i = LOG_LEVEL_DEBUG; i <= LOG_LEVEL_ERROR; i++)
+    {
+        if (strcasecmp(value, level_names[i]) == 0)
+            return (LogLevel)i;
+    }
+    return LOG_LEVEL_INFO;
+}
+
+static int open_log_file(void)
+{
+    log_fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log_fd < 0)
+    {
+        perror("Failed to open log file");
+        return -1;
+    }
+    off_t end = lseek(log_fd, 0, SEEK_END);
+    log_size = end > 0 ? (size_t)end : 0;
+    return 0;
+}
+
+// path -> path.1 -> path.2 ..., the oldest file is overwritten
+static void rotate_log_file(void)
+{
+    char from[4096], to[4096];
+    close(log_fd);
+    for (int i = LOG_KEEP_FILES - 1; i >= 1; i--)
+    {
+        snprintf(from, sizeof(from), "%s.%d", log_path, i);
+        snprintf(to, sizeof(to), "%s.%d", log_path, i + 1);
+        rename(from, to);
+    }
+    snprintf(to, sizeof(to), "%s.1", log_path);
+    rename(log_path, to);
+    open_log_file();
+}
+
+static void write_batch(const char *batch, size_t len)
+{
+    if (log_fd < 0)
+        return;
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t n = write(log_fd, batch + done, len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            perror("Failed to write log file");
+            return;
+        }
+        done += n;
+    }
+    log_size += len;
+    if (log_size >= max_bytes)
+        rotate_log_file();
+}
+
+// Appends the oldest filled slot to the batch.
+// Returns 0 if the ring is empty (or its head is still being filled).
+static int take_slot(char *batch, size_t *used)
+{
+    LogSlot *slot = &ring[dequeue_pos & (LOG_RING_SLOTS - 1)];
+    if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != dequeue_pos + 1)
+        return 0;
+
+    struct tm tm;
+    localtime_r(&slot->time.tv_sec, &tm);
+    int n = strftime(batch + *used, 32, "%Y-%m-%d %H:%M:%S", &tm);
+    n += snprintf(batch + *used + n, 32, ".%03ld %-5s ", slot->time.tv_nsec / 1000000, level_names[slot->level]);
+    memcpy(batch + *used + n, slot->text, slot->len);
+    n += slot->len;
+    if (slot->len == 0 || slot->text[slot->len - 1] != '\n')
+        batch[*used + n++] = '\n';
+    *used += n;
+
+    atomic_store_explicit(&slot->sequence, dequeue_pos + LOG_RING_SLOTS, memory_order_release);
+    dequeue_pos++;
+    return 1;
+}
+
+static void *log_writer(void *arg)
+{
+    (void)arg;
+    char *batch = malloc(LOG_BATCH_BYTES);
+    if (!batch)
+    {
+        perror("Failed to allocate log batch");
+        return NULL;
+    }
+    while (1)
+    {
+        size_t used = 0;
+        int drained = 0;
+        while (used + LOG_LINE_MAX + 256 <= LOG_BATCH_BYTES && take_slot(batch, &used))
+            drained++;
+
+        unsigned long dropped = atomic_exchange(&dropped_count, 0);
+        if (dropped)
+            used += snprintf(batch + used, 128, "Log ring full, dropped %lu messages\n", dropped);
+        if (used)
+            write_batch(batch, used);
+
+        if (!drained)
+        {
+            if (atomic_load(&stopping))
+                break;
+            struct timespec idle = {0, LOG_IDLE_SLEEP_MS * 1000000L};
+            nanosleep(&idle, NULL);
+        }
+    }
+    free(batch);
+    return NULL;
+}
+
+int log_start(const char *path)
+{
+    const char *level_env = getenv("NM_LOG_LEVEL");
+    if (level_env)
+        min_level = parse_level(level_env);
+    const char *max_env = getenv("NM_LOG_MAX_BYTES");
+    if (max_env && strtoull(max_env, NULL, 10) > 0)
+        max_bytes = strtoull(max_env, NULL, 10);
+
+    ring = calloc(LOG_RING_SLOTS, sizeof(LogSlot));
+    log_path = strdup(path);
+    if (!ring || !log_path)
+    {
+        perror("Failed to allocate log ring");
+        free(ring);
+        free(log_path);
+        ring = NULL;
+        return -1;
+    }
+    for (size_t i = 0; i < LOG_RING_SLOTS; i++)
+        atomic_init(&ring[i].sequence, i);
+    if (open_log_file() < 0 || pthread_create(&writer_thread, NULL, log_writer, NULL) != 0)
+    {
+        fprintf(stderr, "Failed to start logger\n");
+        free(ring);
+        ring = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void log_stop(void)
+{
+    if (!ring)
+        return;
+    atomic_store(&stopping, 1);
+    pthread_join(writer_thread, NULL);
+    close(log_fd);
+    log_fd = -1;
+    free(ring);
+    ring = NULL;
+    free(log_path);
+}
+
+void log_vemit(LogLevel level, const char *format, va_list args)
+{
+    if (level < min_level || !ring)
+        return;
+
+    // Claim the next free slot; give up rather than wait if the ring is full
+    size_t pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+    LogSlot *slot;
+    while (1)
+    {
+        slot = &ring[pos & (LOG_RING_SLOTS - 1)];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            atomic_fetch_add_explicit(&dropped_count, 1, memory_order_relaxed);
+            return;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    clock_gettime(CLOCK_REALTIME, &slot->time);
+    slot->level = level;
+    int len = vsnprintf(slot->text, LOG_LINE_MAX, format, args);
+    slot->len = len < 0 ? 0 : (len >= LOG_LINE_MAX ? LOG_LINE_MAX - 1 : len);
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+}
+
+void log_emit(LogLevel level, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    log_vemit(level, format, args);
+    va_end(args);
+}
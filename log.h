@@ -0,0 +1,32 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdarg.h>
+
+// Asynchronous logger for the naming server. Callers format their message
+// into a slot of a fixed-size ring buffer (claimed with a compare-and-swap,
+// no lock) and return; a background thread drains the ring, adds the
+// timestamp and level, and writes many lines with one write(). The file is
+// rotated once it grows past a size limit. When the ring is full a message is
+// dropped and counted instead of waiting, and the writer reports the count.
+
+typedef enum
+{
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR
+} LogLevel;
+
+// Opens the log file and starts the writer thread. The level threshold and
+// rotation size are read from NM_LOG_LEVEL and NM_LOG_MAX_BYTES.
+// Returns 0 on success, -1 on error.
+int log_start(const char *path);
+
+// Writes out everything queued and stops the writer thread
+void log_stop(void);
+
+void log_emit(LogLevel level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void log_vemit(LogLevel level, const char *format, va_list args);
+
+#endif // LOG_H
@@ -0,0 +1,305 @@
+#include "manifest.h"
+#include "protocol.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define MANIFEST_MAGIC "NMMANIF1"
+#define MANIFEST_MIN_BUCKETS 1024
+
+typedef struct ManifestEntry
+{
+    struct ManifestEntry *next;
+    uint64_t hash; // Of the path and the directory flag, folded into the digest
+    int is_directory;
+    char path[];
+} ManifestEntry;
+
+struct Manifest
+{
+    ManifestEntry **buckets;
+    size_t bucket_count; // Power of two
+    size_t count;
+    uint64_t digest;
+};
+
+// FNV-1a, used for the bucket index
+static uint64_t hash_path(const char *path)
+{
+    uint64_t h = 1469598103934665603ULL;
+    for (const unsigned char *p = (const unsigned char *)path; *p; p++)
+    {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Mixes in the directory flag and finalizes the hash, so the XOR of many
+// entry hashes (the digest) stays well distributed
+static uint64_t entry_hash(uint64_t path_hash, int is_directory)
+{
+    uint64_t h = path_hash ^ (is_directory ? 0x9E3779B97F4A7C15ULL : 0);
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+Manifest *manifest_create(void)
+{
+    Manifest *manifest = (Manifest *)calloc(1, sizeof(Manifest));
+    if (!manifest)
+        return NULL;
+    manifest->bucket_count = MANIFEST_MIN_BUCKETS;
+    manifest->buckets = (ManifestEntry **)calloc(manifest->bucket_count, sizeof(ManifestEntry *));
+    if (!manifest->buckets)
+    {
+        free(manifest);
+        return NULL;
+    }
+    return manifest;
+}
+
+void manifest_free(Manifest *manifest)
+{
+    if (!manifest)
+        return;
+    for (size_t i = 0; i < manifest->bucket_count; i++)
+    {
+        ManifestEntry *entry = manifest->buckets[i];
+        while (entry)
+        {
+            ManifestEntry *next = entry->next;
+            free(entry);
+            entry = next;
+        }
+    }
+    free(manifest->buckets);
+    free(manifest);
+}
+
+static ManifestEntry **find_slot(const Manifest *manifest, const char *path, uint64_t path_hash)
+{
+    ManifestEntry **slot = &manifest->buckets[path_hash & (manifest->bucket_count - 1)];
+    while (*slot && strcmp((*slot)->path, path) != 0)
+        slot = &(*slot)->next;
+    return slot;
+}
+
+// Doubles the table once it averages more than one entry per bucket
+static void grow(Manifest *manifest)
+{
+    size_t bucket_count = manifest->bucket_count * 2;
+    ManifestEntry **buckets = (ManifestEntry **)calloc(bucket_count, sizeof(ManifestEntry *));
+    if (!buckets)
+        return; // Keep the longer chains
+    for (size_t i = 0; i < manifest->bucket_count; i++)
+    {
+        ManifestEntry *entry = manifest->buckets[i];
+        while (entry)
+        {
+            ManifestEntry *next = entry->next;
+            size_t b = hash_path(entry->path) & (bucket_count - 1);
+            entry->next = buckets[b];
+            buckets[b] = entry;
+            entry = next;
+        }
+    }
+    free(manifest->buckets);
+    manifest->buckets = buckets;
+    manifest->bucket_count = bucket_count;
+}
+
+int manifest_add(Manifest *manifest, const char *path, int is_directory)
+{
+    is_directory = is_directory ? 1 : 0;
+    uint64_t path_hash = hash_path(path);
+    ManifestEntry **slot = find_slot(manifest, path, path_hash);
+    if (*slot)
+    {
+        if ((*slot)->is_directory == is_directory)
+            return 0;
+        manifest->digest ^= (*slot)->hash;
+        (*slot)->is_directory = is_directory;
+        (*slot)->hash = entry_hash(path_hash, is_directory);
+        manifest->digest ^= (*slot)->hash;
+        return 1;
+    }
+    size_t len = strlen(path) + 1;
+    ManifestEntry *entry = (ManifestEntry *)malloc(sizeof(ManifestEntry) + len);
+    if (!entry)
+    {
+        perror("Failed to allocate manifest entry");
+        return 0;
+    }
+    memcpy(entry->path, path, len);
+    entry->is_directory = is_directory;
+    entry->hash = entry_hash(path_hash, is_directory);
+    entry->next = NULL;
+    *slot = entry;
+    manifest->digest ^= entry->hash;
+    if (++manifest->count > manifest->bucket_count)
+        grow(manifest);
+    return 1;
+}
+
+int manifest_remove(Manifest *manifest, const char *path)
+{
+    ManifestEntry **slot = find_slot(manifest, path, hash_path(path));
+    if (!*slot)
+        return 0;
+    ManifestEntry *entry = *slot;
+    *slot = entry->next;
+    manifest->digest ^= entry->hash;
+    manifest->count--;
+    free(entry);
+    return 1;
+}
+
+int manifest_find(const Manifest *manifest, const char *path, int *is_directory)
+{
+    ManifestEntry *entry = *find_slot(manifest, path, hash_path(path));
+    if (!entry)
+        return 0;
+    if (is_directory)
+        *is_directory = entry->is_directory;
+    return 1;
+}
+
+size_t manifest_count(const Manifest *manifest)
+{
+    return manifest->count;
+}
+
+uint64_t manifest_digest(const Manifest *manifest)
+{
+    return manifest->digest;
+}
+
+int manifest_iterate(const Manifest *manifest, manifest_iter_cb cb, void *data)
+{
+    for (size_t i = 0; i < manifest->bucket_count; i++)
+    {
+        for (ManifestEntry *entry = manifest->buckets[i]; entry; entry = entry->next)
+        {
+            int res = cb(entry->path, entry->is_directory, data);
+            if (res)
+                return res;
+        }
+    }
+    return 0;
+}
+
+static int add_to_clone(const char *path, int is_directory, void *data)
+{
+    return manifest_add((Manifest *)data, path, is_directory) ? 0 : 1;
+}
+
+Manifest *manifest_clone(const Manifest *manifest)
+{
+    Manifest *clone = manifest_create();
+    if (clone && manifest_iterate(manifest, add_to_clone, clone) != 0)
+    {
+        manifest_free(clone);
+        return NULL;
+    }
+    return clone;
+}
+
+static int put_entry(const char *path, int is_directory, void *data)
+{
+    ProtoWriter *writer = (ProtoWriter *)data;
+    proto_put_u8(writer, is_directory);
+    proto_put_str(writer, path);
+    return writer->failed;
+}
+
+// Layout: 8-byte magic, u64 generation, u64 entry count, then
+// (u8 is_directory, str path) entries
+int manifest_save(const Manifest *manifest, const char *path, uint64_t generation)
+{
+    ProtoWriter writer;
+    proto_writer_init(&writer);
+    proto_put_bytes(&writer, MANIFEST_MAGIC, 8);
+    proto_put_u64(&writer, generation);
+    proto_put_u64(&writer, manifest->count);
+    manifest_iterate(manifest, put_entry, &writer);
+
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    int res = -1;
+    int fd = writer.failed ? -1 : open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd >= 0)
+    {
+        size_t done = 0;
+        while (done < writer.len)
+        {
+            ssize_t n = write(fd, writer.data + done, writer.len - done);
+            if (n <= 0)
+                break;
+            done += n;
+        }
+        if (done == writer.len && fsync(fd) == 0)
+            res = 0;
+        close(fd);
+        if (res == 0 && rename(tmp_path, path) < 0)
+            res = -1;
+        if (res < 0)
+            unlink(tmp_path);
+    }
+    if (res < 0)
+        perror("Failed to save manifest");
+    proto_writer_free(&writer);
+    return res;
+}
+
+Manifest *manifest_load(const char *path, uint64_t *generation)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return NULL;
+    struct stat st;
+    ProtoMessage msg = {0};
+    if (fstat(fileno(file), &st) < 0 || st.st_size < 24 || (uint64_t)st.st_size > PROTO_MAX_PAYLOAD ||
+        !(msg.payload = (char *)malloc(st.st_size)) || fread(msg.payload, 1, st.st_size, file) != (size_t)st.st_size)
+    {
+        fclose(file);
+        free(msg.payload);
+        return NULL;
+    }
+    fclose(file);
+    msg.header.payload_len = st.st_size;
+
+    ProtoReader reader;
+    proto_reader_init(&reader, &msg);
+    Manifest *manifest = NULL;
+    if (memcmp(msg.payload, MANIFEST_MAGIC, 8) == 0)
+    {
+        reader.pos += 8;
+        *generation = proto_get_u64(&reader);
+        uint64_t count = proto_get_u64(&reader);
+        manifest = manifest_create();
+        while (manifest && reader.pos < reader.end)
+        {
+            int is_directory = proto_get_u8(&reader);
+            const char *entry = proto_get_str(&reader);
+            if (!entry)
+                break;
+            manifest_add(manifest, entry, is_directory);
+        }
+        if (manifest && (reader.failed || manifest->count != count))
+        {
+            fprintf(stderr, "Ignoring corrupt manifest %s\n", path);
+            manifest_free(manifest);
+            manifest = NULL;
+        }
+    }
+    free(msg.payload);
+    return manifest;
+}
@@ -0,0 +1,38 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The set of paths a storage server exports, kept in a hash table. The
+// digest is an order-independent combination of one hash per entry, so it
+// is updated in O(1) as paths come and go and two manifests with the same
+// entries always have the same digest.
+
+typedef struct Manifest Manifest;
+
+// Return non-zero from the callback to stop the iteration
+typedef int (*manifest_iter_cb)(const char *path, int is_directory, void *data);
+
+Manifest *manifest_create(void);
+void manifest_free(Manifest *manifest);
+Manifest *manifest_clone(const Manifest *manifest);
+
+// Adds or updates a path. Returns 1 if the manifest changed.
+int manifest_add(Manifest *manifest, const char *path, int is_directory);
+// Returns 1 if the path was present
+int manifest_remove(Manifest *manifest, const char *path);
+// Returns 1 and sets *is_directory if the path is present
+int manifest_find(const Manifest *manifest, const char *path, int *is_directory);
+
+size_t manifest_count(const Manifest *manifest);
+uint64_t manifest_digest(const Manifest *manifest);
+int manifest_iterate(const Manifest *manifest, manifest_iter_cb cb, void *data);
+
+// Saves to path.tmp and renames it over path. Returns 0 on success.
+int manifest_save(const Manifest *manifest, const char *path, uint64_t generation);
+// Returns the manifest stored at path and its generation, or NULL if there
+// is none or it is unreadable
+Manifest *manifest_load(const char *path, uint64_t *generation);
+
+#endif // MANIFEST_H
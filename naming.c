@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // accept4
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,495 +13,512 @@
 #include <sys/stat.h>
 
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 
 #include <sys/types.h>
 
-// #include "trie.h"
+#include "trie.h"
+#include "cache.h"
+#include "protocol.h"
+#include "log.h"
+#include "wal.h"
+#include "replication.h"
+#include "placement.h"
+#include "heartbeat.h"
+#include "connpool.h"
 
 char my_ip[INET_ADDRSTRLEN];
 
 #define PORT 8090
 // #define STORAGE_PORT 8081
-#define REPLICATION_FACTOR 3
-#define MAX_CLIENTS 10
+#define REPLICATION_FACTOR 3 // Default copies of each path: its primary and the backups after it on the ring
+#define MAX_REPLICAS 8       // Largest replication factor a policy may ask for
+#define LATENCY_FLOOR_US 200 // Added to reported latencies, so idle servers still compare by load
+#define POLICY_BUCKETS 256   // Replication policy lookup table
+#define LISTEN_BACKLOG 4096  // Clamped by net.core.somaxconn
+#define MAX_EPOLL_EVENTS 256
+#define IDLE_PAYLOAD_KEEP 4096 // Larger receive buffers are released when a session goes idle
+#define SESSION_BUCKETS 4096   // Session token lookup table for write notifications
+#define LIST_MAX_PAGE 65536    // Most entries sent for one LIST request
+#define BATCH_MAX_OPERATIONS 65536 // Most operations in one BATCH request
+#define HELLO_MAX_PAYLOAD 4096     // Largest CLIENT_HELLO or STORAGE_HELLO
+#define CLIENT_MAX_PAYLOAD (BATCH_MAX_OPERATIONS * 256) // Largest client request: a full BATCH of paths averaging ~250 bytes
 #define BUFFER_SIZE 40960
-#define ALPHABET_SIZE 128 // ASCII range to cover all characters
-#define CACHE_SIZE 5      // LRU cache size for recent searches
-
-typedef struct
+#define CACHE_SIZE 131072 // Default location cache capacity, override with NM_CACHE_SIZE
+#define CACHE_SHARDS 64   // Independently locked cache shards
+#define REPLICATION_WORKERS 4 // Concurrent backup copies, override with NM_REPLICATION_WORKERS
+#define REPLICATE_TIMEOUT_SECONDS 600 // Longest wait for a primary to report a replica push
+#define STORE_PIPELINE_DEPTH 32 // STOREs a copy worker sends ahead of their replies
+#define COPY_WORKERS 8          // Paths of one COPY in transfer at once, override with NM_COPY_WORKERS
+#define COPY_MAX_WORKERS 64
+#define COPY_PAGE 256           // Paths of the source tree read from the trie at a time
+#define COPY_REPORT_MS 1000     // Interval of COPY_PROGRESS messages to the client
+#define MAX_STORAGE_SERVERS 1024
+#define PHI_THRESHOLD 8.0         // Suspicion level at which a server is taken out, override with NM_PHI_THRESHOLD
+#define HEARTBEAT_TIMEOUT_MS 2000 // Silence after which a server is taken out whatever phi says, NM_HEARTBEAT_TIMEOUT_MS
+#define DETECTOR_CHECK_MS 50      // How often the failure detector looks at the servers
+#define REPAIR_DELAY_MS 30000 // Downtime after which a server's copies are made again elsewhere, NM_REPAIR_DELAY_MS
+#define REPAIR_RATE 100       // Paths checked by the repair per second, NM_REPAIR_RATE
+#define REPAIR_REPORT_SECONDS 10
+#define WAL_PATH "naming_server.wal"
+#define SNAPSHOT_PATH "naming_server.snap"
+
+typedef struct StorageServer
 {
     char ip[INET_ADDRSTRLEN];
     int port;
     int socket_fd;
+    pthread_mutex_t send_lock; // Commands to the server come from several threads
     int is_async_write_in_progress;
-    int async_writer_socket;
+    uint64_t async_writer_session; // Session token of the client whose async write is running
     int is_server_down;
     char **path_list;
-    int backup_ss[2];
+    uint64_t capacity; // Declared bytes, the server's weight on the placement ring
     int path_count;
+    uint64_t registration_generation; // Of the server's last complete registration, 0 if none
+    uint64_t manifest_digest;         // Digest of the paths it registered then
+    _Atomic uint32_t in_flight;       // Requests the server last reported running
+    _Atomic uint32_t latency_us;      // Its recent mean time to serve a request
+    _Atomic uint32_t routed;          // Reads sent its way since that report
+    pthread_mutex_t liveness_lock;    // Guards the heartbeat history and monitored
+    HeartbeatHistory heartbeats;
+    int monitored; // Set by the first heartbeat, cleared once the server is taken out or lost
+    uint64_t lost_at_ms; // When it went down, or the naming server started without it; 0 while registered
+    int missed_writes;   // Lost while the naming server ran, so its copies may be stale
+    int evicted;         // Down past the repair delay: left out of placement, its copies made elsewhere
 } StorageServer;
 
-typedef StorageServer StorageServer;
-// Trie Node definition
-typedef struct TrieNode
+Trie *global_trie_root = NULL;
+
+// Allocated once with MAX_STORAGE_SERVERS slots and never moved or compacted,
+// so a slot index is a stable handle for a server (used by the location cache)
+StorageServer *storage_servers = NULL;
+int server_count = 0;
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+LocationCache *location_cache = NULL;
+ReplicationQueue *replication_queue = NULL;
+PlacementRing *placement_ring = NULL;
+ConnPool *server_pool = NULL; // Connections to the storage servers' client ports, for copies
+
+// Metadata log records. Each namespace primitive below logs the change it
+// made, and replaying the records in order rebuilds the same state.
+enum
 {
-    struct TrieNode *children[ALPHABET_SIZE];
-    int is_end_of_path;    // 1 if the node represents the end of a valid path
-    StorageServer *server; // Pointer to the associated StorageServer
-    int is_directory;
-    int is_deleted;
-} TrieNode;
+    WAL_SERVER = 1,   // u32 slot, str ip, u32 port
+    WAL_OWN_PATH,     // u32 slot, str path: added to the server's path list
+    WAL_PUT_PATH,     // u32 slot, u8 is_directory, u8 is_deleted, str path
+    WAL_MARK_TREE,    // u8 is_deleted, str path: the path and everything below it
+    WAL_REMOVE_PATH,  // str path
+    WAL_DISOWN_PATH,  // u32 slot, str path: dropped from the server's path list
+    WAL_REGISTRATION, // u32 slot, u64 registration generation, u64 manifest digest
+    WAL_REPLICATE,    // u32 slot, str path: copy to the server's backups queued
+    WAL_REPLICATED,   // u32 slot, str path: copy done or given up
+    WAL_CAPACITY,     // u32 slot, u64 declared capacity in bytes
+    WAL_POLICY,       // str path, u32 copies (0 to inherit again), u32 write quorum, u32 read quorum
+    WAL_VERSION       // str key, u64 version of the copy behind a replica entry
+};
+
+// Returns the stable handle of a registered server
+static int server_handle(const StorageServer *server)
+{
+    return (int)(server - storage_servers);
+}
 
-typedef struct
+// The record_* helpers encode one change and pass it to wal_append (the
+// caller applies it between wal_begin() and wal_end()) or, while a snapshot
+// is written, to wal_snapshot_add
+typedef void (*record_sink)(uint8_t type, const ProtoWriter *record);
+
+static void record_put_path(record_sink sink, StorageServer *server, const char *path, int is_directory, int is_deleted)
 {
-    char path[BUFFER_SIZE];
-    int found_index;
-    time_t last_accessed;
-} CacheEntry;
+    ProtoWriter record;
+    proto_writer_init(&record);
+    proto_put_u32(&record, server_handle(server));
+    proto_put_u8(&record, is_directory ? 1 : 0);
+    proto_put_u8(&record, is_deleted ? 1 : 0);
+    proto_put_str(&record, path);
+    sink(WAL_PUT_PATH, &record);
+    proto_writer_free(&record);
+}
 
-typedef struct
+static void record_server(record_sink sink, StorageServer *server)
 {
-    CacheEntry entries[CACHE_SIZE];
-    int count;
-} LRUCache;
+    ProtoWriter record;
+    proto_writer_init(&record);
+    proto_put_u32(&record, server_handle(server));
+    proto_put_str(&record, server->ip);
+    proto_put_u32(&record, server->port);
+    sink(WAL_SERVER, &record);
+    proto_writer_free(&record);
+}
 
-TrieNode *global_trie_root = NULL;
+static void record_capacity(record_sink sink, StorageServer *server)
+{
+    ProtoWriter record;
+    proto_writer_init(&record);
+    proto_put_u32(&record, server_handle(server));
+    proto_put_u64(&record, server->capacity);
+    sink(WAL_CAPACITY, &record);
+    proto_writer_free(&record);
+}
 
-StorageServer *storage_servers = NULL;
-int server_count = 0;
-pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-LRUCache lru_cache = {.count = 0};
+static void record_registration(record_sink sink, StorageServer *server)
+{
+    ProtoWriter record;
+    proto_writer_init(&record);
+    proto_put_u32(&record, server_handle(server));
+    proto_put_u64(&record, server->registration_generation);
+    proto_put_u64(&record, server->manifest_digest);
+    sink(WAL_REGISTRATION, &record);
+    proto_writer_free(&record);
+}
+
+static void record_own_path(record_sink sink, StorageServer *server, const char *path)
+{
+    ProtoWriter record;
+    proto_writer_init(&record);
+    proto_put_u32(&record, server_handle(server));
+    proto_put_str(&record, path);
+    sink(WAL_OWN_PATH, &record);
+    proto_writer_free(&record);
+}
+
+static void record_replication(record_sink sink, uint8_t type, int source, const char *path)
+{
+    ProtoWriter record;
+    proto_writer_init(&record);
+    proto_put_u32(&record, source);
+    proto_put_str(&record, path);
+    sink(type, &record);
+    proto_writer_free(&record);
+}
 
 // Function prototypes
 void log_message(const char *format, ...);
 void cache_insert(const char *path, int found_index);
 int cache_lookup(const char *path);
+void remove_paths_from_cache(const char *path);
+void remove_subtree_from_cache(const char *path);
 
-TrieNode *create_trie_node(StorageServer *server);
-void insert_path(TrieNode *root, const char *path, StorageServer *server, int is_directory);
-StorageServer *search_path(TrieNode *root, const char *path, int want_to_delete);
-void free_trie(TrieNode *root);
+void insert_path(Trie *root, const char *path, StorageServer *server, int is_directory);
+StorageServer *search_path(Trie *root, const char *path, int want_to_delete);
 StorageServer *path_exists(const char *path, StorageServer **tempo);
+int return_one_if_directory(const char *path);
 
 StorageServer *find_storage_server_by_path(const char *path);
 void remove_storage_server(int socket_fd);
-void parse_and_store_files(StorageServer *server, const char *buffer);
+void store_path_entry(StorageServer *server, const char *path, int is_directory);
+void parse_and_store_files(StorageServer *server, const ProtoMessage *file_list);
+void parse_and_remove_files(StorageServer *server, const ProtoMessage *removed);
+void remove_path_from_server(StorageServer *server, const char *path);
+
+typedef struct Connection Connection;
+
+static void send_copy_progress(uint64_t session_token, uint32_t request_id, uint64_t paths, uint64_t bytes);
+
+double phi_threshold = PHI_THRESHOLD; // 0 to rely on the timeout alone
+uint64_t heartbeat_timeout_ms = HEARTBEAT_TIMEOUT_MS;
+int copy_workers = COPY_WORKERS;
+
+// Takes storage servers whose heartbeats stopped out of routing. A hung or
+// partitioned server can keep its TCP connection open indefinitely, so
+// rather than waiting for the connection to fail, the detector shuts the
+// socket down itself; the server's thread then runs storage_server_lost as
+// for any lost connection, and the server registers again if it was only
+// slow. Detection takes at most the timeout plus DETECTOR_CHECK_MS after
+// the last heartbeat, and usually well under a second with phi.
+void *failure_detector_thread(void *arg)
+{
+    (void)arg;
+    while (1)
+    {
+        usleep(DETECTOR_CHECK_MS * 1000);
+        uint64_t now = heartbeat_now_ms();
+        for (int i = 0; i < server_count; i++)
+        {
+            StorageServer *server = &storage_servers[i];
+            pthread_mutex_lock(&server->liveness_lock);
+            if (!server->monitored)
+            {
+                pthread_mutex_unlock(&server->liveness_lock);
+                continue;
+            }
+            uint64_t silent_ms = now - server->heartbeats.last_ms;
+            double phi = heartbeat_phi(&server->heartbeats, now);
+            int suspected = silent_ms > heartbeat_timeout_ms || (phi_threshold > 0 && phi > phi_threshold);
+            if (suspected)
+            {
+                server->monitored = 0;
+                server->is_server_down = 1;
+                shutdown(server->socket_fd, SHUT_RDWR);
+            }
+            pthread_mutex_unlock(&server->liveness_lock);
+            if (suspected)
+            {
+                log_message("Storage Server %s:%d suspected after %llu ms without a heartbeat (phi %.1f, mean interval %.0f ms)\n",
+                            server->ip, server->port, (unsigned long long)silent_ms, phi, server->heartbeats.mean_ms);
+                printf("Storage Server %s:%d suspected after %llu ms without a heartbeat (phi %.1f)\n", server->ip,
+                       server->port, (unsigned long long)silent_ms, phi);
+            }
+        }
+    }
+    return NULL;
+}
 
-void storage_server_thread(int client_sock);
-void *handle_client(void *arg);
+void storage_server_thread(int client_sock, const char *my_ip, int my_port, uint64_t generation, uint64_t digest, uint64_t capacity);
+int handle_client_message(Connection *conn, const ProtoMessage *msg);
+int notify_session(uint64_t session_token, uint16_t opcode, const void *payload, size_t len);
 void *main_server_thread(void *arg);
 
 // Additional function prototypes
-int perform_copy_between_servers(int src_port, int dest_port, const char *source, const char *destination);
-int perform_copy_between_servers1(int src_port, int dest_port, const char *source, const char *destination);
-void send_command_to_storage(const StorageServer *server, const char *command, const char *path);
+void send_command_to_storage(StorageServer *server, uint16_t command, const char *path);
 
-char buffer_back[BUFFER_SIZE] = {0};
-
-// Print all trie paths that match a given prefix, sending results to the client socket.
-void print_trie_paths1(TrieNode *root, char *path, int level, int client_sock, char *prefix)
+typedef struct
 {
-    // If this node or its subtree is deleted, skip it
-    if (root->is_deleted)
+    const char *path; // Directory being listed, "" for the whole namespace
+    size_t path_len;
+    uint32_t limit; // Entries per page
+    uint32_t sent;
+    int truncated;         // Set if entries remain after this page
+    const char *last_key;  // Cursor for the next page
+    uint32_t request_id;
+    ProtoWriter head;      // Reused for every entry
+    ProtoBatch batch;
+} ListContext;
+
+// Queues one LIST_ENTRY for a live path. The path itself is not copied: the
+// leaf stays valid until the batch is flushed inside the read section.
+static int send_list_entry(TrieLeaf *leaf, void *data)
+{
+    ListContext *ctx = (ListContext *)data;
+    StorageServer *server = leaf->server;
+    if (leaf->is_deleted || server == NULL || server->is_server_down)
     {
-        return;
+        return 0;
     }
-
-    // If this node is the end of a valid path and the server is up
-    if (root->is_end_of_path && root->server != NULL && !root->server->is_server_down && !root->is_deleted)
+    // A prefix like "dir" also covers "dir2/x"; only dir and dir/... belong
+    if (ctx->path_len && !trie_leaf_in_subtree(leaf, ctx->path, ctx->path_len))
     {
-        path[level] = '\0'; // Null-terminate the string
-        // Check if this is a directory or file and send the appropriate message
-        if (root->is_directory)
-        {
-            char temp[BUFFER_SIZE];
-            snprintf(temp, sizeof(temp), "Directory: %s\n", path);
-            if (strstr(path, prefix) != NULL)
-                send(client_sock, temp, strlen(temp), 0);
-        }
-        else if (root->is_directory == 0)
-        {
-            char temp[BUFFER_SIZE];
-            snprintf(temp, sizeof(temp), "File: %s\n", path);
-            if (strstr(path, prefix) != NULL)
-                send(client_sock, temp, strlen(temp), 0);
-        }
+        return 0;
     }
-    // Recursively traverse all children
-    for (int i = 0; i < ALPHABET_SIZE; i++)
+    if (ctx->sent == ctx->limit)
     {
-        if (root->children[i])
-        {
-            path[level] = i; // Add current character to the path
-            print_trie_paths1(root->children[i], path, level + 1, client_sock, prefix);
-        }
+        ctx->truncated = 1;
+        return 1;
     }
+    ctx->sent++;
+    ctx->last_key = leaf->key;
+    proto_writer_reset(&ctx->head);
+    proto_put_u8(&ctx->head, leaf->is_directory ? 1 : 0);
+    proto_put_u32(&ctx->head, leaf->key_len);
+    // Stop walking once the client is gone
+    return proto_batch_add(&ctx->batch, PROTO_LIST_ENTRY, ctx->request_id, &ctx->head, leaf->key, leaf->key_len) < 0;
 }
 
-// Wrapper function to print all trie paths matching a prefix
-void print_all_trie_paths1(int client_sock, char *prefix)
-{
-    char path[BUFFER_SIZE]; // Buffer to store the path as it's built
-    print_trie_paths1(global_trie_root, path, 0, client_sock, prefix);
-    sleep(0.5);
-    send(client_sock, "EOF", strlen("EOF"), 0);
-}
-
-// Print all trie paths (no prefix filtering)
-void print_trie_paths(TrieNode *root, char *path, int level, int client_sock)
+// Sends one page of the paths under a directory, in sorted order, starting
+// after the cursor. Only the part of the trie below the directory is walked.
+// LIST_END carries the cursor of the next page if there is one.
+// The caller must hold the session's send lock.
+void print_all_trie_paths1(int client_sock, uint32_t request_id, const char *path, uint32_t limit, const char *after)
 {
-    if (root->is_deleted)
+    if (path == NULL || strcmp(path, ".") == 0 || strcmp(path, "/") == 0 || strcmp(path, "./") == 0)
     {
-        return;
+        path = "";
     }
-    if (root->is_end_of_path && root->server != NULL && !root->server->is_server_down && !root->is_deleted)
+    ListContext ctx = {.path = path, .path_len = strlen(path), .request_id = request_id};
+    ctx.limit = (limit == 0 || limit > LIST_MAX_PAGE) ? LIST_MAX_PAGE : limit;
+    proto_writer_init(&ctx.head);
+    proto_batch_init(&ctx.batch, client_sock);
+
+    ProtoWriter end;
+    proto_writer_init(&end);
+    trie_read_lock();
+    trie_iterate_prefix_after(global_trie_root, path, after, send_list_entry, &ctx);
+    int failed = proto_batch_flush(&ctx.batch) < 0;
+    if (ctx.truncated)
     {
-        path[level] = '\0'; // Null-terminate the string
-        if (root->is_directory)
-        {
-            char temp[BUFFER_SIZE];
-            snprintf(temp, sizeof(temp), "Directory: %s\n", path);
-            send(client_sock, temp, strlen(temp), 0);
-        }
-        else if (root->is_directory == 0)
-        {
-            char temp[BUFFER_SIZE];
-            snprintf(temp, sizeof(temp), "File: %s\n", path);
-            send(client_sock, temp, strlen(temp), 0);
-        }
+        proto_put_str(&end, ctx.last_key);
     }
-    // Recursively traverse the children
-    for (int i = 0; i < ALPHABET_SIZE; i++)
+    trie_read_unlock();
+    if (!failed)
     {
-        if (root->children[i])
-        {
-            path[level] = i; // Add current character to the path
-            print_trie_paths(root->children[i], path, level + 1, client_sock);
-        }
+        proto_send_writer(client_sock, PROTO_LIST_END, 0, request_id, &end);
     }
+    proto_writer_free(&end);
+    proto_writer_free(&ctx.head);
 }
 
 // Wrapper function to print all paths in the global Trie
-void print_all_trie_paths(int client_sock)
+void print_all_trie_paths(int client_sock, uint32_t request_id)
 {
-    char path[BUFFER_SIZE]; // Buffer to store the path as it's built
-    print_trie_paths(global_trie_root, path, 0, client_sock);
-    sleep(0.5);
-    send(client_sock, "EOF", strlen("EOF"), 0);
+    print_all_trie_paths1(client_sock, request_id, NULL, 0, NULL);
 }
 
-// LRU cache lookup function
+// Returns the stable handle (slot in storage_servers) of the server that
+// holds a path, or -1 if the path is not cached
 int cache_lookup(const char *path)
 {
-    for (int i = 0; i < lru_cache.count; i++)
+    int handle = location_cache_lookup(location_cache, path);
+    if (handle != -1)
     {
-        if (strcmp(lru_cache.entries[i].path, path) == 0)
-        {
-            log_message("Found in cache\n");
-            // printf("Found in cache\n");
-            lru_cache.entries[i].last_accessed = time(NULL); // Update access time
-            // printf("Found in cache\n");
-            return lru_cache.entries[i].found_index;
-        }
+        log_emit(LOG_LEVEL_DEBUG, "Found in cache: %s\n", path);
     }
-    return -1; // Not found in cache
+    return handle;
 }
 
-// LRU cache insert function
+// Caches the server handle for a path; the shard evicts its least recently used entry when full
 void cache_insert(const char *path, int found_index)
 {
-    if (lru_cache.count < CACHE_SIZE)
+    if (found_index < 0 || found_index >= server_count)
     {
-        strcpy(lru_cache.entries[lru_cache.count].path, path);
-        lru_cache.entries[lru_cache.count].found_index = found_index;
-        lru_cache.entries[lru_cache.count].last_accessed = time(NULL);
-        lru_cache.count++;
-    }
-    else
-    {
-        // Evict least recently used
-        int lru_index = 0;
-        for (int i = 1; i < CACHE_SIZE; i++)
-        {
-            if (lru_cache.entries[i].last_accessed < lru_cache.entries[lru_index].last_accessed)
-                lru_index = i;
-        }
-        strcpy(lru_cache.entries[lru_index].path, path);
-        lru_cache.entries[lru_index].found_index = found_index;
-        lru_cache.entries[lru_index].last_accessed = time(NULL);
-        // log_message("Evicted from cache\n");
-        // printf("Evicted from cache\n");
+        return;
     }
+    location_cache_insert(location_cache, path, found_index);
 }
 
-// Function to log messages with IP, port, and status
+// Queues a message for the background log writer; never blocks
 void log_message(const char *format, ...)
 {
-    FILE *log_file = fopen("naming_server.log", "a");
-    if (!log_file)
-    {
-        perror("Failed to open log file");
-        return;
-    }
-
     va_list args;
     va_start(args, format);
-    vfprintf(log_file, format, args);
+    log_vemit(LOG_LEVEL_INFO, format, args);
     va_end(args);
-
-    fclose(log_file);
-}
-
-// Function to create a new Trie Node
-// Allocates and initializes a new TrieNode. Returns NULL on failure.
-TrieNode *create_trie_node(StorageServer *server)
-{
-    TrieNode *node = (TrieNode *)malloc(sizeof(TrieNode));
-    if (!node)
-    {
-        printf("Error: Failed to allocate memory for trie node\n");
-        return NULL;
-    }
-    // Initialize all fields
-    node->is_end_of_path = 0;
-    node->is_deleted = 0;
-    node->is_directory = 0;
-    node->server = server;
-    if (server)
-    {
-        server->is_server_down = 0;
-    }
-    for (int i = 0; i < ALPHABET_SIZE; i++)
-        node->children[i] = NULL;
-    return node;
 }
 
 // Function to insert a path into the Trie
 // Associates the path with a StorageServer and marks as directory or file.
-void insert_path(TrieNode *root, const char *path, StorageServer *server, int is_directory)
+void insert_path(Trie *root, const char *path, StorageServer *server, int is_directory)
 {
     if (!root || !path || !server)
     {
         printf("Error: Invalid parameters in insert_path\n");
         return;
     }
-    TrieNode *crawler = root;
-    while (*path)
-    {
-        if (!crawler->children[(int)*path])
-        {
-            crawler->children[(int)*path] = create_trie_node(server);
-            if (!crawler->children[(int)*path])
-            {
-                printf("Error: Failed to create trie node in insert_path\n");
-                return;
-            }
-        }
-        crawler = crawler->children[(int)*path];
-        path++;
-    }
-    crawler->is_end_of_path = 1;
-    crawler->is_deleted = 0;
-    crawler->is_directory = is_directory;
-    crawler->server = server; // Associate the path with the StorageServer
-    if (crawler->server)
+    // The leaf is published already associated with the StorageServer
+    wal_begin();
+    if (!trie_insert(root, path, server, is_directory, NULL))
     {
-        crawler->server->is_server_down = 0;
+        wal_end();
+        printf("Error: Failed to create trie node in insert_path\n");
+        return;
     }
+    record_put_path(wal_append, server, path, is_directory, 0);
+    wal_end();
 }
 
-// Recursively marks a subtree as deleted (used for delete operations)
-void mark_subtree_as_deleted(TrieNode *node)
+typedef struct
 {
-    if (node == NULL)
-        return;
-    if (node->is_end_of_path)
-    {
-        node->is_deleted = 1;
-    }
-    // Recursively mark all children as deleted
-    for (int i = 0; i < ALPHABET_SIZE; i++)
+    const char *path;
+    size_t path_len;
+    int is_deleted;
+} SubtreeMark;
+
+static int set_subtree_deleted(TrieLeaf *leaf, void *data)
+{
+    SubtreeMark *mark = (SubtreeMark *)data;
+    if (trie_leaf_in_subtree(leaf, mark->path, mark->path_len))
     {
-        if (node->children[i] != NULL)
-        {
-            mark_subtree_as_deleted(node->children[i]);
-        }
+        leaf->is_deleted = mark->is_deleted;
     }
+    return 0;
+}
+
+// Sets or clears the deleted mark on a path and everything below it
+static void mark_subtree(Trie *root, const char *path, int is_deleted)
+{
+    SubtreeMark mark = {.path = path, .path_len = strlen(path), .is_deleted = is_deleted};
+    wal_begin();
+    trie_iterate_prefix(root, path, set_subtree_deleted, &mark);
+    ProtoWriter record;
+    proto_writer_init(&record);
+    proto_put_u8(&record, is_deleted);
+    proto_put_str(&record, path);
+    wal_append(WAL_MARK_TREE, &record);
+    wal_end();
+    proto_writer_free(&record);
+}
+
+// Marks a path and everything below it as deleted (used for delete operations)
+void mark_subtree_as_deleted(Trie *root, const char *path)
+{
+    mark_subtree(root, path, 1);
 }
 
 // Function to search for a path in the Trie
 // Returns the associated StorageServer, or NULL if not found or deleted.
 // If want_to_delete is set, marks the subtree as deleted.
-StorageServer *search_path(TrieNode *root, const char *path, int want_to_delete)
+StorageServer *search_path(Trie *root, const char *path, int want_to_delete)
 {
-    TrieNode *crawler = root;
-    while (*path)
-    {
-        if (!crawler->children[(int)*path] || crawler->is_deleted)
-        {
-            return NULL;
-        }
-        crawler = crawler->children[(int)*path];
-        path++;
-    }
-    if (crawler != NULL && crawler->is_end_of_path && crawler->server != NULL)
+    StorageServer *result = NULL;
+    trie_read_lock();
+    TrieLeaf *leaf = trie_search(root, path);
+    StorageServer *server = leaf ? leaf->server : NULL;
+    if (server != NULL)
     {
         if (want_to_delete)
         {
-            mark_subtree_as_deleted(crawler);
+            mark_subtree_as_deleted(root, path);
         }
-        if (crawler->server->is_server_down || crawler->is_deleted)
+        if (!server->is_server_down && !leaf->is_deleted)
         {
-            return NULL;
+            result = server;
         }
-        return crawler->server;
     }
-    return NULL;
+    trie_read_unlock();
+    return result;
 }
 
 // Function to search for a path in the Trie and return the associated server (no delete)
-StorageServer *search_trie(TrieNode *root, const char *path)
-{
-    TrieNode *current = root;
-    // Traverse the Trie based on the characters in the path
-    for (int i = 0; path[i] != '\0'; i++)
-    {
-        int index = path[i];
-        // If the current character does not have a corresponding child node, return NULL
-        if (!current->children[index])
-        {
-            return NULL;
-        }
-        // Move to the next node
-        current = current->children[index];
-        // If the current node is deleted, the path is invalid
-        if (current->is_deleted)
-        {
-            return NULL;
-        }
-    }
-    // Check if the current node marks the end of a valid path and return the server
-    if (current->is_end_of_path && current->server != NULL && current->server->is_server_down == 0)
-    {
-        return current->server;
-    }
-    // If it's not the end of a valid path, return NULL
-    return NULL;
-}
-
-// Recursively frees all nodes in the Trie
-void free_trie(TrieNode *root)
-{
-    for (int i = 0; i < ALPHABET_SIZE; i++)
-    {
-        if (root->children[i])
-        {
-            free_trie(root->children[i]);
-        }
-    }
-    free(root);
-}
-
-StorageServer *path_exists(const char *path, StorageServer **tempo)
+StorageServer *search_trie(Trie *root, const char *path)
 {
-    pthread_mutex_lock(&lock);
-    int exists = (search_path(global_trie_root, path, 0) != NULL);
-    if (exists == 0)
-    {
-        char temp1[1024] = "Backup1";
-        strcat(temp1, path);
-        exists = (search_path(global_trie_root, temp1, 0) != NULL);
-        if (exists == 0)
-        {
-            char temp2[1024] = "Backup2";
-            strcat(temp2, path);
-            // *tempo = search_path(global_trie_root, temp2,0);
-            int exists = (search_path(global_trie_root, temp2, 0) != NULL);
-            pthread_mutex_unlock(&lock);
-            return search_path(global_trie_root, temp2, 0);
-        }
-        pthread_mutex_unlock(&lock);
-        return search_path(global_trie_root, temp1, 0);
-    }
-    else
+    StorageServer *result = NULL;
+    trie_read_lock();
+    TrieLeaf *leaf = trie_search(root, path);
+    StorageServer *server = leaf ? leaf->server : NULL;
+    if (server != NULL && !leaf->is_deleted && server->is_server_down == 0)
     {
-        pthread_mutex_unlock(&lock);
-        return search_path(global_trie_root, path, 0);
+        result = server;
     }
-    pthread_mutex_unlock(&lock);
-    return *tempo;
+    trie_read_unlock();
+    return result;
 }
 
 StorageServer *find_storage_server_by_path(const char *path)
 {
-    if (cache_lookup(path) != -1)
+    int handle = cache_lookup(path);
+    if (handle != -1)
     {
-        return &storage_servers[cache_lookup(path)];
+        return &storage_servers[handle];
     }
     StorageServer *server = search_path(global_trie_root, path, 0);
     if (server)
     {
-        for (int i = 0; i < server_count; i++)
-        {
-            if (&storage_servers[i] == server)
-            {
-                cache_insert(path, i);
-                return server;
-            }
-        }
-    }
-    return NULL;
-}
-
-static bool has_children(TrieNode *node)
-{
-    if (node == NULL)
-        return false;
-    for (int i = 0; i < 26; i++)
-    {
-        if (node->children[i] != NULL)
-        {
-            return true;
-        }
+        cache_insert(path, server_handle(server));
     }
-    return false;
-}
-
-// Helper function to safely free a node
-static void free_trie_node(TrieNode *node)
-{
-    if (node == NULL)
-        return;
-    // Don't free the server pointer as it's managed elsewhere
-    node->server = NULL;
-    free(node);
+    return server;
 }
 
-// Removes a path from the trie recursively, freeing nodes as needed
-// Returns true if the node can be deleted
-bool remove_path_from_trie(TrieNode *node, const char *path, int depth)
+// Removes a path from the trie, freeing its leaf
+// Returns true if the path was present
+bool remove_path_from_trie(Trie *root, const char *path)
 {
-    int index = path[depth] - 'a';
-    if (index < 0 || index >= 26)
-    {
-        return false; // Invalid character in path
-    }
-    // Recursively remove from child
-    if (node->children[index] != NULL)
-    {
-        bool should_delete_child = remove_path_from_trie(node->children[index], path, depth + 1);
-        if (should_delete_child)
-        {
-            free_trie_node(node->children[index]);
-            node->children[index] = NULL;
-            // If this node is not an endpoint and has no other children, signal it can be deleted
-            if (!node->is_end_of_path && !has_children(node))
-            {
-                return true;
-            }
-        }
-    }
-    return false;
+    wal_begin();
+    bool removed = trie_delete(root, path);
+    if (removed)
+    {
+        ProtoWriter record;
+        proto_writer_init(&record);
+        proto_put_str(&record, path);
+        wal_append(WAL_REMOVE_PATH, &record);
+        proto_writer_free(&record);
+    }
+    wal_end();
+    return removed;
 }
 
 // Removes all paths associated with a storage server from the trie
@@ -515,7 +533,7 @@ void remove_paths_for_server(StorageServer *server)
     {
         if (server->path_list[i] != NULL)
         {
-            remove_path_from_trie(global_trie_root, server->path_list[i], 0);
+            remove_path_from_trie(global_trie_root, server->path_list[i]);
             free(server->path_list[i]);
             server->path_list[i] = NULL;
         }
@@ -527,62 +545,49 @@ void remove_paths_for_server(StorageServer *server)
     pthread_mutex_unlock(&lock); // Release lock
 }
 
-// Helper to clean up TrieNode->server pointers for a removed server
-void clean_trie_server_pointers(TrieNode *node, StorageServer *removed_server) {
-    if (!node) return;
-    if (node->server == removed_server) {
-        node->server = NULL;
-    }
-    for (int i = 0; i < ALPHABET_SIZE; i++) {
-        if (node->children[i]) {
-            clean_trie_server_pointers(node->children[i], removed_server);
-        }
+static int clear_server_pointer(TrieLeaf *leaf, void *data)
+{
+    if (leaf->server == (StorageServer *)data)
+    {
+        leaf->server = NULL;
     }
+    return 0;
 }
 
-// Removes a storage server from the list and updates the trie
+// Helper to clean up TrieLeaf->server pointers for a removed server
+void clean_trie_server_pointers(Trie *root, StorageServer *removed_server)
+{
+    trie_iterate(root, clear_server_pointer, removed_server);
+}
+
+// Removes a storage server and updates the trie. The slot is kept as a
+// tombstone so the handles of the other servers stay valid.
 void remove_storage_server(int socket_fd)
 {
     pthread_mutex_lock(&lock);
-    int i;
-    for (i = 0; i < server_count; i++)
+    for (int i = 0; i < server_count; i++)
     {
         if (storage_servers[i].socket_fd == socket_fd)
         {
-            // Clean up trie pointers before realloc
             clean_trie_server_pointers(global_trie_root, &storage_servers[i]);
-            // Shift remaining servers down in the array
-            for (int j = i; j < server_count - 1; j++)
-            {
-                storage_servers[j] = storage_servers[j + 1];
-            }
-            server_count--;
-            StorageServer *tmp = realloc(storage_servers, server_count * sizeof(StorageServer));
-            if (server_count > 0 && tmp == NULL) {
-                perror("Failed to realloc storage_servers");
-            } else {
-                storage_servers = tmp;
-            }
+            storage_servers[i].is_server_down = 1;
+            storage_servers[i].socket_fd = -1;
             break;
         }
     }
     pthread_mutex_unlock(&lock);
 }
 
-// Adds a path to a storage server's path list
-void add_path_to_server(StorageServer *server, const char *path)
+// Appends a path to a storage server's path list. Returns 0 on success.
+static int append_server_path(StorageServer *server, const char *path)
 {
-    if (server == NULL || path == NULL)
-    {
-        return;
-    }
     if (server->path_list == NULL)
     {
         server->path_list = malloc(sizeof(char *));
         if (server->path_list == NULL)
         {
             perror("Failed to allocate memory for path list");
-            return;
+            return -1;
         }
     }
     else
@@ -591,7 +596,7 @@ void add_path_to_server(StorageServer *server, const char *path)
         if (tmp == NULL)
         {
             perror("Failed to reallocate memory for path list");
-            return;
+            return -1;
         }
         server->path_list = tmp;
     }
@@ -599,1407 +604,2798 @@ void add_path_to_server(StorageServer *server, const char *path)
     if (server->path_list[server->path_count] == NULL)
     {
         perror("Failed to allocate memory for path string");
-        return;
+        return -1;
     }
     server->path_count++;
+    return 0;
 }
 
-// Handles backup/replication: parses file list and stores backups on backup servers
-void parse_and_store_backup(StorageServer *server, const char *buffer)
+// Adds a path to a storage server's path list
+void add_path_to_server(StorageServer *server, const char *path)
 {
-    if (!server || !buffer)
+    if (server == NULL || path == NULL)
     {
-        printf("Error: Invalid server or buffer in parse_and_store_backup\n");
         return;
     }
-    char buffer1[1024];
-    strncpy(buffer1, buffer, sizeof(buffer1) - 1);
-    buffer1[sizeof(buffer1) - 1] = '\0';
-    char *line = strtok((char *)buffer, "\n");
-    while (line != NULL)
+    wal_begin();
+    if (append_server_path(server, path) == 0)
     {
-        sleep(3);
-        if (strncmp(line, "Directory:", 10) == 0 || strncmp(line, "File:", 5) == 0)
-        {
-            int a = (strncmp(line, "Directory:", 10) == 0) ? 1 : 0;
-            char *space_pos = strchr(line, ' ');
-            if (!space_pos)
-            {
-                printf("Error: Invalid line format in backup: %s\n", line);
-                line = strtok(NULL, "\n");
-                continue;
-            }
-            const char *path = space_pos + 1;
-            // Backup 1
-            if (server->backup_ss[0] >= 0 && server->backup_ss[0] < server_count)
-            {
-                char buf[1024];
-                strcpy(buf, path);
-                perform_copy_between_servers(server->port, storage_servers[server->backup_ss[0]].port, path, buf);
-                char temp1[1024] = "Backup1";
-                strcat(temp1, path);
-                insert_path(global_trie_root, temp1, &storage_servers[server->backup_ss[0]], a);
-            }
-            // Backup 2
-            if (server->backup_ss[1] >= 0 && server->backup_ss[1] < server_count)
-            {
-                perform_copy_between_servers(server->port, storage_servers[server->backup_ss[1]].port, path, path);
-                char temp2[1024] = "Backup2";
-                strcat(temp2, path);
-                insert_path(global_trie_root, temp2, &storage_servers[server->backup_ss[1]], a);
-            }
-        }
-        line = strtok(NULL, "\n");
+        record_own_path(wal_append, server, path);
     }
+    wal_end();
 }
 
-// Parses file list from a storage server and inserts into the trie
-void parse_and_store_files(StorageServer *server, const char *buffer)
+// Removes a path from a storage server's path list. Returns 0 if it was there.
+static int remove_server_path(StorageServer *server, const char *path)
 {
-    if (!server || !buffer)
-    {
-        printf("Error: Invalid server or buffer in parse_and_store_files\n");
-        return;
-    }
-    // Initialize global trie root if not already done
-    if (!global_trie_root)
+    for (int i = 0; i < server->path_count; i++)
     {
-        global_trie_root = create_trie_node(NULL);
-        if (!global_trie_root)
+        if (server->path_list[i] != NULL && strcmp(server->path_list[i], path) == 0)
         {
-            printf("Error: Failed to create global trie root\n");
-            return;
+            free(server->path_list[i]);
+            server->path_list[i] = server->path_list[--server->path_count];
+            return 0;
         }
     }
+    return -1;
+}
 
-    char buffer1[1024];
-    strncpy(buffer1, buffer, sizeof(buffer1) - 1);
-    buffer1[sizeof(buffer1) - 1] = '\0';
-
-    char *line = strtok((char *)buffer, "\n");
-
-    while (line != NULL)
+// Drops a path from a storage server's path list
+void remove_path_from_server(StorageServer *server, const char *path)
+{
+    wal_begin();
+    if (remove_server_path(server, path) == 0)
     {
-        if (strncmp(line, "Directory:", 10) == 0 || strncmp(line, "File:", 5) == 0)
-        {
-            int a = (strncmp(line, "Directory:", 10) == 0) ? 1 : 0;
-            char *space_pos = strchr(line, ' ');
-            if (!space_pos)
-            {
-                printf("Error: Invalid line format: %s\n", line);
-                line = strtok(NULL, "\n");
-                continue;
-            }
-            const char *path = space_pos + 1;
-            if (!path || strlen(path) == 0)
-            {
-                printf("Error: Empty path in line: %s\n", line);
-                line = strtok(NULL, "\n");
-                continue;
-            }
-            add_path_to_server(server, path);
-            insert_path(global_trie_root, path, server, a);
-            if (server_count > 2 && server->backup_ss[0] >= 0 && server->backup_ss[0] < server_count)        
-            {
-                char buf[1024];
-                strcpy(buf, path);
-                perform_copy_between_servers(server->port, storage_servers[server->backup_ss[0]].port, path, buf);
-                char temp1[1024] = "Backup1";
-
-                strcat(temp1, path);
-
-                insert_path(global_trie_root, temp1, &storage_servers[server->backup_ss[0]], a);
-            }
-
-            // Backup 2
-            if (server_count > 2 && server->backup_ss[1] >= 0 && server->backup_ss[1] < server_count)
-            {
-                perform_copy_between_servers(server->port, storage_servers[server->backup_ss[1]].port, path, path);
-                char temp2[1024] = "Backup2";
-                strcat(temp2, path);
-                insert_path(global_trie_root, temp2, &storage_servers[server->backup_ss[1]], a);
-            }
-        }
-        line = strtok(NULL, "\n");
+        ProtoWriter record;
+        proto_writer_init(&record);
+        proto_put_u32(&record, server_handle(server));
+        proto_put_str(&record, path);
+        wal_append(WAL_DISOWN_PATH, &record);
+        proto_writer_free(&record);
     }
+    wal_end();
 }
 
-// Collects all paths associated with a storage server into a buffer
-void collect_paths_to_buffer(TrieNode *node, char *current_path, int depth, char *buffer, StorageServer *server)
+// Puts a server on the placement ring, weighted by its declared capacity.
+// Returns 1 if the ring changed.
+static int place_server(StorageServer *server)
 {
+    char name[INET_ADDRSTRLEN + 16];
+    snprintf(name, sizeof(name), "%s:%d", server->ip, server->port);
+    return placement_set(placement_ring, server_handle(server), name, placement_vnodes_for_capacity(server->capacity)) == 1;
+}
 
-    if (node == NULL)
-
-        return;
-
-    // If this node marks the end of a path, append it to the buffer
+// Replication settings of a path and of everything below it that has none
+// of its own
+typedef struct
+{
+    int copies;       // Replicas of each path: the primary and its backups
+    int write_quorum; // Replicas that must hold a synchronous write before it is acknowledged
+    int read_quorum;  // Up-to-date replicas that must be up to serve a read
+} ReplicaPolicy;
 
-    if (node->is_end_of_path && node->server == server)
+typedef struct PolicyEntry
+{
+    struct PolicyEntry *next;
+    ReplicaPolicy policy;
+    char path[];
+} PolicyEntry;
+
+// Policies set with SET_REPLICATION, by path. There are few of them (one per
+// directory that needs other settings), so a fixed table is enough.
+static PolicyEntry *policy_table[POLICY_BUCKETS];
+static size_t policy_count = 0;
+static pthread_rwlock_t policy_lock = PTHREAD_RWLOCK_INITIALIZER;
+// Applies where no policy is set; see main() for the environment overrides
+static ReplicaPolicy default_policy = {REPLICATION_FACTOR, 1, 1};
+
+static PolicyEntry **find_policy(const char *path, size_t len)
+{
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++)
     {
-        current_path[depth] = '\0';
-        strcat(buffer, "File: "); // Null-terminate the current path
-        strcat(buffer, current_path); // Append the path to the buffer
-        strcat(buffer, "\n"); // Add a newline
+        h ^= (unsigned char)path[i];
+        h *= 1099511628211ULL;
     }
+    PolicyEntry **slot = &policy_table[h % POLICY_BUCKETS];
+    while (*slot && (strncmp((*slot)->path, path, len) != 0 || (*slot)->path[len] != '\0'))
+    {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
 
-    // Recur for each child
-
-    for (int i = 0; i < ALPHABET_SIZE; i++)
+// Returns the policy of the path, or of its nearest ancestor that has one.
+// The empty path holds the policy of the whole namespace.
+static ReplicaPolicy effective_policy(const char *path)
+{
+    ReplicaPolicy policy = default_policy;
+    pthread_rwlock_rdlock(&policy_lock);
+    size_t len = strlen(path);
+    while (policy_count > 0)
     {
-        if (node->children[i] != NULL)
+        PolicyEntry *entry = *find_policy(path, len);
+        if (entry)
+        {
+            policy = entry->policy;
+            break;
+        }
+        if (len == 0)
         {
-            current_path[depth] = (char)i; // Add the current character to the path
-            collect_paths_to_buffer(node->children[i], current_path, depth + 1, buffer, server);
+            break;
         }
+        const char *slash = memrchr(path, '/', len);
+        len = slash ? (size_t)(slash - path) : 0;
     }
+    pthread_rwlock_unlock(&policy_lock);
+    return policy;
 }
 
-// Retrieves all paths associated with a storage server into a buffer
-void retrieve_paths_to_buffer(TrieNode *root, char *buffer, StorageServer *server)
+// Sets the policy of a path; a policy of 0 copies removes it, so the path
+// inherits again
+static void apply_policy(const char *path, const ReplicaPolicy *policy)
 {
-    if (root == NULL)
-        return;
-
-    char current_path[BUFFER_SIZE] = {0}; // Temporary array for constructing paths
-
-    buffer[0] = '\0'; // Ensure buffer starts empty
+    pthread_rwlock_wrlock(&policy_lock);
+    PolicyEntry **slot = find_policy(path, strlen(path));
+    if (policy->copies == 0)
+    {
+        if (*slot)
+        {
+            PolicyEntry *entry = *slot;
+            *slot = entry->next;
+            free(entry);
+            policy_count--;
+        }
+    }
+    else if (*slot)
+    {
+        (*slot)->policy = *policy;
+    }
+    else
+    {
+        size_t len = strlen(path) + 1;
+        PolicyEntry *entry = malloc(sizeof(PolicyEntry) + len);
+        if (entry)
+        {
+            memcpy(entry->path, path, len);
+            entry->policy = *policy;
+            entry->next = NULL;
+            *slot = entry;
+            policy_count++;
+        }
+        else
+        {
+            perror("Failed to allocate replication policy");
+        }
+    }
+    pthread_rwlock_unlock(&policy_lock);
+}
 
-    collect_paths_to_buffer(root, current_path, 0, buffer, server);
+static void record_policy(record_sink sink, const char *path, const ReplicaPolicy *policy)
+{
+    ProtoWriter record;
+    proto_writer_init(&record);
+    proto_put_str(&record, path);
+    proto_put_u32(&record, policy->copies);
+    proto_put_u32(&record, policy->write_quorum);
+    proto_put_u32(&record, policy->read_quorum);
+    sink(WAL_POLICY, &record);
+    proto_writer_free(&record);
 }
 
-// Checks if a path exists in the trie and is a valid endpoint
-int validate_path(TrieNode *root, const char *path)
+// Key of a replica entry in the trie: the path itself for the primary
+// (slot 0), Backup<slot><path> for a backup
+static void replica_key(char *key, size_t size, const char *path, int slot)
 {
-    TrieNode *crawler = root;
-    while (*path)
+    if (slot == 0)
+    {
+        snprintf(key, size, "%s", path);
+    }
+    else
     {
-        if (!crawler->children[(int)*path])
-            return 0; // Path does not exist
-        crawler = crawler->children[(int)*path];
-        path++;
+        snprintf(key, size, "Backup%d%s", slot, path);
     }
-    return crawler->is_end_of_path; // Return 1 if it is the end of a valid path
 }
 
-// Recursively finds all file paths with a given prefix and stores them in results
-void find_paths_with_prefix(TrieNode *node, char *current_path, size_t depth, const char *prefix, char **results, int *count)
+static int is_backup_key(const char *key)
 {
-    if (!node)
-        return;
-    if (node->is_end_of_path && !node->is_directory)
+    return strncmp(key, "Backup", 6) == 0 && key[6] >= '1' && key[6] <= '9';
+}
+
+// Lookups run against the lock-free trie, so no global lock is taken here.
+// Returns the first live replica of a path, primary first, or NULL.
+StorageServer *path_exists(const char *path, StorageServer **tempo)
+{
+    (void)tempo;
+    char key[BUFFER_SIZE];
+    for (int slot = 0; slot < MAX_REPLICAS; slot++)
     {
-        current_path[depth] = '\0'; // Null-terminate the path
-        results[*count] = strdup(current_path);
-        if (!results[*count]) {
-            perror("strdup failed in find_paths_with_prefix");
-            return;
+        replica_key(key, sizeof(key), path, slot);
+        StorageServer *server = search_path(global_trie_root, key, 0);
+        if (server != NULL)
+        {
+            return server;
         }
-        (*count)++;
     }
-    for (int i = 0; i < ALPHABET_SIZE; i++)
-    {
-        if (node->children[i])
+    return NULL;
+}
+
+typedef struct
+{
+    StorageServer *server;
+    uint64_t version; // Of the copy the server holds, 0 if it has none yet
+    int slot;
+} Replica;
+
+// Lists the replica entries of a path that are not deleted, primary first,
+// and sets *latest to the newest version any of them holds
+static int list_replicas(const char *path, Replica *replicas, uint64_t *latest)
+{
+    char key[BUFFER_SIZE];
+    int count = 0;
+    *latest = 0;
+    trie_read_lock();
+    for (int slot = 0; slot < MAX_REPLICAS; slot++)
+    {
+        replica_key(key, sizeof(key), path, slot);
+        TrieLeaf *leaf = trie_search(global_trie_root, key);
+        if (leaf == NULL || leaf->is_deleted || leaf->server == NULL)
+        {
+            continue;
+        }
+        replicas[count].server = leaf->server;
+        replicas[count].version = leaf->version;
+        replicas[count].slot = slot;
+        if (replicas[count].version > *latest)
         {
-            current_path[depth] = (char)i;
-            find_paths_with_prefix(node->children[i], current_path, depth + 1, prefix, results, count);
+            *latest = replicas[count].version;
         }
+        count++;
     }
+    trie_read_unlock();
+    return count;
 }
 
-// Recursively finds all paths (files and directories) with a given prefix
-void find_paths_with_prefix_two(TrieNode *node, char *current_path, size_t depth, const char *prefix, char **results, int *count)
+static void record_version(record_sink sink, const char *key, uint64_t version)
 {
-    if (!node)
-        return;
-    if (node->is_end_of_path)
+    ProtoWriter record;
+    proto_writer_init(&record);
+    proto_put_str(&record, key);
+    proto_put_u64(&record, version);
+    sink(WAL_VERSION, &record);
+    proto_writer_free(&record);
+}
+
+// Records the version of the copy behind one replica entry of a path
+static void set_replica_version(const char *path, int slot, uint64_t version)
+{
+    char key[BUFFER_SIZE];
+    replica_key(key, sizeof(key), path, slot);
+    wal_begin();
+    trie_read_lock();
+    TrieLeaf *leaf = trie_search(global_trie_root, key);
+    if (leaf)
     {
-        current_path[depth] = '\0'; // Null-terminate the path
-        results[*count] = strdup(current_path);
-        if (!results[*count]) {
-            perror("strdup failed in find_paths_with_prefix_two");
-            return;
-        }
-        (*count)++;
+        leaf->version = version;
     }
-    for (int i = 0; i < ALPHABET_SIZE; i++)
+    trie_read_unlock();
+    if (leaf)
     {
-        if (node->children[i])
-        {
-            current_path[depth] = (char)i;
-            find_paths_with_prefix_two(node->children[i], current_path, depth + 1, prefix, results, count);
-        }
+        record_version(wal_append, key, version);
     }
+    wal_end();
 }
 
-// Returns a list of file paths with a given prefix (files only)
-char **search_trie_for_prefix(const char *prefix, int *result_count)
+// Fills backups with the servers that should hold copies of a path kept by
+// primary: the next ones on the path's preference list, as many as its
+// replication factor asks for. Evicted servers are passed over, and an
+// evicted primary is made up for with one more backup. A server that is
+// down keeps the copy it already holds but is not made a new backup.
+// Returns how many.
+static int placement_backups(const char *path, const StorageServer *primary, StorageServer **backups)
 {
-    TrieNode *current = global_trie_root;
-    for (const char *p = prefix; *p; p++)
+    ReplicaPolicy policy = effective_policy(path);
+    int wanted = policy.copies - (primary->evicted ? 0 : 1);
+    if (wanted > MAX_REPLICAS - 1)
     {
-        int index = (unsigned char)*p;
-        if (!current->children[index])
+        wanted = MAX_REPLICAS - 1;
+    }
+    int nodes[2 * MAX_REPLICAS];
+    size_t n = placement_lookup(placement_ring, path, nodes, 2 * MAX_REPLICAS);
+    Replica replicas[MAX_REPLICAS];
+    int held = -1; // Replicas are listed the first time a down server comes up
+    int count = 0;
+    for (size_t i = 0; i < n && count < wanted; i++)
+    {
+        StorageServer *server = &storage_servers[nodes[i]];
+        if (server == primary || server->evicted)
         {
-            *result_count = 0;
-            return NULL;
+            continue;
         }
-        current = current->children[index];
-    }
-    // At this point, 'current' points to the last node in the prefix
-    char **results = (char **)malloc(100 * sizeof(char *)); // Allocate memory for up to 100 results
-    if (!results) {
-        perror("malloc failed in search_trie_for_prefix");
-        *result_count = 0;
-        return NULL;
+        if (server->is_server_down)
+        {
+            if (held < 0)
+            {
+                uint64_t latest;
+                held = list_replicas(path, replicas, &latest);
+            }
+            int holds = 0;
+            for (int k = 0; k < held; k++)
+            {
+                holds |= replicas[k].server == server;
+            }
+            if (!holds)
+            {
+                continue;
+            }
+        }
+        backups[count++] = server;
     }
-    char current_path[1024];
-    strcpy(current_path, prefix); // Start with the prefix
-    *result_count = 0;
-    find_paths_with_prefix(current, current_path, strlen(prefix), prefix, results, result_count);
-    return results;
+    return count;
 }
 
-// Returns a list of all paths (files and directories) with a given prefix
-char **search_trie_for_prefix_two(const char *prefix, int *result_count)
+// Chooses the server for a new path: the first live one on its preference list
+static StorageServer *placement_primary(const char *path)
 {
-    TrieNode *current = global_trie_root;
-    for (const char *p = prefix; *p; p++)
+    int nodes[MAX_STORAGE_SERVERS];
+    size_t n = placement_lookup(placement_ring, path, nodes, MAX_STORAGE_SERVERS);
+    for (size_t i = 0; i < n; i++)
     {
-        int index = (unsigned char)*p;
-        if (!current->children[index])
+        StorageServer *server = &storage_servers[nodes[i]];
+        if (!server->is_server_down && server->socket_fd >= 0)
         {
-            *result_count = 0;
-            return NULL;
+            return server;
         }
-        current = current->children[index];
-    }
-    // At this point, 'current' points to the last node in the prefix
-    char **results = (char **)malloc(100 * sizeof(char *)); // Allocate memory for up to 100 results
-    if (!results) {
-        perror("malloc failed in search_trie_for_prefix_two");
-        *result_count = 0;
-        return NULL;
     }
-    char current_path[1024];
-    strcpy(current_path, prefix); // Start with the prefix
-    *result_count = 0;
-    find_paths_with_prefix_two(current, current_path, strlen(prefix), prefix, results, result_count);
-    return results;
+    return NULL;
 }
 
-// Returns 1 if the path is a directory, 0 otherwise
-int return_one_if_directory(const char *path)
+// Lists the live replicas other than the writer, in slot order: the chain a
+// quorum write is pushed down. Returns how many.
+static int write_chain(const char *path, const StorageServer *writer, Replica *chain)
 {
-    TrieNode *crawler = global_trie_root;
-    while (*path)
+    Replica replicas[MAX_REPLICAS];
+    uint64_t latest;
+    int n = list_replicas(path, replicas, &latest);
+    int count = 0;
+    for (int i = 0; i < n; i++)
     {
-        if (!crawler->children[(int)*path])
+        if (replicas[i].server != writer && !replicas[i].server->is_server_down)
         {
-            return 0; // Path not found, so it's not a directory
+            chain[count++] = replicas[i];
         }
-        crawler = crawler->children[(int)*path];
-        path++;
-    }
-    // Check if the final node is marked as a directory
-    if (crawler != NULL && crawler->is_end_of_path && crawler->is_directory)
-    {
-        return 1; // It's a directory
     }
-    return 0; // Not a directory
+    return count;
 }
 
-// Searches for a path in the trie, skipping slashes
-TrieNode *search_in_trie(TrieNode *root, const char *path)
+// The replica to copy a path from: the first live one, in slot order,
+// holding the newest version. NULL if none is up.
+static StorageServer *replication_source(const char *path)
 {
-    TrieNode *current = root;
-    for (const char *p = path; *p; ++p)
+    Replica replicas[MAX_REPLICAS];
+    uint64_t latest;
+    int n = list_replicas(path, replicas, &latest);
+    for (int i = 0; i < n; i++)
     {
-        if (*p == '/')
-            continue; // Skip slashes in the path
-        int index = *p - 'a'; // Convert character to index (adjust based on ALPHABET_SIZE)
-        if (index < 0 || index >= ALPHABET_SIZE || !current->children[index])
-            return NULL; // Path not found
-        current = current->children[index];
+        if (!replicas[i].server->is_server_down && replicas[i].version == latest)
+        {
+            return replicas[i].server;
+        }
     }
-    return current;
+    return NULL;
 }
 
-// Connects to a storage server by port, returns socket fd or -1 on error
-int connect_to_server(int port)
+// Expected wait for one more read on a server: the requests it reported
+// running plus the reads routed to it since, each taking its recent mean
+// service time
+static uint64_t read_cost(StorageServer *server)
 {
-    char temporary[1024];
-    for (int i = 0; i < server_count; i++)
+    uint64_t queued = (uint64_t)server->in_flight + server->routed + 1;
+    return queued * ((uint64_t)server->latency_us + LATENCY_FLOOR_US);
+}
+
+// Picks up to max replicas to read a path from, least loaded first: the live
+// replicas with the newest version, or the newest of the live ones if every
+// up-to-date replica is down. Returns how many.
+static int read_replicas(const char *path, StorageServer **choices, int max)
+{
+    Replica replicas[MAX_REPLICAS];
+    uint64_t latest;
+    int n = list_replicas(path, replicas, &latest);
+    uint64_t best = 0;
+    int live = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (!replicas[i].server->is_server_down && (live++ == 0 || replicas[i].version > best))
+        {
+            best = replicas[i].version;
+        }
+    }
+    // Start from a random replica so equally loaded ones share the reads
+    StorageServer *current[MAX_REPLICAS];
+    uint64_t cost[MAX_REPLICAS];
+    int count = 0;
+    int start = n > 1 ? rand() % n : 0;
+    for (int j = 0; j < n; j++)
     {
-        if (storage_servers[i].port == port)
+        Replica *replica = &replicas[(start + j) % n];
+        if (replica->server->is_server_down || replica->version != best)
+        {
+            continue;
+        }
+        // Insertion sort by cost, stable so ties keep the random order
+        uint64_t c = read_cost(replica->server);
+        int i = count++;
+        while (i > 0 && cost[i - 1] > c)
         {
-            strcpy(temporary, storage_servers[i].ip);
+            current[i] = current[i - 1];
+            cost[i] = cost[i - 1];
+            i--;
         }
+        current[i] = replica->server;
+        cost[i] = c;
     }
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0)
+    int chosen = count < max ? count : max;
+    for (int i = 0; i < chosen; i++)
     {
-        perror("Socket creation failed");
-        return -1;
+        choices[i] = current[i];
     }
-    struct sockaddr_in server_addr = {
-        .sin_family = AF_INET,
-        .sin_port = htons(port),
-        .sin_addr.s_addr = inet_addr(temporary)};
-    if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    if (chosen > 0)
     {
-        perror("Connection to server failed");
-        return -1;
+        choices[0]->routed++;
     }
-    return sock;
+    return chosen;
 }
 
-// Sends a FETCH request to a storage server for a given path
-int send_fetch_request(int sock, const char *path)
+// A storage server's periodic heartbeat, which carries its load
+static void heartbeat_received(StorageServer *server, const ProtoMessage *msg)
 {
-    char command[BUFFER_SIZE];
-    snprintf(command, sizeof(command), "FETCH %s", path);
-    if (send(sock, command, strlen(command), 0) < 0)
+    uint64_t now = heartbeat_now_ms();
+    pthread_mutex_lock(&server->liveness_lock);
+    if (server->monitored)
     {
-        perror("Failed to send FETCH command");
-        return -1;
+        heartbeat_arrived(&server->heartbeats, now);
     }
-    return 0;
-}
+    else
+    {
+        heartbeat_reset(&server->heartbeats, now);
+        server->monitored = 1;
+    }
+    pthread_mutex_unlock(&server->liveness_lock);
 
-// Receives file content from a storage server into buffer
-int receive_file_content(int sock, char *buffer, size_t buffer_size)
-{
-    int bytes_read = recv(sock, buffer, buffer_size - 1, 0);
-    if (bytes_read <= 0)
+    ProtoReader reader;
+    proto_reader_init(&reader, msg);
+    uint32_t in_flight = proto_get_u32(&reader);
+    uint32_t latency_us = proto_get_u32(&reader);
+    if (reader.failed)
     {
-        perror("Failed to receive file content");
-        return -1;
+        printf("Malformed heartbeat from Storage Server %s:%d\n", server->ip, server->port);
+        return;
     }
-    buffer[bytes_read] = '\0';
-    return 0;
+    server->in_flight = in_flight;
+    server->latency_us = latency_us;
+    server->routed = 0;
 }
 
-int flago[1000] = {0};
-
-// Sends a STORE request to a storage server for a given path and content
-int send_store_request(int sock, const char *path, const char *content)
+// Queues a copy of one path to its backups
+static void queue_replication(StorageServer *server, const char *path)
 {
-    char command[BUFFER_SIZE];
-    snprintf(command, sizeof(command), "STORE %s ", path);
-    // Skip backup paths
-    if (strncmp(path, "Backup", 6) == 0)
-    {
-        return 0;
-    }
-    if (send(sock, command, strlen(command), 0) < 0)
+    StorageServer *backups[MAX_REPLICAS - 1];
+    if (placement_backups(path, server, backups) == 0)
     {
-        perror("Failed to send STORE command");
-        return -1;
+        return;
     }
-    if (send(sock, content, strlen(content), 0) < 0)
+    wal_begin();
+    if (replication_enqueue(replication_queue, server_handle(server), path))
     {
-        perror("Failed to send file content");
-        return -1;
+        record_replication(wal_append, WAL_REPLICATE, server_handle(server), path);
     }
-    return 0;
+    wal_end();
 }
 
-int perform_copy_between_servers1(int src_port, int dest_port, const char *source, const char *destination)
+// Makes the Backup<n> entries of a path match its placement. A server that
+// becomes a backup is recorded without a version, so it counts as stale
+// until copied to; a server that only changes slots keeps its version.
+// Entries beyond the replication factor are removed, and so is the file
+// copy on a server that no longer backs the path. Queues a copy from an
+// up-to-date replica if any holder is stale, the primary included.
+// Returns the number of servers newly holding a backup.
+static int reconcile_backups(StorageServer *primary, const char *path, int is_directory)
 {
-    int num = return_one_if_directory(source);
-    int num1 = return_one_if_directory(destination);
-    if ((num && num1))
-    {
-        int result_count = 0;
-        int flag2 = 0;
-        char **matched_paths = search_trie_for_prefix_two(source, &result_count);
-        if (result_count > 0)
+    StorageServer *backups[MAX_REPLICAS - 1];
+    int count = placement_backups(path, primary, backups);
+    StorageServer *old[MAX_REPLICAS] = {0};
+    uint64_t old_version[MAX_REPLICAS] = {0};
+    Replica replicas[MAX_REPLICAS];
+    uint64_t latest;
+    int n = list_replicas(path, replicas, &latest);
+    for (int i = 0; i < n; i++)
+    {
+        old[replicas[i].slot] = replicas[i].server;
+        old_version[replicas[i].slot] = replicas[i].version;
+    }
+
+    char key[BUFFER_SIZE];
+    int added = 0;
+    int stale = 0;
+    for (int j = 0; j < count; j++)
+    {
+        uint64_t version = old_version[j + 1];
+        if (old[j + 1] != backups[j])
         {
-            char temporary[1024];
-            char command[BUFFER_SIZE];
-            char file_content[BUFFER_SIZE];
-            for (int i = 0; i < result_count; i++)
+            int held = 0;
+            version = 0;
+            for (int k = 0; k < MAX_REPLICAS; k++)
             {
-                const char *sub_path = matched_paths[i] + strlen(source);
-                flag2 = return_one_if_directory(matched_paths[i]);
-                char dest_path[1024];
-                snprintf(dest_path, sizeof(dest_path), "%s%s", destination, sub_path);
-                if (flag2 == 0)
-                {
-                    int src_sock = socket(AF_INET, SOCK_STREAM, 0);
-                    if (src_sock < 0)
-                    {
-                        perror("Source server socket creation failed");
-                        return -1;
-                    }
-                    for (int i = 0; i < server_count; i++)
-                    {
-                        if (storage_servers[i].port == src_port)
-                        {
-                            strcpy(temporary, storage_servers[i].ip);
-                        }
-                    }
-                    struct sockaddr_in src_addr = {
-                        .sin_family = AF_INET,
-                        .sin_port = htons(src_port),
-                        .sin_addr.s_addr = inet_addr(temporary)};
-                    if (inet_ntop(AF_INET, &src_addr.sin_addr, temporary, sizeof(temporary)) == NULL)
-                    {
-                        perror("inet_ntop failed");
-                        return -1;
-                    }
-                    if (connect(src_sock, (struct sockaddr *)&src_addr, sizeof(src_addr)) < 0)
-                    {
-                        perror("Connection to source server failed");
-                        close(src_sock);
-                        return -1;
-                    }
-                    // Send FETCH command (should be implemented here if needed)
-                    if (send(src_sock, command, strlen(command), 0) < 0)
-                    {
-                        perror("Failed to send FETCH command to source server");
-                        close(src_sock);
-                        return -1;
-                    }
-                    // Receive the file content from the source server
-                    int bytes_read = recv(src_sock, file_content, sizeof(file_content) - 1, 0);
-                    if (bytes_read <= 0)
-                    {
-                        perror("Failed to receive file content from source server");
-                        close(src_sock);
-                        return -1;
-                    }
-                    file_content[bytes_read] = '\0';
-                    close(src_sock);
-                    // Establish a connection to the destination server
-                    StorageServer *ss = NULL;
-                    for (int i = 0; i < server_count; i++)
-                    {
-                        if (storage_servers[i].port == dest_port)
-                        {
-                            ss = &storage_servers[i];
-                            strcpy(temporary, storage_servers[i].ip);
-                        }
-                    }
-                    if (ss != NULL)
-                    {
-                        insert_path(global_trie_root, dest_path, ss, 0);
-                    }
-                }
-                else
-                {
-                    StorageServer *ss = NULL;
-                    for (int i = 0; i < server_count; i++)
-                    {
-                        if (storage_servers[i].port == dest_port)
-                        {
-                            ss = &storage_servers[i];
-                            strcpy(temporary, storage_servers[i].ip);
-                        }
-                    }
-                    if (ss != NULL)
-                    {
-                        insert_path(global_trie_root, dest_path, ss, 1);
-                    }
-                    strcpy(file_content, "JUST");
-                }
-                int dest_sock = socket(AF_INET, SOCK_STREAM, 0);
-                if (dest_sock < 0)
-                {
-                    perror("Destination server socket creation failed");
-                    return -1;
-                }
-                struct sockaddr_in dest_addr = {
-                    .sin_family = AF_INET,
-                    .sin_port = htons(dest_port),
-                    .sin_addr.s_addr = inet_addr(temporary)};
-                if (connect(dest_sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr)) < 0)
-                {
-                    perror("Connection to destination server failed");
-                    close(dest_sock);
-                    return -1;
-                }
-                // Send the file content to the destination server
-                snprintf(command, sizeof(command), "STORE %s ", dest_path);
-                if (send(dest_sock, command, strlen(command), 0) < 0)
-                {
-                    perror("Failed to send STORE command to destination server");
-                    close(dest_sock);
-                    return -1;
-                }
-                if (send(dest_sock, file_content, strlen(file_content), 0) < 0)
+                if (old[k] == backups[j])
                 {
-                    perror("Failed to send file content to destination server");
-                    close(dest_sock);
-                    return -1;
+                    held = 1;
+                    version = old_version[k];
                 }
-                close(dest_sock);
-                free(matched_paths[i]);
             }
+            replica_key(key, sizeof(key), path, j + 1);
+            insert_path(global_trie_root, key, backups[j], is_directory);
+            set_replica_version(path, j + 1, version);
+            added += !held;
         }
-        else
-        {
-            // No paths found with prefix
-        }
-        free(matched_paths);
+        stale |= version < latest;
     }
-    else if ((!num && !num1))
+    stale |= old[0] == primary && old_version[0] < latest;
+    for (int slot = 1; slot < MAX_REPLICAS; slot++)
     {
-
-        int src_sock = socket(AF_INET, SOCK_STREAM, 0);
-
-        if (src_sock < 0)
-
-        {
-
-            perror("Source server socket creation failed");
-
-            return -1;
-        }
-
-        char temporary[1024];
-        for (int i = 0; i < server_count; i++)
-        {
-            if (storage_servers[i].port == src_port)
-            {
-                strcpy(temporary, storage_servers[i].ip);
-            }
-        }
-        struct sockaddr_in src_addr = {
-            .sin_family = AF_INET,
-            .sin_port = htons(src_port),
-            .sin_addr.s_addr = inet_addr(temporary)};
-        if (connect(src_sock, (struct sockaddr *)&src_addr, sizeof(src_addr)) < 0)
-        {
-            perror("Connection to source server failed");
-            close(src_sock);
-            return -1;
-        }
-        char command[BUFFER_SIZE];
-        snprintf(command, sizeof(command), "FETCH %s", source);
-        if (send(src_sock, command, strlen(command), 0) < 0)
-        {
-            perror("Failed to send FETCH command to source server");
-            close(src_sock);
-            return -1;
-        }
-        char file_content[BUFFER_SIZE];
-        int bytes_read = recv(src_sock, file_content, sizeof(file_content) - 1, 0);
-        if (bytes_read <= 0)
-        {
-            perror("Failed to receive file content from source server");
-            close(src_sock);
-            return -1;
-        }
-        file_content[bytes_read] = '\0';
-        close(src_sock);
-        int dest_sock = socket(AF_INET, SOCK_STREAM, 0);
-        if (dest_sock < 0)
-        {
-            perror("Destination server socket creation failed");
-            return -1;
-        }
-        for (int i = 0; i < server_count; i++)
+        if (old[slot] == NULL)
         {
-            if (storage_servers[i].port == dest_port)
-            {
-                strcpy(temporary, storage_servers[i].ip);
-            }
+            continue;
         }
-        struct sockaddr_in dest_addr = {
-            .sin_family = AF_INET,
-            .sin_port = htons(dest_port),
-            .sin_addr.s_addr = inet_addr(temporary)};
-        if (connect(dest_sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr)) < 0)
+        if (slot > count)
         {
-            perror("Connection to destination server failed");
-            close(dest_sock);
-            return -1;
+            replica_key(key, sizeof(key), path, slot);
+            remove_path_from_trie(global_trie_root, key);
         }
-        snprintf(command, sizeof(command), "STORE %s ", destination);
-        if (send(dest_sock, command, strlen(command), 0) < 0)
+        int kept = old[slot] == primary;
+        for (int k = 0; k < count; k++)
         {
-            perror("Failed to send STORE command to destination server");
-            close(dest_sock);
-            return -1;
+            kept |= backups[k] == old[slot];
         }
-        if (send(dest_sock, file_content, strlen(file_content), 0) < 0)
+        if (!kept && !is_directory && old[slot]->socket_fd >= 0)
         {
-            perror("Failed to send file content to destination server");
-            close(dest_sock);
-            return -1;
+            send_command_to_storage(old[slot], PROTO_DELETE, path);
         }
-        close(dest_sock);
     }
-    else if (!num && num1)
+    StorageServer *source = stale ? replication_source(path) : NULL;
+    if (source)
     {
-        char dest_path[BUFFER_SIZE];
-        strcpy(dest_path, destination);
-        char *last_slash = strrchr(source, '/');
-        if (last_slash != NULL)
-        {
-            strcat(dest_path, last_slash);
-        }
-        char temp[BUFFER_SIZE];
-        int src_sock = socket(AF_INET, SOCK_STREAM, 0);
-        if (src_sock < 0)
-        {
-            perror("Source server socket creation failed");
-            return -1;
-        }
-        char temporary[1024];
-        for (int i = 0; i < server_count; i++)
-        {
-            if (storage_servers[i].port == src_port)
-            {
-                strcpy(temporary, storage_servers[i].ip);
-            }
-        }
-        struct sockaddr_in src_addr = {
-            .sin_family = AF_INET,
-            .sin_port = htons(src_port),
-            .sin_addr.s_addr = inet_addr(temporary)};
-        if (connect(src_sock, (struct sockaddr *)&src_addr, sizeof(src_addr)) < 0)
-        {
-            perror("Connection to source server failed");
-            close(src_sock);
-            return -1;
-        }
-        char command[BUFFER_SIZE];
-        snprintf(command, sizeof(command), "FETCH %s", source);
-        if (send(src_sock, command, strlen(command), 0) < 0)
-        {
-            perror("Failed to send FETCH command to source server");
-            close(src_sock);
-            return -1;
-        }
-        char file_content[BUFFER_SIZE];
-        int bytes_read = recv(src_sock, file_content, sizeof(file_content) - 1, 0);
-        if (bytes_read <= 0)
-        {
-            perror("Failed to receive file content from source server");
-            close(src_sock);
-            return -1;
-        }
-        file_content[bytes_read] = '\0';
-        close(src_sock);
-        int dest_sock = socket(AF_INET, SOCK_STREAM, 0);
-        if (dest_sock < 0)
-        {
-            perror("Destination server socket creation failed");
-            return -1;
-        }
-        for (int i = 0; i < server_count; i++)
-        {
-            if (storage_servers[i].port == dest_port)
-            {
-                strcpy(temporary, storage_servers[i].ip);
-            }
-        }
-        struct sockaddr_in dest_addr = {
-            .sin_family = AF_INET,
-            .sin_port = htons(dest_port),
-            .sin_addr.s_addr = inet_addr(temporary)};
-        if (connect(dest_sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr)) < 0)
-        {
-            perror("Connection to destination server failed");
-            close(dest_sock);
-            return -1;
-        }
-        snprintf(command, sizeof(command), "STORE %s ", dest_path);
-        if (send(dest_sock, command, strlen(command), 0) < 0)
-        {
-            perror("Failed to send STORE command to destination server");
-            close(dest_sock);
-            return -1;
-        }
-        if (send(dest_sock, file_content, strlen(file_content), 0) < 0)
+        queue_replication(source, path);
+    }
+    return added;
+}
+
+typedef struct
+{
+    char *path;
+    int source;
+    int is_directory;
+} PlacedPath;
+
+typedef struct
+{
+    const char *prefix;
+    size_t prefix_len;
+    PlacedPath *items;
+    size_t count;
+    size_t capacity;
+} PlacedPaths;
+
+// Collects one live path under the prefix held by a primary (not a backup entry)
+static int collect_placed_path(TrieLeaf *leaf, void *data)
+{
+    PlacedPaths *placed = (PlacedPaths *)data;
+    StorageServer *server = leaf->server;
+    if (leaf->is_deleted || server == NULL || is_backup_key(leaf->key) ||
+        (placed->prefix_len && !trie_leaf_in_subtree(leaf, placed->prefix, placed->prefix_len)))
+    {
+        return 0;
+    }
+    if (placed->count == placed->capacity)
+    {
+        size_t capacity = placed->capacity ? placed->capacity * 2 : 256;
+        PlacedPath *grown = realloc(placed->items, capacity * sizeof(PlacedPath));
+        if (!grown)
         {
-            perror("Failed to send file content to destination server");
-            close(dest_sock);
-            return -1;
+            perror("realloc failed in collect_placed_path");
+            return 1;
         }
-        close(dest_sock);
+        placed->items = grown;
+        placed->capacity = capacity;
     }
-    else if (num && !num1)
+    PlacedPath *entry = &placed->items[placed->count];
+    entry->path = strdup(leaf->key);
+    if (!entry->path)
     {
-        // printf("Cannot copy a directory to a file\n");
+        return 1;
     }
+    entry->source = server_handle(server);
+    entry->is_directory = leaf->is_directory;
+    placed->count++;
     return 0;
 }
 
-int perform_copy_between_servers(int src_port, int dest_port, const char *source, const char *destination)
+// Brings the backups of every path under a prefix ("" for all of them) in
+// line with the placement ring and replication policies, after either
+// changed. When a server joins, only the paths whose preference lists
+// changed are touched, about 1/N of them.
+static pthread_mutex_t reconcile_lock = PTHREAD_MUTEX_INITIALIZER; // Rebalances and repairs, one path at a time
+
+static void rebalance_backups(const char *prefix)
 {
-    if (flago[server_count] == 0) {
-        flago[server_count] = 1;
-        sleep(10);
-    }
-    int num = return_one_if_directory(source);
-    if (num) {
-        int result_count = 0;
-        int flag2 = 0;
-        char **matched_paths = search_trie_for_prefix(source, &result_count);
-        if (result_count > 0) {
-            for (int i = 0; i < result_count; i++) {
-                flag2 = return_one_if_directory(matched_paths[i]);
-                const char *sub_path = matched_paths[i] + strlen(source);
-                char dest_path[1024];
-                char file_content[BUFFER_SIZE];
-                snprintf(dest_path, sizeof(dest_path), "%s%s", destination, sub_path);
-                if (flag2 == 0) {
-                    int src_sock = connect_to_server(src_port);
-                    if (src_sock < 0) {
-                        log_message("Failed to connect to source server\n");
-                        free(matched_paths[i]);
-                        continue;
-                    }
-                    if (send_fetch_request(src_sock, matched_paths[i]) < 0) {
-                        close(src_sock);
-                        free(matched_paths[i]);
-                        continue;
-                    }
-                    if (receive_file_content(src_sock, file_content, sizeof(file_content)) < 0) {
-                        close(src_sock);
-                        free(matched_paths[i]);
-                        continue;
-                    }
-                    close(src_sock);
-                } else {
-                    strcpy(file_content, "JUST");
-                }
-                int dest_sock = connect_to_server(dest_port);
-                if (dest_sock < 0) {
-                    log_message("Failed to connect to destination server\n");
-                    free(matched_paths[i]);
-                    continue;
-                }
-                if (send_store_request(dest_sock, dest_path, file_content) < 0) {
-                    close(dest_sock);
-                    free(matched_paths[i]);
-                    continue;
-                }
-                close(dest_sock);
-                free(matched_paths[i]);
-            }
-        }
-        free(matched_paths);
-    } else {
-        int src_sock = connect_to_server(src_port);
-        if (src_sock < 0) {
-            log_message("Failed to connect to source server\n");
-            return -1;
-        }
-        if (send_fetch_request(src_sock, source) < 0) {
-            close(src_sock);
-            return -1;
-        }
-        char file_content[BUFFER_SIZE];
-        if (receive_file_content(src_sock, file_content, sizeof(file_content)) < 0) {
-            close(src_sock);
-            return -1;
-        }
-        close(src_sock);
-        int dest_sock = connect_to_server(dest_port);
-        if (dest_sock < 0) {
-            log_message("Failed to connect to destination server\n");
-            return -1;
-        }
-        if (send_store_request(dest_sock, destination, file_content) < 0) {
-            close(dest_sock);
-            return -1;
-        }
-        close(dest_sock);
-    }
-    return 0;
+    pthread_mutex_lock(&reconcile_lock);
+    PlacedPaths placed = {.prefix = prefix, .prefix_len = strlen(prefix)};
+    trie_read_lock();
+    trie_iterate_prefix(global_trie_root, prefix, collect_placed_path, &placed);
+    trie_read_unlock();
+
+    size_t moved = 0;
+    for (size_t i = 0; i < placed.count; i++)
+    {
+        PlacedPath *entry = &placed.items[i];
+        moved += reconcile_backups(&storage_servers[entry->source], entry->path, entry->is_directory);
+        free(entry->path);
+    }
+    free(placed.items);
+    log_message("Placement changed: %zu new backup copies for %zu paths\n", moved, placed.count);
+    printf("Placement changed: %zu new backup copies for %zu paths\n", moved, placed.count);
+    pthread_mutex_unlock(&reconcile_lock);
 }
 
-// Function to remove a specific path from the cache
-void remove_paths_from_cache(const char *path)
+static void *rebalance_thread(void *arg)
 {
-    int shift_index = 0;
-    // Iterate over the cache entries
-    for (int i = 0; i < lru_cache.count; i++)
-    {
-        // If the current entry matches the given path, skip it
-        if (strcmp(lru_cache.entries[i].path, path) == 0)
-        {
-            log_message("Removing path from cache: %s\n", lru_cache.entries[i].path);
-            printf("Removing path from cache: %s\n", lru_cache.entries[i].path);
-        }
-        else
-        {
-            // Shift the entry to maintain a compact cache
-            lru_cache.entries[shift_index++] = lru_cache.entries[i];
-        }
-    }
-    // Update cache count to reflect removed entries
-    lru_cache.count = shift_index;
+    char *prefix = (char *)arg;
+    rebalance_backups(prefix);
+    free(prefix);
+    return NULL;
 }
 
-void mark_subtree_as_revived(TrieNode *node)
+// Rebalances a prefix on a thread of its own, for callers that must not
+// wait for every path below it
+static void schedule_rebalance(const char *prefix)
 {
-    if (node == NULL) return;
-    if (node->is_end_of_path) {
-        node->is_deleted = 0;
-    }
-    // Recursively mark all children as revived
-    for (int i = 0; i < ALPHABET_SIZE; i++) {
-        if (node->children[i] != NULL) {
-            mark_subtree_as_revived(node->children[i]);
-        }
+    char *copy = strdup(prefix);
+    pthread_t thread;
+    if (copy == NULL || pthread_create(&thread, NULL, rebalance_thread, copy) != 0)
+    {
+        perror("Failed to start rebalance thread");
+        free(copy);
+        rebalance_backups(prefix);
+        return;
     }
+    pthread_detach(thread);
 }
 
-StorageServer *search_path_two(TrieNode *root, const char *path)
+// Repair: paths whose replicas must be checked because a server was lost
+// for good or came back, worked through at NM_REPAIR_RATE paths per second
+// so the copies it causes do not swamp the storage servers. Each path is
+// reconciled with its placement, which remakes missing copies from an
+// up-to-date replica and removes copies from servers that no longer need
+// them.
+typedef struct
+{
+    pthread_mutex_t lock;
+    char **paths; // Waiting, from head to count
+    size_t head;
+    size_t count;
+    size_t capacity;
+    size_t checked;    // Since the repair started
+    size_t new_copies; // Servers given a copy they did not hold
+    uint64_t started_ms;
+} RepairQueue;
+
+static RepairQueue repair_queue = {.lock = PTHREAD_MUTEX_INITIALIZER};
+uint64_t repair_delay_ms = REPAIR_DELAY_MS;
+int repair_rate = REPAIR_RATE;
+
+typedef struct
 {
-    TrieNode *crawler = root;
-    while (*path)
+    StorageServer *server; // NULL for every path
+    char **paths;
+    size_t count;
+    size_t capacity;
+} RepairScan;
+
+// Collects a path one of whose replicas the server holds, or every primary path
+static int collect_repair_path(TrieLeaf *leaf, void *data)
+{
+    RepairScan *scan = (RepairScan *)data;
+    int backup = is_backup_key(leaf->key);
+    if (leaf->is_deleted || leaf->server == NULL || (scan->server ? leaf->server != scan->server : backup))
+    {
+        return 0;
+    }
+    if (scan->count == scan->capacity)
     {
-        if (!crawler->children[(int)*path])
+        size_t capacity = scan->capacity ? scan->capacity * 2 : 256;
+        char **grown = realloc(scan->paths, capacity * sizeof(char *));
+        if (!grown)
         {
-            return NULL;
+            perror("realloc failed in collect_repair_path");
+            return 1;
         }
-        crawler = crawler->children[(int)*path];
-        path++;
+        scan->paths = grown;
+        scan->capacity = capacity;
     }
-    if (crawler != NULL && crawler->is_end_of_path && crawler->server != NULL)
+    // Backup<slot><path>, with a single digit slot
+    scan->paths[scan->count] = strdup(backup ? leaf->key + 7 : leaf->key);
+    if (!scan->paths[scan->count])
     {
-        crawler->is_deleted = 0;
-        crawler->server->is_server_down = 0;
-        mark_subtree_as_revived(crawler);
-        return crawler->server;
+        return 1;
     }
-    return NULL;
+    scan->count++;
+    return 0;
 }
 
-void storage_server_thread(int client_sock)
+// Queues the paths a server holds a replica of (every path if NULL) for repair
+static void schedule_repair(StorageServer *server)
 {
-    int new_socket = client_sock;
-    struct sockaddr_in client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    getpeername(new_socket, (struct sockaddr *)&client_addr, &client_len);
-    char buffer[BUFFER_SIZE] = {0};
-    int bytes_read = read(new_socket, buffer, BUFFER_SIZE);
-    char my_ip[INET_ADDRSTRLEN];
-    int my_port = 0;
-    sscanf(buffer, "%s %d", my_ip, &my_port);
-    printf("buffer is %s\n", buffer);
-    printf("My IP is %s and My Port is %d\n", my_ip, my_port);
-    log_message("My IP is %s and My Port is %d\n", my_ip, my_port);
-    memset(buffer, 0, BUFFER_SIZE);
-    bytes_read = read(new_socket, buffer, BUFFER_SIZE);
-    if (bytes_read > 0) {
-        pthread_mutex_lock(&lock);
-        StorageServer *server = NULL;
-        int flag = 0;
-        for (int i = 0; i < server_count; i++) {
-            if (strcmp(storage_servers[i].ip, my_ip) == 0 && storage_servers[i].port == my_port) {
-                server = &storage_servers[i];
-                server->is_server_down = 0;
-                int counter_for_paths = server->path_count;
-                StorageServer *hello;
-                while (counter_for_paths--) {
-                    hello = search_path_two(global_trie_root, server->path_list[counter_for_paths]);
-                }
-                flag = 1;
-                printf("Server is already registered\n");
-            }
+    RepairScan scan = {.server = server};
+    trie_read_lock();
+    trie_iterate(global_trie_root, collect_repair_path, &scan);
+    trie_read_unlock();
+
+    pthread_mutex_lock(&repair_queue.lock);
+    if (repair_queue.head == repair_queue.count)
+    {
+        repair_queue.head = repair_queue.count = 0;
+        repair_queue.checked = repair_queue.new_copies = 0;
+        repair_queue.started_ms = heartbeat_now_ms();
+    }
+    size_t queued = 0;
+    if (repair_queue.count + scan.count > repair_queue.capacity)
+    {
+        size_t capacity = repair_queue.capacity ? repair_queue.capacity : 256;
+        while (capacity < repair_queue.count + scan.count)
+            capacity *= 2;
+        char **grown = realloc(repair_queue.paths, capacity * sizeof(char *));
+        if (grown)
+        {
+            repair_queue.paths = grown;
+            repair_queue.capacity = capacity;
         }
-        if (flag == 0) {
-            storage_servers = realloc(storage_servers, (server_count + 1) * sizeof(StorageServer));
-            if (!storage_servers) {
-                perror("Failed to allocate memory for storage servers");
-                pthread_mutex_unlock(&lock);
-                close(new_socket);
-                pthread_exit(NULL);
+    }
+    for (size_t i = 0; i < scan.count; i++)
+    {
+        if (repair_queue.count < repair_queue.capacity)
+        {
+            repair_queue.paths[repair_queue.count++] = scan.paths[i];
+            queued++;
+        }
+        else
+        {
+            free(scan.paths[i]);
+        }
+    }
+    pthread_mutex_unlock(&repair_queue.lock);
+    free(scan.paths);
+    if (server)
+    {
+        log_message("Repair: checking %zu paths held by %s:%d\n", queued, server->ip, server->port);
+        printf("Repair: checking %zu paths held by %s:%d\n", queued, server->ip, server->port);
+    }
+    else
+    {
+        log_message("Repair: checking all %zu paths\n", queued);
+        printf("Repair: checking all %zu paths\n", queued);
+    }
+}
+
+// Describes the repair in progress for REPAIR_STATUS and the log
+static void repair_status(char *buffer, size_t size)
+{
+    pthread_mutex_lock(&repair_queue.lock);
+    size_t remaining = repair_queue.count - repair_queue.head;
+    size_t checked = repair_queue.checked;
+    size_t new_copies = repair_queue.new_copies;
+    uint64_t elapsed_ms = heartbeat_now_ms() - repair_queue.started_ms;
+    pthread_mutex_unlock(&repair_queue.lock);
+    size_t pending = replication_pending(replication_queue);
+    if (remaining == 0)
+    {
+        snprintf(buffer, size, "No repair running, %zu copies pending", pending);
+        return;
+    }
+    // Paths per second so far, or the configured rate before any is done
+    double rate = checked > 0 && elapsed_ms > 0 ? checked * 1000.0 / elapsed_ms : repair_rate;
+    snprintf(buffer, size, "Repair: %zu of %zu paths checked, %zu new copies, %zu copies pending, about %.0f s left",
+             checked, checked + remaining, new_copies, pending, remaining / rate);
+}
+
+// Takes servers that have been down longer than the repair delay out of
+// placement, and queues their paths so their copies are made elsewhere
+static void evict_lost_servers(uint64_t now)
+{
+    for (int i = 0; i < server_count; i++)
+    {
+        StorageServer *server = &storage_servers[i];
+        if (server->evicted || server->lost_at_ms == 0 || server->socket_fd >= 0 || now - server->lost_at_ms < repair_delay_ms)
+        {
+            continue;
+        }
+        server->is_server_down = 1;
+        server->evicted = 1;
+        log_message("Storage Server %s:%d down for %llu s, making its copies elsewhere\n", server->ip, server->port,
+                    (unsigned long long)(now - server->lost_at_ms) / 1000);
+        printf("Storage Server %s:%d down for %llu s, making its copies elsewhere\n", server->ip, server->port,
+               (unsigned long long)(now - server->lost_at_ms) / 1000);
+        schedule_repair(server);
+    }
+}
+
+void *repair_thread(void *arg)
+{
+    (void)arg;
+    uint64_t last_report = 0;
+    double allowance = 0; // Paths that may be checked now
+    while (1)
+    {
+        // Ten batches a second
+        usleep(100000);
+        uint64_t now = heartbeat_now_ms();
+        evict_lost_servers(now);
+        allowance += repair_rate / 10.0;
+        int worked = 0;
+        for (; allowance >= 1; allowance--)
+        {
+            pthread_mutex_lock(&repair_queue.lock);
+            char *path = repair_queue.head < repair_queue.count ? repair_queue.paths[repair_queue.head++] : NULL;
+            pthread_mutex_unlock(&repair_queue.lock);
+            if (path == NULL)
+            {
+                allowance = 0; // Idle time does not build up a burst
+                break;
             }
-            server = &storage_servers[server_count];
-            // Initialize all fields to safe defaults
-            memset(server, 0, sizeof(StorageServer));
-            inet_ntop(AF_INET, &client_addr.sin_addr, server->ip, INET_ADDRSTRLEN);
-            server->port = ntohs(client_addr.sin_port);
-            char extracted_ip[INET_ADDRSTRLEN] = {0};
-            int extracted_port = 0;
-            server->port = my_port;
-            strcpy(server->ip, my_ip);
-            server->socket_fd = new_socket;
-            server->is_async_write_in_progress = 0;
-            server->async_writer_socket = -1;
+            trie_read_lock();
+            TrieLeaf *leaf = trie_search(global_trie_root, path);
+            StorageServer *primary = leaf != NULL && !leaf->is_deleted ? leaf->server : NULL;
+            int is_directory = leaf != NULL && leaf->is_directory;
+            trie_read_unlock();
+            int added = 0;
+            if (primary != NULL)
+            {
+                pthread_mutex_lock(&reconcile_lock);
+                added = reconcile_backups(primary, path, is_directory);
+                pthread_mutex_unlock(&reconcile_lock);
+            }
+            free(path);
+            pthread_mutex_lock(&repair_queue.lock);
+            repair_queue.checked++;
+            repair_queue.new_copies += added;
+            pthread_mutex_unlock(&repair_queue.lock);
+            worked = 1;
+        }
+        if (!worked)
+        {
+            continue;
+        }
+        char status[256];
+        repair_status(status, sizeof(status));
+        pthread_mutex_lock(&repair_queue.lock);
+        int finished = repair_queue.head == repair_queue.count;
+        pthread_mutex_unlock(&repair_queue.lock);
+        if (finished || now - last_report >= REPAIR_REPORT_SECONDS * 1000)
+        {
+            log_message("%s\n", finished ? "Repair finished" : status);
+            printf("%s\n", finished ? "Repair finished" : status);
+            last_report = now;
+        }
+    }
+    return NULL;
+}
+
+// Records a write a storage server finished. Its copy becomes the newest
+// version, and so do the copies the first hops of its quorum chain stored.
+// The replicas still behind, the primary too if a backup took the write
+// while it was down, get a background copy from the writer.
+static void write_completed(StorageServer *server, const char *path, uint32_t copies)
+{
+    Replica replicas[MAX_REPLICAS];
+    uint64_t latest;
+    int n = list_replicas(path, replicas, &latest);
+    int writer = 0;
+    while (writer < n && replicas[writer].server != server)
+    {
+        writer++;
+    }
+    if (writer == n)
+    {
+        return;
+    }
+    Replica chain[MAX_REPLICAS];
+    int chained = write_chain(path, server, chain);
+    set_replica_version(path, replicas[writer].slot, latest + 1);
+    for (int i = 0; i < chained && i < (int)copies; i++)
+    {
+        set_replica_version(path, chain[i].slot, latest + 1);
+    }
+    queue_replication(server, path);
+}
+
+// Records one path held by a storage server and replicates it to its backups
+void store_path_entry(StorageServer *server, const char *path, int is_directory)
+{
+    if (strlen(path) == 0)
+    {
+        printf("Error: Empty path from %s:%d\n", server->ip, server->port);
+        return;
+    }
+    // A path the namespace already maps to this server (a re-registration,
+    // or state restored from the metadata log) is not listed or copied
+    // again. Nor is one held by another live server: this server then has
+    // a backup copy of it, or a parent directory made for a path placed here.
+    trie_read_lock();
+    TrieLeaf *leaf = trie_search(global_trie_root, path);
+    StorageServer *owner = leaf != NULL && !leaf->is_deleted ? leaf->server : NULL;
+    trie_read_unlock();
+    if (owner == server || (owner != NULL && !owner->is_server_down))
+    {
+        return;
+    }
+    // The server's copy is now the one of record, newer than any backup
+    Replica replicas[MAX_REPLICAS];
+    uint64_t latest;
+    pthread_mutex_lock(&reconcile_lock);
+    list_replicas(path, replicas, &latest);
+    add_path_to_server(server, path);
+    insert_path(global_trie_root, path, server, is_directory);
+    set_replica_version(path, 0, latest + 1);
+    reconcile_backups(server, path, is_directory);
+    pthread_mutex_unlock(&reconcile_lock);
+}
+
+// Parses one FILE_LIST batch from a storage server and inserts its paths into the trie
+void parse_and_store_files(StorageServer *server, const ProtoMessage *file_list)
+{
+    if (!server || !file_list)
+    {
+        printf("Error: Invalid server or file list in parse_and_store_files\n");
+        return;
+    }
+    // Initialize global trie root if not already done
+    if (!global_trie_root)
+    {
+        global_trie_root = create_trie();
+        if (!global_trie_root)
+        {
+            printf("Error: Failed to create global trie root\n");
+            return;
+        }
+    }
+
+    ProtoReader reader;
+    proto_reader_init(&reader, file_list);
+    while (reader.pos < reader.end)
+    {
+        int is_directory = proto_get_u8(&reader);
+        const char *path = proto_get_str(&reader);
+        if (!path)
+        {
+            printf("Error: Malformed file list from %s:%d\n", server->ip, server->port);
+            break;
+        }
+        store_path_entry(server, path, is_directory);
+    }
+}
+
+// Applies one FILE_REMOVED batch: paths the server no longer holds are
+// marked deleted, with their backup copies, as a DELETE would
+void parse_and_remove_files(StorageServer *server, const ProtoMessage *removed)
+{
+    ProtoReader reader;
+    proto_reader_init(&reader, removed);
+    while (reader.pos < reader.end)
+    {
+        const char *path = proto_get_str(&reader);
+        if (!path || strlen(path) >= BUFFER_SIZE - 16)
+        {
+            printf("Error: Malformed removal list from %s:%d\n", server->ip, server->port);
+            break;
+        }
+        remove_path_from_server(server, path);
+        trie_read_lock();
+        TrieLeaf *leaf = trie_search(global_trie_root, path);
+        int mine = leaf != NULL && leaf->server == server;
+        trie_read_unlock();
+        if (!mine)
+        {
+            continue;
+        }
+        char backup[BUFFER_SIZE];
+        search_path(global_trie_root, path, 1);
+        for (int i = 0; i < MAX_REPLICAS - 1; i++)
+        {
+            snprintf(backup, sizeof(backup), "Backup%d%s", i + 1, path);
+            search_path(global_trie_root, backup, 1);
+        }
+        remove_subtree_from_cache(path);
+    }
+}
+
+// Checks if a path exists in the trie and is a valid endpoint
+int validate_path(Trie *root, const char *path)
+{
+    return trie_search(root, path) != NULL;
+}
+
+typedef struct
+{
+    const char *prefix;
+    size_t prefix_len;
+    int files_only;
+    char **results;
+    int count;
+    int capacity;
+} PrefixMatches;
+
+// Collects one live path below the prefix, growing the result array as needed
+static int find_paths_with_prefix(TrieLeaf *leaf, void *data)
+{
+    PrefixMatches *matches = (PrefixMatches *)data;
+    if (leaf->is_deleted || (matches->files_only && leaf->is_directory) ||
+        !trie_leaf_in_subtree(leaf, matches->prefix, matches->prefix_len))
+    {
+        return 0;
+    }
+    if (matches->count == matches->capacity)
+    {
+        int capacity = matches->capacity ? matches->capacity * 2 : 16;
+        char **grown = realloc(matches->results, capacity * sizeof(char *));
+        if (!grown)
+        {
+            perror("realloc failed in find_paths_with_prefix");
+            return 1;
+        }
+        matches->results = grown;
+        matches->capacity = capacity;
+    }
+    matches->results[matches->count] = strdup(leaf->key);
+    if (!matches->results[matches->count])
+    {
+        perror("strdup failed in find_paths_with_prefix");
+        return 1;
+    }
+    matches->count++;
+    return 0;
+}
+
+static char **collect_paths_with_prefix(const char *prefix, int files_only, int *result_count)
+{
+    PrefixMatches matches = {.prefix = prefix, .prefix_len = strlen(prefix), .files_only = files_only};
+    trie_iterate_prefix(global_trie_root, prefix, find_paths_with_prefix, &matches);
+    *result_count = matches.count;
+    return matches.results;
+}
+
+// Returns a list of file paths with a given prefix (files only)
+char **search_trie_for_prefix(const char *prefix, int *result_count)
+{
+    return collect_paths_with_prefix(prefix, 1, result_count);
+}
+
+// Returns a list of all paths (files and directories) with a given prefix
+char **search_trie_for_prefix_two(const char *prefix, int *result_count)
+{
+    return collect_paths_with_prefix(prefix, 0, result_count);
+}
+
+// Returns 1 if the path is a directory, 0 otherwise
+int return_one_if_directory(const char *path)
+{
+    trie_read_lock();
+    TrieLeaf *leaf = trie_search(global_trie_root, path);
+    int is_directory = leaf != NULL && leaf->is_directory;
+    trie_read_unlock();
+    return is_directory; // 1 for a directory, 0 otherwise
+}
+
+// Searches for a path in the trie and returns its leaf
+// The caller must be inside trie_read_lock() for as long as it uses the leaf
+TrieLeaf *search_in_trie(Trie *root, const char *path)
+{
+    return trie_search(root, path);
+}
+
+// Leases a connection to a storage server's client port from the pool
+static int connect_to_server(StorageServer *server)
+{
+    return connpool_acquire(server_pool, server_handle(server), server->ip, server->port);
+}
+
+// Gives a leased connection back; one whose exchange failed is closed
+static void release_connection(StorageServer *server, int sock, int reusable)
+{
+    connpool_release(server_pool, server_handle(server), sock, reusable);
+}
+
+typedef struct
+{
+    char *path;
+    int is_directory;
+} PendingStore;
+
+// STOREs sent on a connection whose replies are still to be read. A storage
+// server answers the requests of a connection in order, so a copy worker
+// keeps sending while earlier files are written. A path enters the
+// namespace only once its STORE is answered.
+typedef struct
+{
+    int sock;
+    StorageServer *server; // Recorded as the holder of each stored path
+    uint32_t sent;     // Request ids are 1, 2, ... in sending order
+    uint32_t answered;
+    int failed;        // A store was refused, or the connection broke
+    PendingStore pending[STORE_PIPELINE_DEPTH];
+} StorePipeline;
+
+// Retires the oldest outstanding STORE, recording its path if it was stored
+static void settle_store(StorePipeline *pipe, int stored)
+{
+    PendingStore *entry = &pipe->pending[pipe->answered++ % STORE_PIPELINE_DEPTH];
+    if (stored && entry->path)
+    {
+        insert_path(global_trie_root, entry->path, pipe->server, entry->is_directory);
+    }
+    free(entry->path);
+    entry->path = NULL;
+}
+
+// Reads the reply to the oldest outstanding STORE
+static void await_store(StorePipeline *pipe)
+{
+    ProtoMessage reply = {0};
+    if (proto_recv(pipe->sock, &reply) <= 0)
+    {
+        // Nothing more will come on this connection
+        pipe->failed = 1;
+        while (pipe->answered < pipe->sent)
+        {
+            settle_store(pipe, 0);
+        }
+    }
+    else
+    {
+        int stored = reply.header.opcode == PROTO_OK && reply.header.request_id == pipe->answered + 1;
+        if (!stored)
+        {
+            printf("Storage server failed to store request %u\n", reply.header.request_id);
+            pipe->failed = 1;
+        }
+        settle_store(pipe, stored);
+    }
+    proto_message_free(&reply);
+}
+
+// Sends a STORE request to a storage server, first waiting for replies if
+// STORE_PIPELINE_DEPTH are already outstanding. With more set, it is a part
+// of a file that further STOREs complete and gets no reply. Returns 0 once
+// it is sent, -1 on error.
+int send_store_request(StorePipeline *pipe, const char *path, int is_directory, const char *content, size_t content_len, int more)
+{
+    // Skip backup paths
+    if (strncmp(path, "Backup", 6) == 0)
+    {
+        return 0;
+    }
+    while (pipe->sent - pipe->answered >= STORE_PIPELINE_DEPTH)
+    {
+        await_store(pipe);
+    }
+    ProtoWriter writer;
+    proto_writer_init(&writer);
+    proto_put_str(&writer, path);
+    proto_put_bytes(&writer, content, content_len);
+    uint16_t flags = (is_directory ? PROTO_FLAG_DIRECTORY : 0) | (more ? PROTO_FLAG_MORE : 0);
+    int res = proto_send_writer(pipe->sock, PROTO_STORE, flags, pipe->sent + 1, &writer);
+    proto_writer_free(&writer);
+    if (res < 0)
+    {
+        perror("Failed to send STORE command");
+        pipe->failed = 1;
+        return -1;
+    }
+    if (!more)
+    {
+        PendingStore *entry = &pipe->pending[pipe->sent++ % STORE_PIPELINE_DEPTH];
+        entry->path = strdup(path);
+        entry->is_directory = is_directory;
+    }
+    return 0;
+}
+
+// Waits until every STORE sent is written. Returns 0 if all succeeded.
+int finish_store_requests(StorePipeline *pipe)
+{
+    while (pipe->answered < pipe->sent)
+    {
+        await_store(pipe);
+    }
+    return pipe->failed ? -1 : 0;
+}
+
+// Streams a file from the source server to the destination. Each DATA chunk
+// of the FETCH is passed on as soon as the next one arrives, flagged MORE,
+// and the last one completes the file, so no more than two chunks are held
+// here whatever the size. A file that fits in one chunk is one plain STORE.
+// Adds the bytes sent to *bytes. Returns 0 on success, -1 on error.
+static int stream_file(int src_sock, StorePipeline *dest, const char *source, const char *destination, uint64_t *bytes)
+{
+    if (proto_send_str(src_sock, PROTO_FETCH, 0, source) < 0)
+    {
+        perror("Failed to send FETCH command");
+        return -1;
+    }
+    ProtoMessage chunks[2];
+    memset(chunks, 0, sizeof(chunks));
+    ProtoMessage *pending = NULL; // Received, not yet passed on
+    int current = 0;
+    int parts = 0; // STOREs flagged MORE sent
+    int res = -1;
+    while (proto_recv(src_sock, &chunks[current]) > 0)
+    {
+        ProtoMessage *msg = &chunks[current];
+        if (msg->header.opcode == PROTO_DATA)
+        {
+            if (pending && send_store_request(dest, destination, 0, pending->payload, pending->header.payload_len, 1) < 0)
+            {
+                break;
+            }
+            if (pending)
+            {
+                *bytes += pending->header.payload_len;
+                parts++;
+            }
+            pending = msg;
+            current ^= 1;
+            continue;
+        }
+        if (msg->header.opcode == PROTO_END)
+        {
+            size_t len = pending ? pending->header.payload_len : 0;
+            res = send_store_request(dest, destination, 0, pending ? pending->payload : "", len, 0);
+            *bytes += len;
+        }
+        else
+        {
+            printf("Storage server refused FETCH %s\n", source);
+        }
+        break;
+    }
+    if (res < 0 && parts > 0)
+    {
+        // The destination may hold an unfinished file on this connection;
+        // closing it there drops the file
+        dest->failed = 1;
+    }
+    proto_message_free(&chunks[0]);
+    proto_message_free(&chunks[1]);
+    return res;
+}
+
+// A path of the source subtree, with where it goes
+typedef struct
+{
+    char *source;
+    int is_directory;
+} CopyItem;
+
+// A recursive COPY in progress. The source subtree is read COPY_PAGE paths
+// at a time from a cursor, so a tree of any size is copied without listing
+// it first, and COPY_WORKERS threads take paths from the current page.
+typedef struct
+{
+    pthread_mutex_t lock;
+    const char *source;
+    size_t source_len;
+    const char *destination;
+    StorageServer *src;
+    StorageServer *dest;
+    CopyItem page[COPY_PAGE];
+    int page_count;
+    int page_next;
+    char *cursor;   // Last path read, NULL before the first page
+    int exhausted;  // The subtree has been read to the end
+    int failed;     // Stops the workers at their next path
+    uint64_t paths; // Copied so far
+    uint64_t bytes;
+    uint64_t reported_ms;
+    uint64_t session_token; // Client to report progress to, which may leave before the copy ends
+    uint32_t request_id;
+} CopyJob;
+
+// Adds one live path of the source subtree to the page
+static int collect_copy_item(TrieLeaf *leaf, void *data)
+{
+    CopyJob *job = (CopyJob *)data;
+    if (!trie_leaf_in_subtree(leaf, job->source, job->source_len))
+    {
+        return 0;
+    }
+    // The cursor moves past deleted paths too
+    free(job->cursor);
+    job->cursor = strdup(leaf->key);
+    if (!job->cursor)
+    {
+        job->failed = 1;
+        return 1;
+    }
+    if (leaf->is_deleted)
+    {
+        return 0;
+    }
+    CopyItem *item = &job->page[job->page_count];
+    item->source = strdup(leaf->key);
+    item->is_directory = leaf->is_directory;
+    if (!item->source)
+    {
+        job->failed = 1;
+        return 1;
+    }
+    return ++job->page_count == COPY_PAGE;
+}
+
+// Takes the next path to copy, reading the next page once the current one
+// is handed out. Returns 0 when there is none left. Called with the job lock
+// held.
+static int next_copy_item(CopyJob *job, CopyItem *item)
+{
+    if (job->page_next == job->page_count && !job->exhausted && !job->failed)
+    {
+        job->page_count = 0;
+        job->page_next = 0;
+        trie_read_lock();
+        trie_iterate_prefix_after(global_trie_root, job->source, job->cursor, collect_copy_item, job);
+        trie_read_unlock();
+        if (job->page_count < COPY_PAGE)
+        {
+            job->exhausted = 1;
+        }
+    }
+    if (job->failed || job->page_next == job->page_count)
+    {
+        return 0;
+    }
+    *item = job->page[job->page_next++];
+    return 1;
+}
+
+// Copy worker: copies paths of the job until there are none left or one
+// failed, with one destination connection for all of them. Each file is
+// fetched from its least loaded up-to-date replica, as the files below a
+// directory may be placed on any server.
+static void *copy_worker(void *arg)
+{
+    CopyJob *job = (CopyJob *)arg;
+    StorePipeline pipe = {.sock = connect_to_server(job->dest), .server = job->dest};
+    CopyItem item;
+    pthread_mutex_lock(&job->lock);
+    if (pipe.sock < 0)
+    {
+        log_emit(LOG_LEVEL_ERROR, "Failed to connect to destination server %d\n", job->dest->port);
+        job->failed = 1;
+    }
+    while (next_copy_item(job, &item))
+    {
+        pthread_mutex_unlock(&job->lock);
+        char dest_path[BUFFER_SIZE];
+        snprintf(dest_path, sizeof(dest_path), "%s%s", job->destination, item.source + job->source_len);
+        uint64_t bytes = 0;
+        int res;
+        if (item.is_directory)
+        {
+            res = send_store_request(&pipe, dest_path, 1, NULL, 0, 0);
+        }
+        else
+        {
+            StorageServer *holder = job->src;
+            read_replicas(item.source, &holder, 1);
+            int src_sock = connect_to_server(holder);
+            res = src_sock < 0 ? -1 : stream_file(src_sock, &pipe, item.source, dest_path, &bytes);
+            // A refused FETCH may leave DATA unread on the connection
+            release_connection(holder, src_sock, res == 0);
+        }
+        free(item.source);
+
+        pthread_mutex_lock(&job->lock);
+        if (res < 0 || pipe.failed)
+        {
+            job->failed = 1;
+            continue;
+        }
+        job->paths++;
+        job->bytes += bytes;
+        uint64_t now = heartbeat_now_ms();
+        if (now - job->reported_ms >= COPY_REPORT_MS)
+        {
+            job->reported_ms = now;
+            send_copy_progress(job->session_token, job->request_id, job->paths, job->bytes);
+        }
+    }
+    pthread_mutex_unlock(&job->lock);
+    if (pipe.sock >= 0)
+    {
+        if (finish_store_requests(&pipe) < 0)
+        {
+            pthread_mutex_lock(&job->lock);
+            job->failed = 1;
+            pthread_mutex_unlock(&job->lock);
+        }
+        release_connection(job->dest, pipe.sock, !pipe.failed);
+    }
+    return NULL;
+}
+
+// Copies a file, or a directory and everything below it, to a server,
+// reporting progress to the client every COPY_REPORT_MS. A directory goes
+// below the destination directory keeping its contents' relative paths.
+int perform_copy_between_servers1(StorageServer *src, StorageServer *dest, const char *source, const char *destination,
+                                  uint64_t session_token, uint32_t request_id)
+{
+    int num = return_one_if_directory(source);
+    int num1 = return_one_if_directory(destination);
+    size_t source_len = strlen(source);
+    if (num && !num1)
+    {
+        // printf("Cannot copy a directory to a file\n");
+        return -1;
+    }
+    if (num && strncmp(destination, source, source_len) == 0 &&
+        (destination[source_len] == '/' || destination[source_len] == '\0'))
+    {
+        // The copy would walk into itself
+        return -1;
+    }
+    char dest_path[BUFFER_SIZE];
+    if (!num && num1)
+    {
+        const char *last_slash = strrchr(source, '/');
+        snprintf(dest_path, sizeof(dest_path), "%s%s", destination, last_slash != NULL ? last_slash : "");
+        destination = dest_path;
+    }
+    CopyJob *job = calloc(1, sizeof(CopyJob));
+    if (!job)
+    {
+        perror("Failed to allocate copy");
+        return -1;
+    }
+    pthread_mutex_init(&job->lock, NULL);
+    job->source = source;
+    job->source_len = source_len;
+    job->destination = destination;
+    job->src = src;
+    job->dest = dest;
+    job->session_token = session_token;
+    job->request_id = request_id;
+    job->reported_ms = heartbeat_now_ms();
+    if (!num)
+    {
+        // A single file: no need to walk the trie
+        job->page[0].source = strdup(source);
+        job->page[0].is_directory = 0;
+        job->page_count = job->page[0].source != NULL;
+        job->exhausted = 1;
+        job->failed = job->page[0].source == NULL;
+    }
+
+    pthread_t workers[COPY_MAX_WORKERS];
+    int started = 0;
+    for (int i = 1; num && i < copy_workers; i++)
+    {
+        if (pthread_create(&workers[started], NULL, copy_worker, job) != 0)
+        {
+            perror("Failed to start copy worker");
+            break;
+        }
+        started++;
+    }
+    copy_worker(job);
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(workers[i], NULL);
+    }
+
+    int res = job->failed ? -1 : 0;
+    for (int i = job->page_next; i < job->page_count; i++)
+    {
+        free(job->page[i].source);
+    }
+    log_message("Copied %llu paths, %llu bytes from %s to %s%s\n", (unsigned long long)job->paths,
+                (unsigned long long)job->bytes, source, destination, res < 0 ? " before failing" : "");
+    uint64_t opened, reused;
+    connpool_stats(server_pool, &opened, &reused);
+    log_emit(LOG_LEVEL_DEBUG, "Storage server connections: %llu opened, %llu reused\n", (unsigned long long)opened,
+             (unsigned long long)reused);
+    free(job->cursor);
+    pthread_mutex_destroy(&job->lock);
+    free(job);
+    return res;
+}
+
+// Queues copies of a path, or of a directory and everything below it, to
+// the backups of the given server
+void replicate_to_backups(StorageServer *server, const char *path)
+{
+    int result_count = 1;
+    char **matched_paths = NULL;
+    if (return_one_if_directory(path)) {
+        matched_paths = search_trie_for_prefix_two(path, &result_count);
+    }
+    for (int i = 0; i < result_count; i++) {
+        // Paths below a directory may be placed on other servers
+        StorageServer *holder = matched_paths ? search_path(global_trie_root, matched_paths[i], 0) : server;
+        if (holder) {
+            queue_replication(holder, matched_paths ? matched_paths[i] : path);
+        }
+        if (matched_paths) {
+            free(matched_paths[i]);
+        }
+    }
+    free(matched_paths);
+}
+
+// A REPLICATE sent to a primary, waiting for its REPLICATED
+typedef struct ReplicaWait
+{
+    struct ReplicaWait *next;
+    uint32_t request_id;
+    StorageServer *server;
+    int done;
+    uint32_t copies;
+} ReplicaWait;
+
+static ReplicaWait *replica_waits = NULL;
+static pthread_mutex_t replica_wait_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t replica_wait_cond = PTHREAD_COND_INITIALIZER;
+static uint32_t next_replicate_id = 0;
+
+// Called when a primary reports a finished REPLICATE
+static void replica_push_finished(StorageServer *server, const ProtoMessage *msg)
+{
+    ProtoReader reader;
+    proto_reader_init(&reader, msg);
+    uint32_t copies = proto_get_u32(&reader);
+    pthread_mutex_lock(&replica_wait_lock);
+    for (ReplicaWait *wait = replica_waits; wait; wait = wait->next)
+    {
+        if (wait->request_id == msg->header.request_id && wait->server == server)
+        {
+            wait->copies = reader.failed ? 0 : copies;
+            wait->done = 1;
+            pthread_cond_broadcast(&replica_wait_cond);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&replica_wait_lock);
+}
+
+// Fails the REPLICATEs of a server that disconnected
+static void replica_pushes_abandoned(StorageServer *server)
+{
+    pthread_mutex_lock(&replica_wait_lock);
+    for (ReplicaWait *wait = replica_waits; wait; wait = wait->next)
+    {
+        if (wait->server == server)
+        {
+            wait->done = 1;
+        }
+    }
+    pthread_cond_broadcast(&replica_wait_cond);
+    pthread_mutex_unlock(&replica_wait_lock);
+}
+
+// Replication worker: asks the server holding a queued path to push it down
+// the chain of its live backups that are behind, and waits for the result.
+// The data goes from storage server to storage server; only the command and
+// the report pass through here. A path that was deleted or moved since is
+// skipped, and so is one whose primary missed a write (it would push an
+// older version over a newer one).
+static int replicate_path(int source, const char *path, void *data)
+{
+    (void)data;
+    if (source >= server_count)
+    {
+        return 0;
+    }
+    StorageServer *server = &storage_servers[source];
+    trie_read_lock();
+    TrieLeaf *leaf = trie_search(global_trie_root, path);
+    int is_directory = leaf != NULL && leaf->is_directory;
+    trie_read_unlock();
+
+    Replica replicas[MAX_REPLICAS];
+    uint64_t latest;
+    int count = list_replicas(path, replicas, &latest);
+    int own = 0;
+    while (own < count && replicas[own].server != server)
+    {
+        own++;
+    }
+    if (own == count)
+    {
+        return 0;
+    }
+    // Copy from another up-to-date replica if this one went down or fell behind
+    uint64_t version = replicas[own].version;
+    if (server->is_server_down || server->socket_fd < 0 || version < latest)
+    {
+        StorageServer *other = replication_source(path);
+        if (other == NULL)
+        {
+            return -1;
+        }
+        if (other != server)
+        {
+            log_emit(LOG_LEVEL_INFO, "Replicating %s from %s:%d instead of %s:%d\n", path, other->ip, other->port, server->ip, server->port);
+            queue_replication(other, path);
+            return 0;
+        }
+    }
+
+    ProtoWriter writer;
+    proto_writer_init(&writer);
+    proto_put_str(&writer, path);
+    uint32_t targets = 0;
+    int missing = 0;
+    int slots[MAX_REPLICAS];
+    for (int i = 0; i < count; i++)
+    {
+        if (i == own || replicas[i].version >= version)
+        {
+            continue;
+        }
+        if (replicas[i].server->is_server_down)
+        {
+            missing++;
+            continue;
+        }
+        proto_put_str(&writer, replicas[i].server->ip);
+        proto_put_u32(&writer, replicas[i].server->port);
+        slots[targets++] = replicas[i].slot;
+    }
+    if (targets == 0)
+    {
+        proto_writer_free(&writer);
+        return missing ? -1 : 0;
+    }
+
+    ReplicaWait wait = {.server = server};
+    pthread_mutex_lock(&replica_wait_lock);
+    wait.request_id = ++next_replicate_id;
+    wait.next = replica_waits;
+    replica_waits = &wait;
+    pthread_mutex_unlock(&replica_wait_lock);
+
+    pthread_mutex_lock(&server->send_lock);
+    int res = proto_send_writer(server->socket_fd, PROTO_REPLICATE, is_directory ? PROTO_FLAG_DIRECTORY : 0, wait.request_id, &writer);
+    pthread_mutex_unlock(&server->send_lock);
+    proto_writer_free(&writer);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += REPLICATE_TIMEOUT_SECONDS;
+    pthread_mutex_lock(&replica_wait_lock);
+    while (res == 0 && !wait.done)
+    {
+        if (pthread_cond_timedwait(&replica_wait_cond, &replica_wait_lock, &deadline) == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+    ReplicaWait **link = &replica_waits;
+    while (*link != &wait)
+    {
+        link = &(*link)->next;
+    }
+    *link = wait.next;
+    pthread_mutex_unlock(&replica_wait_lock);
+
+    // The chain stops at the first hop that fails, so the first copies made it
+    for (uint32_t i = 0; res == 0 && i < wait.copies && i < targets; i++)
+    {
+        set_replica_version(path, slots[i], version);
+    }
+    if (res < 0 || wait.copies < targets || missing)
+    {
+        log_emit(LOG_LEVEL_WARN, "Replicated %s from %s:%d to %u of %u backups\n", path, server->ip, server->port, wait.copies,
+                 targets + missing);
+        return -1;
+    }
+    return 0;
+}
+
+// Replication worker: a job finished, so it leaves the persistent queue
+static void replication_done(int source, const char *path, int succeeded, void *data)
+{
+    (void)succeeded;
+    (void)data;
+    ProtoWriter record;
+    proto_writer_init(&record);
+    proto_put_u32(&record, source);
+    proto_put_str(&record, path);
+    wal_begin();
+    if (replication_retire(replication_queue, source, path))
+    {
+        wal_append(WAL_REPLICATED, &record);
+    }
+    wal_end();
+    proto_writer_free(&record);
+}
+
+// Function to remove a specific path from the cache
+void remove_paths_from_cache(const char *path)
+{
+    if (location_cache_remove(location_cache, path))
+    {
+        log_message("Removing path from cache: %s\n", path);
+        printf("Removing path from cache: %s\n", path);
+    }
+}
+
+// Removes a path and everything cached below it (directory delete)
+void remove_subtree_from_cache(const char *path)
+{
+    size_t removed = location_cache_remove_subtree(location_cache, path);
+    if (removed > 0)
+    {
+        log_message("Removed %zu cached paths under %s\n", removed, path);
+        printf("Removed %zu cached paths under %s\n", removed, path);
+    }
+}
+
+// Clears the deleted mark on a path and everything below it
+void mark_subtree_as_revived(Trie *root, const char *path)
+{
+    mark_subtree(root, path, 0);
+}
+
+StorageServer *search_path_two(Trie *root, const char *path)
+{
+    trie_read_lock();
+    TrieLeaf *leaf = trie_search(root, path);
+    StorageServer *server = leaf ? leaf->server : NULL;
+    if (server != NULL)
+    {
+        leaf->is_deleted = 0;
+        server->is_server_down = 0;
+        mark_subtree_as_revived(root, path);
+    }
+    trie_read_unlock();
+    return server;
+}
+
+// Applies the FILE_LIST and FILE_REMOVED batches of a registration as they
+// arrive, then records and acknowledges the new registration generation.
+// Returns 0 on success, -1 if the connection failed or misbehaved.
+static int receive_registration(StorageServer *server, int sock, ProtoMessage *msg)
+{
+    size_t received = 0;
+    while (proto_recv(sock, msg) > 0) {
+        uint16_t opcode = msg->header.opcode;
+        received += msg->header.payload_len;
+        if (opcode == PROTO_FILE_LIST) {
+            parse_and_store_files(server, msg);
+            continue;
+        }
+        if (opcode == PROTO_FILE_REMOVED) {
+            parse_and_remove_files(server, msg);
+            continue;
+        }
+        if (opcode != PROTO_FILE_LIST_END) {
+            printf("Unexpected message %u during registration of %s:%d\n", opcode, server->ip, server->port);
+            return -1;
+        }
+        ProtoReader reader;
+        proto_reader_init(&reader, msg);
+        uint64_t generation = proto_get_u64(&reader);
+        uint64_t digest = proto_get_u64(&reader);
+        if (reader.failed) {
+            return -1;
+        }
+        wal_begin();
+        server->registration_generation = generation;
+        server->manifest_digest = digest;
+        record_registration(wal_append, server);
+        wal_end();
+        ProtoWriter writer;
+        proto_writer_init(&writer);
+        proto_put_u64(&writer, generation);
+        pthread_mutex_lock(&server->send_lock);
+        int res = proto_send_writer(sock, PROTO_REGISTERED, 0, 0, &writer);
+        pthread_mutex_unlock(&server->send_lock);
+        proto_writer_free(&writer);
+        log_message("Received %zu bytes of file lists, registration generation %llu\n", received, (unsigned long long)generation);
+        printf("Received %zu bytes of file lists, registration generation %llu\n", received, (unsigned long long)generation);
+        return res;
+    }
+    return -1;
+}
+
+// Marks a disconnected storage server down. Its paths stay in the
+// namespace: lookups pass over down servers, reads go to the other
+// replicas, and the repair remakes its copies if it stays away. Does
+// nothing if the server already registered again on a new connection.
+static void storage_server_lost(StorageServer *server, int sock)
+{
+    pthread_mutex_lock(&server->send_lock);
+    int current = server->socket_fd == sock;
+    if (current) {
+        server->socket_fd = -1;
+    }
+    pthread_mutex_unlock(&server->send_lock);
+    if (!current) {
+        return;
+    }
+    if (server->is_async_write_in_progress) {
+        server->is_async_write_in_progress = 0;
+        notify_session(server->async_writer_session, PROTO_ASYNC_FAILED, NULL, 0);
+    }
+    log_message("STOP received or connection error\n");
+    // The socket is closed once this returns; the detector must not touch it
+    pthread_mutex_lock(&server->liveness_lock);
+    server->monitored = 0;
+    pthread_mutex_unlock(&server->liveness_lock);
+    server->is_server_down = 1;
+    server->lost_at_ms = heartbeat_now_ms();
+    server->missed_writes = 1;
+    replica_pushes_abandoned(server);
+    connpool_forget(server_pool, server_handle(server));
+    int counter_for_paths = server->path_count;
+    while (counter_for_paths--) {
+        remove_paths_from_cache(server->path_list[counter_for_paths]);
+    }
+    printf("STOP received or connection error\n");
+}
+
+void storage_server_thread(int client_sock, const char *my_ip, int my_port, uint64_t generation, uint64_t digest, uint64_t capacity)
+{
+    int new_socket = client_sock;
+    printf("My IP is %s and My Port is %d\n", my_ip, my_port);
+    log_message("My IP is %s and My Port is %d\n", my_ip, my_port);
+    ProtoMessage msg = {0};
+    pthread_mutex_lock(&lock);
+    StorageServer *server = NULL;
+    int flag = 0;
+    int rejoined = 0; // 1 if the server was lost while we ran, 2 if it was evicted
+    for (int i = 0; i < server_count; i++) {
+        if (strcmp(storage_servers[i].ip, my_ip) == 0 && storage_servers[i].port == my_port) {
+            server = &storage_servers[i];
+            rejoined = server->evicted ? 2 : server->missed_writes;
             server->is_server_down = 0;
-            server->path_list = NULL;
-            server->path_count = 0;
-            server->backup_ss[0] = -1;
-            server->backup_ss[1] = -1;
-            server_count++;
-            if (server_count < REPLICATION_FACTOR) {
-                for (int i = 0; i < 2; i++) {
-                    server->backup_ss[i] = -1;
-                }
-            } else {
-                for (int j = 0; j < REPLICATION_FACTOR - 1; j++) {
-                    if (storage_servers[j].backup_ss[0] == -1) {
-                        if (j == 0) {
-                            storage_servers[j].backup_ss[0] = 1;
-                            storage_servers[j].backup_ss[1] = 2;
-                        } else {
-                            storage_servers[j].backup_ss[0] = 0;
-                            storage_servers[j].backup_ss[1] = 2;
-                        }
-                        char buffer1[BUFFER_SIZE] = {0};
-                        if (j == 1) {
-                            retrieve_paths_to_buffer(global_trie_root, buffer1, &storage_servers[j]);
-                            sleep(7);
-                            parse_and_store_backup(&storage_servers[j], buffer1);
-                        } else {
-                            sleep(7);
-                            parse_and_store_backup(&storage_servers[j], buffer_back);
-                        }
-                    } else
-                        break;
-                }
-                server->backup_ss[0] = rand() % (server_count - 1);
-                int temp = rand() % (server_count - 1);
-                while (temp == server->backup_ss[0]) {
-                    temp = rand() % (server_count - 1);
-                }
-                server->backup_ss[1] = temp;
-            }
-            pthread_mutex_unlock(&lock);
-            log_message("Registered Storage Server from IP: %s, Port: %d\n", server->ip, server->port);
-            printf("Registered Storage Server from IP: %s, Port: %d\n", server->ip, server->port);
-            log_message("Received file list:\n%s\n", buffer);
-            printf("Received file list:\n%s\n", buffer);
-            sleep(1);
-            char polo_temporary[BUFFER_SIZE];
-            snprintf(polo_temporary, sizeof(polo_temporary), "IP: %s Port: %d\n", server->ip, server->port);
-            send(new_socket, polo_temporary, strlen(polo_temporary), 0);
-            parse_and_store_files(server, buffer);
-            if (server_count == 1) {
-                retrieve_paths_to_buffer(global_trie_root, buffer_back, server);
+            server->lost_at_ms = 0;
+            server->missed_writes = 0;
+            server->evicted = 0;
+            pthread_mutex_lock(&server->send_lock);
+            server->socket_fd = new_socket;
+            pthread_mutex_unlock(&server->send_lock);
+            server->in_flight = 0;
+            server->routed = 0;
+            // Pooled connections to a restarted server are dead
+            connpool_forget(server_pool, server_handle(server));
+            int counter_for_paths = server->path_count;
+            while (counter_for_paths--) {
+                search_path_two(global_trie_root, server->path_list[counter_for_paths]);
             }
-        } else {
+            flag = 1;
+            printf("Server is already registered\n");
+        }
+    }
+    if (flag == 0) {
+        if (server_count >= MAX_STORAGE_SERVERS) {
+            fprintf(stderr, "Too many storage servers, rejecting %s:%d\n", my_ip, my_port);
             pthread_mutex_unlock(&lock);
-            log_message("Registered Storage Server from IP: %s, Port: %d\n", server->ip, server->port);
-            printf("Registered Storage Server from IP: %s, Port: %d\n", server->ip, server->port);
-            log_message("Received file list:\n%s\n", buffer);
-            printf("Received file list:\n%s\n", buffer);
-            parse_and_store_files(server, buffer);
-            if (server_count == 1) {
-                retrieve_paths_to_buffer(global_trie_root, buffer_back, server);
-            }
-            char polo_temporary[BUFFER_SIZE];
-            snprintf(polo_temporary, sizeof(polo_temporary), "IP: %s Port: %d\n", server->ip, server->port);
-            send(new_socket, polo_temporary, strlen(polo_temporary), 0);
-        }
-        while (1) {
-            memset(buffer, 0, BUFFER_SIZE);
-            bytes_read = recv(new_socket, buffer, BUFFER_SIZE, 0);
-            int client_socket_number = 0;
-            if (strncmp(buffer, "ASYNC_WRITE_PROGRESS", 20) == 0) {
-                char path[BUFFER_SIZE];
-                sscanf(buffer, "ASYNC_WRITE_PROGRESS %d %s", &client_socket_number, path);
-                server->is_async_write_in_progress = 1;
-                server->async_writer_socket = client_socket_number;
-                StorageServer *idx = path_exists(path, NULL);
-                if (idx == NULL) {
-                    send(client_socket_number, "ASYNC_WRITE_SUCCESS", strlen("ASYNC_WRITE_SUCCESS"), 0);
-                    continue;
-                }
-                if (idx->backup_ss[0] != (-1) && idx->backup_ss[1] != (-1)) {
-                    perform_copy_between_servers(idx->port, storage_servers[idx->backup_ss[0]].port, path, path);
-                    perform_copy_between_servers(idx->port, storage_servers[idx->backup_ss[1]].port, path, path);
-                    send(client_socket_number, "ASYNC_WRITE_SUCCESS", strlen("ASYNC_WRITE_SUCCESS"), 0);
-                    continue;
-                } else if (idx->backup_ss[0] == -1) {
-                    perform_copy_between_servers(idx->port, storage_servers[idx->backup_ss[1]].port, path, path);
-                    send(client_socket_number, "ASYNC_WRITE_SUCCESS", strlen("ASYNC_WRITE_SUCCESS"), 0);
-                    continue;
-                } else if (idx->backup_ss[1] == -1) {
-                    perform_copy_between_servers(idx->port, storage_servers[idx->backup_ss[0]].port, path, path);
-                    send(client_socket_number, "ASYNC_WRITE_SUCCESS", strlen("ASYNC_WRITE_SUCCESS"), 0);
-                    continue;
-                }
-                continue;
-            }
-            printf("Received from Storage Server %s:%d: %s\n", server->ip, server->port, buffer);
-            log_message("Received from Storage Server %s:%d: %s\n", server->ip, server->port, buffer);
-            if (strncmp(buffer, "ASYNC_WRITE_SUCCESS", 19) == 0) {
-                log_message("ASYNC_WRITE_SUCCESS received\n");
-                printf("ASYNC_WRITE_SUCCESS received\n");
-                int client_socket_number = 0;
-                char path[BUFFER_SIZE];
-                sscanf(buffer, "ASYNC_WRITE_SUCCESS %d %s", &client_socket_number, path);
-                log_message("Client Socket Number is %d\n", client_socket_number);
-                printf("Client Socket Number is %d\n", client_socket_number);
-                sleep(1);
-                server->is_async_write_in_progress = 0;
-                send(client_socket_number, "ASYNC_WRITE_SUCCESS", strlen("ASYNC_WRITE_SUCCESS"), 0);
-            }
-            if (strncmp(buffer, "WRITE_SUCCESS", strlen("WRITE_SUCCESS")) == 0) {
-                printf("WRITE_SUCCESS received\n");
-                log_message("WRITE_SUCCESS received\n");
-                char path[BUFFER_SIZE];
-                sscanf(buffer, "WRITE_SUCCESS %s", path);
-                sleep(1);
-                StorageServer *idx = path_exists(path, NULL);
-                if (idx == NULL) {
-                    send(client_socket_number, "WRITE_SUCCESS", strlen("WRITE_SUCCESS"), 0);
-                    continue;
-                }
-                if (idx->backup_ss[0] != (-1) && idx->backup_ss[1] != (-1)) {
-                    perform_copy_between_servers(idx->port, storage_servers[idx->backup_ss[0]].port, path, path);
-                    perform_copy_between_servers(idx->port, storage_servers[idx->backup_ss[1]].port, path, path);
-                    send(client_socket_number, "WRITE_SUCCESS", strlen("WRITE_SUCCESS"), 0);
-                    continue;
-                } else if (idx->backup_ss[0] == -1) {
-                    perform_copy_between_servers(idx->port, storage_servers[idx->backup_ss[1]].port, path, path);
-                    send(client_socket_number, "WRITE_SUCCESS", strlen("WRITE_SUCCESS"), 0);
-                    continue;
-                } else if (idx->backup_ss[1] == -1) {
-                    perform_copy_between_servers(idx->port, storage_servers[idx->backup_ss[0]].port, path, path);
-                    send(client_socket_number, "WRITE_SUCCESS", strlen("WRITE_SUCCESS"), 0);
-                    continue;
-                }
+            proto_message_free(&msg);
+            return;
+        }
+        server = &storage_servers[server_count];
+        wal_begin();
+        // Initialize all fields to safe defaults
+        memset(server, 0, sizeof(StorageServer));
+        pthread_mutex_init(&server->send_lock, NULL);
+        pthread_mutex_init(&server->liveness_lock, NULL);
+        server->port = my_port;
+        snprintf(server->ip, sizeof(server->ip), "%s", my_ip);
+        server->socket_fd = new_socket;
+        server->is_async_write_in_progress = 0;
+        server->async_writer_session = 0;
+        server->is_server_down = 0;
+        server->path_list = NULL;
+        server->path_count = 0;
+        server->capacity = capacity;
+        server->registration_generation = 0;
+        server->manifest_digest = 0;
+        server_count++;
+        record_server(wal_append, server);
+        record_capacity(wal_append, server);
+        wal_end();
+    } else if (capacity != 0 && capacity != server->capacity) {
+        wal_begin();
+        server->capacity = capacity;
+        record_capacity(wal_append, server);
+        wal_end();
+    }
+    // A new server, or a new weight, moves part of the backups once the
+    // server's own paths are known
+    int placement_changed = place_server(server);
+    pthread_mutex_unlock(&lock);
+    log_message("Registered Storage Server from IP: %s, Port: %d\n", server->ip, server->port);
+    printf("Registered Storage Server from IP: %s, Port: %d\n", server->ip, server->port);
+    // A server whose last registration is still on record only sends the
+    // paths that changed since; any other server sends all of them
+    int full_list = !(flag && generation != 0 && server->registration_generation == generation &&
+                      server->manifest_digest == digest);
+    pthread_mutex_lock(&server->send_lock);
+    proto_send(new_socket, PROTO_WELCOME, full_list ? PROTO_FLAG_FULL_LIST : 0, 0, NULL, 0);
+    pthread_mutex_unlock(&server->send_lock);
+    int registered = receive_registration(server, new_socket, &msg);
+    if (rejoined == 2) {
+        // Back in placement: its copies return to it and the stand-ins go
+        schedule_repair(NULL);
+    } else if (placement_changed) {
+        rebalance_backups("");
+    } else if (rejoined) {
+        // Writes it missed are copied to it
+        schedule_repair(server);
+    }
+    if (registered < 0) {
+        storage_server_lost(server, new_socket);
+        proto_message_free(&msg);
+        return;
+    }
+
+    while (1) {
+        int res = proto_recv(new_socket, &msg);
+        if (res <= 0 || msg.header.opcode == PROTO_STOP) {
+            storage_server_lost(server, new_socket);
+            break;
+        }
+        uint16_t opcode = msg.header.opcode;
+        if (opcode == PROTO_REPLICATED) {
+            replica_push_finished(server, &msg);
+            continue;
+        }
+        if (opcode == PROTO_HEARTBEAT) {
+            heartbeat_received(server, &msg);
+            continue;
+        }
+        ProtoReader reader;
+        proto_reader_init(&reader, &msg);
+        uint64_t session_token = 0;
+        if (opcode == PROTO_ASYNC_PROGRESS || opcode == PROTO_ASYNC_DONE || opcode == PROTO_ASYNC_FAILED ||
+            opcode == PROTO_ASYNC_UNSYNCED) {
+            session_token = proto_get_u64(&reader);
+        }
+        const char *path = proto_get_str(&reader);
+        if (!path) {
+            printf("Malformed message %u from Storage Server %s:%d\n", opcode, server->ip, server->port);
+            continue;
+        }
+        printf("Received %u from Storage Server %s:%d: %s\n", opcode, server->ip, server->port, path);
+        log_message("Received %u from Storage Server %s:%d: %s\n", opcode, server->ip, server->port, path);
+        if (opcode == PROTO_ASYNC_PROGRESS) {
+            server->is_async_write_in_progress = 1;
+            server->async_writer_session = session_token;
+            notify_session(session_token, opcode, msg.payload, msg.header.payload_len);
+        } else if (opcode == PROTO_ASYNC_DONE || opcode == PROTO_ASYNC_FAILED || opcode == PROTO_ASYNC_UNSYNCED) {
+            log_message("Async write of %s finished for session %llu\n", path, (unsigned long long)session_token);
+            server->is_async_write_in_progress = 0;
+            // The new content is in place either way for DONE and UNSYNCED
+            if (opcode != PROTO_ASYNC_FAILED) {
+                write_completed(server, path, 0);
             }
-            if (bytes_read <= 0 || strcmp(buffer, "STOP") == 0) {
-                if (server->is_async_write_in_progress) {
-                    server->is_async_write_in_progress = 0;
-                    send(server->async_writer_socket, "ASYNC_WRITE_FAIL", strlen("ASYNC_WRITE_FAIL"), 0);
-                }
-                log_message("STOP received or connection error\n");
-                server->is_server_down = 1;
-                int counter_for_paths = server->path_count;
-                StorageServer *hello;
-                while (counter_for_paths--) {
-                    remove_paths_from_cache(server->path_list[counter_for_paths]);
-                    hello = search_path(global_trie_root, server->path_list[counter_for_paths], 1);
-                }
-                printf("STOP received or connection error\n");
-                log_message("STOP received or connection error\n");
-                break;
+            notify_session(session_token, opcode, msg.payload, msg.header.payload_len);
+        } else if (opcode == PROTO_WRITE_DONE) {
+            printf("WRITE_SUCCESS received\n");
+            log_message("WRITE_SUCCESS received\n");
+            // Replicas a quorum write reached along the chain
+            uint32_t copies = reader.pos < reader.end ? proto_get_u32(&reader) : 0;
+            write_completed(server, path, copies);
+        }
+    }
+    proto_message_free(&msg);
+}
+
+typedef struct
+{
+    int sock;
+    char ip[INET_ADDRSTRLEN];
+    int port;
+    uint64_t generation; // Registration generation the server last completed
+    uint64_t digest;
+    uint64_t capacity; // 0 if the server did not declare one
+} StorageHello;
+
+void *handle_storage_connection_thread(void *arg)
+{
+    StorageHello *hello = (StorageHello *)arg;
+    storage_server_thread(hello->sock, hello->ip, hello->port, hello->generation, hello->digest, hello->capacity);
+    close(hello->sock);
+    free(hello);
+    return NULL;
+}
+
+// Connections are owned by the epoll reactor. Each one is registered
+// edge-triggered and one-shot, so at most one worker services it at a time
+// and re-arms it when its socket is drained.
+typedef enum
+{
+    CONN_HANDSHAKE, // Waiting for CLIENT_HELLO or STORAGE_HELLO
+    CONN_CLIENT
+} ConnectionState;
+
+struct Connection
+{
+    int fd;
+    ConnectionState state;
+    uint64_t session_token;    // Set once the client is welcomed
+    pthread_mutex_t send_lock; // Replies and forwarded write notifications share the socket
+    ProtoMessage msg;          // Message being received
+    struct Connection *next;         // Work queue link
+    struct Connection *session_next; // Session table chain
+};
+
+// Client sessions by token, so storage server threads can forward write
+// notifications. A token is never reused, unlike the descriptor.
+static Connection *session_table[SESSION_BUCKETS];
+static pthread_mutex_t session_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t next_session_token = 1;
+
+static void register_session(Connection *conn)
+{
+    pthread_mutex_lock(&session_lock);
+    conn->session_token = next_session_token++;
+    Connection **bucket = &session_table[conn->session_token % SESSION_BUCKETS];
+    conn->session_next = *bucket;
+    *bucket = conn;
+    pthread_mutex_unlock(&session_lock);
+}
+
+static void unregister_session(Connection *conn)
+{
+    pthread_mutex_lock(&session_lock);
+    Connection **slot = &session_table[conn->session_token % SESSION_BUCKETS];
+    while (*slot && *slot != conn)
+        slot = &(*slot)->session_next;
+    if (*slot)
+        *slot = conn->session_next;
+    pthread_mutex_unlock(&session_lock);
+}
+
+// Sends a message to the client session with the given token, if it is
+// still connected. Returns 0 if it was sent.
+static int send_to_session(uint64_t session_token, uint16_t opcode, uint32_t request_id, const void *payload, size_t len)
+{
+    int res = -1;
+    pthread_mutex_lock(&session_lock);
+    Connection *conn = session_table[session_token % SESSION_BUCKETS];
+    while (conn && conn->session_token != session_token)
+        conn = conn->session_next;
+    if (conn)
+    {
+        pthread_mutex_lock(&conn->send_lock);
+        res = proto_send(conn->fd, opcode, 0, request_id, payload, len);
+        pthread_mutex_unlock(&conn->send_lock);
+    }
+    pthread_mutex_unlock(&session_lock);
+    return res;
+}
+
+int notify_session(uint64_t session_token, uint16_t opcode, const void *payload, size_t len)
+{
+    return send_to_session(session_token, opcode, 0, payload, len);
+}
+
+// Sends a reply carrying a message string on a client session
+static int send_reply(Connection *conn, uint16_t opcode, uint32_t request_id, const char *message)
+{
+    pthread_mutex_lock(&conn->send_lock);
+    int res = proto_send_str(conn->fd, opcode, request_id, message);
+    pthread_mutex_unlock(&conn->send_lock);
+    return res;
+}
+
+// Tells a client how far its COPY got
+static void send_copy_progress(uint64_t session_token, uint32_t request_id, uint64_t paths, uint64_t bytes)
+{
+    ProtoWriter writer;
+    proto_writer_init(&writer);
+    proto_put_u64(&writer, paths);
+    proto_put_u64(&writer, bytes);
+    send_to_session(session_token, PROTO_COPY_PROGRESS, request_id, writer.data, writer.len);
+    proto_writer_free(&writer);
+}
+
+// A COPY running in the background, answered on its session once it ends
+typedef struct
+{
+    StorageServer *src;
+    StorageServer *dest;
+    char *source;
+    char *destination;
+    uint64_t session_token;
+    uint32_t request_id;
+} CopyRequest;
+
+static void *copy_request_thread(void *arg)
+{
+    CopyRequest *request = (CopyRequest *)arg;
+    const char *message = "COPY operation successful\n";
+    uint16_t opcode = PROTO_OK;
+    if (perform_copy_between_servers1(request->src, request->dest, request->source, request->destination,
+                                      request->session_token, request->request_id) != 0)
+    {
+        opcode = PROTO_ERROR;
+        message = request->src == request->dest ? "Error copying within the same storage server\n"
+                                                : "Error copying between storage servers\n";
+    }
+    else
+    {
+        replicate_to_backups(request->dest, request->destination);
+    }
+    ProtoWriter writer;
+    proto_writer_init(&writer);
+    proto_put_str(&writer, message);
+    send_to_session(request->session_token, opcode, request->request_id, writer.data, writer.len);
+    proto_writer_free(&writer);
+    free(request->source);
+    free(request->destination);
+    free(request);
+    return NULL;
+}
+
+// Starts a COPY on a thread of its own, so the reactor worker goes back to
+// its sessions while the files are transferred. Returns 0 once started.
+static int start_copy(StorageServer *src, StorageServer *dest, const char *source, const char *destination,
+                      uint64_t session_token, uint32_t request_id)
+{
+    CopyRequest *request = calloc(1, sizeof(CopyRequest));
+    if (request)
+    {
+        request->src = src;
+        request->dest = dest;
+        request->source = strdup(source);
+        request->destination = strdup(destination);
+        request->session_token = session_token;
+        request->request_id = request_id;
+    }
+    pthread_t thread;
+    if (!request || !request->source || !request->destination ||
+        pthread_create(&thread, NULL, copy_request_thread, request) != 0)
+    {
+        perror("Failed to start copy");
+        if (request)
+        {
+            free(request->source);
+            free(request->destination);
+            free(request);
+        }
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+// Sends a command to a server and to the backups of the path. The paths
+// below a directory may be placed on any server, so a directory DELETE
+// goes to every connected one.
+static void send_command_with_backups(StorageServer *server, uint16_t command, const char *path)
+{
+    if (command == PROTO_DELETE && return_one_if_directory(path))
+    {
+        for (int i = 0; i < server_count; i++)
+        {
+            if (storage_servers[i].socket_fd >= 0)
+                send_command_to_storage(&storage_servers[i], command, path);
+        }
+        return;
+    }
+    send_command_to_storage(server, command, path);
+    StorageServer *backups[MAX_REPLICAS - 1];
+    int count = placement_backups(path, server, backups);
+    for (int i = 0; i < count; i++)
+    {
+        if (backups[i]->socket_fd >= 0)
+            send_command_to_storage(backups[i], command, path);
+    }
+}
+
+// Builds the LOCATION of a READ, WRITE, INFO or STREAM. Returns the reply
+// opcode; an ERROR reply carries its message.
+static uint16_t locate_path(uint16_t command, const char *path, ProtoWriter *reply)
+{
+    ReplicaPolicy policy = effective_policy(path);
+    StorageServer *tempo = NULL;
+    StorageServer *others[MAX_REPLICAS];
+    int other_count = 0;
+    uint32_t quorum = 1;
+    if (command == PROTO_WRITE)
+    {
+        int found = cache_lookup(path);
+        if (found == -1)
+        {
+            tempo = path_exists(path, NULL);
+            if (tempo != NULL && !tempo->is_server_down)
+            {
+                found = server_handle(tempo);
+                cache_insert(path, found);
             }
         }
-        close(new_socket);
+        else if (storage_servers[found].is_server_down)
+        {
+            tempo = path_exists(path, NULL);
+        }
+        if (tempo == NULL && found != -1)
+            tempo = &storage_servers[found];
+        // The writer pushes a synchronous write down the other live
+        // replicas until the write quorum holds it
+        Replica chain[MAX_REPLICAS];
+        int chained = tempo ? write_chain(path, tempo, chain) : 0;
+        if (tempo && chained + 1 < policy.write_quorum)
+        {
+            proto_put_str(reply, "Not enough replicas are up for the write quorum");
+            return PROTO_ERROR;
+        }
+        quorum = policy.write_quorum;
+        for (int i = 0; i < chained; i++)
+            others[other_count++] = chain[i].server;
+    }
+    else
+    {
+        // Any up-to-date replica can serve a read: the least loaded is
+        // offered first, and the client falls back along the others
+        StorageServer *choices[MAX_REPLICAS];
+        int count = read_replicas(path, choices, MAX_REPLICAS);
+        if (count > 0 && count < policy.read_quorum)
+        {
+            proto_put_str(reply, "Not enough up-to-date replicas are up for the read quorum");
+            return PROTO_ERROR;
+        }
+        tempo = count > 0 ? choices[0] : NULL;
+        quorum = policy.read_quorum;
+        for (int i = 1; i < count; i++)
+            others[other_count++] = choices[i];
+    }
+    if (tempo == NULL)
+    {
+        log_message("File not found in any storage server\n");
+        printf("File not found in any storage server\n");
+        proto_put_str(reply, "File not found in any storage server");
+        return PROTO_ERROR;
+    }
+    proto_put_str(reply, tempo->ip);
+    proto_put_u32(reply, tempo->port);
+    proto_put_u32(reply, quorum);
+    for (int i = 0; i < other_count; i++)
+    {
+        proto_put_str(reply, others[i]->ip);
+        proto_put_u32(reply, others[i]->port);
+    }
+    log_message("Sent Storage Server details to client\n");
+    printf("Sent Storage Server details to client\n");
+    return PROTO_LOCATION;
+}
+
+// Creates a file or directory below an existing directory
+static uint16_t create_path(uint16_t command, const char *path, ProtoWriter *reply)
+{
+    int len = strlen(path);
+    char file_name[BUFFER_SIZE];
+    strcpy(file_name, path);
+    for (int i = len - 1; i >= 0; i--)
+    {
+        if (path[i] == '/')
+        {
+            len = i;
+            break;
+        }
+    }
+    file_name[len] = '\0';
+    StorageServer *real = NULL;
+    int found = cache_lookup(path);
+    if (found == -1)
+    {
+        real = path_exists(path, NULL);
+    }
+    if (real != NULL || found != -1)
+    {
+        printf("File or Directory already exists\n");
+        log_message("File or Directory already exists\n");
+        proto_put_str(reply, "File or Directory already exists");
+        return PROTO_ERROR;
+    }
+    found = cache_lookup(file_name);
+    if (found == -1)
+    {
+        real = path_exists(file_name, NULL);
+        if (real)
+        {
+            found = server_handle(real);
+            cache_insert(file_name, found);
+        }
+    }
+    if (found == -1)
+    {
+        log_message("Directory Not found\n");
+        printf("Directory Not found\n");
+        proto_put_str(reply, "Directory Not Found");
+        return PROTO_ERROR;
+    }
+    // The parent only has to exist; the new path goes where the ring places it
+    StorageServer *target = placement_primary(path);
+    if (target == NULL)
+    {
+        proto_put_str(reply, "No storage server available");
+        return PROTO_ERROR;
+    }
+    send_command_with_backups(target, command, path);
+    store_path_entry(target, path, command == PROTO_CREATE_DIR);
+    proto_put_str(reply, command == PROTO_CREATE_DIR ? "Directory created" : "File created");
+    return PROTO_OK;
+}
+
+// Deletes a path, its backups and, for a directory, everything below it
+static uint16_t delete_path(const char *path, ProtoWriter *reply)
+{
+    StorageServer *real = NULL;
+    int found = cache_lookup(path);
+    if (found == -1)
+    {
+        real = path_exists(path, NULL);
+        if (real)
+        {
+            found = server_handle(real);
+            cache_insert(path, found);
+        }
+    }
+    uint16_t opcode = PROTO_OK;
+    if (found != -1)
+    {
+        StorageServer *target = real ? real : &storage_servers[found];
+        char temppp[BUFFER_SIZE];
+        send_command_with_backups(target, PROTO_DELETE, path);
+        search_path(global_trie_root, path, 1);
+        for (int i = 0; i < MAX_REPLICAS - 1; i++)
+        {
+            snprintf(temppp, sizeof(temppp), "Backup%d%s", i + 1, path);
+            search_path(global_trie_root, temppp, 1);
+        }
+        proto_put_str(reply, "Deleted");
+    }
+    else
+    {
+        log_message("File not found in any storage server\n");
+        printf("File not found in any storage server\n");
+        proto_put_str(reply, "File not found in any storage server");
+        opcode = PROTO_ERROR;
+    }
+    remove_subtree_from_cache(path);
+    return opcode;
+}
+
+// Runs a request on one path and builds its reply: a LOCATION for READ,
+// WRITE, INFO and STREAM, OK or ERROR with a message otherwise. Single
+// requests and BATCH operations both come here.
+static uint16_t run_path_operation(uint16_t command, const char *path, ProtoWriter *reply)
+{
+    switch (command)
+    {
+    case PROTO_READ:
+    case PROTO_WRITE:
+    case PROTO_INFO:
+    case PROTO_STREAM:
+        return locate_path(command, path, reply);
+    // Ranged requests go where whole-file ones would
+    case PROTO_READ_RANGE:
+        return locate_path(PROTO_READ, path, reply);
+    case PROTO_WRITE_RANGE:
+    case PROTO_APPEND:
+        return locate_path(PROTO_WRITE, path, reply);
+    case PROTO_CREATE_DIR:
+    case PROTO_CREATE_FILE:
+        return create_path(command, path, reply);
+    case PROTO_DELETE:
+        return delete_path(path, reply);
+    default:
+        proto_put_str(reply, "Unknown command");
+        return PROTO_ERROR;
+    }
+}
+
+// Runs the operations of a BATCH in order and answers them all with one
+// BATCH_RESULT. The request is checked as a whole before any operation
+// runs, so a malformed batch changes nothing. Consecutive lookups share one
+// trie read section, which keeps the nodes they pass through in place
+// between them; creations and deletions, which talk to storage servers and
+// retire nodes, run outside it.
+static void handle_batch(Connection *conn, const ProtoMessage *msg)
+{
+    uint32_t request_id = msg->header.request_id;
+    ProtoReader reader;
+    proto_reader_init(&reader, msg);
+    uint32_t count = proto_get_u32(&reader);
+    ProtoReader ops = reader;
+    for (uint32_t i = 0; i < count && !reader.failed; i++)
+    {
+        proto_get_u32(&reader);
+        const char *path = proto_get_str(&reader);
+        if (path && strlen(path) >= BUFFER_SIZE - 16)
+            reader.failed = 1;
+    }
+    if (reader.failed || count > BATCH_MAX_OPERATIONS || reader.pos != reader.end)
+    {
+        fprintf(stderr, "Invalid batch request\n");
+        send_reply(conn, PROTO_ERROR, request_id, "Invalid batch request");
+        return;
+    }
+    log_message("Received batch of %u operations from client\n", count);
+    printf("Received batch of %u operations from client\n", count);
+
+    ProtoWriter results;
+    ProtoWriter reply;
+    proto_writer_init(&results);
+    proto_writer_init(&reply);
+    proto_put_u32(&results, count);
+    int reading = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint16_t command = (uint16_t)proto_get_u32(&ops);
+        const char *path = proto_get_str(&ops);
+        int mutation = command == PROTO_CREATE_FILE || command == PROTO_CREATE_DIR || command == PROTO_DELETE;
+        if (mutation && reading)
+            trie_read_unlock();
+        else if (!mutation && !reading)
+            trie_read_lock();
+        reading = !mutation;
+        proto_writer_reset(&reply);
+        uint16_t opcode = run_path_operation(command, path, &reply);
+        proto_put_u32(&results, opcode);
+        proto_put_u32(&results, (uint32_t)reply.len);
+        proto_put_bytes(&results, reply.data, reply.len);
+    }
+    if (reading)
+        trie_read_unlock();
+    pthread_mutex_lock(&conn->send_lock);
+    proto_send_writer(conn->fd, PROTO_BATCH_RESULT, 0, request_id, &results);
+    pthread_mutex_unlock(&conn->send_lock);
+    proto_writer_free(&reply);
+    proto_writer_free(&results);
+}
+
+// Runs one request received from a client session. Returns -1 when the
+// client asked to end the session, 0 otherwise.
+int handle_client_message(Connection *conn, const ProtoMessage *msg) {
+    uint16_t command = msg->header.opcode;
+    uint32_t request_id = msg->header.request_id;
+    ProtoReader reader;
+    proto_reader_init(&reader, msg);
+    if (command == PROTO_STOP) {
+        log_message("Received STOP command from client\n");
+        printf("Received STOP command from client\n");
+        return -1;
+    }
+    if (command == PROTO_BATCH) {
+        handle_batch(conn, msg);
+        return 0;
+    }
+    const char *path = proto_get_str(&reader);
+    if (!path || strlen(path) >= BUFFER_SIZE - 16) {
+        fprintf(stderr, "Invalid request %u\n", command);
+        send_reply(conn, PROTO_ERROR, request_id, "Invalid request");
+        return 0;
+    }
+    printf("DEBUG: Received from client: %u '%s'\n", command, path);
+    log_message("Received from client: %u %s\n", command, path);
+    if (command == PROTO_COPY) {
+        const char *path1 = proto_get_str(&reader);
+        if (!path1 || strlen(path1) >= BUFFER_SIZE - 16) {
+            send_reply(conn, PROTO_ERROR, request_id, "Invalid path or path1 path\n");
+            return 0;
+        }
+        printf("Processing COPY command from client: Source: %s, Destination: %s\n", path, path1);
+        log_message("Processing COPY command from client: Source: %s, Destination: %s\n", path, path1);
+        // Validate path and path1 paths
+        StorageServer *src_server = path_exists(path, NULL);
+        StorageServer *dest_server = path_exists(path1, NULL);
+        if (!src_server || !dest_server) {
+            send_reply(conn, PROTO_ERROR, request_id, "Invalid path or path1 path\n");
+            return 0;
+        }
+        // Progress and the final reply are sent from the copy's own thread
+        if (start_copy(src_server, dest_server, path, path1, conn->session_token, request_id) != 0) {
+            send_reply(conn, PROTO_ERROR, request_id, "Error starting the copy\n");
+        }
+    } else if (command == PROTO_READ || command == PROTO_WRITE || command == PROTO_INFO || command == PROTO_STREAM ||
+               command == PROTO_CREATE_DIR || command == PROTO_CREATE_FILE || command == PROTO_DELETE ||
+               command == PROTO_READ_RANGE || command == PROTO_WRITE_RANGE || command == PROTO_APPEND) {
+        ProtoWriter reply;
+        proto_writer_init(&reply);
+        uint16_t opcode = run_path_operation(command, path, &reply);
+        pthread_mutex_lock(&conn->send_lock);
+        proto_send_writer(conn->fd, opcode, 0, request_id, &reply);
+        pthread_mutex_unlock(&conn->send_lock);
+        proto_writer_free(&reply);
+    } else if (command == PROTO_REPAIR_STATUS) {
+        char status[256];
+        repair_status(status, sizeof(status));
+        send_reply(conn, PROTO_OK, request_id, status);
+    } else if (command == PROTO_SET_REPLICATION) {
+        ReplicaPolicy policy;
+        policy.copies = proto_get_u32(&reader);
+        policy.write_quorum = proto_get_u32(&reader);
+        policy.read_quorum = proto_get_u32(&reader);
+        // "." or "/" sets the policy of the whole namespace
+        if (strcmp(path, ".") == 0 || strcmp(path, "/") == 0)
+            path = "";
+        if (reader.failed || policy.copies < 0 || policy.copies > MAX_REPLICAS ||
+            (policy.copies > 0 && (policy.write_quorum < 1 || policy.write_quorum > policy.copies ||
+                                   policy.read_quorum < 1 || policy.read_quorum > policy.copies))) {
+            send_reply(conn, PROTO_ERROR, request_id, "Invalid replication settings");
+            return 0;
+        }
+        if (path[0] != '\0' && path_exists(path, NULL) == NULL) {
+            send_reply(conn, PROTO_ERROR, request_id, "File not found in any storage server");
+            return 0;
+        }
+        wal_begin();
+        apply_policy(path, &policy);
+        record_policy(wal_append, path, &policy);
+        wal_end();
+        // Backups of the paths below are added or dropped to match in the
+        // background; the reply only waits for the policy to be logged
+        schedule_rebalance(path);
+        char message[160];
+        ReplicaPolicy current = effective_policy(path);
+        snprintf(message, sizeof(message),
+                 "Replication set: %d copies, write quorum %d, read quorum %d; backups are being rebalanced",
+                 current.copies, current.write_quorum, current.read_quorum);
+        send_reply(conn, PROTO_OK, request_id, message);
+    } else if (command == PROTO_LIST) {
+        // Older clients send only the path
+        uint32_t limit = 0;
+        const char *after = NULL;
+        if (reader.pos < reader.end) {
+            limit = proto_get_u32(&reader);
+            if (reader.pos < reader.end)
+                after = proto_get_str(&reader);
+        }
+        pthread_mutex_lock(&conn->send_lock);
+        print_all_trie_paths1(conn->fd, request_id, path, limit, after);
+        pthread_mutex_unlock(&conn->send_lock);
     } else {
-        log_message("Error reading from Storage Server\n");
-        printf("Error reading from Storage Server\n");
-        close(new_socket);
+        fprintf(stderr, "Unknown command received\n");
+        send_reply(conn, PROTO_ERROR, request_id, "Unknown command");
     }
+    return 0;
 }
 
-void *handle_storage_connection_thread(void *arg)
+typedef struct
 {
-    int client_socket = *((int *)arg);
-    free(arg);
-    storage_server_thread(client_socket);
-    close(client_socket);
-    return NULL;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    Connection *head;
+    Connection *tail;
+} WorkQueue;
+
+static WorkQueue work_queue = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL};
+static int epoll_fd = -1;
+
+static void work_queue_push(Connection *conn)
+{
+    conn->next = NULL;
+    pthread_mutex_lock(&work_queue.lock);
+    if (work_queue.tail)
+        work_queue.tail->next = conn;
+    else
+        work_queue.head = conn;
+    work_queue.tail = conn;
+    pthread_cond_signal(&work_queue.ready);
+    pthread_mutex_unlock(&work_queue.lock);
 }
 
-void *handle_client(void *arg) {
-    int client_sock = *((int *)arg);
-    free(arg);
-    char buffer[BUFFER_SIZE] = {0};
-    while (1) {
-        int bytes_read = recv(client_sock, buffer, BUFFER_SIZE - 1, 0);
-        log_message("Received from client: %s\n", buffer);
-        sleep(0.3);
-        if (bytes_read <= 0) {
-            if (bytes_read == 0) {
-                log_message("Client disconnected\n");
-                printf("Client disconnected\n");
-            } else {
-                perror("Client read error");
-            }
-            close(client_sock);
-            pthread_exit(NULL);
+static Connection *work_queue_pop(void)
+{
+    pthread_mutex_lock(&work_queue.lock);
+    while (!work_queue.head)
+        pthread_cond_wait(&work_queue.ready, &work_queue.lock);
+    Connection *conn = work_queue.head;
+    work_queue.head = conn->next;
+    if (!work_queue.head)
+        work_queue.tail = NULL;
+    pthread_mutex_unlock(&work_queue.lock);
+    return conn;
+}
+
+static int watch_connection(Connection *conn, int op)
+{
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+    ev.data.ptr = conn;
+    return epoll_ctl(epoll_fd, op, conn->fd, &ev);
+}
+
+static void close_connection(Connection *conn)
+{
+    if (conn->session_token)
+        unregister_session(conn);
+    close(conn->fd); // Also removes it from the epoll set
+    proto_message_free(&conn->msg);
+    pthread_mutex_destroy(&conn->send_lock);
+    free(conn);
+}
+
+// Storage servers keep one long-lived connection with a blocking protocol,
+// and there are few of them, so each still gets its own thread.
+static void hand_off_storage_connection(Connection *conn)
+{
+    ProtoReader reader;
+    proto_reader_init(&reader, &conn->msg);
+    const char *ip = proto_get_str(&reader);
+    uint32_t port = proto_get_u32(&reader);
+    uint64_t generation = proto_get_u64(&reader);
+    uint64_t digest = proto_get_u64(&reader);
+    // Older storage servers do not declare a capacity
+    uint64_t capacity = reader.pos < reader.end ? proto_get_u64(&reader) : 0;
+    StorageHello *hello = malloc(sizeof(StorageHello));
+    if (!ip || reader.failed || !hello)
+    {
+        fprintf(stderr, "Invalid storage server greeting, closing\n");
+        free(hello);
+        close_connection(conn);
+        return;
+    }
+    snprintf(hello->ip, sizeof(hello->ip), "%s", ip);
+    hello->port = port;
+    hello->generation = generation;
+    hello->digest = digest;
+    hello->capacity = capacity;
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    int flags = fcntl(conn->fd, F_GETFL, 0);
+    fcntl(conn->fd, F_SETFL, flags & ~O_NONBLOCK);
+    hello->sock = conn->fd;
+    proto_message_free(&conn->msg);
+    pthread_mutex_destroy(&conn->send_lock);
+    free(conn);
+
+    pthread_t storage_thread;
+    if (pthread_create(&storage_thread, NULL, handle_storage_connection_thread, (void *)hello) != 0)
+    {
+        perror("Failed to create storage connection thread");
+        close(hello->sock);
+        free(hello);
+        return;
+    }
+    pthread_detach(storage_thread);
+}
+
+// Reads until the socket would block, running every message received.
+// Returns 1 if the connection should be re-armed, 0 if it was closed or
+// handed off.
+static int service_connection(Connection *conn)
+{
+    while (1)
+    {
+        int res = proto_recv_partial(conn->fd, &conn->msg,
+                                     conn->state == CONN_HANDSHAKE ? HELLO_MAX_PAYLOAD : CLIENT_MAX_PAYLOAD);
+        if (res == 0)
+        {
+            // Idle sessions should not pin a large receive buffer
+            if (conn->msg.received == 0 && conn->msg.capacity > IDLE_PAYLOAD_KEEP)
+                proto_message_free(&conn->msg);
+            return 1;
         }
-        buffer[bytes_read] = '\0';
-        printf("DEBUG: Received from client: '%s'\n", buffer);
-        log_message("Received from client: %s\n", buffer);
-        char command[BUFFER_SIZE], path[BUFFER_SIZE], path1[BUFFER_SIZE];
-        if (sscanf(buffer, "%s %s %s", command, path, path1) == 3 && strcmp(command, "COPY") == 0) {
-            printf("Processing COPY command from client: Source: %s, Destination: %s\n", path, path1);
-            log_message("Processing COPY command from client: Source: %s, Destination: %s\n", path, path1);
-            // Validate path and path1 paths
-            StorageServer *src_server = path_exists(path, NULL);
-            StorageServer *dest_server = path_exists(path1, NULL);
-            int src_valid = 1;
-            int dest_valid = 1;
-            if (!src_server || !dest_server) {
-                char error_message[] = "Invalid path or path1 path\n";
-                send(client_sock, error_message, strlen(error_message), 0);
-                continue;
-            }
-            // Determine path and path1 storage servers
-            int src_ss = src_server->port;
-            int dest_ss = dest_server->port;
-            if (src_ss == -1 || dest_ss == -1) {
-                char error_message[] = "Failed to locate path or path1 server\n";
-                send(client_sock, error_message, strlen(error_message), 0);
+        if (res < 0)
+        {
+            log_message("Client disconnected\n");
+            printf("Client disconnected\n");
+            close_connection(conn);
+            return 0;
+        }
+
+        if (conn->state == CONN_HANDSHAKE)
+        {
+            if (conn->msg.header.opcode == PROTO_CLIENT_HELLO)
+            {
+                log_message("Client connection detected\n");
+                printf("Client connection detected.\n");
+                conn->state = CONN_CLIENT;
+                register_session(conn);
+                ProtoWriter writer;
+                proto_writer_init(&writer);
+                proto_put_u64(&writer, conn->session_token);
+                pthread_mutex_lock(&conn->send_lock);
+                proto_send_writer(conn->fd, PROTO_WELCOME, 0, conn->msg.header.request_id, &writer);
+                pthread_mutex_unlock(&conn->send_lock);
+                proto_writer_free(&writer);
                 continue;
             }
-            if (src_ss == dest_ss) {
-                // Same storage server
-                if (perform_copy_between_servers1(src_ss, dest_ss, path, path1) != 0) {
-                    char error_message[] = "Error copying within the same storage server\n";
-                    send(client_sock, error_message, strlen(error_message), 0);
-                    continue;
-                }
-            } else {
-                if (perform_copy_between_servers1(src_ss, dest_ss, path, path1) != 0) {
-                    char error_message[] = "Error copying between storage servers\n";
-                    send(client_sock, error_message, strlen(error_message), 0);
-                    continue;
-                }
-            }
-            StorageServer *ss = NULL;
-            for (int i = 0; i < server_count; i++) {
-                if (storage_servers[i].port == dest_ss) {
-                    ss = &storage_servers[i];
-                }
-            }
-            if (ss != NULL) {
-                if (ss->backup_ss[0] != (-1) && ss->backup_ss[1] != (-1)) {
-                    perform_copy_between_servers(ss->port, storage_servers[ss->backup_ss[0]].port, path, path);
-                    perform_copy_between_servers(ss->port, storage_servers[ss->backup_ss[1]].port, path, path);
-                } else if (ss->backup_ss[0] == -1) {
-                    perform_copy_between_servers(ss->port, storage_servers[ss->backup_ss[1]].port, path, path);
-                } else if (ss->backup_ss[1] == -1) {
-                    perform_copy_between_servers(ss->port, storage_servers[ss->backup_ss[0]].port, path, path);
-                }
+            if (conn->msg.header.opcode == PROTO_STORAGE_HELLO)
+            {
+                log_message("Storage Server connection detected\n");
+                printf("Storage Server connection detected.\n");
+                hand_off_storage_connection(conn);
+                return 0;
             }
-            char success_message[] = "COPY operation successful\n";
-            send(client_sock, success_message, strlen(success_message), 0);
+            fprintf(stderr, "Unknown connection type, closing\n");
+            close_connection(conn);
+            return 0;
         }
-        // Skip the initial client connection message
-        if (strncmp(buffer, "CLIENT CONNECTING", 17) == 0) {
-            continue;
+
+        if (handle_client_message(conn, &conn->msg) < 0)
+        {
+            close_connection(conn);
+            return 0;
         }
-        if (sscanf(buffer, "%s %s", command, path) < 2) {
-            fprintf(stderr, "Invalid command format: %s\n", buffer);
-            continue;
+    }
+}
+
+static void *reactor_worker(void *arg)
+{
+    (void)arg;
+    while (1)
+    {
+        Connection *conn = work_queue_pop();
+        if (service_connection(conn) && watch_connection(conn, EPOLL_CTL_MOD) < 0)
+        {
+            perror("epoll_ctl rearm");
+            close_connection(conn);
         }
-        if (strcmp(command, "READ") == 0 || strcmp(command, "WRITE") == 0 || strcmp(command, "INFO") == 0 || strcmp(command, "STREAM") == 0) {
-            int found = -1;
-            StorageServer *tempo;
-            StorageServer **asd;
-            if (cache_lookup(path) == -1) {
-                tempo = path_exists(path, asd);
-                if (tempo == NULL) {
-                    found = -1;
-                } else {
-                    for (int i = 0; i < server_count; i++) {
-                        if (tempo->socket_fd == storage_servers[i].socket_fd && !storage_servers[i].is_server_down) {
-                            found = i;
-                            break;
-                        }
-                    }
-                    if (tempo)
-                        cache_insert(path, found);
-                }
-            } else {
-                tempo = NULL;
-                found = cache_lookup(path);
-                if (found != -1 && storage_servers[found].is_server_down) {
-                    tempo = path_exists(path, asd);
-                }
-            }
-            if (tempo == NULL)
-                tempo = &storage_servers[found];
-            if (found == -1 || tempo == NULL) {
-                char response[BUFFER_SIZE] = "File not found in any storage server";
-                send(client_sock, response, strlen(response), 0);
-                log_message("File not found in any storage server\n");
-                printf("File not found in any storage server\n");
-                continue;
-            }
-            char response[BUFFER_SIZE];
-            snprintf(response, sizeof(response), "IP: %s Port: %d\n", (tempo)->ip, (tempo)->port);
-            send(client_sock, response, strlen(response), 0);
-            log_message("Sent Storage Server details to client\n");
-            printf("Sent Storage Server details to client\n");
-        } else if (strcmp(command, "LIST") == 0) {
-            print_all_trie_paths1(client_sock, path);
-        } else if (strcmp(command, "CREATE_DIC") == 0 || strcmp(command, "CREATE_F") == 0) {
-            int len = strlen(path);
-            char file_name[BUFFER_SIZE];
-            strcpy(file_name, path);
-            for (int i = len - 1; i >= 0; i--) {
-                if (path[i] == '/') {
-                    len = i;
-                    break;
-                }
-            }
-            file_name[len] = '\0';
-            int found = -1;
-            StorageServer **tempo;
-            StorageServer *real = NULL;
-            if (cache_lookup(path) == -1) {
-                real = path_exists(path, tempo);
-            } else {
-                found = cache_lookup(path);
-            }
-            if (real != NULL || found != -1) {
-                printf("File or Directory already exists\n");
-                log_message("File or Directory already exists\n");
-                sleep(1);
-                send(client_sock, "File or Directory already exists", strlen("File or Directory already exists"), 0);
+    }
+    return NULL;
+}
+
+// Accepts every pending connection on the (edge-triggered) listening socket
+static void accept_connections(int server_fd)
+{
+    while (1)
+    {
+        int new_socket = accept4(server_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (new_socket < 0)
+        {
+            if (errno == EINTR)
                 continue;
-            }
-            if (cache_lookup(file_name) == -1) {
-                real = path_exists(file_name, tempo);
-                if (real == NULL) {
-                    found = -1;
-                }
-                if (real) {
-                    for (int i = 0; i < server_count; i++) {
-                        if (real->socket_fd == storage_servers[i].socket_fd) {
-                            found = i;
-                            break;
-                        }
-                    }
-                    cache_insert(file_name, found);
-                }
-            } else {
-                found = cache_lookup(file_name);
-            }
-            if (found != -1) {
-                if (strcmp(command, "CREATE_DIC") == 0) {
-                    if (real) {
-                        send_command_to_storage(real, "CREATE_DIC", path);
-                        if (real->backup_ss[0] != -1)
-                            send_command_to_storage(&storage_servers[real->backup_ss[0]], "CREATE_DIC", path);
-                        if (real->backup_ss[1] != -1)
-                            send_command_to_storage(&storage_servers[real->backup_ss[1]], "CREATE_DIC", path);
-                    } else if (found != -1) {
-                        send_command_to_storage(&storage_servers[found], "CREATE_DIC", path);
-                        if (storage_servers[found].backup_ss[0] != -1)
-                            send_command_to_storage(&storage_servers[storage_servers[found].backup_ss[0]], "CREATE_DIC", path);
-                        if (storage_servers[found].backup_ss[1] != -1)
-                            send_command_to_storage(&storage_servers[storage_servers[found].backup_ss[1]], "CREATE_DIC", path);
-                    }
-                } else if (strcmp(command, "CREATE_F") == 0) {
-                    if (real) {
-                        send_command_to_storage(real, "CREATE_F", path);
-                        if (real->backup_ss[0] != -1)
-                            send_command_to_storage(&storage_servers[real->backup_ss[0]], "CREATE_F", path);
-                        if (real->backup_ss[1] != -1)
-                            send_command_to_storage(&storage_servers[real->backup_ss[1]], "CREATE_F", path);
-                    } else if (found != -1) {
-                        send_command_to_storage(&storage_servers[found], "CREATE_F", path);
-                        if (storage_servers[found].backup_ss[0] != -1)
-                            send_command_to_storage(&storage_servers[storage_servers[found].backup_ss[0]], "CREATE_F", path);
-                        if (storage_servers[found].backup_ss[1] != -1)
-                            send_command_to_storage(&storage_servers[storage_servers[found].backup_ss[1]], "CREATE_F", path);
-                    }
-                }
-                if (strcmp(command, "CREATE_F") == 0) {
-                    char buffer[BUFFER_SIZE];
-                    snprintf(buffer, sizeof(buffer), "File: %s\n", path);
-                    strcpy(path, buffer);
-                    if (real)
-                        parse_and_store_files(real, path);
-                    else
-                        parse_and_store_files(&storage_servers[found], path);
-                } else {
-                    char buffer[BUFFER_SIZE];
-                    snprintf(buffer, sizeof(buffer), "Directory: %s\n", path);
-                    strcpy(path, buffer);
-                    if (real)
-                        parse_and_store_files(real, path);
-                    else
-                        parse_and_store_files(&storage_servers[found], path);
-                }
-            } else {
-                char response[BUFFER_SIZE] = "Directory Not Found";
-                sleep(1);
-                send(client_sock, response, strlen(response), 0);
-                log_message("Directory Not found\n");
-                printf("Directory Not found\n");
-            }
-        } else if (strcmp(command, "DELETE") == 0) {
-            int found = -1;
-            StorageServer **tempo;
-            StorageServer *real = NULL;
-            if (cache_lookup(path) == -1) {
-                real = path_exists(path, tempo);
-                if (real == NULL) {
-                    found = -1;
-                }
-                if (real) {
-                    for (int i = 0; i < server_count; i++) {
-                        if (real->socket_fd == storage_servers[i].socket_fd) {
-                            found = i;
-                            break;
-                        }
-                    }
-                    cache_insert(path, found);
-                }
-            } else {
-                found = cache_lookup(path);
-            }
-            char temppp[BUFFER_SIZE];
-            if (real) {
-                send_command_to_storage(real, "DELETE", path);
-                search_path(global_trie_root, path, 1);
-                if (real->backup_ss[0] != -1) {
-                    send_command_to_storage(&storage_servers[real->backup_ss[0]], "DELETE", path);
-                    strcpy(temppp, "Backup1");
-                    strcat(temppp, path);
-                    search_path(global_trie_root, temppp, 1);
-                }
-                if (real->backup_ss[1] != -1) {
-                    send_command_to_storage(&storage_servers[real->backup_ss[1]], "DELETE", path);
-                    strcpy(temppp, "Backup2");
-                    strcat(temppp, path);
-                    search_path(global_trie_root, temppp, 1);
-                }
-            } else if (found != -1) {
-                send_command_to_storage(&storage_servers[found], "DELETE", path);
-                search_path(global_trie_root, path, 1);
-                if (storage_servers[found].backup_ss[0] != -1) {
-                    send_command_to_storage(&storage_servers[storage_servers[found].backup_ss[0]], "DELETE", path);
-                    strcpy(temppp, "Backup1");
-                    strcat(temppp, path);
-                    search_path(global_trie_root, temppp, 1);
-                }
-                if (storage_servers[found].backup_ss[1] != -1) {
-                    send_command_to_storage(&storage_servers[storage_servers[found].backup_ss[1]], "DELETE", path);
-                    strcpy(temppp, "Backup2");
-                    strcat(temppp, path);
-                    search_path(global_trie_root, temppp, 1);
-                }
-            } else {
-                char response[BUFFER_SIZE] = "File not found in any storage server";
-                sleep(1);
-                send(client_sock, response, strlen(response), 0);
-                log_message("File not found in any storage server\n");
-                printf("File not found in any storage server\n");
-            }
-            remove_paths_from_cache(path);
-        } else if (strcmp(command, "STOP") == 0) {
-            log_message("Received STOP command from client\n");
-            printf("Received STOP command from client\n");
-            close(client_sock);
-            pthread_exit(NULL);
-        } else {
-            fprintf(stderr, "Unknown command received\n");
-            send(client_sock, "Unknown command", strlen("Unknown command"), 0);
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept");
+            return;
+        }
+        Connection *conn = calloc(1, sizeof(Connection));
+        if (!conn)
+        {
+            perror("Failed to allocate connection");
+            close(new_socket);
+            continue;
+        }
+        conn->fd = new_socket;
+        conn->state = CONN_HANDSHAKE;
+        pthread_mutex_init(&conn->send_lock, NULL);
+        if (watch_connection(conn, EPOLL_CTL_ADD) < 0)
+        {
+            perror("epoll_ctl add");
+            close_connection(conn);
         }
     }
-    close(client_sock);
-    pthread_exit(NULL);
 }
 
+static int worker_count(void)
+{
+    const char *env = getenv("NM_WORKERS");
+    long count = env ? strtol(env, NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+}
+
+// Accepts client and storage connections and dispatches readable sessions
+// to a fixed pool of worker threads
 void *main_server_thread(void *arg)
 {
     const char *ip = (const char *)arg;
-    int server_fd, new_socket;
+    int server_fd;
     struct sockaddr_in address;
     int opt = 1;
-    int addrlen = sizeof(address);
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0)
+    if ((server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
     {
         perror("Socket failed");
         pthread_exit(NULL);
@@ -2017,82 +3413,298 @@ void *main_server_thread(void *arg)
         perror("bind failed");
         pthread_exit(NULL);
     }
-    if (listen(server_fd, MAX_CLIENTS) < 0)
+    if (listen(server_fd, LISTEN_BACKLOG) < 0)
     {
         perror("listen");
         pthread_exit(NULL);
     }
-    log_message("Main server thread running, waiting for connections...\n");
-    printf("Main server thread running, waiting for connections...\n");
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0)
+    {
+        perror("epoll_create1");
+        pthread_exit(NULL);
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL; // The listening socket is the only entry without a Connection
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) < 0)
+    {
+        perror("epoll_ctl listen");
+        pthread_exit(NULL);
+    }
+
+    int workers = worker_count();
+    for (int i = 0; i < workers; i++)
+    {
+        pthread_t worker;
+        if (pthread_create(&worker, NULL, reactor_worker, NULL) != 0)
+        {
+            perror("Failed to create worker thread");
+            pthread_exit(NULL);
+        }
+        pthread_detach(worker);
+    }
+    log_message("Main server thread running with %d workers, waiting for connections...\n", workers);
+    printf("Main server thread running with %d workers, waiting for connections...\n", workers);
 
     printf("Naming server started in IP AND PORT %s:%d\n", ip, PORT);
     log_message("Naming server started in IP AND PORT %s:%d\n", ip, PORT);
+    struct epoll_event events[MAX_EPOLL_EVENTS];
     while (1)
     {
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-        new_socket = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
-        if (new_socket < 0)
+        int ready = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+        if (ready < 0)
         {
-            perror("accept");
+            if (errno != EINTR)
+                perror("epoll_wait");
             continue;
         }
-        char buffer[BUFFER_SIZE] = {0};
-        read(new_socket, buffer, BUFFER_SIZE);
-        log_message("Received from client: %s\n", buffer);
-        printf("BUFFER: %s\n", buffer);
-
-        if (strncmp(buffer, "CLIENT", 6) == 0)
+        for (int i = 0; i < ready; i++)
         {
-            log_message("Client connection detected\n");
-            printf("Client connection detected.\n");
+            if (events[i].data.ptr == NULL)
+                accept_connections(server_fd);
+            else
+                work_queue_push((Connection *)events[i].data.ptr);
+        }
+    }
 
-            send(new_socket, "Connected to Naming Server\n", strlen("Connected to Naming Server\n"), 0);
+    return NULL;
+}
 
-            // Launch a new thread to handle the client request using handle_client
-            int *client_sock = malloc(sizeof(int));
-            *client_sock = new_socket;
-            pthread_t client_thread;
-            pthread_create(&client_thread, NULL, (void *)handle_client, (void *)client_sock);
-            pthread_detach(client_thread); // Detach to free resources after finishing
-        }
-        else if (strncmp(buffer, "STORAGE", 7) == 0)
-        {
-            log_message("Storage Server connection detected\n");
-            printf("Storage Server connection detected.\n");
+void send_command_to_storage(StorageServer *server, uint16_t command, const char *path)
+{
+    // Use the stored socket_fd to send command directly
+    pthread_mutex_lock(&server->send_lock);
+    proto_send_str(server->socket_fd, command, 0, path);
+    pthread_mutex_unlock(&server->send_lock);
+    log_message("Sent command %u for path '%s' to Storage Server\n", command, path);
+    printf("Sent command %u for path '%s' to Storage Server\n", command, path);
+}
 
-            // Create a separate thread for handling storage server registration
-            int *storage_sock = malloc(sizeof(int));
-            *storage_sock = new_socket;
+// Rebuilds one change from the metadata log at startup. Restored servers
+// are assumed to be up so lookups can be answered right away; each one takes
+// its connection back when it registers again.
+static void restore_record(uint8_t type, ProtoReader *record, void *data)
+{
+    (void)data;
+    if (type == WAL_MARK_TREE || type == WAL_REMOVE_PATH)
+    {
+        int is_deleted = type == WAL_MARK_TREE ? proto_get_u8(record) : 0;
+        const char *path = proto_get_str(record);
+        if (!path)
+            return;
+        if (type == WAL_REMOVE_PATH)
+            remove_path_from_trie(global_trie_root, path);
+        else if (is_deleted)
+            mark_subtree_as_deleted(global_trie_root, path);
+        else
+            mark_subtree_as_revived(global_trie_root, path);
+        return;
+    }
+    if (type == WAL_POLICY || type == WAL_VERSION)
+    {
+        const char *path = proto_get_str(record);
+        if (!path)
+            return;
+        if (type == WAL_POLICY)
+        {
+            ReplicaPolicy policy;
+            policy.copies = proto_get_u32(record);
+            policy.write_quorum = proto_get_u32(record);
+            policy.read_quorum = proto_get_u32(record);
+            if (!record->failed)
+                apply_policy(path, &policy);
+            return;
+        }
+        uint64_t version = proto_get_u64(record);
+        TrieLeaf *leaf = trie_search(global_trie_root, path);
+        if (leaf && !record->failed)
+            leaf->version = version;
+        return;
+    }
 
-            pthread_t storage_thread;
-            pthread_create(&storage_thread, NULL, handle_storage_connection_thread, (void *)storage_sock);
-            pthread_detach(storage_thread);
+    uint32_t slot = proto_get_u32(record);
+    if (record->failed || slot >= MAX_STORAGE_SERVERS || (type != WAL_SERVER && (int)slot >= server_count))
+    {
+        fprintf(stderr, "Skipping log record %u for unknown server %u\n", type, slot);
+        return;
+    }
+    StorageServer *server = &storage_servers[slot];
+    if (type == WAL_SERVER)
+    {
+        const char *ip = proto_get_str(record);
+        uint32_t port = proto_get_u32(record);
+        if (!ip)
+            return;
+        if ((int)slot >= server_count)
+        {
+            memset(server, 0, sizeof(StorageServer));
+            pthread_mutex_init(&server->send_lock, NULL);
+            pthread_mutex_init(&server->liveness_lock, NULL);
+            server_count = slot + 1;
         }
+        snprintf(server->ip, sizeof(server->ip), "%s", ip);
+        server->port = port;
+        server->socket_fd = -1;
+        server->is_server_down = 0;
+        server->lost_at_ms = heartbeat_now_ms(); // Until it registers again
+        place_server(server);
+    }
+    else if (type == WAL_CAPACITY)
+    {
+        server->capacity = proto_get_u64(record);
+        place_server(server);
+    }
+    else if (type == WAL_OWN_PATH || type == WAL_DISOWN_PATH)
+    {
+        const char *path = proto_get_str(record);
+        if (path && type == WAL_OWN_PATH)
+            append_server_path(server, path);
+        else if (path)
+            remove_server_path(server, path);
+    }
+    else if (type == WAL_REGISTRATION)
+    {
+        server->registration_generation = proto_get_u64(record);
+        server->manifest_digest = proto_get_u64(record);
+    }
+    else if (type == WAL_REPLICATE || type == WAL_REPLICATED)
+    {
+        const char *path = proto_get_str(record);
+        if (path && type == WAL_REPLICATE)
+            replication_enqueue(replication_queue, (int)slot, path);
+        else if (path)
+            replication_retire(replication_queue, (int)slot, path);
+    }
+    else if (type == WAL_PUT_PATH)
+    {
+        int is_directory = proto_get_u8(record);
+        int is_deleted = proto_get_u8(record);
+        const char *path = proto_get_str(record);
+        TrieLeaf *leaf = path ? trie_insert(global_trie_root, path, server, is_directory, NULL) : NULL;
+        if (leaf)
+            leaf->is_deleted = is_deleted;
     }
+}
 
-    return NULL;
+static int snapshot_leaf(TrieLeaf *leaf, void *data)
+{
+    (void)data;
+    StorageServer *server = leaf->server;
+    if (server != NULL)
+    {
+        record_put_path(wal_snapshot_add, server, leaf->key, leaf->is_directory, leaf->is_deleted);
+        if (leaf->version != 0)
+        {
+            record_version(wal_snapshot_add, leaf->key, leaf->version);
+        }
+    }
+    return 0;
 }
 
-void send_command_to_storage(const StorageServer *server, const char *command, const char *path)
+static int snapshot_replication(int source, const char *path, void *data)
 {
-    char buffer[BUFFER_SIZE];
-    snprintf(buffer, sizeof(buffer), "%s %s\n", command, path);
+    (void)data;
+    record_replication(wal_snapshot_add, WAL_REPLICATE, source, path);
+    return 0;
+}
 
-    // Use the stored socket_fd to send command directly
-    // printf("socket_fd is %d\n", server->socket_fd);
-    send(server->socket_fd, buffer, strlen(buffer), 0);
-    log_message("Sent command '%s' for path '%s' to Storage Server\n", command, path);
-    printf("Sent command '%s' for path '%s' to Storage Server\n", command, path);
+// Writes the servers, their path lists, every mapped path with its version,
+// the replication policies and the pending backup copies. Runs inside wal_begin(), so no change to this state is in
+// progress.
+static int write_snapshot(void *data)
+{
+    (void)data;
+    for (int i = 0; i < server_count; i++)
+    {
+        StorageServer *server = &storage_servers[i];
+        record_server(wal_snapshot_add, server);
+        record_capacity(wal_snapshot_add, server);
+        record_registration(wal_snapshot_add, server);
+        for (int j = 0; j < server->path_count; j++)
+        {
+            if (server->path_list[j] != NULL)
+            {
+                record_own_path(wal_snapshot_add, server, server->path_list[j]);
+            }
+        }
+    }
+    trie_iterate(global_trie_root, snapshot_leaf, NULL);
+    for (int i = 0; i < POLICY_BUCKETS; i++)
+    {
+        for (PolicyEntry *entry = policy_table[i]; entry; entry = entry->next)
+        {
+            record_policy(wal_snapshot_add, entry->path, &entry->policy);
+        }
+    }
+    replication_iterate(replication_queue, snapshot_replication, NULL);
+    return 0;
 }
 
 int main()
 {
-    global_trie_root = create_trie_node(NULL);
+    global_trie_root = create_trie();
+    storage_servers = calloc(MAX_STORAGE_SERVERS, sizeof(StorageServer));
+    const char *cache_size_env = getenv("NM_CACHE_SIZE");
+    size_t cache_size = cache_size_env ? strtoul(cache_size_env, NULL, 10) : CACHE_SIZE;
+    location_cache = location_cache_create(cache_size > 0 ? cache_size : CACHE_SIZE, CACHE_SHARDS);
+    replication_queue = replication_create(replicate_path, replication_done, NULL);
+    placement_ring = placement_create();
+    const char *pool_env = getenv("NM_POOL_MAX_IDLE");
+    server_pool = connpool_create(pool_env ? atoi(pool_env) : CONNPOOL_MAX_IDLE, CONNPOOL_IDLE_TIMEOUT_MS);
+    if (!storage_servers || !location_cache || !replication_queue || !placement_ring || !server_pool)
+    {
+        fprintf(stderr, "Failed to allocate naming server state\n");
+        exit(EXIT_FAILURE);
+    }
 
+    if (log_start("naming_server.log") < 0)
+    {
+        fprintf(stderr, "Logging to naming_server.log is disabled\n");
+    }
     log_message("Starting Naming Server...\n");
     printf("Starting Naming Server...\n");
 
+    // Replication defaults for paths with no policy of their own
+    const char *copies_env = getenv("NM_REPLICATION_FACTOR");
+    const char *write_quorum_env = getenv("NM_WRITE_QUORUM");
+    const char *read_quorum_env = getenv("NM_READ_QUORUM");
+    if (copies_env && atoi(copies_env) >= 1 && atoi(copies_env) <= MAX_REPLICAS)
+    {
+        default_policy.copies = atoi(copies_env);
+    }
+    if (write_quorum_env && atoi(write_quorum_env) >= 1 && atoi(write_quorum_env) <= default_policy.copies)
+    {
+        default_policy.write_quorum = atoi(write_quorum_env);
+    }
+    if (read_quorum_env && atoi(read_quorum_env) >= 1 && atoi(read_quorum_env) <= default_policy.copies)
+    {
+        default_policy.read_quorum = atoi(read_quorum_env);
+    }
+
+    long restored = wal_open(WAL_PATH, SNAPSHOT_PATH, restore_record, write_snapshot, NULL);
+    if (restored < 0)
+    {
+        fprintf(stderr, "Failed to restore the namespace from %s and %s\n", SNAPSHOT_PATH, WAL_PATH);
+        exit(EXIT_FAILURE);
+    }
+    log_message("Restored %ld metadata records: %d storage servers, %zu paths\n", restored, server_count, trie_size(global_trie_root));
+    printf("Restored %ld metadata records: %d storage servers, %zu paths\n", restored, server_count, trie_size(global_trie_root));
+
+    // Copies still pending from before a restart resume once the servers are back
+    const char *replication_env = getenv("NM_REPLICATION_WORKERS");
+    int replication_workers = replication_env ? atoi(replication_env) : REPLICATION_WORKERS;
+    if (replication_workers <= 0)
+    {
+        replication_workers = REPLICATION_WORKERS;
+    }
+    if (replication_start(replication_queue, replication_workers) < 0)
+    {
+        fprintf(stderr, "Failed to start replication workers\n");
+        exit(EXIT_FAILURE);
+    }
+    log_message("Replication running with %d workers, %zu copies pending\n", replication_workers, replication_pending(replication_queue));
+
     // Get the IP address using hostname -I
     char ip_buffer[BUFFER_SIZE];
     FILE *fp = popen("hostname -I", "r");
@@ -2115,6 +3727,66 @@ int main()
 
     // printf("My IP is %s\n", my_ip);
 
+    // Peers that disconnect mid-send must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // Every idle session holds a descriptor, so allow as many as permitted
+    struct rlimit fd_limit;
+    if (getrlimit(RLIMIT_NOFILE, &fd_limit) == 0 && fd_limit.rlim_cur < fd_limit.rlim_max)
+    {
+        fd_limit.rlim_cur = fd_limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &fd_limit);
+    }
+
+    // Failure detection: phi-accrual by default, NM_FAILURE_DETECTOR=timeout
+    // for a fixed timeout only
+    const char *detector_env = getenv("NM_FAILURE_DETECTOR");
+    const char *phi_env = getenv("NM_PHI_THRESHOLD");
+    const char *timeout_env = getenv("NM_HEARTBEAT_TIMEOUT_MS");
+    if (phi_env && atof(phi_env) > 0)
+    {
+        phi_threshold = atof(phi_env);
+    }
+    if (detector_env && strcmp(detector_env, "timeout") == 0)
+    {
+        phi_threshold = 0;
+    }
+    if (timeout_env && atoi(timeout_env) > 0)
+    {
+        heartbeat_timeout_ms = atoi(timeout_env);
+    }
+    const char *copy_workers_env = getenv("NM_COPY_WORKERS");
+    if (copy_workers_env && atoi(copy_workers_env) >= 1 && atoi(copy_workers_env) <= COPY_MAX_WORKERS)
+    {
+        copy_workers = atoi(copy_workers_env);
+    }
+    const char *repair_delay_env = getenv("NM_REPAIR_DELAY_MS");
+    const char *repair_rate_env = getenv("NM_REPAIR_RATE");
+    if (repair_delay_env && atoi(repair_delay_env) >= 0)
+    {
+        repair_delay_ms = atoi(repair_delay_env);
+    }
+    if (repair_rate_env && atoi(repair_rate_env) > 0)
+    {
+        repair_rate = atoi(repair_rate_env);
+    }
+    pthread_t repair;
+    if (pthread_create(&repair, NULL, repair_thread, NULL) != 0)
+    {
+        perror("Failed to start the repair scheduler");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(repair);
+
+    pthread_t detector_thread;
+    if (pthread_create(&detector_thread, NULL, failure_detector_thread, NULL) != 0)
+    {
+        perror("Failed to start the failure detector");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(detector_thread);
+    log_message("Failure detector: phi threshold %.1f, timeout %llu ms\n", phi_threshold, (unsigned long long)heartbeat_timeout_ms);
+
     pthread_t server_thread;
     pthread_mutex_init(&lock, NULL);
 
@@ -2124,9 +3796,15 @@ int main()
     // Wait for threads to finish
     pthread_join(server_thread, NULL);
 
+    replication_destroy(replication_queue);
+    wal_close();
     free_trie(global_trie_root);
+    location_cache_destroy(location_cache);
+    free(storage_servers);
+    placement_free(placement_ring);
 
     pthread_mutex_destroy(&lock);
+    log_stop();
 
     return 0;
 }
\ No newline at end of file
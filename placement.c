@@ -0,0 +1,237 @@
+#include "placement.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+typedef struct
+{
+    uint64_t point;
+    int node;
+} RingPoint;
+
+typedef struct
+{
+    int node;
+    uint32_t vnodes;
+    char *name;
+} RingMember;
+
+struct PlacementRing
+{
+    pthread_rwlock_t lock; // Lookups share it, membership changes take it exclusively
+    RingMember *members;
+    size_t member_count;
+    size_t member_capacity;
+    RingPoint *points; // Sorted by point
+    size_t point_count;
+};
+
+// FNV-1a
+static uint64_t hash_string(const char *s)
+{
+    uint64_t h = 1469598103934665603ULL;
+    for (const unsigned char *p = (const unsigned char *)s; *p; p++)
+    {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// MurmurHash3 finalizer, so similar names and paths land far apart
+static uint64_t mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static uint64_t vnode_point(uint64_t name_hash, uint32_t index)
+{
+    return mix(name_hash + (uint64_t)(index + 1) * 0x9E3779B97F4A7C15ULL);
+}
+
+static int compare_points(const void *a, const void *b)
+{
+    const RingPoint *x = (const RingPoint *)a;
+    const RingPoint *y = (const RingPoint *)b;
+    if (x->point != y->point)
+        return x->point < y->point ? -1 : 1;
+    return x->node - y->node;
+}
+
+// Lays out the virtual nodes of every member again. Called with the lock
+// held for writing.
+static int rebuild(PlacementRing *ring)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < ring->member_count; i++)
+        count += ring->members[i].vnodes;
+    RingPoint *points = count ? (RingPoint *)malloc(count * sizeof(RingPoint)) : NULL;
+    if (count && !points)
+    {
+        perror("Failed to allocate placement ring");
+        return -1;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < ring->member_count; i++)
+    {
+        uint64_t name_hash = hash_string(ring->members[i].name);
+        for (uint32_t v = 0; v < ring->members[i].vnodes; v++)
+        {
+            points[n].point = vnode_point(name_hash, v);
+            points[n].node = ring->members[i].node;
+            n++;
+        }
+    }
+    qsort(points, count, sizeof(RingPoint), compare_points);
+    free(ring->points);
+    ring->points = points;
+    ring->point_count = count;
+    return 0;
+}
+
+PlacementRing *placement_create(void)
+{
+    PlacementRing *ring = (PlacementRing *)calloc(1, sizeof(PlacementRing));
+    if (!ring)
+        return NULL;
+    pthread_rwlock_init(&ring->lock, NULL);
+    return ring;
+}
+
+void placement_free(PlacementRing *ring)
+{
+    if (!ring)
+        return;
+    for (size_t i = 0; i < ring->member_count; i++)
+        free(ring->members[i].name);
+    free(ring->members);
+    free(ring->points);
+    pthread_rwlock_destroy(&ring->lock);
+    free(ring);
+}
+
+uint32_t placement_vnodes_for_capacity(uint64_t capacity)
+{
+    if (capacity == 0)
+        return PLACEMENT_DEFAULT_VNODES;
+    uint64_t vnodes = capacity / PLACEMENT_BYTES_PER_VNODE;
+    if (vnodes < PLACEMENT_MIN_VNODES)
+        return PLACEMENT_MIN_VNODES;
+    if (vnodes > PLACEMENT_MAX_VNODES)
+        return PLACEMENT_MAX_VNODES;
+    return (uint32_t)vnodes;
+}
+
+static RingMember *find_member(PlacementRing *ring, int node)
+{
+    for (size_t i = 0; i < ring->member_count; i++)
+    {
+        if (ring->members[i].node == node)
+            return &ring->members[i];
+    }
+    return NULL;
+}
+
+int placement_set(PlacementRing *ring, int node, const char *name, uint32_t vnodes)
+{
+    pthread_rwlock_wrlock(&ring->lock);
+    RingMember *member = find_member(ring, node);
+    if (member && member->vnodes == vnodes && strcmp(member->name, name) == 0)
+    {
+        pthread_rwlock_unlock(&ring->lock);
+        return 0;
+    }
+    char *copy = strdup(name);
+    if (!copy)
+    {
+        pthread_rwlock_unlock(&ring->lock);
+        return -1;
+    }
+    if (!member)
+    {
+        if (ring->member_count == ring->member_capacity)
+        {
+            size_t capacity = ring->member_capacity ? ring->member_capacity * 2 : 16;
+            RingMember *grown = (RingMember *)realloc(ring->members, capacity * sizeof(RingMember));
+            if (!grown)
+            {
+                free(copy);
+                pthread_rwlock_unlock(&ring->lock);
+                return -1;
+            }
+            ring->members = grown;
+            ring->member_capacity = capacity;
+        }
+        member = &ring->members[ring->member_count++];
+        member->node = node;
+    }
+    else
+    {
+        free(member->name);
+    }
+    member->name = copy;
+    member->vnodes = vnodes;
+    int res = rebuild(ring) < 0 ? -1 : 1;
+    pthread_rwlock_unlock(&ring->lock);
+    return res;
+}
+
+int placement_remove(PlacementRing *ring, int node)
+{
+    pthread_rwlock_wrlock(&ring->lock);
+    RingMember *member = find_member(ring, node);
+    if (!member)
+    {
+        pthread_rwlock_unlock(&ring->lock);
+        return 0;
+    }
+    free(member->name);
+    *member = ring->members[--ring->member_count];
+    rebuild(ring);
+    pthread_rwlock_unlock(&ring->lock);
+    return 1;
+}
+
+size_t placement_member_count(PlacementRing *ring)
+{
+    pthread_rwlock_rdlock(&ring->lock);
+    size_t count = ring->member_count;
+    pthread_rwlock_unlock(&ring->lock);
+    return count;
+}
+
+size_t placement_lookup(PlacementRing *ring, const char *key, int *nodes, size_t max)
+{
+    uint64_t h = mix(hash_string(key));
+    pthread_rwlock_rdlock(&ring->lock);
+    if (max > ring->member_count)
+        max = ring->member_count;
+    // First virtual node at or after the key's point, wrapping around
+    size_t lo = 0, hi = ring->point_count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ring->points[mid].point < h)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    size_t found = 0;
+    for (size_t i = 0; i < ring->point_count && found < max; i++)
+    {
+        int node = ring->points[(lo + i) % ring->point_count].node;
+        size_t j = 0;
+        while (j < found && nodes[j] != node)
+            j++;
+        if (j == found)
+            nodes[found++] = node;
+    }
+    pthread_rwlock_unlock(&ring->lock);
+    return found;
+}
@@ -0,0 +1,41 @@
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Consistent-hash placement for the naming server. Every storage server
+// owns a number of virtual nodes on a 64-bit hash ring, proportional to the
+// capacity it declares. A path hashes to a point on the ring, and walking
+// clockwise from there gives its preference list: the distinct servers in
+// the order they should hold it (the first as primary, the next ones as
+// backups). Virtual node positions depend only on the server's name, so
+// adding or removing a server only changes the lists of the paths whose
+// points fall next to its virtual nodes, about 1/N of them.
+
+#define PLACEMENT_BYTES_PER_VNODE (1ULL << 28) // One virtual node per 256 MiB of capacity
+#define PLACEMENT_MIN_VNODES 64
+#define PLACEMENT_MAX_VNODES 8192
+#define PLACEMENT_DEFAULT_VNODES 256 // For servers that declare no capacity
+
+typedef struct PlacementRing PlacementRing;
+
+PlacementRing *placement_create(void);
+void placement_free(PlacementRing *ring);
+
+// Virtual nodes for a server of the given capacity in bytes (0 if unknown)
+uint32_t placement_vnodes_for_capacity(uint64_t capacity);
+
+// Adds a server, or changes its weight. The name (e.g. "ip:port") seeds the
+// virtual node positions. Returns 1 if the ring changed, 0 if it already
+// held the server with this weight, -1 on allocation failure.
+int placement_set(PlacementRing *ring, int node, const char *name, uint32_t vnodes);
+// Returns 1 if the server was on the ring
+int placement_remove(PlacementRing *ring, int node);
+size_t placement_member_count(PlacementRing *ring);
+
+// Fills nodes with up to max distinct servers in preference order for key.
+// Returns how many were filled.
+size_t placement_lookup(PlacementRing *ring, const char *key, int *nodes, size_t max);
+
+#endif // PLACEMENT_H
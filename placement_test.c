@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "placement.h"
+
+// Standalone test of the naming server's consistent-hash placement:
+//   gcc -o placement_test placement_test.c placement.c -lpthread && ./placement_test
+
+#define KEYS 20000
+#define MAX_NODES 8
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+    if (ok) {
+        printf("✅ %s\n", what);
+    } else {
+        printf("❌ %s\n", what);
+        failures++;
+    }
+}
+
+static const char *key_name(int i) {
+    static char key[64];
+    snprintf(key, sizeof(key), "dir%d/file%d.txt", i % 97, i);
+    return key;
+}
+
+static void set_node(PlacementRing *ring, int node, uint32_t vnodes) {
+    char name[32];
+    snprintf(name, sizeof(name), "10.0.0.%d:%d", node + 1, 9000 + node);
+    placement_set(ring, node, name, vnodes);
+}
+
+// The primary of every key
+static void primaries(PlacementRing *ring, int *owner) {
+    for (int i = 0; i < KEYS; i++) {
+        owner[i] = -1;
+        placement_lookup(ring, key_name(i), &owner[i], 1);
+    }
+}
+
+static void count_owners(const int *owner, int *counts) {
+    memset(counts, 0, sizeof(int) * MAX_NODES);
+    for (int i = 0; i < KEYS; i++) {
+        if (owner[i] >= 0 && owner[i] < MAX_NODES) {
+            counts[owner[i]]++;
+        }
+    }
+}
+
+int main() {
+    printf("=== Placement Ring Test ===\n");
+    PlacementRing *ring = placement_create();
+    int nodes[MAX_NODES];
+    static int before[KEYS], after[KEYS];
+    int counts[MAX_NODES];
+    char what[128];
+
+    printf("\n🔎 Lookups...\n");
+    check(placement_lookup(ring, "a.txt", nodes, 3) == 0, "an empty ring places nothing");
+    for (int n = 0; n < 4; n++) {
+        set_node(ring, n, PLACEMENT_DEFAULT_VNODES);
+    }
+    check(placement_member_count(ring) == 4, "four servers are on the ring");
+
+    int distinct = 1, stable = 1;
+    for (int i = 0; i < 1000; i++) {
+        int again[MAX_NODES];
+        size_t found = placement_lookup(ring, key_name(i), nodes, 3);
+        if (found != 3 || nodes[0] == nodes[1] || nodes[0] == nodes[2] || nodes[1] == nodes[2]) {
+            distinct = 0;
+        }
+        if (placement_lookup(ring, key_name(i), again, 3) != found || memcmp(nodes, again, sizeof(int) * found) != 0) {
+            stable = 0;
+        }
+    }
+    check(distinct, "a preference list holds distinct servers");
+    check(stable, "the same key always gets the same list");
+    check(placement_lookup(ring, "a.txt", nodes, MAX_NODES) == 4, "asking for more servers than exist gives them all");
+
+    // The positions depend only on the names, not on the order servers came in
+    PlacementRing *other = placement_create();
+    for (int n = 3; n >= 0; n--) {
+        set_node(other, n, PLACEMENT_DEFAULT_VNODES);
+    }
+    primaries(ring, before);
+    primaries(other, after);
+    check(memcmp(before, after, sizeof(before)) == 0, "a ring built in another order places keys the same way");
+    placement_free(other);
+
+    printf("\n⚖️  Weights...\n");
+    count_owners(before, counts);
+    int even = 1;
+    for (int n = 0; n < 4; n++) {
+        if (counts[n] < KEYS / 4 * 0.75 || counts[n] > KEYS / 4 * 1.25) {
+            even = 0;
+        }
+    }
+    snprintf(what, sizeof(what), "equal servers get similar shares (%d %d %d %d)", counts[0], counts[1], counts[2],
+             counts[3]);
+    check(even, what);
+
+    check(placement_vnodes_for_capacity(0) == PLACEMENT_DEFAULT_VNODES, "a server with no capacity gets the default");
+    check(placement_vnodes_for_capacity(1) == PLACEMENT_MIN_VNODES, "a tiny server gets the minimum");
+    check(placement_vnodes_for_capacity(1ULL << 50) == PLACEMENT_MAX_VNODES, "a huge server gets the maximum");
+    check(placement_vnodes_for_capacity(PLACEMENT_BYTES_PER_VNODE * 1024) ==
+              2 * placement_vnodes_for_capacity(PLACEMENT_BYTES_PER_VNODE * 512),
+          "twice the capacity gets twice the virtual nodes");
+
+    check(placement_set(ring, 0, "10.0.0.1:9000", PLACEMENT_DEFAULT_VNODES) == 0, "setting an unchanged server is a no-op");
+    check(placement_set(ring, 0, "10.0.0.1:9000", PLACEMENT_DEFAULT_VNODES * 3) == 1, "changing a weight changes the ring");
+    primaries(ring, after);
+    count_owners(after, counts);
+    // Three times the weight of each of the other three: half the keys
+    snprintf(what, sizeof(what), "a triple-weight server gets about half the keys (%d)", counts[0]);
+    check(counts[0] > KEYS * 0.4 && counts[0] < KEYS * 0.6, what);
+    set_node(ring, 0, PLACEMENT_DEFAULT_VNODES);
+
+    printf("\n🔀 Membership changes...\n");
+    primaries(ring, before);
+    set_node(ring, 4, PLACEMENT_DEFAULT_VNODES);
+    primaries(ring, after);
+    int moved = 0, elsewhere = 0;
+    for (int i = 0; i < KEYS; i++) {
+        if (before[i] != after[i]) {
+            moved++;
+            elsewhere += after[i] != 4;
+        }
+    }
+    snprintf(what, sizeof(what), "adding a fifth server moves about 1/5 of the keys (%d)", moved);
+    check(moved > KEYS / 5 * 0.7 && moved < KEYS / 5 * 1.3, what);
+    check(elsewhere == 0, "keys only move onto the new server");
+
+    placement_remove(ring, 4);
+    primaries(ring, after);
+    check(memcmp(before, after, sizeof(before)) == 0, "removing it again restores the old placement");
+
+    check(placement_remove(ring, 2) == 1 && placement_remove(ring, 2) == 0, "a server is removed once");
+    primaries(ring, after);
+    moved = 0;
+    elsewhere = 0;
+    for (int i = 0; i < KEYS; i++) {
+        if (before[i] != after[i]) {
+            moved++;
+            elsewhere += before[i] != 2;
+        }
+        if (after[i] == 2) {
+            elsewhere++;
+        }
+    }
+    check(moved > 0 && elsewhere == 0, "removing a server only moves its own keys");
+
+    // The backups of a key are the servers after its primary, so losing the
+    // primary promotes the first backup
+    set_node(ring, 2, PLACEMENT_DEFAULT_VNODES);
+    int promoted = 1;
+    for (int i = 0; i < 1000; i++) {
+        int list[3], later[2];
+        placement_lookup(ring, key_name(i), list, 3);
+        placement_remove(ring, list[0]);
+        placement_lookup(ring, key_name(i), later, 2);
+        if (later[0] != list[1] || later[1] != list[2]) {
+            promoted = 0;
+        }
+        set_node(ring, list[0], PLACEMENT_DEFAULT_VNODES);
+    }
+    check(promoted, "when a primary leaves, its backups move up in order");
+
+    placement_free(ring);
+    printf("\n%s %d failure(s)\n", failures ? "❌" : "🎉", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,503 @@
+#include "protocol.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+
+#define PROTO_SEND_TIMEOUT_MS 5000 // Give up on a peer that stops reading for this long
+
+static void put_be16(unsigned char *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void put_be32(unsigned char *p, uint32_t v)
+{
+    for (int i = 3; i >= 0; i--, v >>= 8)
+        p[i] = v;
+}
+
+static void put_be64(unsigned char *p, uint64_t v)
+{
+    for (int i = 7; i >= 0; i--, v >>= 8)
+        p[i] = v;
+}
+
+static uint16_t get_be16(const unsigned char *p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t get_be32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static uint64_t get_be64(const unsigned char *p)
+{
+    return (uint64_t)get_be32(p) << 32 | get_be32(p + 4);
+}
+
+// Waits for buffer space on a non-blocking socket. Returns 0 once there is
+// some, -1 on timeout.
+static int wait_writable(int sock)
+{
+    struct pollfd pfd = {.fd = sock, .events = POLLOUT};
+    return poll(&pfd, 1, PROTO_SEND_TIMEOUT_MS) > 0 ? 0 : -1;
+}
+
+// Sends every iovec, waiting for buffer space on non-blocking sockets.
+// flags are added to MSG_NOSIGNAL.
+static int send_iov(int sock, struct iovec *iov, int iovcnt, int flags)
+{
+    while (iovcnt > 0)
+    {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL | flags);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_writable(sock) == 0)
+                continue;
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)sent >= iov->iov_len)
+        {
+            sent -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+    return 0;
+}
+
+// Sends one message with a single system call in the common case.
+// Returns 0 on success, -1 on error.
+int proto_send(int sock, uint16_t opcode, uint16_t flags, uint32_t request_id, const void *payload, size_t len)
+{
+    unsigned char raw[PROTO_HEADER_SIZE];
+    put_be16(raw, opcode);
+    put_be16(raw + 2, flags);
+    put_be32(raw + 4, request_id);
+    put_be64(raw + 8, len);
+    struct iovec iov[2] = {{raw, PROTO_HEADER_SIZE}, {(void *)payload, len}};
+    return send_iov(sock, iov, len ? 2 : 1, 0);
+}
+
+// Sends len bytes of an open file from offset as DATA messages of up to
+// PROTO_FILE_CHUNK_SIZE bytes. Each header is sent with MSG_MORE and the
+// bytes after it with sendfile(), so the content goes from the page cache
+// to the socket without passing through user space. A file that turns out
+// shorter than len leaves a DATA message that cannot be completed, so the
+// connection is shut down. Returns 0 on success, -1 on error.
+int proto_send_file(int sock, uint32_t request_id, int fd, off_t offset, uint64_t len)
+{
+    while (len > 0)
+    {
+        size_t chunk = len < PROTO_FILE_CHUNK_SIZE ? (size_t)len : PROTO_FILE_CHUNK_SIZE;
+        unsigned char raw[PROTO_HEADER_SIZE];
+        put_be16(raw, PROTO_DATA);
+        put_be16(raw + 2, 0);
+        put_be32(raw + 4, request_id);
+        put_be64(raw + 8, chunk);
+        struct iovec iov = {raw, PROTO_HEADER_SIZE};
+        if (send_iov(sock, &iov, 1, MSG_MORE) < 0)
+            return -1;
+        size_t left = chunk;
+        while (left > 0)
+        {
+            ssize_t sent = sendfile(sock, fd, &offset, left);
+            if (sent < 0 && errno == EINTR)
+                continue;
+            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && wait_writable(sock) == 0)
+                continue;
+            if (sent <= 0)
+            {
+                shutdown(sock, SHUT_RDWR);
+                return -1;
+            }
+            left -= sent;
+        }
+        len -= chunk;
+    }
+    return 0;
+}
+
+// Sends a message whose payload is a single string (requests on a path,
+// OK and ERROR replies)
+int proto_send_str(int sock, uint16_t opcode, uint32_t request_id, const char *str)
+{
+    ProtoWriter writer;
+    proto_writer_init(&writer);
+    proto_put_str(&writer, str);
+    int res = proto_send_writer(sock, opcode, 0, request_id, &writer);
+    proto_writer_free(&writer);
+    return res;
+}
+
+int proto_send_writer(int sock, uint16_t opcode, uint16_t flags, uint32_t request_id, const ProtoWriter *writer)
+{
+    if (writer->failed)
+        return -1;
+    return proto_send(sock, opcode, flags, request_id, writer->data, writer->len);
+}
+
+void proto_batch_init(ProtoBatch *batch, int sock)
+{
+    batch->sock = sock;
+    batch->messages = 0;
+    batch->iovcnt = 0;
+    batch->failed = 0;
+    batch->scratch_used = 0;
+}
+
+// Queues one message. Returns 0 on success, -1 if the connection failed.
+int proto_batch_add(ProtoBatch *batch, uint16_t opcode, uint32_t request_id, const ProtoWriter *head, const void *body, size_t body_len)
+{
+    if (batch->failed || head->failed || head->len > PROTO_BATCH_HEAD_MAX)
+        return -1;
+    unsigned char *raw = batch->scratch + batch->scratch_used;
+    put_be16(raw, opcode);
+    put_be16(raw + 2, 0);
+    put_be32(raw + 4, request_id);
+    put_be64(raw + 8, head->len + body_len);
+    memcpy(raw + PROTO_HEADER_SIZE, head->data, head->len);
+    batch->scratch_used += PROTO_HEADER_SIZE + head->len;
+
+    batch->iov[batch->iovcnt].iov_base = raw;
+    batch->iov[batch->iovcnt++].iov_len = PROTO_HEADER_SIZE + head->len;
+    if (body_len)
+    {
+        batch->iov[batch->iovcnt].iov_base = (void *)body;
+        batch->iov[batch->iovcnt++].iov_len = body_len;
+    }
+    if (++batch->messages == PROTO_BATCH_MESSAGES)
+        return proto_batch_flush(batch);
+    return 0;
+}
+
+// Sends everything queued. Returns 0 on success, -1 on error.
+int proto_batch_flush(ProtoBatch *batch)
+{
+    if (batch->failed)
+        return -1;
+    if (batch->iovcnt && send_iov(batch->sock, batch->iov, batch->iovcnt, 0) < 0)
+        batch->failed = 1;
+    batch->messages = 0;
+    batch->iovcnt = 0;
+    batch->scratch_used = 0;
+    return batch->failed ? -1 : 0;
+}
+
+static int grow_payload(ProtoMessage *msg, size_t capacity)
+{
+    if (msg->capacity >= capacity)
+        return 0;
+    char *payload = (char *)realloc(msg->payload, capacity);
+    if (!payload)
+    {
+        perror("Failed to allocate message payload");
+        return -1;
+    }
+    msg->payload = payload;
+    msg->capacity = capacity;
+    return 0;
+}
+
+static int check_payload(const ProtoMessage *msg, uint64_t max_payload)
+{
+    if (msg->header.payload_len > max_payload)
+    {
+        fprintf(stderr, "Protocol error: payload of %llu bytes\n", (unsigned long long)msg->header.payload_len);
+        return -1;
+    }
+    return 0;
+}
+
+// Makes room for the payload of a decoded header
+static int reserve_payload(ProtoMessage *msg, uint64_t max_payload)
+{
+    uint64_t len = msg->header.payload_len;
+    if (check_payload(msg, max_payload) < 0 || grow_payload(msg, len + 1) < 0)
+        return -1;
+    msg->payload[len] = '\0';
+    return 0;
+}
+
+static void decode_header(ProtoMessage *msg)
+{
+    msg->header.opcode = get_be16(msg->raw);
+    msg->header.flags = get_be16(msg->raw + 2);
+    msg->header.request_id = get_be32(msg->raw + 4);
+    msg->header.payload_len = get_be64(msg->raw + 8);
+}
+
+// Reads exactly len bytes from a blocking socket.
+// Returns 1 on success, 0 on EOF before the first byte, -1 otherwise.
+static int recv_full(int sock, void *buf, size_t len)
+{
+    size_t got = 0;
+    while (got < len)
+    {
+        ssize_t n = recv(sock, (char *)buf + got, len - got, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return (n == 0 && got == 0) ? 0 : -1;
+        got += n;
+    }
+    return 1;
+}
+
+// Receives one whole message from a blocking socket.
+// Returns 1 on success, 0 if the peer closed the connection between
+// messages, -1 on error or a truncated message.
+int proto_recv(int sock, ProtoMessage *msg)
+{
+    return proto_recv_max(sock, msg, PROTO_MAX_PAYLOAD);
+}
+
+// Like proto_recv, but a message with a payload above max_payload is an
+// error, found before any memory is set aside for it
+int proto_recv_max(int sock, ProtoMessage *msg, uint64_t max_payload)
+{
+    int res = recv_full(sock, msg->raw, PROTO_HEADER_SIZE);
+    if (res <= 0)
+        return res;
+    decode_header(msg);
+    if (reserve_payload(msg, max_payload) < 0)
+        return -1;
+    if (msg->header.payload_len && recv_full(sock, msg->payload, msg->header.payload_len) != 1)
+        return -1;
+    return 1;
+}
+
+// Receives on a non-blocking socket, resuming where the previous call left
+// off. Never reads past the end of the current message. A message with a
+// payload above max_payload is an error; the payload buffer grows as the
+// bytes arrive, so a header alone never claims more than
+// PROTO_PARTIAL_STEP.
+// Returns 1 once a whole message is available, 0 if the socket ran dry
+// first, -1 on EOF or error.
+int proto_recv_partial(int sock, ProtoMessage *msg, uint64_t max_payload)
+{
+    while (1)
+    {
+        char *dest;
+        size_t want;
+        if (msg->received < PROTO_HEADER_SIZE)
+        {
+            dest = (char *)msg->raw + msg->received;
+            want = PROTO_HEADER_SIZE - msg->received;
+        }
+        else
+        {
+            size_t got = msg->received - PROTO_HEADER_SIZE;
+            size_t len = msg->header.payload_len;
+            if (got == len)
+            {
+                msg->payload[len] = '\0';
+                msg->received = 0;
+                return 1;
+            }
+            if (got + 1 >= msg->capacity)
+            {
+                size_t step = msg->capacity > PROTO_PARTIAL_STEP ? msg->capacity : PROTO_PARTIAL_STEP;
+                if (grow_payload(msg, len - got < step ? len + 1 : got + 1 + step) < 0)
+                    return -1;
+            }
+            dest = msg->payload + got;
+            want = len - got;
+            if (want > msg->capacity - 1 - got)
+                want = msg->capacity - 1 - got;
+        }
+        ssize_t n = recv(sock, dest, want, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (n <= 0)
+            return -1;
+        msg->received += n;
+        if (msg->received == PROTO_HEADER_SIZE)
+        {
+            decode_header(msg);
+            size_t len = msg->header.payload_len;
+            if (check_payload(msg, max_payload) < 0 ||
+                grow_payload(msg, len < PROTO_PARTIAL_STEP ? len + 1 : PROTO_PARTIAL_STEP) < 0)
+                return -1;
+        }
+    }
+}
+
+void proto_message_free(ProtoMessage *msg)
+{
+    free(msg->payload);
+    msg->payload = NULL;
+    msg->capacity = 0;
+    msg->received = 0;
+}
+
+void proto_writer_init(ProtoWriter *writer)
+{
+    writer->data = NULL;
+    writer->len = 0;
+    writer->capacity = 0;
+    writer->failed = 0;
+}
+
+// Empties the writer but keeps its buffer for the next message
+void proto_writer_reset(ProtoWriter *writer)
+{
+    writer->len = 0;
+    writer->failed = 0;
+}
+
+void proto_writer_free(ProtoWriter *writer)
+{
+    free(writer->data);
+    proto_writer_init(writer);
+}
+
+static char *writer_reserve(ProtoWriter *writer, size_t len)
+{
+    if (writer->failed)
+        return NULL;
+    if (writer->len + len > writer->capacity)
+    {
+        size_t capacity = writer->capacity ? writer->capacity : 256;
+        while (capacity < writer->len + len)
+            capacity *= 2;
+        char *data = (char *)realloc(writer->data, capacity);
+        if (!data)
+        {
+            perror("Failed to grow message buffer");
+            writer->failed = 1;
+            return NULL;
+        }
+        writer->data = data;
+        writer->capacity = capacity;
+    }
+    char *dest = writer->data + writer->len;
+    writer->len += len;
+    return dest;
+}
+
+void proto_put_u8(ProtoWriter *writer, uint8_t value)
+{
+    char *dest = writer_reserve(writer, 1);
+    if (dest)
+        *dest = value;
+}
+
+void proto_put_u32(ProtoWriter *writer, uint32_t value)
+{
+    char *dest = writer_reserve(writer, 4);
+    if (dest)
+        put_be32((unsigned char *)dest, value);
+}
+
+void proto_put_u64(ProtoWriter *writer, uint64_t value)
+{
+    char *dest = writer_reserve(writer, 8);
+    if (dest)
+        put_be64((unsigned char *)dest, value);
+}
+
+void proto_put_str(ProtoWriter *writer, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    proto_put_u32(writer, len);
+    proto_put_bytes(writer, str, len);
+}
+
+void proto_put_bytes(ProtoWriter *writer, const void *data, size_t len)
+{
+    char *dest = writer_reserve(writer, len);
+    if (dest && len)
+        memcpy(dest, data, len);
+}
+
+void proto_reader_init(ProtoReader *reader, const ProtoMessage *msg)
+{
+    reader->pos = msg->payload;
+    reader->end = msg->payload + msg->header.payload_len;
+    reader->failed = 0;
+}
+
+static const char *reader_take(ProtoReader *reader, size_t len)
+{
+    if (reader->failed || (size_t)(reader->end - reader->pos) < len)
+    {
+        reader->failed = 1;
+        return NULL;
+    }
+    const char *p = reader->pos;
+    reader->pos += len;
+    return p;
+}
+
+uint8_t proto_get_u8(ProtoReader *reader)
+{
+    const char *p = reader_take(reader, 1);
+    return p ? (uint8_t)*p : 0;
+}
+
+uint32_t proto_get_u32(ProtoReader *reader)
+{
+    const char *p = reader_take(reader, 4);
+    return p ? get_be32((const unsigned char *)p) : 0;
+}
+
+uint64_t proto_get_u64(ProtoReader *reader)
+{
+    const char *p = reader_take(reader, 8);
+    return p ? get_be64((const unsigned char *)p) : 0;
+}
+
+// Returns a pointer into the payload, or NULL if the string is malformed
+const char *proto_get_str(ProtoReader *reader)
+{
+    uint32_t len = proto_get_u32(reader);
+    if (reader->failed || len == 0)
+    {
+        reader->failed = 1;
+        return NULL;
+    }
+    const char *str = reader_take(reader, len);
+    if (!str || str[len - 1] != '\0' || memchr(str, '\0', len) != str + len - 1)
+    {
+        reader->failed = 1;
+        return NULL;
+    }
+    return str;
+}
+
+// Returns a pointer to the next len bytes, or NULL if the payload is shorter
+const char *proto_get_bytes(ProtoReader *reader, size_t len)
+{
+    return reader_take(reader, len);
+}
+
+// Returns whatever is left of the payload (file content)
+const char *proto_get_rest(ProtoReader *reader, size_t *len)
+{
+    *len = reader->failed ? 0 : (size_t)(reader->end - reader->pos);
+    const char *rest = reader->pos;
+    reader->pos = reader->end;
+    return rest;
+}
@@ -0,0 +1,215 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Wire protocol shared by the naming server, storage servers and clients.
+// Every message is a fixed 16-byte header followed by payload_len bytes:
+//
+//   u16 opcode | u16 flags | u32 request_id | u64 payload_len
+//
+// All integers are big-endian. Strings in a payload are a u32 length that
+// counts the terminating NUL, followed by the bytes and the NUL, so a reader
+// can hand out pointers into the received payload without copying. File
+// content travels as raw bytes (one WRITE/STORE payload, or a stream of DATA
+// messages closed by END), so it may be of any size and contain any byte.
+// Replies carry the request_id of the request they answer.
+
+#define PROTO_HEADER_SIZE 16
+#define PROTO_MAX_PAYLOAD (1ULL << 30) // Larger messages are treated as corrupt
+#define PROTO_PARTIAL_STEP (64 << 10)  // Payload buffer growth while a message arrives in parts
+#define PROTO_CHUNK_SIZE 65536         // Payload size of one DATA message built in memory
+#define PROTO_FILE_CHUNK_SIZE (1 << 20) // Payload size of one DATA message sent from a file
+#define PROTO_BATCH_MESSAGES 256       // Messages gathered into one sendmsg() by a ProtoBatch
+#define PROTO_BATCH_HEAD_MAX 16        // Largest copied part of a batched payload
+
+enum
+{
+    // Session setup
+    PROTO_CLIENT_HELLO = 1, // client -> NS
+    PROTO_STORAGE_HELLO,    // SS -> NS: str ip, u32 client port, u64 registration generation, u64 manifest digest, u64 capacity in bytes
+    PROTO_WELCOME,          // NS -> client: u64 session token; NS -> SS: empty, PROTO_FLAG_FULL_LIST asks for every path
+    PROTO_FILE_LIST,        // SS -> NS: (u8 is_directory, str path) entries up to the end of the payload
+
+    // Requests: sent to the NS to locate or change a path, and to a SS to
+    // operate on the file itself
+    PROTO_READ,        // str path
+    PROTO_WRITE,       // to SS: u64 session token, str path, [PROTO_FLAG_QUORUM: u32 write quorum,
+                       // u32 replica count, (str ip, u32 port) each], data (rest of payload);
+                       // PROTO_FLAG_STREAM sends the data as DATA messages closed by END instead
+    PROTO_INFO,        // str path
+    PROTO_STREAM,      // str path
+    PROTO_LIST,        // str directory, optional u32 page size, optional str cursor
+    PROTO_CREATE_DIR,  // str path
+    PROTO_CREATE_FILE, // str path
+    PROTO_DELETE,      // str path
+    PROTO_COPY,        // str source, str destination
+    PROTO_STOP,        // empty
+
+    // NS -> SS replication
+    PROTO_FETCH, // str path; answered with DATA... END
+    PROTO_STORE, // str path, content (rest of payload); PROTO_FLAG_DIRECTORY creates a directory,
+                 // PROTO_FLAG_MORE sends a file in parts
+
+    // Replies
+    PROTO_OK,         // str message
+    PROTO_ERROR,      // str message
+    PROTO_LOCATION,   // str ip, u32 port, u32 read or write quorum, then (str ip, u32 port) of
+                      // the other replicas: read alternatives, or the write's replica chain
+    PROTO_LIST_ENTRY, // u8 is_directory, str path
+    PROTO_LIST_END,   // optional str cursor, present if more entries follow
+    PROTO_DATA,       // raw bytes
+    PROTO_END,        // empty, ends a DATA stream
+
+    // SS -> NS write notifications, forwarded by the NS to the writing client
+    PROTO_WRITE_DONE,     // str path, u32 replicas the write was pushed to
+    PROTO_ASYNC_PROGRESS, // u64 session token, str path
+    PROTO_ASYNC_DONE,     // u64 session token, str path
+    PROTO_ASYNC_FAILED,   // u64 session token, str path
+
+    // Registration after WELCOME: any number of FILE_LIST and FILE_REMOVED
+    // batches, closed by FILE_LIST_END, which the NS acknowledges once the
+    // paths are recorded
+    PROTO_FILE_REMOVED,  // SS -> NS: str path entries up to the end of the payload
+    PROTO_FILE_LIST_END, // SS -> NS: u64 new registration generation, u64 manifest digest
+    PROTO_REGISTERED,    // NS -> SS: u64 registration generation
+
+    // Replica push: the NS asks the primary to copy a path down a chain of
+    // backups. Each hop answers a file PUSH with the SIGNATURES of its
+    // current copy, receives DELTA... END, rebuilds the file and pushes it
+    // on to the next hop the same way; every hop answers REPLICATED once the
+    // rest of the chain has. The primary reports to the NS on its
+    // registration connection.
+    PROTO_REPLICATE,  // NS -> SS: str path, then (str ip, u32 port) of each backup in chain order
+    PROTO_PUSH,       // SS -> SS: str path, u64 content hash, u64 stamp, then (str ip, u32 port) of the hops after this one
+    PROTO_REPLICATED, // u32 copies made, str path
+    PROTO_SIGNATURES, // SS -> SS: block signatures of the current copy, see delta.h
+    PROTO_DELTA,      // SS -> SS: delta operations, see delta.h
+
+    // Replication policy of a path and everything below it without its own
+    PROTO_SET_REPLICATION, // client -> NS: str path, u32 copies (0 to inherit), u32 write quorum, u32 read quorum
+
+    PROTO_HEARTBEAT, // SS -> NS, periodically: u32 requests in flight, u32 recent mean service time in microseconds
+
+    PROTO_REPAIR_STATUS, // client -> NS: str (ignored); replied with OK and a progress message
+
+    // Many path requests in one round trip. The NS runs them in order and
+    // answers each with what it would send for it alone.
+    PROTO_BATCH,       // client -> NS: u32 count, then (u32 opcode, str path) each; READ, WRITE, INFO, STREAM,
+                       // CREATE_DIR, CREATE_FILE or DELETE
+    PROTO_BATCH_RESULT, // NS -> client: u32 count, then (u32 reply opcode, u32 length, reply payload) each
+
+    PROTO_COPY_PROGRESS, // NS -> client, during a COPY: u64 paths copied, u64 bytes copied
+
+    // Ranged requests: located at the NS like READ and WRITE (str path),
+    // then sent to the SS, which works on the file in place. Ranged writes
+    // are always synchronous.
+    PROTO_READ_RANGE,  // to SS: str path, u64 offset, u64 length (0 for up to the end); answered with DATA... END
+    PROTO_WRITE_RANGE, // to SS: u64 session token, str path, u64 offset, [PROTO_FLAG_QUORUM fields as for WRITE], data
+    PROTO_APPEND,      // to SS: u64 session token, str path, [PROTO_FLAG_QUORUM fields as for WRITE], data
+
+    // Range push: a backup whose copy is at a stamp the sender's range log
+    // reaches is sent only the ranges written since, as RANGE... END; any
+    // other backup is sent nothing, and the sender pushes the whole file
+    PROTO_PUSH_RANGE, // SS -> SS: str path, then (str ip, u32 port) of the hops after this one; answered with
+                      // OK: u64 stamp of the current copy, 0 if unknown
+    PROTO_RANGE,      // SS -> SS: u64 offset, bytes; the END after the last carries u64 file size, u64 stamp
+
+    // Like ASYNC_DONE, but the new content may not survive a crash of the
+    // SS, which then carries the write out again at its next start
+    PROTO_ASYNC_UNSYNCED // SS -> NS -> client: u64 session token, str path
+};
+
+#define PROTO_FLAG_DIRECTORY 0x1 // STORE, REPLICATE, PUSH: the path is a directory
+#define PROTO_FLAG_SYNC 0x2      // WRITE: write synchronously whatever the size
+#define PROTO_FLAG_FULL_LIST 0x4 // WELCOME: the NS does not know this server's manifest; send all paths
+#define PROTO_FLAG_QUORUM 0x8    // WRITE: a synchronous write is pushed to replicas before it is acknowledged
+#define PROTO_FLAG_MORE 0x10     // STORE: more of the file follows in further STOREs; only the last is answered
+#define PROTO_FLAG_STREAM 0x20   // WRITE: the data follows in DATA messages of at most PROTO_FILE_CHUNK_SIZE bytes
+
+typedef struct
+{
+    uint16_t opcode;
+    uint16_t flags;
+    uint32_t request_id;
+    uint64_t payload_len;
+} ProtoHeader;
+
+// A received message. The payload buffer is reused by later receives into
+// the same struct and is always NUL-terminated one byte past payload_len.
+typedef struct
+{
+    ProtoHeader header;
+    char *payload;
+    size_t capacity;
+    size_t received; // Progress of proto_recv_partial
+    unsigned char raw[PROTO_HEADER_SIZE];
+} ProtoMessage;
+
+// Builds a payload
+typedef struct
+{
+    char *data;
+    size_t len;
+    size_t capacity;
+    int failed; // Set if an allocation failed; sending a failed writer is an error
+} ProtoWriter;
+
+// Walks a received payload without copying it
+typedef struct
+{
+    const char *pos;
+    const char *end;
+    int failed; // Set once a read runs past the payload or finds a malformed string
+} ProtoReader;
+
+// Gathers many small messages and sends them with one system call. Each
+// payload is a short head that is copied (at most PROTO_BATCH_HEAD_MAX bytes)
+// followed by a body that is only referenced, so bodies must stay valid until
+// the batch is flushed. The batch flushes itself when full.
+typedef struct
+{
+    int sock;
+    int messages;
+    int iovcnt;
+    int failed; // Set once a send fails; later adds and flushes do nothing
+    size_t scratch_used;
+    struct iovec iov[2 * PROTO_BATCH_MESSAGES];
+    unsigned char scratch[PROTO_BATCH_MESSAGES * (PROTO_HEADER_SIZE + PROTO_BATCH_HEAD_MAX)];
+} ProtoBatch;
+
+int proto_send(int sock, uint16_t opcode, uint16_t flags, uint32_t request_id, const void *payload, size_t len);
+int proto_send_str(int sock, uint16_t opcode, uint32_t request_id, const char *str);
+int proto_send_writer(int sock, uint16_t opcode, uint16_t flags, uint32_t request_id, const ProtoWriter *writer);
+int proto_send_file(int sock, uint32_t request_id, int fd, off_t offset, uint64_t len);
+
+void proto_batch_init(ProtoBatch *batch, int sock);
+int proto_batch_add(ProtoBatch *batch, uint16_t opcode, uint32_t request_id, const ProtoWriter *head, const void *body, size_t body_len);
+int proto_batch_flush(ProtoBatch *batch);
+
+int proto_recv(int sock, ProtoMessage *msg);
+int proto_recv_max(int sock, ProtoMessage *msg, uint64_t max_payload);
+int proto_recv_partial(int sock, ProtoMessage *msg, uint64_t max_payload);
+void proto_message_free(ProtoMessage *msg);
+
+void proto_writer_init(ProtoWriter *writer);
+void proto_writer_reset(ProtoWriter *writer);
+void proto_writer_free(ProtoWriter *writer);
+void proto_put_u8(ProtoWriter *writer, uint8_t value);
+void proto_put_u32(ProtoWriter *writer, uint32_t value);
+void proto_put_u64(ProtoWriter *writer, uint64_t value);
+void proto_put_str(ProtoWriter *writer, const char *str);
+void proto_put_bytes(ProtoWriter *writer, const void *data, size_t len);
+
+void proto_reader_init(ProtoReader *reader, const ProtoMessage *msg);
+uint8_t proto_get_u8(ProtoReader *reader);
+uint32_t proto_get_u32(ProtoReader *reader);
+uint64_t proto_get_u64(ProtoReader *reader);
+const char *proto_get_str(ProtoReader *reader);
+const char *proto_get_bytes(ProtoReader *reader, size_t len);
+const char *proto_get_rest(ProtoReader *reader, size_t *len);
+
+#endif // PROTOCOL_H
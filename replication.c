@@ -0,0 +1,384 @@
+#include "replication.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#define REPLICATION_MIN_BUCKETS 1024
+#define REPLICATION_MAX_ATTEMPTS 12       // About eight minutes of retries
+#define REPLICATION_RETRY_BASE_MS 500     // Doubled after every failure
+#define REPLICATION_RETRY_MAX_MS 120000
+
+typedef struct ReplicationJob
+{
+    struct ReplicationJob *hash_next;
+    struct ReplicationJob *prev, *next; // In the ready or the retry list
+    int source;
+    int running;  // Taken by a worker and not yet retired
+    int dirty;    // Queued again while running
+    int attempts; // Failed copies so far
+    struct timespec not_before;
+    char path[];
+} ReplicationJob;
+
+typedef struct
+{
+    ReplicationJob *head, *tail;
+} JobList;
+
+struct ReplicationQueue
+{
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    ReplicationJob **buckets;
+    size_t bucket_count; // Power of two
+    size_t count;
+    JobList ready;  // FIFO
+    JobList retry;  // Sorted by not_before
+    replication_copy_cb copy;
+    replication_done_cb done;
+    void *data;
+    int stopping;
+    int worker_count;
+    pthread_t *workers;
+};
+
+static uint64_t hash_job(int source, const char *path)
+{
+    uint64_t h = 1469598103934665603ULL ^ (uint32_t)source;
+    for (const unsigned char *p = (const unsigned char *)path; *p; p++)
+    {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static ReplicationJob **find_slot(ReplicationQueue *queue, int source, const char *path)
+{
+    ReplicationJob **slot = &queue->buckets[hash_job(source, path) & (queue->bucket_count - 1)];
+    while (*slot && ((*slot)->source != source || strcmp((*slot)->path, path) != 0))
+        slot = &(*slot)->hash_next;
+    return slot;
+}
+
+// Doubles the table once it averages more than one job per bucket
+static void grow(ReplicationQueue *queue)
+{
+    size_t bucket_count = queue->bucket_count * 2;
+    ReplicationJob **buckets = (ReplicationJob **)calloc(bucket_count, sizeof(ReplicationJob *));
+    if (!buckets)
+        return; // Keep the longer chains
+    for (size_t i = 0; i < queue->bucket_count; i++)
+    {
+        ReplicationJob *job = queue->buckets[i];
+        while (job)
+        {
+            ReplicationJob *next = job->hash_next;
+            size_t b = hash_job(job->source, job->path) & (bucket_count - 1);
+            job->hash_next = buckets[b];
+            buckets[b] = job;
+            job = next;
+        }
+    }
+    free(queue->buckets);
+    queue->buckets = buckets;
+    queue->bucket_count = bucket_count;
+}
+
+static void list_push(JobList *list, ReplicationJob *job)
+{
+    job->next = NULL;
+    job->prev = list->tail;
+    if (list->tail)
+        list->tail->next = job;
+    else
+        list->head = job;
+    list->tail = job;
+}
+
+static void list_unlink(JobList *list, ReplicationJob *job)
+{
+    if (job->prev)
+        job->prev->next = job->next;
+    else
+        list->head = job->next;
+    if (job->next)
+        job->next->prev = job->prev;
+    else
+        list->tail = job->prev;
+    job->prev = job->next = NULL;
+}
+
+static int time_before(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+// Puts a failed job back after a delay that doubles with every attempt
+static void schedule_retry(ReplicationQueue *queue, ReplicationJob *job)
+{
+    long delay_ms = REPLICATION_RETRY_BASE_MS;
+    for (int i = 1; i < job->attempts && delay_ms < REPLICATION_RETRY_MAX_MS; i++)
+        delay_ms *= 2;
+    if (delay_ms > REPLICATION_RETRY_MAX_MS)
+        delay_ms = REPLICATION_RETRY_MAX_MS;
+    clock_gettime(CLOCK_MONOTONIC, &job->not_before);
+    job->not_before.tv_sec += delay_ms / 1000;
+    job->not_before.tv_nsec += (delay_ms % 1000) * 1000000L;
+    if (job->not_before.tv_nsec >= 1000000000L)
+    {
+        job->not_before.tv_sec++;
+        job->not_before.tv_nsec -= 1000000000L;
+    }
+
+    ReplicationJob *after = queue->retry.tail;
+    while (after && time_before(&job->not_before, &after->not_before))
+        after = after->prev;
+    if (!after)
+    {
+        job->prev = NULL;
+        job->next = queue->retry.head;
+        if (queue->retry.head)
+            queue->retry.head->prev = job;
+        else
+            queue->retry.tail = job;
+        queue->retry.head = job;
+        pthread_cond_signal(&queue->wake);
+        return;
+    }
+    job->prev = after;
+    job->next = after->next;
+    if (after->next)
+        after->next->prev = job;
+    else
+        queue->retry.tail = job;
+    after->next = job;
+}
+
+// Waits for the next job that is due. Returns NULL when stopping.
+static ReplicationJob *take_job(ReplicationQueue *queue)
+{
+    while (!queue->stopping)
+    {
+        ReplicationJob *job = queue->ready.head;
+        if (job)
+        {
+            list_unlink(&queue->ready, job);
+            return job;
+        }
+        job = queue->retry.head;
+        if (!job)
+        {
+            pthread_cond_wait(&queue->wake, &queue->lock);
+            continue;
+        }
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (!time_before(&now, &job->not_before))
+        {
+            list_unlink(&queue->retry, job);
+            return job;
+        }
+        pthread_cond_timedwait(&queue->wake, &queue->lock, &job->not_before);
+    }
+    return NULL;
+}
+
+static void *replication_worker(void *arg)
+{
+    ReplicationQueue *queue = (ReplicationQueue *)arg;
+    pthread_mutex_lock(&queue->lock);
+    while (1)
+    {
+        ReplicationJob *job = take_job(queue);
+        if (!job)
+            break;
+        job->running = 1;
+        job->dirty = 0;
+        pthread_mutex_unlock(&queue->lock);
+
+        int res = queue->copy(job->source, job->path, queue->data);
+
+        pthread_mutex_lock(&queue->lock);
+        if (res < 0 && !job->dirty && ++job->attempts < REPLICATION_MAX_ATTEMPTS)
+        {
+            job->running = 0;
+            schedule_retry(queue, job);
+            continue;
+        }
+        pthread_mutex_unlock(&queue->lock);
+        // The job stays marked running, so it cannot be freed or merged
+        // into until the callback retires it
+        if (res < 0 && !job->dirty)
+            log_emit(LOG_LEVEL_ERROR, "Giving up replicating %s from server %d after %d attempts\n", job->path, job->source, job->attempts);
+        queue->done(job->source, job->path, res == 0, queue->data);
+        pthread_mutex_lock(&queue->lock);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+ReplicationQueue *replication_create(replication_copy_cb copy, replication_done_cb done, void *data)
+{
+    ReplicationQueue *queue = (ReplicationQueue *)calloc(1, sizeof(ReplicationQueue));
+    if (!queue)
+        return NULL;
+    queue->bucket_count = REPLICATION_MIN_BUCKETS;
+    queue->buckets = (ReplicationJob **)calloc(queue->bucket_count, sizeof(ReplicationJob *));
+    if (!queue->buckets)
+    {
+        free(queue);
+        return NULL;
+    }
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&queue->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    queue->copy = copy;
+    queue->done = done;
+    queue->data = data;
+    return queue;
+}
+
+int replication_start(ReplicationQueue *queue, int workers)
+{
+    queue->workers = (pthread_t *)calloc(workers, sizeof(pthread_t));
+    if (!queue->workers)
+        return -1;
+    for (int i = 0; i < workers; i++)
+    {
+        if (pthread_create(&queue->workers[i], NULL, replication_worker, queue) != 0)
+        {
+            perror("Failed to create replication worker");
+            break;
+        }
+        queue->worker_count++;
+    }
+    return queue->worker_count > 0 ? 0 : -1;
+}
+
+void replication_destroy(ReplicationQueue *queue)
+{
+    if (!queue)
+        return;
+    pthread_mutex_lock(&queue->lock);
+    queue->stopping = 1;
+    pthread_cond_broadcast(&queue->wake);
+    pthread_mutex_unlock(&queue->lock);
+    for (int i = 0; i < queue->worker_count; i++)
+        pthread_join(queue->workers[i], NULL);
+    free(queue->workers);
+
+    for (size_t i = 0; i < queue->bucket_count; i++)
+    {
+        ReplicationJob *job = queue->buckets[i];
+        while (job)
+        {
+            ReplicationJob *next = job->hash_next;
+            free(job);
+            job = next;
+        }
+    }
+    free(queue->buckets);
+    pthread_cond_destroy(&queue->wake);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue);
+}
+
+int replication_enqueue(ReplicationQueue *queue, int source, const char *path)
+{
+    pthread_mutex_lock(&queue->lock);
+    ReplicationJob **slot = find_slot(queue, source, path);
+    if (*slot)
+    {
+        ReplicationJob *job = *slot;
+        if (job->running)
+        {
+            job->dirty = 1;
+        }
+        else if (job->attempts > 0)
+        {
+            // A new version is worth trying right away
+            list_unlink(&queue->retry, job);
+            job->attempts = 0;
+            list_push(&queue->ready, job);
+            pthread_cond_signal(&queue->wake);
+        }
+        pthread_mutex_unlock(&queue->lock);
+        return 0;
+    }
+
+    size_t len = strlen(path) + 1;
+    ReplicationJob *job = (ReplicationJob *)calloc(1, sizeof(ReplicationJob) + len);
+    if (!job)
+    {
+        pthread_mutex_unlock(&queue->lock);
+        perror("Failed to allocate replication job");
+        return 0;
+    }
+    memcpy(job->path, path, len);
+    job->source = source;
+    *slot = job;
+    list_push(&queue->ready, job);
+    if (++queue->count > queue->bucket_count)
+        grow(queue);
+    pthread_cond_signal(&queue->wake);
+    pthread_mutex_unlock(&queue->lock);
+    return 1;
+}
+
+int replication_retire(ReplicationQueue *queue, int source, const char *path)
+{
+    pthread_mutex_lock(&queue->lock);
+    ReplicationJob **slot = find_slot(queue, source, path);
+    ReplicationJob *job = *slot;
+    if (!job)
+    {
+        pthread_mutex_unlock(&queue->lock);
+        return 0;
+    }
+    if (job->running && job->dirty)
+    {
+        job->running = 0;
+        job->dirty = 0;
+        job->attempts = 0;
+        list_push(&queue->ready, job);
+        pthread_cond_signal(&queue->wake);
+        pthread_mutex_unlock(&queue->lock);
+        return 0;
+    }
+    if (!job->running)
+        list_unlink(job->attempts > 0 ? &queue->retry : &queue->ready, job);
+    *slot = job->hash_next;
+    queue->count--;
+    pthread_mutex_unlock(&queue->lock);
+    free(job);
+    return 1;
+}
+
+size_t replication_pending(ReplicationQueue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    size_t count = queue->count;
+    pthread_mutex_unlock(&queue->lock);
+    return count;
+}
+
+int replication_iterate(ReplicationQueue *queue, replication_iter_cb cb, void *data)
+{
+    int res = 0;
+    pthread_mutex_lock(&queue->lock);
+    for (size_t i = 0; i < queue->bucket_count && res == 0; i++)
+    {
+        for (ReplicationJob *job = queue->buckets[i]; job && res == 0; job = job->hash_next)
+            res = cb(job->source, job->path, data);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return res;
+}
@@ -0,0 +1,48 @@
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include <stddef.h>
+
+// Background replication for the naming server. Copying a path from a
+// storage server to its backups is queued as a job and carried out by a
+// fixed pool of worker threads, so registrations and write
+// acknowledgements never wait for replica copies. Jobs are keyed by
+// (source, path): queuing a path that is already waiting does
+// nothing, and queuing one that is being copied makes it run once more
+// afterwards, so a hot file is shipped in its latest version rather than
+// once per write. Failed copies are retried with exponential backoff.
+//
+// The queue itself is in memory; the caller makes it persistent by logging
+// replication_enqueue() and replication_retire() calls that return 1 and
+// replaying them at startup, before replication_start().
+
+typedef struct ReplicationQueue ReplicationQueue;
+
+// Copies one path. Returns 0 on success, -1 to retry later.
+typedef int (*replication_copy_cb)(int source, const char *path, void *data);
+
+// Called by a worker once a job succeeded or ran out of attempts. It must
+// call replication_retire() for the job before returning.
+typedef void (*replication_done_cb)(int source, const char *path, int succeeded, void *data);
+
+// Return non-zero from the callback to stop the iteration
+typedef int (*replication_iter_cb)(int source, const char *path, void *data);
+
+ReplicationQueue *replication_create(replication_copy_cb copy, replication_done_cb done, void *data);
+// Stops the workers; jobs still queued are dropped
+void replication_destroy(ReplicationQueue *queue);
+// Starts the worker threads. Returns 0 on success.
+int replication_start(ReplicationQueue *queue, int workers);
+
+// Queues a copy. Returns 1 if a new job was created, 0 if it was merged
+// into a pending one.
+int replication_enqueue(ReplicationQueue *queue, int source, const char *path);
+// Removes a job. Returns 1 if it was removed, 0 if it was queued again while
+// running (it is then put back in the queue) or is unknown.
+int replication_retire(ReplicationQueue *queue, int source, const char *path);
+
+size_t replication_pending(ReplicationQueue *queue);
+// Visits every pending job, with the queue locked
+int replication_iterate(ReplicationQueue *queue, replication_iter_cb cb, void *data);
+
+#endif // REPLICATION_H
@@ -12,102 +12,350 @@
 #include <sys/types.h>
 #include <errno.h>
 #include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/statvfs.h>
+#include <signal.h>
+#include <sys/random.h>
+
+#include "protocol.h"
+#include "manifest.h"
+#include "delta.h"
+#include "asyncwrite.h"
+#include "journal.h"
 
 #define BUFFER_SIZE 40960
 // #define DEFAULT_PORT 9099  // Default port for Storage Server
 #define ASYNC_THRESHOLD 10 // Define a threshold for switching between sync/async
-#define CHUNK_SIZE 2       // Size of chunks for flushing to persistent memory
-#define MAX_FILES 1000     // Maximum number of files supported by the server
+#define FILE_ACCESS_BUCKETS 65536 // Hash table of per-file access controls
+#define NS_RETRY_SECONDS 2 // Delay before reconnecting to the Naming Server
+#define MAX_REPLICA_TARGETS 8 // Longest replication chain
+#define HEARTBEAT_MS 200      // Interval between heartbeats to the Naming Server
+#define RANGE_LOG_MAX 32      // Ranged writes remembered per file for replication
 
 int storage_port;
-int naming_server_sock;
+int naming_server_sock = -1;
+pthread_mutex_t naming_server_send_lock = PTHREAD_MUTEX_INITIALIZER; // Notifications come from several threads
+int naming_server_registered; // Heartbeats wait until the registration has been sent
+
+// Load carried by heartbeats to the Naming Server, which routes reads to the least loaded replica
+_Atomic uint32_t requests_in_flight;
+_Atomic uint32_t service_time_us; // Moving average over recent requests
+_Atomic uint64_t requests_served;
+
+AsyncWriter *async_writer; // Carries out accepted asynchronous writes
+Journal *journal;          // Holds accepted asynchronous writes until they are carried out
+char journal_path[BUFFER_SIZE];
+char **replayed_paths; // Written again from the journal at startup, for the Naming Server to replicate
+size_t replayed_count;
+
+typedef struct
+{
+    const char *naming_server_ip;
+    int naming_server_port;
+    const char *storage_ip;
+    int storage_port;
+    uint64_t capacity; // Bytes declared to the Naming Server, which weights placement by it
+} NamingServerLink;
+
+// One hop of a replication chain and the hops after it
+typedef struct
+{
+    char path[BUFFER_SIZE];
+    int is_directory;
+    uint64_t content_hash; // Of the file being pushed (PUSH only)
+    uint64_t stamp;        // Of the content being pushed (PUSH only)
+    char ip[MAX_REPLICA_TARGETS][INET_ADDRSTRLEN];
+    int port[MAX_REPLICA_TARGETS];
+    int target_count;
+} ReplicaChain;
+
+// The paths under the exported folder, kept up to date as this server
+// creates and deletes them, so reconnecting to the Naming Server needs no
+// rescan. The acknowledged manifest is what the Naming Server recorded at
+// the last registration; only the naming server thread touches it, and the
+// next registration sends just the difference from it.
+const char *export_root;
+size_t export_root_len;
+Manifest *current_manifest;
+pthread_mutex_t manifest_lock = PTHREAD_MUTEX_INITIALIZER;
+Manifest *acked_manifest;
+uint64_t acked_generation;
+Manifest *pending_manifest; // Sent, waiting for REGISTERED
+uint64_t pending_generation;
+char manifest_path[BUFFER_SIZE];
+
+// Every file has a stamp naming its content, and a log of the ranged
+// writes that led to it. Replacing a file gives it a fresh stamp and clears
+// the log; a ranged write logs the old stamp, the new one and the range. A
+// backup whose copy carries a stamp found in the log is brought up to date
+// by sending just the ranges written since. Stamps are kept in memory only:
+// after a restart they are unknown (0) and backups get the whole file.
+typedef struct
+{
+    uint64_t base;  // Stamp before the write
+    uint64_t stamp; // Stamp after it
+    uint64_t offset;
+    uint64_t length;
+} RangeWrite;
+
+typedef struct
+{
+    int count;
+    RangeWrite writes[RANGE_LOG_MAX]; // Oldest first, each starting from the stamp the previous one left
+} RangeLog;
 
 typedef struct FileAccessControl
 {
-    char file_path[BUFFER_SIZE];
+    struct FileAccessControl *next; // Hash chain
     pthread_mutex_t write_mutex; // Mutex to lock write operations
-    pthread_mutex_t read_mutex;  // Mutex to protect read count updates
+    pthread_mutex_t read_mutex;  // Mutex to protect read count updates, the stamp and the range log
     pthread_cond_t write_cond;   // Condition variable to signal write availability
     int read_count;              // Track active readers
+    uint64_t stamp;              // Of the current content, 0 if unknown
+    RangeLog *ranges;            // Allocated on the first ranged write
+    char file_path[];
 } FileAccessControl;
 
-typedef struct AsyncWriteTask
-{
-    char file_path[BUFFER_SIZE];
-    char *data;
-    int data_size;
-    int client_socket;
-    int bytes_written;
-    FileAccessControl *file_access; // Add this line to reference the file's access control
-} AsyncWriteTask;
+// Access controls by path. Entries are created on first use and kept, as
+// threads may hold on to them, so a server copes with any number of files.
+FileAccessControl *file_access_controls[FILE_ACCESS_BUCKETS];
+pthread_mutex_t access_management_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-typedef struct
+// FNV-1a
+static uint32_t hash_path(const char *path)
 {
-
-    char filepath[BUFFER_SIZE];
-
-    char content[BUFFER_SIZE];
-
-    size_t content_length;
-
-} AsyncFileWriteArgs;
-
-FileAccessControl file_access_controls[MAX_FILES];
-int file_access_count = 0;
-pthread_mutex_t access_management_mutex = PTHREAD_MUTEX_INITIALIZER;
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)path; *p; p++)
+    {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h;
+}
 
 FileAccessControl *get_file_access(const char *file_path)
 {
     printf("Requesting access control for file: %s\n", file_path);
+    FileAccessControl **bucket = &file_access_controls[hash_path(file_path) % FILE_ACCESS_BUCKETS];
     pthread_mutex_lock(&access_management_mutex);
 
     // Check if the file already has access control initialized
-    for (int i = 0; i < file_access_count; i++)
+    for (FileAccessControl *entry = *bucket; entry; entry = entry->next)
     {
-        if (strcmp(file_access_controls[i].file_path, file_path) == 0)
+        if (strcmp(entry->file_path, file_path) == 0)
         {
             printf("Found existing access control for file: %s\n", file_path);
             pthread_mutex_unlock(&access_management_mutex);
-            return &file_access_controls[i];
+            return entry;
         }
     }
 
     // If no entry exists, create a new one
-    if (file_access_count < MAX_FILES)
-    {
-        printf("Creating new access control for file: %s\n", file_path);
-        strncpy(file_access_controls[file_access_count].file_path, file_path, BUFFER_SIZE - 1);
-        file_access_controls[file_access_count].file_path[BUFFER_SIZE - 1] = '\0';
-        pthread_mutex_init(&file_access_controls[file_access_count].write_mutex, NULL);
-        pthread_mutex_init(&file_access_controls[file_access_count].read_mutex, NULL);
-        pthread_cond_init(&file_access_controls[file_access_count].write_cond, NULL);
-        file_access_controls[file_access_count].read_count = 0;
-        file_access_count++;
+    size_t len = strlen(file_path);
+    FileAccessControl *entry = malloc(sizeof(FileAccessControl) + len + 1);
+    if (!entry)
+    {
+        perror("Failed to create access control");
         pthread_mutex_unlock(&access_management_mutex);
-        return &file_access_controls[file_access_count - 1];
+        return NULL;
     }
-
-    printf("Failed to create access control for file: %s (max limit reached)\n", file_path);
+    printf("Creating new access control for file: %s\n", file_path);
+    memcpy(entry->file_path, file_path, len + 1);
+    pthread_mutex_init(&entry->write_mutex, NULL);
+    pthread_mutex_init(&entry->read_mutex, NULL);
+    pthread_cond_init(&entry->write_cond, NULL);
+    entry->read_count = 0;
+    entry->stamp = 0;
+    entry->ranges = NULL;
+    entry->next = *bucket;
+    *bucket = entry;
     pthread_mutex_unlock(&access_management_mutex);
-    return NULL; // Failed to allocate a new entry
+    return entry;
+}
+
+// A stamp no other content has had
+static uint64_t new_stamp(void)
+{
+    uint64_t stamp = 0;
+    if (getrandom(&stamp, sizeof(stamp), 0) != sizeof(stamp))
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        stamp = ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec) ^ ((uint64_t)storage_port << 48);
+    }
+    return stamp ? stamp : 1;
+}
+
+// Records that the whole content of a file changed: stamp is that of the
+// copy it was replicated from, or 0 if the content is unknown
+static void set_content_stamp(const char *path, uint64_t stamp)
+{
+    FileAccessControl *file_access = get_file_access(path);
+    if (file_access == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&file_access->read_mutex);
+    file_access->stamp = stamp;
+    if (file_access->ranges)
+    {
+        file_access->ranges->count = 0;
+    }
+    pthread_mutex_unlock(&file_access->read_mutex);
+}
+
+// Records a file written anew on this server
+static void content_replaced(const char *path)
+{
+    set_content_stamp(path, new_stamp());
+}
+
+// Logs a ranged write that took a file from stamp base to stamp. Called
+// with read_mutex held.
+static void log_range_write(FileAccessControl *file_access, uint64_t base, uint64_t stamp, uint64_t offset, uint64_t length)
+{
+    if (file_access->ranges == NULL)
+    {
+        file_access->ranges = calloc(1, sizeof(RangeLog));
+    }
+    RangeLog *log = file_access->ranges;
+    if (log != NULL)
+    {
+        if (log->count == RANGE_LOG_MAX)
+        {
+            memmove(log->writes, log->writes + 1, (RANGE_LOG_MAX - 1) * sizeof(RangeWrite));
+            log->count--;
+        }
+        log->writes[log->count++] = (RangeWrite){base, stamp, offset, length};
+    }
+    file_access->stamp = stamp;
+}
+
+static int compare_range_offsets(const void *a, const void *b)
+{
+    const RangeWrite *x = (const RangeWrite *)a;
+    const RangeWrite *y = (const RangeWrite *)b;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+// Gathers the ranges written since stamp base into sorted, disjoint ranges
+// of a file of the given size. Returns how many, or -1 if the log does not
+// reach back to base.
+static int ranges_since(const RangeLog *log, uint64_t stamp, uint64_t base, uint64_t size, RangeWrite *ranges)
+{
+    if (base == 0)
+    {
+        return -1;
+    }
+    int first = log->count;
+    if (base != stamp)
+    {
+        first = 0;
+        while (first < log->count && log->writes[first].base != base)
+        {
+            first++;
+        }
+        if (first == log->count)
+        {
+            return -1;
+        }
+    }
+    int count = 0;
+    for (int i = first; i < log->count; i++)
+    {
+        uint64_t offset = log->writes[i].offset;
+        uint64_t end = offset + log->writes[i].length;
+        if (end > size)
+        {
+            end = size;
+        }
+        if (offset < end)
+        {
+            ranges[count++] = (RangeWrite){0, 0, offset, end - offset};
+        }
+    }
+    qsort(ranges, count, sizeof(RangeWrite), compare_range_offsets);
+    int merged = 0;
+    for (int i = 0; i < count; i++)
+    {
+        RangeWrite *last = merged > 0 ? &ranges[merged - 1] : NULL;
+        if (last != NULL && ranges[i].offset <= last->offset + last->length)
+        {
+            uint64_t end = ranges[i].offset + ranges[i].length;
+            if (end > last->offset + last->length)
+            {
+                last->length = end - last->offset;
+            }
+        }
+        else
+        {
+            ranges[merged++] = ranges[i];
+        }
+    }
+    return merged;
+}
+
+// Writes all of data at offset. Returns 0 on success, -1 on error.
+static int write_at(int fd, const char *data, size_t len, uint64_t offset)
+{
+    while (len > 0)
+    {
+        ssize_t n = pwrite(fd, data, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        data += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
 }
 
 // Function prototypes
-void list_files_recursive(const char *path, char *file_list);
-void handle_command(const char *command, const char *path);
-void listen_for_commands(int sock);
-void register_with_naming_server(const char *ip, int port, int storage_port, const char *storage_server_ip, const char *file_name);
-void start_storage_server(int port);
+void list_files_recursive(const char *path, Manifest *manifest);
+void handle_command(uint16_t command, const char *path);
+int register_with_naming_server(int sock, const NamingServerLink *link);
+int open_storage_server(int port);
+void start_storage_server(int server_sock);
 void *handle_client_thread(void *client_sock); // Use pthread for concurrent client handling
-void process_command(const char *command, const char *file_path, char *data, int client_sock);
-void send_file_content(const char *file_path, int client_sock);
-void receive_file_content(const char *file_path, int client_sock, char *data, bool async);
-void send_file_info(const char *file_path, int client_sock);
-void *async_write_handler(void *arg);
-void notify_naming_server(const char *status);
+void send_file_content(const char *file_path, int client_sock, uint32_t request_id, uint64_t offset, uint64_t length);
+void receive_file_content(const char *file_path, int client_sock, uint32_t request_id, const char *data, size_t data_len, bool async, uint64_t session_token, const ReplicaChain *quorum_chain, uint32_t write_quorum);
+void send_file_info(const char *file_path, int client_sock, uint32_t request_id);
+static int receive_file_stream(const char *file_path, int client_sock, uint32_t request_id, const ReplicaChain *quorum_chain, uint32_t write_quorum);
+static void receive_file_range(const char *file_path, int client_sock, uint32_t request_id, const char *data, size_t data_len, uint64_t offset, bool append, const ReplicaChain *quorum_chain, uint32_t write_quorum);
+void notify_naming_server(uint16_t opcode, uint64_t session_token, const char *path);
+void notify_write_done(const char *path, uint32_t copies);
+static void announce_replayed_writes(void);
 void *naming_server_communication_thread(void *arg);
+void *heartbeat_thread(void *arg);
+int connect_to_peer(const char *ip, int port);
+void *replicate_thread(void *arg);
+void receive_replica_push(int upstream_sock, const ProtoMessage *push);
+void receive_replica_ranges(int upstream_sock, const ProtoMessage *push);
+
+// Records a path created on this server if it is part of the export
+void track_path(const char *path, int is_directory)
+{
+    if (strncmp(path, export_root, export_root_len) != 0 || path[export_root_len] != '/')
+    {
+        return;
+    }
+    pthread_mutex_lock(&manifest_lock);
+    manifest_add(current_manifest, path, is_directory);
+    pthread_mutex_unlock(&manifest_lock);
+}
 
-void list_files_recursive(const char *path, char *file_list)
+void untrack_path(const char *path)
+{
+    pthread_mutex_lock(&manifest_lock);
+    manifest_remove(current_manifest, path);
+    pthread_mutex_unlock(&manifest_lock);
+}
+
+// Adds everything below path to the manifest
+void list_files_recursive(const char *path, Manifest *manifest)
 {
     DIR *dir;
     struct dirent *entry;
@@ -120,21 +368,20 @@ void list_files_recursive(const char *path, char *file_list)
 
     while ((entry = readdir(dir)) != NULL)
     {
+        char new_path[BUFFER_SIZE];
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+        snprintf(new_path, sizeof(new_path), "%s/%s", path, entry->d_name);
         if (entry->d_type == DT_DIR)
         {
-            char new_path[BUFFER_SIZE];
-            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-            {
-                continue;
-            }
-
-            snprintf(new_path, sizeof(new_path), "%s/%s", path, entry->d_name);
-            snprintf(file_list + strlen(file_list), BUFFER_SIZE - strlen(file_list), "Directory: %s\n", new_path);
-            list_files_recursive(new_path, file_list);
+            manifest_add(manifest, new_path, 1);
+            list_files_recursive(new_path, manifest);
         }
         else
         {
-            snprintf(file_list + strlen(file_list), BUFFER_SIZE - strlen(file_list), "File: %s/%s\n", path, entry->d_name);
+            manifest_add(manifest, new_path, 0);
         }
     }
     closedir(dir);
@@ -264,91 +511,170 @@ void display_deleted_paths(const DeletedPaths *deleted_paths)
     }
 }
 
-void *async_file_write(void *args)
-
+// Creates a directory and any missing parents (mkdir -p)
+void make_directories(const char *path)
 {
+    char temp_path[BUFFER_SIZE];
+    snprintf(temp_path, sizeof(temp_path), "%s", path);
+    size_t len = strlen(temp_path);
 
-    AsyncFileWriteArgs *file_args = (AsyncFileWriteArgs *)args;
-
-    // Create directories for the filepath if necessary
+    if (len > 0 && temp_path[len - 1] == '/')
+    {
+        temp_path[len - 1] = '\0';
+    }
 
-    char directory_path[BUFFER_SIZE];
+    for (char *p = temp_path + 1; *p; p++)
+    {
+        if (*p == '/')
+        {
+            *p = '\0';
+            if (mkdir(temp_path, 0755) == 0)
+                track_path(temp_path, 1);
+            *p = '/';
+        }
+    }
 
-    strncpy(directory_path, file_args->filepath, BUFFER_SIZE);
+    if (mkdir(temp_path, 0755) == 0)
+        track_path(temp_path, 1);
+}
 
+// Writes a replica pushed by the Naming Server, creating its directories.
+// Returns 0 on success, -1 on error.
+int store_file(const char *filepath, const char *content, size_t content_length)
+{
+    // Create directories for the filepath if necessary
+    char directory_path[BUFFER_SIZE];
+    snprintf(directory_path, sizeof(directory_path), "%s", filepath);
     char *last_slash = strrchr(directory_path, '/');
-
     if (last_slash)
-
     {
-
         *last_slash = '\0'; // Remove the file name to isolate the directory path
-
-        // mkdir(directory_path, 0755);
-        char temp_path[1024];
-        strcpy(temp_path, directory_path);
-        size_t len = strlen(temp_path);
-
-        if (temp_path[len - 1] == '/')
-        {
-            temp_path[len - 1] = '\0';
-        }
-
-        for (char *p = temp_path + 1; *p; p++)
-        {
-            if (*p == '/')
-            {
-                *p = '\0';
-                mkdir(temp_path, 0755);
-                *p = '/';
-            }
-        }
-
-        mkdir(temp_path, 0755);
+        make_directories(directory_path);
     }
 
     // Write the file content
-
-    FILE *file = fopen(file_args->filepath, "w");
-
+    FILE *file = fopen(filepath, "wb");
     if (!file)
-
     {
-
         perror("Error opening file for writing");
-
-        free(file_args); // Clean up memory
-
-        return NULL;
+        return -1;
     }
-
-    if (fwrite(file_args->content, 1, file_args->content_length, file) != file_args->content_length)
-
+    if (fwrite(content, 1, content_length, file) != content_length)
     {
-
         perror("Error writing file content");
-
         fclose(file);
+        return -1;
+    }
+    fclose(file);
+    track_path(filepath, 0);
+    content_replaced(filepath);
+    printf("File successfully stored at: %s\n", filepath);
+    return 0;
+}
 
-        free(file_args); // Clean up memory
-
-        return NULL;
+// Creates the missing parents of a path. The Naming Server places a new
+// path independently of its parent, which may not exist here yet.
+static void make_parent_directories(const char *path)
+{
+    char parent[BUFFER_SIZE];
+    snprintf(parent, sizeof(parent), "%s", path);
+    char *last_slash = strrchr(parent, '/');
+    if (last_slash && last_slash != parent)
+    {
+        *last_slash = '\0';
+        make_directories(parent);
     }
+}
 
-    fclose(file);
+// A file sent as several STOREs, all but the last flagged MORE. It is
+// written to "<path>.partial" and renamed over the path once complete, so
+// readers never see half of it. Only the last STORE is answered.
+typedef struct
+{
+    FILE *file; // NULL when no file is in progress
+    int failed; // A chunk could not be written; the last STORE reports it
+    char path[BUFFER_SIZE];
+} PartialStore;
 
-    printf("File successfully stored at: %s\n", file_args->filepath);
+static void partial_temp_path(const char *path, char *temp, size_t size)
+{
+    snprintf(temp, size, "%s.partial", path);
+}
 
-    free(file_args); // Clean up memory
+// Drops a file left unfinished
+static void abort_partial_store(PartialStore *partial)
+{
+    if (!partial->file)
+        return;
+    char temp[BUFFER_SIZE + 16];
+    partial_temp_path(partial->path, temp, sizeof(temp));
+    fclose(partial->file);
+    unlink(temp);
+    partial->file = NULL;
+}
 
-    return NULL;
+// Stores one STORE's content. Returns 0 on success, -1 on error; for a
+// chunk flagged MORE the result is only known at the last one.
+static int store_chunk(PartialStore *partial, const char *path, const char *content, size_t content_length, int more)
+{
+    char temp[BUFFER_SIZE + 16];
+    if (partial->file && strcmp(partial->path, path) != 0)
+    {
+        abort_partial_store(partial);
+    }
+    if (!partial->file)
+    {
+        if (!more)
+        {
+            return store_file(path, content, content_length);
+        }
+        make_parent_directories(path);
+        snprintf(partial->path, sizeof(partial->path), "%s", path);
+        partial_temp_path(path, temp, sizeof(temp));
+        partial->file = fopen(temp, "wb");
+        partial->failed = partial->file == NULL;
+        if (!partial->file)
+        {
+            perror("Error opening file for writing");
+            return -1;
+        }
+    }
+    if (!partial->failed && fwrite(content, 1, content_length, partial->file) != content_length)
+    {
+        perror("Error writing file content");
+        partial->failed = 1;
+    }
+    if (more)
+    {
+        return partial->failed ? -1 : 0;
+    }
+    int failed = partial->failed;
+    partial_temp_path(path, temp, sizeof(temp));
+    if (fclose(partial->file) != 0 || failed || rename(temp, path) != 0)
+    {
+        unlink(temp);
+        failed = 1;
+    }
+    partial->file = NULL;
+    if (failed)
+    {
+        return -1;
+    }
+    track_path(path, 0);
+    content_replaced(path);
+    printf("File successfully stored at: %s\n", path);
+    return 0;
 }
 
-void handle_command(const char *command, const char *path)
+void handle_command(uint16_t command, const char *path)
 {
-    printf("handle Received command '%s' for path '%s'\n", command, path);
+    printf("handle Received command %u for path '%s'\n", command, path);
+    if (command == PROTO_CREATE_DIR || command == PROTO_CREATE_FILE)
+    {
+        make_parent_directories(path);
+    }
 
-    if (strcmp(command, "CREATE_DIC") == 0)
+    if (command == PROTO_CREATE_DIR)
     {
         printf("Creating directory at %s\n", path);
 
@@ -358,12 +684,13 @@ void handle_command(const char *command, const char *path)
 
         // strcat(pwd, path);
 
-        mkdir(path, 0755);
+        if (mkdir(path, 0755) == 0)
+            track_path(path, 1);
 
         printf("Created directory at %s\n", pwd);
     }
 
-    else if (strcmp(command, "CREATE_F") == 0)
+    else if (command == PROTO_CREATE_FILE)
     {
 
         printf("Creating file at %s\n", path);
@@ -380,10 +707,12 @@ void handle_command(const char *command, const char *path)
         }
 
         fclose(file);
+        track_path(path, 0);
+        content_replaced(path);
 
         printf("Created file at %s\n", path);
     }
-    else if (strcmp(command, "DELETE") == 0)
+    else if (command == PROTO_DELETE)
     {
         struct stat path_stat;
 
@@ -401,6 +730,10 @@ void handle_command(const char *command, const char *path)
             initialize_deleted_paths(&deleted_paths);
             delete_directory_recursive(path, &deleted_paths);
             display_deleted_paths(&deleted_paths);
+            for (int i = 0; i < deleted_paths.size; i++)
+            {
+                untrack_path(deleted_paths.paths[i]);
+            }
             free_deleted_paths(&deleted_paths);
         }
         else
@@ -409,6 +742,8 @@ void handle_command(const char *command, const char *path)
             if (remove(path) == 0)
             {
                 printf("Deleted file: %s\n", path);
+                untrack_path(path);
+                set_content_stamp(path, 0);
             }
             else
             {
@@ -416,268 +751,371 @@ void handle_command(const char *command, const char *path)
             }
         }
     }
-    else if (strcmp(command, "COPY") == 0)
+}
+
+// Records the manifest the Naming Server just acknowledged
+static void registration_acknowledged(const ProtoMessage *msg)
+{
+    ProtoReader reader;
+    proto_reader_init(&reader, msg);
+    uint64_t generation = proto_get_u64(&reader);
+    if (reader.failed || pending_manifest == NULL || generation != pending_generation)
     {
-        // Implement file copy logic here if needed
-        printf("Copy command received for path %s\n", path);
+        printf("Ignoring registration acknowledgement %llu\n", (unsigned long long)generation);
+        return;
     }
+    manifest_free(acked_manifest);
+    acked_manifest = pending_manifest;
+    acked_generation = generation;
+    pending_manifest = NULL;
+    manifest_save(acked_manifest, manifest_path, acked_generation);
+    printf("Registered with Naming Server, generation %llu\n", (unsigned long long)generation);
 }
 
-void *naming_server_communication_thread(void *arg)
+// Runs commands from the Naming Server until it disconnects.
+// Returns 1 if it asked this server to stop, 0 if the connection was lost.
+static int serve_naming_server(int sock)
 {
-
-    int sock = *(int *)arg;
-
-    char buffer[BUFFER_SIZE];
+    ProtoMessage msg = {0};
+    int stopped = 0;
 
     while (1)
-
     {
-
         printf("Waiting for message from Naming Server...\n");
 
-        memset(buffer, 0, BUFFER_SIZE);
-
-        int bytes_received = recv(sock, buffer, BUFFER_SIZE - 1, 0);
-
-        if (bytes_received <= 0)
-
+        if (proto_recv(sock, &msg) <= 0)
         {
-
             printf("Connection to Naming Server lost\n");
-
             break;
         }
 
-        printf("Bytes received: %d\n", bytes_received);
-
-        buffer[bytes_received] = '\0';
-
-        printf("Raw message received from Naming Server: %s\n", buffer);
-
-        // Parse the command and path
-
-        char command[BUFFER_SIZE] = {0};
-
-        char path[BUFFER_SIZE] = {0};
-
-        // Use a more robust parsing approach
-
-        if (sscanf(buffer, "%s %[^\n]", command, path) >= 2)
-
+        uint16_t command = msg.header.opcode;
+        if (command == PROTO_REGISTERED)
         {
-
-            printf("Parsed Command: %s, Path: %s\n", command, path);
-
-            if (strcmp(command, "CREATE_DIC") == 0)
-
+            registration_acknowledged(&msg);
+            continue;
+        }
+        if (command == PROTO_REPLICATE)
+        {
+            // Pushing a large file takes a while; keep serving the Naming Server
+            ProtoMessage *request = malloc(sizeof(ProtoMessage));
+            pthread_t thread;
+            if (request == NULL)
             {
-
-                handle_command("CREATE_DIC", path);
+                perror("Failed to allocate replication request");
+                continue;
             }
+            *request = msg;
+            memset(&msg, 0, sizeof(msg));
+            if (pthread_create(&thread, NULL, replicate_thread, request) != 0)
+            {
+                perror("Failed to create replication thread");
+                proto_message_free(request);
+                free(request);
+                continue;
+            }
+            pthread_detach(thread);
+            continue;
+        }
+        if (command == PROTO_STOP)
+        {
+            printf("Received STOP command from Naming Server\n");
+            pthread_mutex_lock(&naming_server_send_lock);
+            proto_send(sock, PROTO_OK, 0, msg.header.request_id, NULL, 0);
+            pthread_mutex_unlock(&naming_server_send_lock);
+            stopped = 1;
+            break;
+        }
 
-            else if (strcmp(command, "CREATE_F") == 0)
+        ProtoReader reader;
+        proto_reader_init(&reader, &msg);
+        const char *path = proto_get_str(&reader);
+        if (!path)
+        {
+            printf("Malformed command %u from Naming Server\n", command);
+            continue;
+        }
+        printf("Parsed Command: %u, Path: %s\n", command, path);
 
+        if (command == PROTO_CREATE_DIR || command == PROTO_CREATE_FILE)
+        {
+            handle_command(command, path);
+        }
+        else if (command == PROTO_DELETE)
+        {
+            FileAccessControl *file_access = get_file_access(path);
+            if (file_access == NULL)
             {
-
-                handle_command("CREATE_F", path);
+                perror("Failed to get file access for deletion");
+                continue;
             }
 
-            else if (strcmp(command, "DELETE") == 0)
+            const char *busy_msg = NULL;
+            // Attempt to acquire the write mutex
+            if (pthread_mutex_trylock(&file_access->write_mutex) != 0)
+            {
+                printf("File is currently being written: %s\n", path);
+                busy_msg = "Write in progress. Cannot delete the file right now. Please try again later.\n";
+            }
+            else
             {
-                FileAccessControl *file_access = get_file_access(path);
-                if (file_access == NULL)
-                {
-                    perror("Failed to get file access for deletion");
-                    pthread_exit(NULL);
-                }
-
-                // Attempt to acquire the write mutex
-                if (pthread_mutex_trylock(&file_access->write_mutex) != 0)
-                {
-                    // If the mutex is already locked, notify the client
-                    printf("File is currently being written: %s\n", path);
-                    const char *busy_msg = "Write in progress. Cannot delete the file right now. Please try again later.\n";
-                    send(sock, busy_msg, strlen(busy_msg), 0);
-                    continue;
-                }
-
                 // Check if there are active readers
                 pthread_mutex_lock(&file_access->read_mutex);
                 if (file_access->read_count > 0)
                 {
-                    // If there are active readers, notify the client
                     printf("File is currently being read: %s\n", path);
-                    const char *busy_msg = "Read in progress. Cannot delete the file right now. Please try again later.\n";
-                    send(sock, busy_msg, strlen(busy_msg), 0);
-                    pthread_mutex_unlock(&file_access->read_mutex);
-                    pthread_mutex_unlock(&file_access->write_mutex);
-                    continue;
+                    busy_msg = "Read in progress. Cannot delete the file right now. Please try again later.\n";
                 }
                 pthread_mutex_unlock(&file_access->read_mutex);
-
-                handle_command("DELETE", path);
+                if (!busy_msg)
+                {
+                    handle_command(PROTO_DELETE, path);
+                }
+                pthread_mutex_unlock(&file_access->write_mutex);
             }
-
-            else if (strcmp(command, "STOP") == 0)
-
+            if (busy_msg)
             {
+                pthread_mutex_lock(&naming_server_send_lock);
+                proto_send_str(sock, PROTO_ERROR, msg.header.request_id, busy_msg);
+                pthread_mutex_unlock(&naming_server_send_lock);
+            }
+        }
+        else
+        {
+            printf("Unknown command received: %u\n", command);
+        }
+    }
 
-                printf("Received STOP command from Naming Server\n");
+    proto_message_free(&msg);
+    return stopped;
+}
 
-                send(sock, "STOP_ACK", strlen("STOP_ACK"), 0);
-
-                break;
-            }
+// Connects to the Naming Server or to another Storage Server
+int connect_to_peer(const char *ip, int port)
+{
+    int sock;
+    struct sockaddr_in server_address;
 
-            else
+    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    {
+        perror("Socket creation error");
+        return -1;
+    }
 
-            {
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(port);
 
-                printf("Unknown command received: %s\n", command);
-            }
-        }
+    if (inet_pton(AF_INET, ip, &server_address.sin_addr) <= 0)
+    {
+        perror("Invalid address/ Address not supported");
+        close(sock);
+        return -1;
+    }
 
-        else
+    if (connect(sock, (struct sockaddr *)&server_address, sizeof(server_address)) < 0)
+    {
+        fprintf(stderr, "Connection to %s:%d failed: %s\n", ip, port, strerror(errno));
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
 
+// Keeps this server registered: connects, registers, serves the Naming
+// Server, and reconnects whenever the connection is lost
+void *naming_server_communication_thread(void *arg)
+{
+    const NamingServerLink *link = (const NamingServerLink *)arg;
+    while (1)
+    {
+        int sock = connect_to_peer(link->naming_server_ip, link->naming_server_port);
+        if (sock >= 0)
         {
+            pthread_mutex_lock(&naming_server_send_lock);
+            naming_server_sock = sock;
+            pthread_mutex_unlock(&naming_server_send_lock);
+
+            int stopped = 0;
+            if (register_with_naming_server(sock, link) == 0)
+            {
+                pthread_mutex_lock(&naming_server_send_lock);
+                naming_server_registered = 1;
+                pthread_mutex_unlock(&naming_server_send_lock);
+                announce_replayed_writes();
+                stopped = serve_naming_server(sock);
+            }
 
-            printf("Failed to parse command and path from: %s\n", buffer);
+            pthread_mutex_lock(&naming_server_send_lock);
+            naming_server_sock = -1;
+            naming_server_registered = 0;
+            pthread_mutex_unlock(&naming_server_send_lock);
+            close(sock);
+            if (stopped)
+            {
+                break;
+            }
         }
+        printf("Reconnecting to Naming Server in %d seconds\n", NS_RETRY_SECONDS);
+        sleep(NS_RETRY_SECONDS);
     }
-
-    close(sock);
-
-    pthread_exit(NULL);
+    return NULL;
 }
 
-void listen_for_commands(int sock)
+// Sends a heartbeat to the Naming Server every HEARTBEAT_MS while
+// registered, with the requests in flight and the recent service time
+void *heartbeat_thread(void *arg)
 {
-    char buffer[BUFFER_SIZE];
+    (void)arg;
+    uint64_t last_served = 0;
     while (1)
     {
-        printf("Listening for commands from Naming Server...\n");
-        memset(buffer, 0, BUFFER_SIZE);
-        int bytes_received = recv(sock, buffer, BUFFER_SIZE - 1, 0);
-        if (bytes_received <= 0)
+        usleep(HEARTBEAT_MS * 1000);
+        // An idle server's average would otherwise keep a slow request's
+        // time forever and never be picked again
+        if (requests_served == last_served && requests_in_flight == 0)
         {
-            printf("Connection closed by Naming Server or error occurred\n");
-            break;
+            service_time_us /= 2;
         }
-
-        buffer[strcspn(buffer, "\n")] = 0;
-
-        // Check if received message is "STOP"
-        if (strcmp(buffer, "STOP") == 0)
+        last_served = requests_served;
+        ProtoWriter writer;
+        proto_writer_init(&writer);
+        proto_put_u32(&writer, requests_in_flight);
+        proto_put_u32(&writer, service_time_us);
+        pthread_mutex_lock(&naming_server_send_lock);
+        if (naming_server_registered)
         {
-            printf("Received STOP command, closing connection\n");
-            send(sock, "STOP_ACK", strlen("STOP_ACK"), 0); // Acknowledge stop
-            break;
+            proto_send_writer(naming_server_sock, PROTO_HEARTBEAT, 0, 0, &writer);
         }
-
-        // Parse the received command and path
-        char command[BUFFER_SIZE], path[BUFFER_SIZE];
-        sscanf(buffer, "%s %s", command, path);
-        printf("Received command '%s' for path '%s'\n", command, path);
-        handle_command(command, path);
+        pthread_mutex_unlock(&naming_server_send_lock);
+        proto_writer_free(&writer);
     }
-    close(sock);
+    return NULL;
 }
 
-void register_with_naming_server(const char *ip, int port, int storage_port, const char *storage_server_ip, const char *file_name)
+// One FILE_LIST or FILE_REMOVED message being filled
+typedef struct
 {
     int sock;
-    struct sockaddr_in server_address;
-    char file_list[BUFFER_SIZE] = {0};
-
-    // List files in accessible path
-    // char cwd[BUFFER_SIZE];
-    // strcpy(cwd, ".");
-
-    // printf("CWD is %s\n", cwd);
-
-    list_files_recursive(file_name, file_list);
-
-    char ip_port_info[BUFFER_SIZE];
-    snprintf(ip_port_info, sizeof(ip_port_info), "IP: %s Port: %d", ip, storage_port);
-
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
-    {
-        perror("Socket creation error");
+    uint16_t opcode;
+    ProtoWriter batch;
+    const Manifest *known; // Entries already in this manifest are skipped
+    size_t sent;
+    int failed;
+} RegistrationBatch;
+
+static void flush_registration_batch(RegistrationBatch *batch)
+{
+    if (batch->batch.len == 0 || batch->failed)
         return;
-    }
+    if (proto_send_writer(batch->sock, batch->opcode, 0, 0, &batch->batch) < 0)
+        batch->failed = 1;
+    proto_writer_reset(&batch->batch);
+}
 
-    naming_server_sock = sock;
+// Queues a path that the Naming Server does not know about yet
+static int send_new_path(const char *path, int is_directory, void *data)
+{
+    RegistrationBatch *batch = (RegistrationBatch *)data;
+    int known_directory;
+    if (batch->known && manifest_find(batch->known, path, &known_directory) && known_directory == is_directory)
+        return 0;
+    proto_put_u8(&batch->batch, is_directory);
+    proto_put_str(&batch->batch, path);
+    batch->sent++;
+    if (batch->batch.len >= PROTO_CHUNK_SIZE)
+        flush_registration_batch(batch);
+    return batch->failed;
+}
 
-    server_address.sin_family = AF_INET;
-    server_address.sin_addr.s_addr = inet_addr(ip);
-    server_address.sin_port = htons(port);
+// Queues a path that the Naming Server knows about but this server no longer has
+static int send_removed_path(const char *path, int is_directory, void *data)
+{
+    (void)is_directory;
+    RegistrationBatch *batch = (RegistrationBatch *)data;
+    if (manifest_find(batch->known, path, NULL))
+        return 0;
+    proto_put_str(&batch->batch, path);
+    batch->sent++;
+    if (batch->batch.len >= PROTO_CHUNK_SIZE)
+        flush_registration_batch(batch);
+    return batch->failed;
+}
 
-    if (inet_pton(AF_INET, ip, &server_address.sin_addr) <= 0)
+// Introduces this server and streams its paths in batches: all of them if
+// the Naming Server asks for a full list, otherwise only what changed since
+// the last acknowledged registration. Returns 0 on success, -1 on error.
+int register_with_naming_server(int sock, const NamingServerLink *link)
+{
+    ProtoWriter writer;
+    proto_writer_init(&writer);
+    proto_put_str(&writer, link->storage_ip);
+    proto_put_u32(&writer, link->storage_port);
+    proto_put_u64(&writer, acked_manifest ? acked_generation : 0);
+    proto_put_u64(&writer, acked_manifest ? manifest_digest(acked_manifest) : 0);
+    proto_put_u64(&writer, link->capacity);
+    int res = proto_send_writer(sock, PROTO_STORAGE_HELLO, 0, 0, &writer);
+    proto_writer_free(&writer);
+
+    ProtoMessage welcome = {0};
+    if (res < 0 || proto_recv(sock, &welcome) <= 0 || welcome.header.opcode != PROTO_WELCOME)
     {
-        perror("Invalid address/ Address not supported");
-        return;
+        printf("Naming Server did not accept the registration\n");
+        proto_message_free(&welcome);
+        return -1;
     }
-
-    if (connect(sock, (struct sockaddr *)&server_address, sizeof(server_address)) < 0)
+    int full_list = acked_manifest == NULL || (welcome.header.flags & PROTO_FLAG_FULL_LIST);
+    proto_message_free(&welcome);
+
+    pthread_mutex_lock(&manifest_lock);
+    manifest_free(pending_manifest);
+    pending_manifest = manifest_clone(current_manifest);
+    pthread_mutex_unlock(&manifest_lock);
+    if (pending_manifest == NULL)
     {
-        perror("Connection to Naming Server failed");
-        return;
+        perror("Failed to copy manifest");
+        return -1;
     }
-
-    // Send file list to Naming Server
-    send(sock, "STORAGE", strlen("STORAGE"), 0);
-    sleep(1);
-
-    char my_ip_and_port[BUFFER_SIZE];
-    snprintf(my_ip_and_port, sizeof(my_ip_and_port), "%s %d", storage_server_ip, storage_port);
-
-    send(sock, my_ip_and_port, strlen(my_ip_and_port), 0);
-
-    sleep(1);
-
-    printf("Sending file list to Naming Server...\n");
-    send(sock, file_list, strlen(file_list), 0);
-
-    // Receive assigned IP and port from Naming Server
-    // char ip_port_info[BUFFER_SIZE];
-    // snprintf(ip_port_info, sizeof(ip_port_info), "%s %d", "127.0.0.1", storage_port);
-    // send(sock, ip_port_info, strlen(ip_port_info), 0);
-
-    // printf("Sent IP and port to Naming Server: %s %d\n", "127.0.0.1", storage_port);
-
-    // Create thread for continuous communication with naming server
-
-    pthread_t naming_server_thread;
-
-    int *sock_ptr = malloc(sizeof(int));
-
-    *sock_ptr = naming_server_sock;
-
-    if (pthread_create(&naming_server_thread, NULL, naming_server_communication_thread, sock_ptr) != 0)
+    pending_generation = acked_generation + 1;
+
+    // Other threads' notifications must not interleave with the batches
+    pthread_mutex_lock(&naming_server_send_lock);
+    RegistrationBatch added = {.sock = sock, .opcode = PROTO_FILE_LIST, .known = full_list ? NULL : acked_manifest};
+    proto_writer_init(&added.batch);
+    manifest_iterate(pending_manifest, send_new_path, &added);
+    flush_registration_batch(&added);
+
+    RegistrationBatch removed = {.sock = sock, .opcode = PROTO_FILE_REMOVED, .known = pending_manifest};
+    proto_writer_init(&removed.batch);
+    if (!full_list)
     {
-
-        perror("Failed to create naming server communication thread");
-
-        free(sock_ptr);
-
-        close(naming_server_sock);
-
-        return;
+        manifest_iterate(acked_manifest, send_removed_path, &removed);
+        flush_registration_batch(&removed);
     }
 
-    pthread_detach(naming_server_thread);
+    proto_writer_init(&writer);
+    proto_put_u64(&writer, pending_generation);
+    proto_put_u64(&writer, manifest_digest(pending_manifest));
+    res = (added.failed || removed.failed) ? -1 : proto_send_writer(sock, PROTO_FILE_LIST_END, 0, 0, &writer);
+    pthread_mutex_unlock(&naming_server_send_lock);
+    proto_writer_free(&writer);
+    proto_writer_free(&added.batch);
+    proto_writer_free(&removed.batch);
+
+    printf("Sent %s registration to Naming Server: %zu paths added, %zu removed\n", full_list ? "full" : "incremental",
+           added.sent, removed.sent);
+    return res < 0 ? -1 : 0;
 }
 
-void start_storage_server(int port)
+// Binds and listens on the client port. This happens before registering so
+// the Naming Server can replicate to this server as soon as it knows of it.
+int open_storage_server(int port)
 {
-    int server_sock, client_sock;
-    struct sockaddr_in server_address, client_address;
-    socklen_t client_address_len = sizeof(client_address);
+    int server_sock;
+    struct sockaddr_in server_address;
     int opt = 1;
 
     // Create a socket for the Storage Server
-    if ((server_sock = socket(AF_INET, SOCK_STREAM, 0)) == 0)
+    if ((server_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
     {
         perror("Socket creation failed");
         exit(EXIT_FAILURE);
@@ -715,6 +1153,14 @@ void start_storage_server(int port)
     }
 
     printf("Storage Server is listening on port %d...\n", port);
+    return server_sock;
+}
+
+void start_storage_server(int server_sock)
+{
+    int client_sock;
+    struct sockaddr_in client_address;
+    socklen_t client_address_len = sizeof(client_address);
 
     // Accept client connections and handle them
     while (1)
@@ -736,532 +1182,947 @@ void start_storage_server(int port)
         {
             perror("Failed to create thread");
             free(client_sock_ptr);
+            close(client_sock);
+            continue;
         }
+        pthread_detach(client_thread);
     }
 
     close(server_sock);
 }
 
-void send_audio_file(const char *file_path, int client_sock)
-
+// Sends length bytes of an open file from offset (up to the end for a
+// length of 0) as DATA messages followed by END, moving the content with
+// sendfile() rather than through a buffer here. Returns 0 on success, -1 if
+// the connection failed.
+static int send_file_body(int fd, int client_sock, uint32_t request_id, uint64_t offset, uint64_t length)
 {
-
-    FILE *file = fopen(file_path, "rb");
-
-    if (!file)
-
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) < 0)
+    {
+        perror("Error checking file");
+        return -1;
+    }
+    uint64_t size = file_stat.st_size;
+    if (offset > size)
+    {
+        offset = size;
+    }
+    if (length == 0 || length > size - offset)
+    {
+        length = size - offset;
+    }
+    if (proto_send_file(client_sock, request_id, fd, offset, length) < 0)
     {
+        return -1;
+    }
+    return proto_send(client_sock, PROTO_END, 0, request_id, NULL, 0);
+}
 
+// Streams a file as DATA messages followed by END
+void send_audio_file(const char *file_path, int client_sock, uint32_t request_id)
+{
+    int fd = open(file_path, O_RDONLY);
+    if (fd < 0)
+    {
         perror("Error opening audio file");
-
-        send(client_sock, "Error: Unable to open file", strlen("Error: Unable to open file"), 0);
-
+        proto_send_str(client_sock, PROTO_ERROR, request_id, "Error: Unable to open file");
         return;
     }
 
-    char buffer[BUFFER_SIZE];
-
-    size_t bytes_read;
-
-    // Send the file in binary chunks
-
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), file)) > 0)
-
+    if (send_file_body(fd, client_sock, request_id, 0, 0) < 0)
     {
-
-        // printf("Sending audio data...\n");
-
-        if (send(client_sock, buffer, bytes_read, 0) == -1)
-
-        {
-
-            printf("Error sending audio data\n");
-
-            perror("Error sending audio data");
-
-            break;
-        }
+        perror("Error sending audio data");
+        close(fd);
+        return;
     }
-
-    // printf("sdbffdghggfnbfgng \n");
-
-    sleep(1);
-
-    // After streaming the audio data
-
-    send(client_sock, "EOF", strlen("EOF"), 0);
-
-    fclose(file);
-
+    close(fd);
     printf("Finished streaming audio file: %s\n", file_path);
 }
 
-void fetch_directory(int client_sock, const char *dir_path)
-
+// Sends a regular file to the Naming Server for replication
+void send_fetched_file(const char *file_path, int client_sock, uint32_t request_id)
 {
-
-    DIR *dir = opendir(dir_path);
-
-    if (!dir)
-
+    struct stat file_stat;
+    if (stat(file_path, &file_stat) == -1)
     {
-
-        perror("Error opening directory");
-
-        char response[] = "ERROR: Directory not found\n";
-
-        send(client_sock, response, strlen(response), 0);
-
+        perror("Error checking path");
+        proto_send_str(client_sock, PROTO_ERROR, request_id, "ERROR: File or directory not found\n");
         return;
     }
-
-    struct dirent *entry;
-
-    char file_path[BUFFER_SIZE];
-
-    char buffer[BUFFER_SIZE];
-
-    while ((entry = readdir(dir)) != NULL)
-
+    if (!S_ISREG(file_stat.st_mode))
     {
+        printf("Cannot fetch a directory\n");
+        proto_send_str(client_sock, PROTO_ERROR, request_id, "ERROR: Not a regular file\n");
+        return;
+    }
 
-        // Skip current and parent directories
-
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-
-            continue;
-
-        snprintf(file_path, BUFFER_SIZE, "%s/%s", dir_path, entry->d_name);
-
-        struct stat file_stat;
-
-        if (stat(file_path, &file_stat) == -1)
+    int fd = open(file_path, O_RDONLY);
+    if (fd < 0)
+    {
+        perror("Error opening file");
+        proto_send_str(client_sock, PROTO_ERROR, request_id, "ERROR: Unable to open file\n");
+        return;
+    }
 
-        {
+    FileAccessControl *file_access = get_file_access(file_path);
+    pthread_mutex_lock(&file_access->read_mutex);
+    file_access->read_count++;
+    pthread_mutex_unlock(&file_access->read_mutex);
 
-            perror("Error getting file stats");
+    int failed = send_file_body(fd, client_sock, request_id, 0, 0) < 0;
 
-            continue;
-        }
+    pthread_mutex_lock(&file_access->read_mutex);
+    file_access->read_count--;
+    pthread_mutex_unlock(&file_access->read_mutex);
+    close(fd);
 
-        if (S_ISDIR(file_stat.st_mode))
+    if (failed)
+    {
+        perror("Error sending file data");
+    }
+    else
+    {
+        printf("File sent successfully: %s\n", file_path);
+    }
+}
 
+// Reads a REPLICATE or PUSH payload. Returns 0 on success, -1 if malformed.
+static int parse_replica_chain(const ProtoMessage *msg, ReplicaChain *chain)
+{
+    ProtoReader reader;
+    proto_reader_init(&reader, msg);
+    const char *path = proto_get_str(&reader);
+    if (!path || strlen(path) >= sizeof(chain->path))
+    {
+        return -1;
+    }
+    snprintf(chain->path, sizeof(chain->path), "%s", path);
+    chain->is_directory = (msg->header.flags & PROTO_FLAG_DIRECTORY) != 0;
+    chain->content_hash = msg->header.opcode == PROTO_PUSH ? proto_get_u64(&reader) : 0;
+    chain->stamp = msg->header.opcode == PROTO_PUSH ? proto_get_u64(&reader) : 0;
+    chain->target_count = 0;
+    while (reader.pos < reader.end && chain->target_count < MAX_REPLICA_TARGETS)
+    {
+        const char *ip = proto_get_str(&reader);
+        uint32_t port = proto_get_u32(&reader);
+        if (!ip || reader.failed || strlen(ip) >= INET_ADDRSTRLEN)
         {
-
-            // Recursively fetch subdirectory
-
-            fetch_directory(client_sock, file_path);
+            return -1;
         }
+        snprintf(chain->ip[chain->target_count], INET_ADDRSTRLEN, "%s", ip);
+        chain->port[chain->target_count++] = port;
+    }
+    return reader.failed ? -1 : 0;
+}
 
-        else if (S_ISREG(file_stat.st_mode))
+// Opens a PUSH or PUSH_RANGE of the chain's path to its first target,
+// passing the other targets along. Returns the socket, or -1 if the target
+// is unreachable.
+static int open_replica_push(const ReplicaChain *chain, uint16_t opcode, uint64_t content_hash, uint64_t stamp)
+{
+    int sock = connect_to_peer(chain->ip[0], chain->port[0]);
+    if (sock < 0)
+    {
+        return -1;
+    }
+    ProtoWriter writer;
+    proto_writer_init(&writer);
+    proto_put_str(&writer, chain->path);
+    if (opcode == PROTO_PUSH)
+    {
+        proto_put_u64(&writer, content_hash);
+        proto_put_u64(&writer, stamp);
+    }
+    for (int i = 1; i < chain->target_count; i++)
+    {
+        proto_put_str(&writer, chain->ip[i]);
+        proto_put_u32(&writer, chain->port[i]);
+    }
+    int res = proto_send_writer(sock, opcode, chain->is_directory ? PROTO_FLAG_DIRECTORY : 0, 0, &writer);
+    proto_writer_free(&writer);
+    if (res < 0)
+    {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
 
+// Waits for the copies made down the chain, and closes the push
+static uint32_t finish_replica_push(int sock)
+{
+    uint32_t copies = 0;
+    ProtoMessage reply = {0};
+    if (proto_recv(sock, &reply) > 0 && reply.header.opcode == PROTO_REPLICATED)
+    {
+        ProtoReader reader;
+        proto_reader_init(&reader, &reply);
+        copies = proto_get_u32(&reader);
+        if (reader.failed)
         {
-
-            // Send file name and content
-
-            snprintf(buffer, BUFFER_SIZE, "FILENAME %s\n", file_path);
-
-            send(client_sock, buffer, strlen(buffer), 0);
-
-            FILE *file = fopen(file_path, "r");
-
-            if (!file)
-
-            {
-
-                perror("Error opening file for reading");
-
-                continue;
-            }
-
-            size_t bytes_read;
-
-            while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, file)) > 0)
-
-            {
-
-                if (send(client_sock, buffer, bytes_read, 0) < 0)
-
-                {
-
-                    perror("Error sending file data");
-
-                    fclose(file);
-
-                    closedir(dir);
-
-                    return;
-                }
-            }
-
-            fclose(file);
-
-            // Indicate end of file
-
-            send(client_sock, "EOF", 3, 0);
+            copies = 0;
         }
     }
-
-    closedir(dir);
-
-    printf("Directory %s transferred successfully.\n", dir_path);
+    proto_message_free(&reply);
+    close(sock);
+    return copies;
 }
 
-void handle_client(int client_sock)
+// Delta operations being gathered into DELTA messages
+typedef struct
 {
-    char buffer[BUFFER_SIZE];
+    int sock;
+    ProtoWriter ops;
+    uint64_t literal_bytes;
+    uint64_t copied_blocks;
+} DeltaStream;
 
-    // Read command from the client
-    while (1)
+static int flush_delta_stream(DeltaStream *stream)
+{
+    if (stream->ops.len == 0)
     {
-        memset(buffer, 0, BUFFER_SIZE);
-        int bytes_received = recv(client_sock, buffer, BUFFER_SIZE - 1, 0);
+        return 0;
+    }
+    int res = proto_send_writer(stream->sock, PROTO_DELTA, 0, 0, &stream->ops);
+    proto_writer_reset(&stream->ops);
+    return res;
+}
 
-        if (bytes_received <= 0)
+static int send_delta_literal(const unsigned char *data, size_t len, void *ctx)
+{
+    DeltaStream *stream = (DeltaStream *)ctx;
+    stream->literal_bytes += len;
+    while (len > 0)
+    {
+        size_t piece = len < PROTO_CHUNK_SIZE ? len : PROTO_CHUNK_SIZE;
+        proto_put_u8(&stream->ops, DELTA_OP_LITERAL);
+        proto_put_u32(&stream->ops, piece);
+        proto_put_bytes(&stream->ops, data, piece);
+        data += piece;
+        len -= piece;
+        if (stream->ops.len >= PROTO_CHUNK_SIZE && flush_delta_stream(stream) < 0)
         {
-            printf("Connection closed by client or error occurred\n");
-            break;
+            return -1;
         }
+    }
+    return 0;
+}
 
-        buffer[bytes_received] = '\0';
-        // printf("Received from client: %s\n", buffer);
-
-        // Parse the command and file path (handle READ or WRITE commands)
-        char command[BUFFER_SIZE], file_path[BUFFER_SIZE], file_data[BUFFER_SIZE], filepath[BUFFER_SIZE];
-
-        const char *file_content = NULL;
-
-        const char *first_space = strchr(buffer, ' ');
-
-        if (!first_space)
+static int send_delta_copy(uint32_t first_block, uint32_t block_count, void *ctx)
+{
+    DeltaStream *stream = (DeltaStream *)ctx;
+    stream->copied_blocks += block_count;
+    proto_put_u8(&stream->ops, DELTA_OP_COPY);
+    proto_put_u32(&stream->ops, first_block);
+    proto_put_u32(&stream->ops, block_count);
+    if (stream->ops.len >= PROTO_CHUNK_SIZE)
+    {
+        return flush_delta_stream(stream);
+    }
+    return 0;
+}
 
-        {
-
-            fprintf(stderr, "Error: Invalid format, no filepath found\n");
+// Brings the next hop up to date with just the ranges written since the
+// stamp of its copy, if the range log reaches back to it. The ranges are
+// read after the stamp is taken, so they may hold later writes too; those
+// are logged after the stamp as well and are sent again next time. Returns
+// the number of backups updated, or -1 if the whole file has to be pushed.
+static int push_replica_ranges(const ReplicaChain *chain)
+{
+    FileAccessControl *file_access = get_file_access(chain->path);
+    if (file_access == NULL)
+    {
+        return -1;
+    }
+    RangeLog log;
+    pthread_mutex_lock(&file_access->read_mutex);
+    uint64_t stamp = file_access->stamp;
+    log.count = file_access->ranges ? file_access->ranges->count : 0;
+    if (log.count > 0)
+    {
+        memcpy(log.writes, file_access->ranges->writes, log.count * sizeof(RangeWrite));
+    }
+    pthread_mutex_unlock(&file_access->read_mutex);
+    if (stamp == 0 || log.count == 0)
+    {
+        return -1;
+    }
 
-            return;
+    int fd = open(chain->path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    int sock = open_replica_push(chain, PROTO_PUSH_RANGE, 0, 0);
+    if (sock < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    RangeWrite ranges[RANGE_LOG_MAX];
+    int count = -1;
+    ProtoMessage reply = {0};
+    if (proto_recv(sock, &reply) > 0 && reply.header.opcode == PROTO_OK)
+    {
+        ProtoReader reader;
+        proto_reader_init(&reader, &reply);
+        uint64_t base = proto_get_u64(&reader);
+        if (!reader.failed)
+        {
+            count = ranges_since(&log, stamp, base, st.st_size, ranges);
         }
+    }
+    proto_message_free(&reply);
+    if (count < 0)
+    {
+        // The hop drops the push when the connection closes
+        close(sock);
+        close(fd);
+        return -1;
+    }
 
-        // Extract the command
-
-        size_t command_length = first_space - buffer;
-
-        strncpy(command, buffer, command_length);
-
-        command[command_length] = '\0'; // Null-terminate the command
-
-        // Check if the command is "STORE"
-
-        if (strcmp(command, "STORE") == 0)
+    char *buffer = malloc(PROTO_CHUNK_SIZE);
+    ProtoWriter writer;
+    proto_writer_init(&writer);
+    uint64_t sent = 0;
+    int res = buffer ? 0 : -1;
+    for (int i = 0; i < count && res == 0; i++)
+    {
+        for (uint64_t done = 0; done < ranges[i].length && res == 0;)
         {
-                        size_t content_length;
-
-            char writable_content[BUFFER_SIZE];
-
-            const char *second_space = strchr(first_space + 1, ' ');
-
-            if (!second_space)
-
+            uint64_t left = ranges[i].length - done;
+            size_t piece = left < PROTO_CHUNK_SIZE ? (size_t)left : PROTO_CHUNK_SIZE;
+            ssize_t n = pread(fd, buffer, piece, ranges[i].offset + done);
+            if (n <= 0)
             {
-
-                fprintf(stderr, "Error: Invalid format, no file content found\n");
-
-                return;
-            }
-
-            size_t filepath_length = second_space - first_space - 1;
-
-            strncpy(filepath, first_space + 1, filepath_length);
-
-            filepath[filepath_length] = '\0'; // Null-terminate the filepath
-
-            file_content = second_space + 1;
-
-            // Check for EOF marker
-
-            char *eof_marker = strstr(file_content, "EOF");
-
-            if (eof_marker)
-
-            {
-
-                content_length = eof_marker - file_content; // Exclude EOF
-            }
-
-            else
-
-            {
-
-                fprintf(stderr, "Warning: EOF marker missing, writing all received data\n");
-
-                content_length = strlen(file_content); // Write everything received
+                res = -1;
+                break;
             }
+            proto_writer_reset(&writer);
+            proto_put_u64(&writer, ranges[i].offset + done);
+            proto_put_bytes(&writer, buffer, n);
+            res = proto_send_writer(sock, PROTO_RANGE, 0, 0, &writer);
+            done += n;
+            sent += n;
+        }
+    }
+    if (res == 0)
+    {
+        proto_writer_reset(&writer);
+        proto_put_u64(&writer, st.st_size);
+        proto_put_u64(&writer, stamp);
+        res = proto_send_writer(sock, PROTO_END, 0, 0, &writer);
+    }
+    proto_writer_free(&writer);
+    free(buffer);
+    close(fd);
+    if (res < 0)
+    {
+        close(sock);
+        return 0;
+    }
+    uint32_t copies = finish_replica_push(sock);
+    printf("Pushed %d ranges of %s, %llu bytes\n", count, chain->path, (unsigned long long)sent);
+    return copies;
+}
 
-            if (content_length >= BUFFER_SIZE)
-
-            {
-
-                fprintf(stderr, "Error: Content too large to handle\n");
+// Sends a local file (or creates a directory) down the chain. For a file,
+// the next hop answers with the block signatures of its current copy and
+// only the differences are sent. Returns the number of backups that stored it.
+static uint32_t push_replica(const ReplicaChain *chain)
+{
+    if (chain->target_count == 0)
+    {
+        return 0;
+    }
+    if (chain->is_directory)
+    {
+        int sock = open_replica_push(chain, PROTO_PUSH, 0, 0);
+        return sock < 0 ? 0 : finish_replica_push(sock);
+    }
+    int updated = push_replica_ranges(chain);
+    if (updated >= 0)
+    {
+        return updated;
+    }
 
-                return;
-            }
+    FileAccessControl *file_access = get_file_access(chain->path);
+    if (file_access == NULL)
+    {
+        return 0;
+    }
+    // The stamp is taken before the file is opened, so the content sent is
+    // at least as new as the stamp it is sent with
+    pthread_mutex_lock(&file_access->read_mutex);
+    uint64_t stamp = file_access->stamp;
+    file_access->read_count++;
+    pthread_mutex_unlock(&file_access->read_mutex);
 
-            strncpy(writable_content, file_content, content_length);
+    int fd = open(chain->path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        perror("Error opening file to replicate");
+        if (fd >= 0)
+            close(fd);
+        pthread_mutex_lock(&file_access->read_mutex);
+        file_access->read_count--;
+        pthread_mutex_unlock(&file_access->read_mutex);
+        return 0;
+    }
 
-            writable_content[content_length] = '\0'; // Null-terminate
-            printf("FILE CONTE %s", writable_content);
-            // Prepare arguments for the asynchronous task
-            if (strcmp(writable_content, "JUST") == 0)
+    uint32_t copies = 0;
+    size_t size = st.st_size;
+    unsigned char *data = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    uint64_t content_hash = 0;
+    int sock = -1;
+    if (data == MAP_FAILED || (data && delta_file_hash(fd, &content_hash) < 0))
+    {
+        perror("Error reading file to replicate");
+    }
+    else if ((sock = open_replica_push(chain, PROTO_PUSH, content_hash, stamp)) < 0)
+    {
+        printf("Cannot reach %s:%d to replicate %s\n", chain->ip[0], chain->port[0], chain->path);
+    }
+    else
+    {
+        ProtoMessage reply = {0};
+        ProtoReader reader;
+        DeltaSignature sig;
+        DeltaStream stream = {.sock = sock};
+        proto_writer_init(&stream.ops);
+        if (proto_recv(sock, &reply) > 0 && reply.header.opcode == PROTO_SIGNATURES &&
+            (proto_reader_init(&reader, &reply), delta_signature_get(&reader, &sig)) == 0)
+        {
+            if (delta_generate(data, size, &sig, send_delta_literal, send_delta_copy, &stream) == 0 &&
+                flush_delta_stream(&stream) == 0 && proto_send(sock, PROTO_END, 0, 0, NULL, 0) == 0)
             {
-                char temp_path[1024];
-                strcpy(temp_path, filepath);
-                size_t len = strlen(temp_path);
-
-                if (temp_path[len - 1] == '/')
-                {
-                    temp_path[len - 1] = '\0';
-                }
-
-                for (char *p = temp_path + 1; *p; p++)
-                {
-                    if (*p == '/')
-                    {
-                        *p = '\0';
-                        mkdir(temp_path, 0755);
-                        *p = '/';
-                    }
-                }
-
-                mkdir(temp_path, 0755);
-
-                // mkdir(file_path, 0755);
-                printf("Directory created successfully at: '%s'\n", filepath);
+                copies = finish_replica_push(sock);
+                sock = -1;
+                printf("Pushed %s: %llu literal bytes, %llu blocks of %u reused\n", chain->path,
+                       (unsigned long long)stream.literal_bytes, (unsigned long long)stream.copied_blocks, sig.block_size);
             }
-            else
-            {
-
-                AsyncFileWriteArgs *args = malloc(sizeof(AsyncFileWriteArgs));
-
-                if (!args)
-
-                {
-
-                    perror("Failed to allocate memory for asynchronous task");
-
-                    return;
-                }
-
-                strncpy(args->filepath, filepath, BUFFER_SIZE - 1);
-                strncpy(args->content, writable_content, BUFFER_SIZE - 1);
-                args->content_length = content_length;
-                FileAccessControl *file_access = get_file_access(filepath);
-
-                pthread_mutex_lock(&file_access->read_mutex);
-                file_access->read_count++;
-                pthread_t thread;
+            delta_signature_free(&sig);
+        }
+        proto_writer_free(&stream.ops);
+        proto_message_free(&reply);
+        if (sock >= 0)
+        {
+            close(sock);
+        }
+    }
 
-                if (pthread_create(&thread, NULL, async_file_write, args) != 0)
+    if (data && data != MAP_FAILED)
+    {
+        munmap(data, size);
+    }
+    pthread_mutex_lock(&file_access->read_mutex);
+    file_access->read_count--;
+    pthread_mutex_unlock(&file_access->read_mutex);
+    close(fd);
+    return copies;
+}
 
-                {
+// Carries out a REPLICATE from the Naming Server and reports the result
+void *replicate_thread(void *arg)
+{
+    ProtoMessage *request = (ProtoMessage *)arg;
+    ReplicaChain *chain = malloc(sizeof(ReplicaChain));
+    uint32_t copies = 0;
+    if (chain != NULL && parse_replica_chain(request, chain) == 0)
+    {
+        copies = push_replica(chain);
+        printf("Replicated %s to %u of %d backups\n", chain->path, copies, chain->target_count);
+    }
 
-                    perror("Failed to create thread for asynchronous file writing");
+    ProtoWriter writer;
+    proto_writer_init(&writer);
+    proto_put_u32(&writer, copies);
+    proto_put_str(&writer, chain != NULL ? chain->path : "");
+    pthread_mutex_lock(&naming_server_send_lock);
+    if (naming_server_sock >= 0)
+    {
+        proto_send_writer(naming_server_sock, PROTO_REPLICATED, 0, request->header.request_id, &writer);
+    }
+    pthread_mutex_unlock(&naming_server_send_lock);
+    proto_writer_free(&writer);
 
-                    free(args); // Clean up memory
+    free(chain);
+    proto_message_free(request);
+    free(request);
+    return NULL;
+}
 
-                    return;
-                }
+// Rebuilds a file from the DELTA messages of a push, using the current copy
+// as the basis. The result is written under a temporary name and renamed
+// once its hash matches the sender's, so a broken push never leaves a
+// damaged replica behind. Returns 0 if the replica was stored.
+static int receive_replica_file(int upstream_sock, const ReplicaChain *chain)
+{
+    int basis_fd = open(chain->path, O_RDONLY | O_CLOEXEC);
+    DeltaSignature sig;
+    if (delta_signature_compute(basis_fd, &sig) < 0)
+    {
+        // Without a signature the whole file is sent
+        sig.block_size = DELTA_MIN_BLOCK;
+        sig.file_size = 0;
+        sig.block_count = 0;
+    }
+    ProtoWriter writer;
+    proto_writer_init(&writer);
+    delta_signature_put(&writer, &sig);
+    int res = proto_send_writer(upstream_sock, PROTO_SIGNATURES, 0, 0, &writer);
+    proto_writer_free(&writer);
+    delta_signature_free(&sig);
 
-                file_access->read_count--;
-                pthread_mutex_unlock(&file_access->read_mutex);
-                // Detach the thread so it cleans up after itself
+    char directory_path[BUFFER_SIZE];
+    snprintf(directory_path, sizeof(directory_path), "%s", chain->path);
+    char *last_slash = strrchr(directory_path, '/');
+    if (last_slash)
+    {
+        *last_slash = '\0';
+        make_directories(directory_path);
+    }
+    char part_path[BUFFER_SIZE + 8];
+    snprintf(part_path, sizeof(part_path), "%s.part", chain->path);
+    FILE *file = res < 0 ? NULL : fopen(part_path, "w+b");
+    if (!file)
+    {
+        perror("Error opening replica for writing");
+        if (basis_fd >= 0)
+            close(basis_fd);
+        return -1;
+    }
 
-                pthread_detach(thread);
-            }
+    ProtoMessage msg = {0};
+    int complete = 0;
+    while (proto_recv(upstream_sock, &msg) > 0)
+    {
+        if (msg.header.opcode == PROTO_END)
+        {
+            complete = 1;
+            break;
         }
-
-        int n = sscanf(buffer, "%s %s", command, file_path);
-
-        if (n < 2)
+        ProtoReader ops;
+        proto_reader_init(&ops, &msg);
+        if (msg.header.opcode != PROTO_DELTA || delta_apply(&ops, basis_fd, sig.block_size, file) < 0)
         {
-            printf("Invalid command format\n");
-            continue;
+            break;
         }
+    }
+    proto_message_free(&msg);
+    if (basis_fd >= 0)
+    {
+        close(basis_fd);
+    }
 
-        if (strcmp(command, "READ") == 0)
+    uint64_t content_hash = 0;
+    res = -1;
+    if (fflush(file) == 0 && complete && delta_file_hash(fileno(file), &content_hash) == 0)
+    {
+        if (content_hash == chain->content_hash)
         {
-            // For READ command, only file_path is used
-            process_command(command, file_path, NULL, client_sock);
+            res = 0;
         }
-        else if (strcmp(command, "WRITE") == 0)
+        else
         {
-            // For WRITE command, the file data needs to be received after the file path
-            // Wait for the file data from the client (assuming it is sent after the path)
-            printf("Waiting for file data...\n");
+            // Do not trust the basis again: the next push sends the whole file
+            printf("Replica of %s does not match the primary, discarding it\n", chain->path);
+            unlink(chain->path);
+            set_content_stamp(chain->path, 0);
+        }
+    }
+    if (fclose(file) != 0)
+    {
+        res = -1;
+    }
+    if (res == 0 && rename(part_path, chain->path) == 0)
+    {
+        track_path(chain->path, 0);
+        set_content_stamp(chain->path, chain->stamp);
+        return 0;
+    }
+    unlink(part_path);
+    return -1;
+}
 
-            int total_bytes_received = 0;
+// Stores a replica pushed by another Storage Server, then pushes it on to
+// the rest of the chain and reports how many copies were made
+void receive_replica_push(int upstream_sock, const ProtoMessage *push)
+{
+    ReplicaChain *chain = malloc(sizeof(ReplicaChain));
+    if (chain == NULL || parse_replica_chain(push, chain) < 0)
+    {
+        free(chain);
+        proto_send_str(upstream_sock, PROTO_ERROR, push->header.request_id, "Malformed push");
+        return;
+    }
 
-            while (total_bytes_received < BUFFER_SIZE - 1)
-            {
-                int bytes_received = recv(client_sock, file_data + total_bytes_received, BUFFER_SIZE - 1 - total_bytes_received, 0);
-                if (bytes_received <= 0)
-                {
-                    printf("Error or connection closed while receiving file data\n");
-                    break;
-                }
-                total_bytes_received += bytes_received;
-                if (strstr(file_data, "EOF") != NULL)
-                {
-                    break;
-                }
-            }
-            file_data[total_bytes_received] = '\0'; // Null-terminate the file data
+    uint32_t copies = 0;
+    if (chain->is_directory)
+    {
+        make_directories(chain->path);
+        copies = 1;
+    }
+    else if (receive_replica_file(upstream_sock, chain) == 0)
+    {
+        copies = 1;
+    }
+    if (copies > 0 && chain->target_count > 0)
+    {
+        copies += push_replica(chain);
+    }
+    printf("Stored replica of %s, %u copies down the chain\n", chain->path, copies);
+
+    ProtoWriter writer;
+    proto_writer_init(&writer);
+    proto_put_u32(&writer, copies);
+    proto_put_str(&writer, chain->path);
+    proto_send_writer(upstream_sock, PROTO_REPLICATED, 0, push->header.request_id, &writer);
+    proto_writer_free(&writer);
+    free(chain);
+}
 
-            // int file_data_length = recv(client_sock, file_data, BUFFER_SIZE - 1, 0);
-            // if (file_data_length <= 0)
-            // {
-            //     printf("Error or connection closed while receiving file data\n");
-            //     break;
-            // }
+// Applies a range push to the local copy in place, then passes it down the
+// rest of the chain and reports how many copies were brought up to date.
+// A copy whose stamp is unknown is left alone; the sender then pushes the
+// whole file instead.
+void receive_replica_ranges(int upstream_sock, const ProtoMessage *push)
+{
+    ReplicaChain *chain = malloc(sizeof(ReplicaChain));
+    if (chain == NULL || parse_replica_chain(push, chain) < 0)
+    {
+        free(chain);
+        proto_send_str(upstream_sock, PROTO_ERROR, push->header.request_id, "Malformed push");
+        return;
+    }
+    FileAccessControl *file_access = get_file_access(chain->path);
+    int fd = file_access ? open(chain->path, O_WRONLY | O_CLOEXEC) : -1;
+    uint64_t base = 0;
+    if (fd >= 0)
+    {
+        pthread_mutex_lock(&file_access->read_mutex);
+        base = file_access->stamp;
+        pthread_mutex_unlock(&file_access->read_mutex);
+    }
+    ProtoWriter writer;
+    proto_writer_init(&writer);
+    proto_put_u64(&writer, base);
+    int res = proto_send_writer(upstream_sock, PROTO_OK, 0, push->header.request_id, &writer);
+    proto_writer_free(&writer);
+    if (res < 0 || base == 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        free(chain);
+        return;
+    }
 
-            // file_data[file_data_length] = '\0'; // Null-terminate the file data
+    // Readers wait for the whole push, as they do for a write
+    pthread_mutex_lock(&file_access->write_mutex);
+    pthread_mutex_lock(&file_access->read_mutex);
+    int failed = file_access->stamp != base;
+    pthread_mutex_unlock(&file_access->read_mutex);
 
-            printf("Received file data: %s\n", file_data);
-            process_command(command, file_path, file_data, client_sock);
+    RangeWrite applied[RANGE_LOG_MAX];
+    int applied_count = 0;
+    int complete = 0;
+    uint64_t size = 0, stamp = 0;
+    ProtoMessage msg = {0};
+    while (proto_recv(upstream_sock, &msg) > 0)
+    {
+        ProtoReader reader;
+        proto_reader_init(&reader, &msg);
+        if (msg.header.opcode == PROTO_END)
+        {
+            size = proto_get_u64(&reader);
+            stamp = proto_get_u64(&reader);
+            complete = !reader.failed && stamp != 0;
+            break;
         }
-        else if (strcmp(command, "STREAM") == 0)
-
+        if (msg.header.opcode != PROTO_RANGE)
         {
-
-            // char crt_dir[4096];
-
-            // getcwd(crt_dir, sizeof(crt_dir));
-
-            // strcat(crt_dir, file_path);
-
-            process_command(command, file_path, file_data, client_sock);
+            break;
         }
-
-        else if ((strcmp(command, "INFO")) == 0)
-
+        uint64_t offset = proto_get_u64(&reader);
+        size_t len;
+        const char *bytes = proto_get_rest(&reader, &len);
+        if (failed || reader.failed)
         {
-
-            process_command(command, file_path, NULL, client_sock);
+            failed = 1;
+            continue;
         }
-        else if ((strcmp(command, "FETCH")) == 0)
-
+        if (write_at(fd, bytes, len, offset) < 0)
         {
+            perror("Error applying range to replica");
+            failed = 1;
+            continue;
+        }
+        // The pieces of one range arrive in order
+        RangeWrite *last = applied_count > 0 ? &applied[applied_count - 1] : NULL;
+        if (last != NULL && last->offset + last->length == offset)
+            last->length += len;
+        else if (applied_count < RANGE_LOG_MAX)
+            applied[applied_count++] = (RangeWrite){0, 0, offset, len};
+        else
+            failed = 1;
+    }
+    proto_message_free(&msg);
+    if (complete && !failed && ftruncate(fd, size) != 0)
+    {
+        perror("Error resizing replica");
+        failed = 1;
+    }
+    close(fd);
 
-            // sleep(2);
-
-            struct stat file_stat;
-
-            if (stat(file_path, &file_stat) == -1)
+    // The ranges are logged so that the next hops can be sent just them too
+    pthread_mutex_lock(&file_access->read_mutex);
+    if (complete && !failed)
+    {
+        uint64_t previous = base;
+        for (int i = 0; i < applied_count; i++)
+        {
+            uint64_t next = i == applied_count - 1 ? stamp : new_stamp();
+            log_range_write(file_access, previous, next, applied[i].offset, applied[i].length);
+            previous = next;
+        }
+        if (previous != stamp)
+        {
+            log_range_write(file_access, previous, stamp, size, 0);
+        }
+    }
+    else
+    {
+        file_access->stamp = 0;
+        if (file_access->ranges)
+        {
+            file_access->ranges->count = 0;
+        }
+    }
+    pthread_mutex_unlock(&file_access->read_mutex);
+    pthread_mutex_unlock(&file_access->write_mutex);
 
-            {
+    if (complete)
+    {
+        uint32_t copies = failed ? 0 : 1;
+        if (copies > 0 && chain->target_count > 0)
+        {
+            copies += push_replica(chain);
+        }
+        printf("Applied %d ranges to replica of %s, %u copies down the chain\n", applied_count, chain->path, copies);
+        proto_writer_init(&writer);
+        proto_put_u32(&writer, copies);
+        proto_put_str(&writer, chain->path);
+        proto_send_writer(upstream_sock, PROTO_REPLICATED, 0, push->header.request_id, &writer);
+        proto_writer_free(&writer);
+    }
+    free(chain);
+}
 
-                perror("Error checking path");
+static void request_started(struct timespec *started)
+{
+    clock_gettime(CLOCK_MONOTONIC, started);
+    requests_in_flight++;
+}
 
-                char response[] = "ERROR: File or directory not found\n";
+// Folds the request's service time into the moving average (weight 1/8)
+static void request_finished(const struct timespec *started)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t elapsed_us = (now.tv_sec - started->tv_sec) * 1000000LL + (now.tv_nsec - started->tv_nsec) / 1000;
+    uint32_t sample = elapsed_us > UINT32_MAX ? UINT32_MAX : (uint32_t)elapsed_us;
+    uint32_t average = service_time_us;
+    service_time_us = average - average / 8 + sample / 8;
+    requests_served++;
+    requests_in_flight--;
+}
 
-                send(client_sock, response, strlen(response), 0);
+// Serves one connection from a client or the Naming Server until it closes
+void handle_client(int client_sock)
+{
+    ProtoMessage msg = {0};
+    struct timespec started;
+    PartialStore partial = {0};
 
-                return;
-            }
+    for (; proto_recv(client_sock, &msg) > 0; request_finished(&started))
+    {
+        uint16_t command = msg.header.opcode;
+        uint32_t request_id = msg.header.request_id;
+        ProtoReader reader;
+        proto_reader_init(&reader, &msg);
 
-            if (S_ISDIR(file_stat.st_mode))
+        uint64_t session_token = 0;
+        if (command == PROTO_WRITE || command == PROTO_WRITE_RANGE || command == PROTO_APPEND)
+        {
+            session_token = proto_get_u64(&reader);
+        }
+        const char *file_path = proto_get_str(&reader);
+        if (!file_path)
+        {
+            fprintf(stderr, "Error: Invalid format, no filepath found\n");
+            break;
+        }
+        request_started(&started);
 
+        if (command == PROTO_PUSH)
+        {
+            receive_replica_push(client_sock, &msg);
+        }
+        else if (command == PROTO_PUSH_RANGE)
+        {
+            receive_replica_ranges(client_sock, &msg);
+        }
+        else if (command == PROTO_STORE)
+        {
+            if (msg.header.flags & PROTO_FLAG_DIRECTORY)
             {
-
-                printf("Cannot error a directory\n");
-                // fetch_directory(client_sock, file_path);
+                make_directories(file_path);
+                printf("Directory created successfully at: '%s'\n", file_path);
+                proto_send_str(client_sock, PROTO_OK, request_id, "Directory stored");
+                continue;
             }
+            size_t content_length;
+            const char *file_content = proto_get_rest(&reader, &content_length);
+            FileAccessControl *file_access = get_file_access(file_path);
 
-            else if (S_ISREG(file_stat.st_mode))
-
-            {
-
-                if (access(file_path, F_OK) != 0)
-
-                {
-
-                    perror("File not found");
-
-                    char response[] = "ERROR: File not found\n";
-
-                    send(client_sock, response, strlen(response), 0);
-                }
-
-                else
-
-                {
-
-                    FILE *file = fopen(file_path, "r");
-
-                    if (!file)
-
-                    {
-
-                        perror("Error opening file");
-
-                        char response[] = "ERROR: Unable to open file\n";
-
-                        send(client_sock, response, strlen(response), 0);
-                    }
-
-                    else
-
-                    {
-
-                        // Read the file content and send it to the client
-
-                        char file_buffer[BUFFER_SIZE];
-
-                        size_t bytes_read;
-
-                        FileAccessControl *file_access = get_file_access(file_path);
-                        pthread_mutex_lock(&file_access->read_mutex);
-                        file_access->read_count++;
-
-                        while ((bytes_read = fread(file_buffer, 1, sizeof(file_buffer), file)) > 0)
-
-                        {
-
-                            if (send(client_sock, file_buffer, bytes_read, 0) < 0)
+            int more = (msg.header.flags & PROTO_FLAG_MORE) != 0;
 
-                            {
-
-                                perror("Error sending file data");
-
-                                fclose(file);
-
-                                close(client_sock);
-
-                                return;
-                            }
-                        }
-
-                        file_access->read_count--;
-                        pthread_mutex_unlock(&file_access->read_mutex);
-
-                        fclose(file);
-
-                        // Indicate end of file transfer
-
-                        char eof_message[] = "EOF";
-
-                        send(client_sock, eof_message, strlen(eof_message), 0);
+            pthread_mutex_lock(&file_access->read_mutex);
+            file_access->read_count++;
+            pthread_mutex_unlock(&file_access->read_mutex);
+            int res = store_chunk(&partial, file_path, file_content, content_length, more);
+            pthread_mutex_lock(&file_access->read_mutex);
+            file_access->read_count--;
+            pthread_mutex_unlock(&file_access->read_mutex);
 
-                        printf("File sent successfully: %s\n", file_path);
+            if (more)
+                continue;
+            if (res == 0)
+                proto_send_str(client_sock, PROTO_OK, request_id, "File stored");
+            else
+                proto_send_str(client_sock, PROTO_ERROR, request_id, "Cannot store file");
+        }
+        else if (command == PROTO_READ)
+        {
+            send_file_content(file_path, client_sock, request_id, 0, 0);
+        }
+        else if (command == PROTO_READ_RANGE)
+        {
+            uint64_t offset = proto_get_u64(&reader);
+            uint64_t length = proto_get_u64(&reader);
+            if (reader.failed)
+            {
+                proto_send_str(client_sock, PROTO_ERROR, request_id, "Malformed read request\n");
+                continue;
+            }
+            send_file_content(file_path, client_sock, request_id, offset, length);
+        }
+        else if (command == PROTO_WRITE || command == PROTO_WRITE_RANGE || command == PROTO_APPEND)
+        {
+            uint64_t offset = command == PROTO_WRITE_RANGE ? proto_get_u64(&reader) : 0;
+            // The replicas a quorum write must reach before it is acknowledged
+            ReplicaChain *quorum_chain = NULL;
+            uint32_t write_quorum = 1;
+            if (msg.header.flags & PROTO_FLAG_QUORUM)
+            {
+                write_quorum = proto_get_u32(&reader);
+                uint32_t count = proto_get_u32(&reader);
+                quorum_chain = malloc(sizeof(ReplicaChain));
+                if (quorum_chain == NULL)
+                {
+                    perror("Failed to allocate replica chain");
+                    proto_send_str(client_sock, PROTO_ERROR, request_id, "Internal error\n");
+                    continue;
+                }
+                snprintf(quorum_chain->path, sizeof(quorum_chain->path), "%s", file_path);
+                quorum_chain->is_directory = 0;
+                quorum_chain->content_hash = 0;
+                quorum_chain->target_count = 0;
+                for (uint32_t i = 0; i < count && !reader.failed; i++)
+                {
+                    const char *ip = proto_get_str(&reader);
+                    uint32_t port = proto_get_u32(&reader);
+                    // The chain only needs to be as long as the quorum
+                    if (ip && strlen(ip) < INET_ADDRSTRLEN && quorum_chain->target_count + 1 < (int)write_quorum &&
+                        quorum_chain->target_count < MAX_REPLICA_TARGETS)
+                    {
+                        snprintf(quorum_chain->ip[quorum_chain->target_count], INET_ADDRSTRLEN, "%s", ip);
+                        quorum_chain->port[quorum_chain->target_count++] = port;
                     }
                 }
+                if (reader.failed)
+                {
+                    free(quorum_chain);
+                    proto_send_str(client_sock, PROTO_ERROR, request_id, "Malformed write request\n");
+                    continue;
+                }
+            }
+            if (command != PROTO_WRITE)
+            {
+                size_t data_len;
+                const char *data = proto_get_rest(&reader, &data_len);
+                if (reader.failed)
+                    proto_send_str(client_sock, PROTO_ERROR, request_id, "Malformed write request\n");
+                else
+                    receive_file_range(file_path, client_sock, request_id, data, data_len, offset, command == PROTO_APPEND,
+                                       quorum_chain, write_quorum);
+                free(quorum_chain);
+                continue;
+            }
+            if (msg.header.flags & PROTO_FLAG_STREAM)
+            {
+                int res = receive_file_stream(file_path, client_sock, request_id, quorum_chain, write_quorum);
+                free(quorum_chain);
+                if (res < 0)
+                    break;
+                continue;
+            }
+            size_t data_len;
+            const char *data = proto_get_rest(&reader, &data_len);
+            printf("Received %zu bytes of file data\n", data_len);
+
+            bool async;
+            if (msg.header.flags & PROTO_FLAG_SYNC)
+            {
+                async = false;
+            }
+            else
+            {
+                async = (data_len > ASYNC_THRESHOLD) ? true : false;
+            }
+            if (quorum_chain != NULL)
+            {
+                async = false; // Acknowledging before the replicas have it would defeat the quorum
             }
+            receive_file_content(file_path, client_sock, request_id, data, data_len, async, session_token, quorum_chain, write_quorum);
+            free(quorum_chain);
+        }
+        else if (command == PROTO_STREAM)
+        {
+            send_audio_file(file_path, client_sock, request_id);
+        }
+        else if (command == PROTO_INFO)
+        {
+            send_file_info(file_path, client_sock, request_id);
+        }
+        else if (command == PROTO_FETCH)
+        {
+            send_fetched_file(file_path, client_sock, request_id);
         }
         else
         {
-            printf("Unknown command: %s\n", command);
-            // send(client_sock, "Unknown command", strlen("Unknown command"), 0);
+            printf("Unknown command: %u\n", command);
+            proto_send_str(client_sock, PROTO_ERROR, request_id, "Unknown command");
         }
     }
+    abort_partial_store(&partial);
+    printf("Connection closed by client or error occurred\n");
+    proto_message_free(&msg);
 }
 
 void *handle_client_thread(void *client_sock_ptr)
@@ -1276,52 +2137,27 @@ void *handle_client_thread(void *client_sock_ptr)
     pthread_exit(NULL); // Exit the thread after handling the client
 }
 
-void process_command(const char *command, const char *file_path, char *data, int client_sock)
+// Releases the read access taken by send_file_content
+static void end_file_read(FileAccessControl *file_access)
 {
-    if (strcmp(command, "READ") == 0)
-    {
-        send_file_content(file_path, client_sock);
-    }
-    else if (strcmp(command, "WRITE") == 0 && data != NULL)
-    {
-        printf("Came here and file path is %s\n", file_path);
-
-        bool async;
-        if (strncmp(data, "--SYNC", 6) == 0)
-        {
-            async = false;
-            data += 6;
-        }
-        else
-        {
-            async = (strlen(data) > ASYNC_THRESHOLD) ? true : false;
-        }
-
-        receive_file_content(file_path, client_sock, data, async);
-    }
-    else if (strcmp(command, "INFO") == 0)
-    {
-        send_file_info(file_path, client_sock);
-    }
-    else if (strcmp(command, "STREAM") == 0)
-    {
-        send_audio_file(file_path, client_sock);
-    }
-    else
+    pthread_mutex_lock(&file_access->read_mutex);
+    file_access->read_count--;
+    if (file_access->read_count == 0)
     {
-        printf("Unknown command: %s\n", command);
-        send(client_sock, "Unknown command", strlen("Unknown command"), 0);
+        pthread_mutex_unlock(&file_access->write_mutex);
     }
+    pthread_mutex_unlock(&file_access->read_mutex);
 }
 
-void send_file_content(const char *file_path, int client_sock)
+// Sends a file, or length bytes of it from offset (up to the end for a
+// length of 0), to a reader
+void send_file_content(const char *file_path, int client_sock, uint32_t request_id, uint64_t offset, uint64_t length)
 {
     FileAccessControl *file_access = get_file_access(file_path);
     if (file_access == NULL)
     {
         perror("Failed to get file access for reading");
-        const char *error_msg = "Concurrent reading error\n";
-        send(client_sock, error_msg, strlen(error_msg), 0);
+        proto_send_str(client_sock, PROTO_ERROR, request_id, "Concurrent reading error\n");
         return;
     }
 
@@ -1330,8 +2166,7 @@ void send_file_content(const char *file_path, int client_sock)
     {
         // If write mutex is already locked, notify the reader
         printf("File is currently being written: %s\n", file_path);
-        const char *busy_msg = "Write in progress. Cannot read the file right now. Please try again later.\n";
-        send(client_sock, busy_msg, strlen(busy_msg), 0);
+        proto_send_str(client_sock, PROTO_ERROR, request_id, "Write in progress. Cannot read the file right now. Please try again later.\n");
         return; // Return early without proceeding further
     }
 
@@ -1348,73 +2183,76 @@ void send_file_content(const char *file_path, int client_sock)
     }
     pthread_mutex_unlock(&file_access->read_mutex);
 
-    char temp[BUFFER_SIZE];
-    strcpy(temp, file_path);
-
-    FILE *file = fopen(temp, "r");
-    char buffer[BUFFER_SIZE];
-
-    if (file == NULL)
+    int fd = open(file_path, O_RDONLY);
+    if (fd < 0)
     {
         perror("File open failed");
-        const char *error_msg = "File not found\n";
-        send(client_sock, error_msg, strlen(error_msg), 0);
-
-        pthread_mutex_lock(&file_access->read_mutex);
-        file_access->read_count--;
-        if (file_access->read_count == 0)
-        {
-            pthread_mutex_unlock(&file_access->write_mutex);
-        }
-        pthread_mutex_unlock(&file_access->read_mutex);
-
+        proto_send_str(client_sock, PROTO_ERROR, request_id, "File not found\n");
+        end_file_read(file_access);
         return;
     }
 
-    // Send file content to the client, line by line
-    while (fgets(buffer, sizeof(buffer), file) != NULL)
+    if (send_file_body(fd, client_sock, request_id, offset, length) < 0)
     {
-        // Send each line followed by a newline character
-        if (send(client_sock, buffer, strlen(buffer), 0) == -1)
-        {
-            perror("Send failed");
-            fclose(file);
+        perror("Send failed");
+    }
+    else
+    {
+        printf("File sent successfully\n");
+    }
 
-            pthread_mutex_lock(&file_access->read_mutex);
-            file_access->read_count--;
-            if (file_access->read_count == 0)
-            {
-                pthread_mutex_unlock(&file_access->write_mutex);
-            }
-            pthread_mutex_unlock(&file_access->read_mutex);
+    end_file_read(file_access);
+    close(fd);
+}
 
-            return;
-        }
-    }
+// A write goes to "<path>.writing" and is renamed over the path once
+// complete, so readers never see half of it
+static void write_temp_path(const char *path, char *temp, size_t size)
+{
+    snprintf(temp, size, "%s.writing", path);
+}
 
-    printf("File sent successfully\n");
+// Completes a synchronous write whose data is in place: pushes it to the
+// quorum, answers the client, tells the Naming Server and releases the file
+static void finish_sync_write(const char *file_path, int client_sock, uint32_t request_id, const ReplicaChain *quorum_chain,
+                              uint32_t write_quorum, FileAccessControl *file_access)
+{
+    track_path(file_path, 0);
 
-    pthread_mutex_lock(&file_access->read_mutex);
-    file_access->read_count--;
-    if (file_access->read_count == 0)
+    // A quorum write is only acknowledged once enough replicas hold it
+    uint32_t copies = 0;
+    if (quorum_chain != NULL)
     {
-        pthread_mutex_unlock(&file_access->write_mutex);
+        copies = push_replica(quorum_chain);
+        printf("Pushed %s to %u of %d replicas\n", file_path, copies, quorum_chain->target_count);
     }
-    pthread_mutex_unlock(&file_access->read_mutex);
+    printf("Notifying Naming Server: write of %s\n", file_path);
+    notify_write_done(file_path, copies);
 
-    fclose(file);
-    close(client_sock); // Close the client connection after sending the file
+    // Released before the reply, so the client's next request finds the file free
+    printf("Releasing write mutex for file: %s\n", file_path);
+    pthread_mutex_unlock(&file_access->write_mutex);
+
+    if (copies + 1 < write_quorum)
+    {
+        char reply[128];
+        snprintf(reply, sizeof(reply), "Write reached only %u of %u replicas\n", copies + 1, write_quorum);
+        proto_send_str(client_sock, PROTO_ERROR, request_id, reply);
+    }
+    else
+    {
+        proto_send_str(client_sock, PROTO_OK, request_id, "File written successfully\n");
+    }
 }
 
-void receive_file_content(const char *file_path, int client_sock, char *data, bool async)
+void receive_file_content(const char *file_path, int client_sock, uint32_t request_id, const char *data, size_t data_len, bool async, uint64_t session_token, const ReplicaChain *quorum_chain, uint32_t write_quorum)
 {
     printf("Receiving file content for path: %s\n", file_path);
     FileAccessControl *file_access = get_file_access(file_path);
     if (file_access == NULL)
     {
         perror("Failed to get file access for writing");
-        const char *error_msg = "Internal error\n";
-        send(client_sock, error_msg, strlen(error_msg), 0);
+        proto_send_str(client_sock, PROTO_ERROR, request_id, "Internal error\n");
         return;
     }
 
@@ -1423,8 +2261,7 @@ void receive_file_content(const char *file_path, int client_sock, char *data, bo
     {
         // If the mutex is already locked, notify the client
         printf("File is currently being written: %s\n", file_path);
-        const char *busy_msg = "Write in progress. Please wait...\n";
-        send(client_sock, busy_msg, strlen(busy_msg), 0);
+        proto_send_str(client_sock, PROTO_ERROR, request_id, "Write in progress. Please wait...\n");
         return; // Return early without proceeding further
     }
 
@@ -1433,122 +2270,342 @@ void receive_file_content(const char *file_path, int client_sock, char *data, bo
     if (async)
     {
         printf("Performing asynchronous write for file: %s\n", file_path);
-        AsyncWriteTask *task = (AsyncWriteTask *)malloc(sizeof(AsyncWriteTask));
-        strcpy(task->file_path, file_path);
-        task->data = strdup(data); // Copy data for async processing
-        task->data_size = strlen(data);
-        task->client_socket = client_sock;
-        task->file_access = file_access; // This line assigns the FileAccessControl to the task
-
-        send(client_sock, "Asynchronous write accepted\n", strlen("Asynchronous write accepted\n"), 0);
-
-        pthread_t async_thread;
-        if (pthread_create(&async_thread, NULL, async_write_handler, (void *)task) != 0)
+        // Journaled before it is acknowledged, so a crash cannot lose it;
+        // then queued for the I/O threads. The file keeps its old content
+        // until the new one is durable.
+        uint64_t seq;
+        if (journal_append(journal, file_path, data, data_len, &seq) != 0)
         {
-            perror("Failed to create async write thread");
-            free(task->data);
-            free(task);
+            proto_send_str(client_sock, PROTO_ERROR, request_id, "Cannot journal write\n");
+            pthread_mutex_unlock(&file_access->write_mutex);
+            return;
+        }
+        if (async_writer_submit(async_writer, file_path, data, data_len, session_token, file_access, seq) != 0)
+        {
+            journal_applied(journal, seq);
+            proto_send_str(client_sock, PROTO_ERROR, request_id, "Internal error\n");
             pthread_mutex_unlock(&file_access->write_mutex);
             return;
         }
 
         // Send immediate acknowledgment
-        close(client_sock);
+        proto_send_str(client_sock, PROTO_OK, request_id, "Asynchronous write accepted\n");
     }
     else
     {
         printf("Performing synchronous write for file: %s\n", file_path);
-        FILE *file = fopen(file_path, "w");
+        char temp[BUFFER_SIZE + 16];
+        write_temp_path(file_path, temp, sizeof(temp));
+        FILE *file = fopen(temp, "wb");
         if (file == NULL)
         {
             perror("File open failed");
-            const char *error_msg = "Cannot create file\n";
-            send(client_sock, error_msg, strlen(error_msg), 0);
+            proto_send_str(client_sock, PROTO_ERROR, request_id, "Cannot create file\n");
             pthread_mutex_unlock(&file_access->write_mutex); // Release write access
             return;
         }
 
-        // Write data to the file
-        fputs(data, file);
+        // Write data to the file, replacing the old content in one step
+        int failed = fwrite(data, 1, data_len, file) != data_len;
+        if (fclose(file) != 0 || failed || rename(temp, file_path) != 0)
+        {
+            perror("File write failed");
+            unlink(temp);
+            proto_send_str(client_sock, PROTO_ERROR, request_id, "Cannot write file\n");
+            pthread_mutex_unlock(&file_access->write_mutex);
+            return;
+        }
         printf("Data written to file: %s\n", file_path);
+        content_replaced(file_path);
+        finish_sync_write(file_path, client_sock, request_id, quorum_chain, write_quorum, file_access);
+    }
+}
 
-        send(client_sock, "File written successfully\n", strlen("File written successfully\n"), 0);
-
-        char message[BUFFER_SIZE];
-
-        snprintf(message, sizeof(message), "WRITE_SUCCESS %s", file_path);
-
-        printf("Notifying Naming Server: %s\n", message);
+// Receives the data of a WRITE flagged STREAM: DATA messages closed by END.
+// Each chunk is on disk before the next one is read, so a writer faster
+// than the disk is held back by TCP flow control, and memory stays at one
+// chunk whatever the size of the file. The data goes to "<path>.writing",
+// which is synced and renamed over the path at END: readers see the old
+// file or the new one, never a mix. Streamed writes are always synchronous.
+// Returns -1 if the connection failed or broke the protocol.
+static int receive_file_stream(const char *file_path, int client_sock, uint32_t request_id, const ReplicaChain *quorum_chain, uint32_t write_quorum)
+{
+    printf("Receiving file stream for path: %s\n", file_path);
+    const char *error = NULL;
+    FileAccessControl *file_access = get_file_access(file_path);
+    if (file_access == NULL)
+    {
+        perror("Failed to get file access for writing");
+        error = "Internal error\n";
+    }
+    else if (pthread_mutex_trylock(&file_access->write_mutex) != 0)
+    {
+        printf("File is currently being written: %s\n", file_path);
+        error = "Write in progress. Please wait...\n";
+        file_access = NULL;
+    }
 
-        notify_naming_server(message);
+    char temp[BUFFER_SIZE + 16];
+    write_temp_path(file_path, temp, sizeof(temp));
+    int fd = -1;
+    if (error == NULL)
+    {
+        fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            perror("File open failed");
+            error = "Cannot create file\n";
+        }
+    }
 
-        printf("Releasing write mutex for file: %s\n", file_path);
-        pthread_mutex_unlock(&file_access->write_mutex);
+    // The whole stream is read even after an error, so the connection stays
+    // usable for the next request
+    ProtoMessage chunk = {0};
+    uint64_t received = 0;
+    int res;
+    while ((res = proto_recv_max(client_sock, &chunk, PROTO_FILE_CHUNK_SIZE)) > 0 && chunk.header.opcode == PROTO_DATA)
+    {
+        size_t left = chunk.header.payload_len;
+        const char *pos = chunk.payload;
+        while (error == NULL && left > 0)
+        {
+            ssize_t n = write(fd, pos, left);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+            {
+                perror("File write failed");
+                error = "Cannot write file\n";
+                break;
+            }
+            pos += n;
+            left -= n;
+        }
+        received += chunk.header.payload_len;
+    }
+    int complete = res > 0 && chunk.header.opcode == PROTO_END;
+    proto_message_free(&chunk);
 
-        fclose(file);
-        close(client_sock);
+    if (fd >= 0)
+    {
+        if (complete && error == NULL && fsync(fd) != 0)
+        {
+            perror("File sync failed");
+            error = "Cannot write file\n";
+        }
+        close(fd);
+        if (!complete || error != NULL || rename(temp, file_path) != 0)
+        {
+            if (complete && error == NULL)
+            {
+                perror("File rename failed");
+                error = "Cannot write file\n";
+            }
+            unlink(temp);
+        }
+    }
+    if (!complete)
+    {
+        printf("Write stream of %s broken off after %llu bytes\n", file_path, (unsigned long long)received);
+        if (file_access != NULL)
+            pthread_mutex_unlock(&file_access->write_mutex);
+        return -1;
+    }
+    if (error != NULL)
+    {
+        proto_send_str(client_sock, PROTO_ERROR, request_id, error);
+        if (file_access != NULL)
+            pthread_mutex_unlock(&file_access->write_mutex);
+        return 0;
     }
+    printf("Streamed %llu bytes to file: %s\n", (unsigned long long)received, file_path);
+    content_replaced(file_path);
+    finish_sync_write(file_path, client_sock, request_id, quorum_chain, write_quorum, file_access);
+    return 0;
 }
 
-void *async_write_handler(void *arg)
+// Writes data over part of a file in place, at offset for a WRITE_RANGE or
+// at the end for an APPEND, and logs the range so that replication sends
+// just that range to backups that were up to date
+static void receive_file_range(const char *file_path, int client_sock, uint32_t request_id, const char *data, size_t data_len, uint64_t offset, bool append, const ReplicaChain *quorum_chain, uint32_t write_quorum)
 {
+    printf("Receiving %zu bytes for %s of %s\n", data_len, append ? "append" : "range write", file_path);
+    FileAccessControl *file_access = get_file_access(file_path);
+    if (file_access == NULL)
+    {
+        perror("Failed to get file access for writing");
+        proto_send_str(client_sock, PROTO_ERROR, request_id, "Internal error\n");
+        return;
+    }
+    if (pthread_mutex_trylock(&file_access->write_mutex) != 0)
+    {
+        printf("File is currently being written: %s\n", file_path);
+        proto_send_str(client_sock, PROTO_ERROR, request_id, "Write in progress. Please wait...\n");
+        return;
+    }
 
-    printf("Async write handler started\n");
-    printf("Path Given is %s\n", ((AsyncWriteTask *)arg)->file_path);
+    int fd = open(file_path, O_WRONLY);
+    struct stat st;
+    if (fd < 0 || (append && fstat(fd, &st) < 0))
+    {
+        perror("File open failed");
+        if (fd >= 0)
+            close(fd);
+        proto_send_str(client_sock, PROTO_ERROR, request_id, "File not found\n");
+        pthread_mutex_unlock(&file_access->write_mutex);
+        return;
+    }
+    if (append)
+    {
+        offset = st.st_size;
+    }
+    int failed = write_at(fd, data, data_len, offset) < 0;
+    if (close(fd) != 0)
+    {
+        failed = 1;
+    }
+    if (failed)
+    {
+        // Part of the range may have been written
+        perror("File write failed");
+        set_content_stamp(file_path, 0);
+        proto_send_str(client_sock, PROTO_ERROR, request_id, "Cannot write file\n");
+        pthread_mutex_unlock(&file_access->write_mutex);
+        return;
+    }
+    printf("Wrote %zu bytes at offset %llu of %s\n", data_len, (unsigned long long)offset, file_path);
 
-    char temp[BUFFER_SIZE];
+    pthread_mutex_lock(&file_access->read_mutex);
+    uint64_t base = file_access->stamp ? file_access->stamp : new_stamp();
+    log_range_write(file_access, base, new_stamp(), offset, data_len);
+    pthread_mutex_unlock(&file_access->read_mutex);
+    finish_sync_write(file_path, client_sock, request_id, quorum_chain, write_quorum, file_access);
+}
 
-    AsyncWriteTask *task = (AsyncWriteTask *)arg;
-    printf("Async write handler started for file: %s\n", task->file_path);
+// Reports how far an async write got, at most once per progress interval
+static void async_write_progress(const AsyncWrite *write, void *data)
+{
+    (void)data;
+    notify_naming_server(PROTO_ASYNC_PROGRESS, write->session_token, write->path);
+}
 
-    // Perform the asynchronous write
-    FILE *file = fopen(task->file_path, "w");
-    if (file == NULL)
+// Records a batch of async writes as applied with a single journal flush.
+// Called before any of their write mutexes is released: replaying one of
+// them after a crash would undo whatever the next writer did. One that may
+// not have reached the disk is left in the journal to be carried out again
+// at the next start.
+static void async_write_batch_done(AsyncWrite *const *writes, const int *outcomes, int count, void *data)
+{
+    (void)data;
+    uint64_t seqs[ASYNC_WRITE_BATCH];
+    size_t applied = 0;
+    for (int i = 0; i < count && i < ASYNC_WRITE_BATCH; i++)
     {
-        perror("File open failed for async write");
-        notify_naming_server("ASYNC_WRITE_FAIL");
-        free(task->data);
-        pthread_mutex_unlock(&task->file_access->write_mutex); // Unlock the mutex on failure
-        free(task);
-        return NULL;
+        if (outcomes[i] != ASYNC_WRITE_UNSYNCED)
+            seqs[applied++] = writes[i]->seq;
+        else if (journal_unsynced(journal, writes[i]->path) != 0)
+            perror("Failed to record unsynced write");
     }
+    journal_applied_batch(journal, seqs, applied);
+}
 
-    // Flush data in chunks to the file
-    int bytes_written = 0;
-    while (bytes_written < task->data_size)
+// An async write is in place, or failed: tell the client through the
+// Naming Server and let the next writer of the file in. One in place but
+// not durable still replaced the content; its journal record makes the
+// next start write it again.
+static void async_write_done(const AsyncWrite *write, int outcome, void *data)
+{
+    (void)data;
+    FileAccessControl *file_access = (FileAccessControl *)write->owner;
+    if (outcome != ASYNC_WRITE_FAILED)
     {
-        int chunk_size = (task->data_size - bytes_written > CHUNK_SIZE) ? CHUNK_SIZE : (task->data_size - bytes_written);
-        fwrite(task->data + bytes_written, 1, chunk_size, file);
-        bytes_written += chunk_size;
-
-        char update_msg[BUFFER_SIZE];
-        snprintf(update_msg, sizeof(update_msg), "ASYNC_WRITE_PROGRESS %d %s",
-                 task->client_socket, task->file_path);
-        notify_naming_server(update_msg);
-
-        sleep(2);
-        fflush(file); // Flush each chunk to persistent memory
+        track_path(write->path, 0);
+        content_replaced(write->path);
+        notify_naming_server(outcome == ASYNC_WRITE_SUCCEEDED ? PROTO_ASYNC_DONE : PROTO_ASYNC_UNSYNCED,
+                             write->session_token, write->path);
     }
+    else
+    {
+        notify_naming_server(PROTO_ASYNC_FAILED, write->session_token, write->path);
+    }
+    printf("Releasing write mutex after async write for file: %s\n", write->path);
+    pthread_mutex_unlock(&file_access->write_mutex);
+}
 
+// Carries out a write left in the journal by a crash, the way a synchronous
+// write is
+static void replay_journaled_write(const char *path, const char *content, size_t len, void *data)
+{
+    (void)data;
+    char temp[BUFFER_SIZE + 16];
+    write_temp_path(path, temp, sizeof(temp));
+    FILE *file = fopen(temp, "wb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Cannot replay write of %s: %s\n", path, strerror(errno));
+        return;
+    }
+    int ok = fwrite(content, 1, len, file) == len && fflush(file) == 0 && fsync(fileno(file)) == 0;
     fclose(file);
+    if (!ok || rename(temp, path) != 0)
+    {
+        fprintf(stderr, "Cannot replay write of %s: %s\n", path, strerror(errno));
+        unlink(temp);
+        return;
+    }
+    printf("Replayed journaled write of %zu bytes to %s\n", len, path);
+    char **grown = realloc(replayed_paths, (replayed_count + 1) * sizeof(char *));
+    if (grown != NULL)
+    {
+        replayed_paths = grown;
+        replayed_paths[replayed_count] = strdup(path);
+        if (replayed_paths[replayed_count] != NULL)
+        {
+            replayed_count++;
+        }
+    }
+}
 
-    // Notify Naming Server about successful write
-    char notification[BUFFER_SIZE];
-    snprintf(notification, sizeof(notification), "%s %d %s", "ASYNC_WRITE_SUCCESS", task->client_socket, task->file_path);
-    notify_naming_server(notification);
-
-    // Release the write mutex only after the write is complete
-    printf("Releasing write mutex after async write for file: %s\n", task->file_path);
-    pthread_mutex_unlock(&task->file_access->write_mutex);
+// The Naming Server never heard that the replayed writes finished: report
+// them once registered, so the backups get the new content
+static void announce_replayed_writes(void)
+{
+    for (size_t i = 0; i < replayed_count; i++)
+    {
+        notify_write_done(replayed_paths[i], 0);
+        free(replayed_paths[i]);
+    }
+    free(replayed_paths);
+    replayed_paths = NULL;
+    replayed_count = 0;
+}
 
-    free(task->data);
-    free(task);
-    return NULL;
+// Reports write progress to the Naming Server. session_token identifies the
+// client session to forward the result to (0 for synchronous writes).
+void notify_naming_server(uint16_t opcode, uint64_t session_token, const char *path)
+{
+    ProtoWriter writer;
+    proto_writer_init(&writer);
+    proto_put_u64(&writer, session_token);
+    proto_put_str(&writer, path);
+    pthread_mutex_lock(&naming_server_send_lock);
+    proto_send_writer(naming_server_sock, opcode, 0, 0, &writer);
+    pthread_mutex_unlock(&naming_server_send_lock);
+    proto_writer_free(&writer);
 }
 
-void notify_naming_server(const char *status)
+// Reports a finished synchronous write, with the number of other replicas
+// that already hold it, so the Naming Server can mark them up to date
+void notify_write_done(const char *path, uint32_t copies)
 {
-    send(naming_server_sock, status, strlen(status), 0);
+    ProtoWriter writer;
+    proto_writer_init(&writer);
+    proto_put_str(&writer, path);
+    proto_put_u32(&writer, copies);
+    pthread_mutex_lock(&naming_server_send_lock);
+    proto_send_writer(naming_server_sock, PROTO_WRITE_DONE, 0, 0, &writer);
+    pthread_mutex_unlock(&naming_server_send_lock);
+    proto_writer_free(&writer);
 }
 
 #include <stdio.h>
@@ -1559,7 +2616,7 @@ void notify_naming_server(const char *status)
 #include <time.h>
 #include <arpa/inet.h>
 
-void send_file_info(const char *file_path, int client_sock)
+void send_file_info(const char *file_path, int client_sock, uint32_t request_id)
 {
     char temp[BUFFER_SIZE];
     strcpy(temp, file_path);
@@ -1570,7 +2627,7 @@ void send_file_info(const char *file_path, int client_sock)
     if (stat(temp, &file_stat) == -1)
     {
         perror("stat");
-        send(client_sock, "Error: File not found\n", strlen("Error: File not found\n"), 0);
+        proto_send_str(client_sock, PROTO_ERROR, request_id, "Error: File not found\n");
         return;
     }
 
@@ -1627,7 +2684,24 @@ void send_file_info(const char *file_path, int client_sock)
         strcat(info, "Other\n");
 
     // Send the information to the client
-    send(client_sock, info, strlen(info), 0);
+    proto_send_str(client_sock, PROTO_OK, request_id, info);
+}
+
+// Size of the file system holding the folder, or SS_CAPACITY_GB if set
+static uint64_t declared_capacity(const char *folder)
+{
+    const char *env = getenv("SS_CAPACITY_GB");
+    if (env && strtoull(env, NULL, 10) > 0)
+    {
+        return strtoull(env, NULL, 10) << 30;
+    }
+    struct statvfs fs;
+    if (statvfs(folder, &fs) < 0)
+    {
+        perror("statvfs");
+        return 0;
+    }
+    return (uint64_t)fs.f_blocks * fs.f_frsize;
 }
 
 int main(int argc, char *argv[])
@@ -1644,6 +2718,9 @@ int main(int argc, char *argv[])
     int storage_server_port = atoi(argv[3]);
     const char *folder_name = argv[4];
 
+    // sendfile() has no MSG_NOSIGNAL; a reader that hangs up must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
     // Retrieve the IP address of the Storage Server using 'hostname -I'
     char storage_ip[BUFFER_SIZE];
     FILE *fp = popen("hostname -I", "r");
@@ -1671,13 +2748,92 @@ int main(int argc, char *argv[])
     printf("Registering with Naming Server at %s:%d\n", naming_server_ip, naming_server_port);
     printf("Storage Server IP: %s, Port: %d\n", storage_ip, storage_server_port);
 
-    register_with_naming_server(naming_server_ip, naming_server_port, storage_server_port, storage_ip, folder_name);
+    // Listen before registering: the Naming Server may replicate to us right away
+    int server_sock = open_storage_server(storage_server_port);
+
+    // Scan the export once; from here on it is kept up to date as paths change
+    export_root = folder_name;
+    export_root_len = strlen(folder_name);
+    while (export_root_len > 1 && folder_name[export_root_len - 1] == '/')
+    {
+        export_root_len--;
+    }
+    // Finish the async writes acknowledged before a crash, before the scan
+    snprintf(journal_path, sizeof(journal_path), "%.*s.%d.journal", (int)export_root_len, folder_name, storage_server_port);
+    long replayed;
+    journal = journal_open(journal_path, replay_journaled_write, NULL, &replayed);
+    if (journal == NULL)
+    {
+        fprintf(stderr, "Failed to open journal %s\n", journal_path);
+        return 1;
+    }
+    if (replayed > 0)
+    {
+        printf("Replayed %ld journaled writes\n", replayed);
+    }
+    current_manifest = manifest_create();
+    if (current_manifest == NULL)
+    {
+        perror("Failed to create manifest");
+        return 1;
+    }
+    list_files_recursive(folder_name, current_manifest);
+
+    // The last list the Naming Server acknowledged, so a restart only sends what changed
+    snprintf(manifest_path, sizeof(manifest_path), "%.*s.%d.manifest", (int)export_root_len, folder_name, storage_server_port);
+    acked_manifest = manifest_load(manifest_path, &acked_generation);
+    if (acked_manifest == NULL)
+    {
+        acked_generation = 0;
+    }
+    // SS_WRITE_THREADS I/O threads carry out async writes, reporting progress
+    // at most every SS_PROGRESS_MS
+    const char *threads_env = getenv("SS_WRITE_THREADS");
+    const char *progress_env = getenv("SS_PROGRESS_MS");
+    async_writer = async_writer_create(threads_env ? atoi(threads_env) : 0,
+                                       progress_env ? (uint32_t)atoi(progress_env) : ASYNC_WRITE_PROGRESS_MS,
+                                       async_write_progress, async_write_batch_done,
+                                       async_write_done, NULL);
+    if (async_writer == NULL)
+    {
+        perror("Failed to start async writes");
+        return 1;
+    }
+    printf("Exporting %zu paths, last registration generation %llu\n", manifest_count(current_manifest),
+           (unsigned long long)acked_generation);
+
+    NamingServerLink *link = malloc(sizeof(NamingServerLink));
+    if (link == NULL)
+    {
+        perror("Failed to allocate Naming Server link");
+        return 1;
+    }
+    link->naming_server_ip = naming_server_ip;
+    link->naming_server_port = naming_server_port;
+    link->storage_ip = strdup(storage_ip);
+    link->storage_port = storage_server_port;
+    link->capacity = declared_capacity(folder_name);
+    printf("Declaring %llu bytes of capacity\n", (unsigned long long)link->capacity);
+
+    pthread_t naming_server_thread;
+    if (pthread_create(&naming_server_thread, NULL, naming_server_communication_thread, link) != 0)
+    {
+        perror("Failed to create naming server communication thread");
+        return 1;
+    }
+    pthread_detach(naming_server_thread);
 
-    sleep(2);
+    pthread_t beat_thread;
+    if (pthread_create(&beat_thread, NULL, heartbeat_thread, NULL) != 0)
+    {
+        perror("Failed to create heartbeat thread");
+        return 1;
+    }
+    pthread_detach(beat_thread);
 
-    // Start the Storage Server to listen for client requests
+    // Serve client and Naming Server requests
 
-    start_storage_server(storage_server_port);
+    start_storage_server(server_sock);
 
     return 0;
 }
\ No newline at end of file
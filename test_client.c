@@ -4,23 +4,33 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include "protocol.h"
 
-#define BUFFER_SIZE 1024
+// gcc -o test_client test_client.c protocol.c
 
 int main(int argc, char *argv[]) {
     if (argc != 4) {
         printf("Usage: %s <naming_server_ip> <port> <command>\n", argv[0]);
-        printf("Commands: READ <file>, WRITE <file>, INFO <file>\n");
+        printf("Commands: READ (test_storage1/file1.txt), READ2 (test_storage2/file4.txt)\n");
         return 1;
     }
 
     char *ns_ip = argv[1];
     int ns_port = atoi(argv[2]);
     char *command = argv[3];
-    
+    const char *path;
+
+    if (strcmp(command, "READ") == 0) {
+        path = "test_storage1/file1.txt";
+    } else if (strcmp(command, "READ2") == 0) {
+        path = "test_storage2/file4.txt";
+    } else {
+        printf("Unknown command\n");
+        return 1;
+    }
+
     int sock;
     struct sockaddr_in ns_addr;
-    char buffer[BUFFER_SIZE];
 
     // Create socket
     if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
@@ -30,7 +40,7 @@ int main(int argc, char *argv[]) {
 
     ns_addr.sin_family = AF_INET;
     ns_addr.sin_port = htons(ns_port);
-    
+
     if (inet_pton(AF_INET, ns_ip, &ns_addr.sin_addr) <= 0) {
         perror("Invalid address");
         return 1;
@@ -45,75 +55,64 @@ int main(int argc, char *argv[]) {
     printf("Connected to naming server\n");
 
     // Send client identification
-    send(sock, "CLIENT CONNECTING TO NAMING SERVER ...", 38, 0);
-    sleep(1);
-
-    // Send command
-    if (strcmp(command, "READ") == 0) {
-        send(sock, "READ test_storage1/file1.txt", 28, 0);
-        printf("Sent: READ test_storage1/file1.txt\n");
-    } else if (strcmp(command, "READ2") == 0) {
-        send(sock, "READ test_storage2/file4.txt", 28, 0);
-        printf("Sent: READ test_storage2/file4.txt\n");
-    } else {
-        printf("Unknown command\n");
+    ProtoMessage msg = {0};
+    proto_send(sock, PROTO_CLIENT_HELLO, 0, 0, NULL, 0);
+    if (proto_recv(sock, &msg) <= 0 || msg.header.opcode != PROTO_WELCOME) {
+        printf("Naming server did not accept the client\n");
+        proto_message_free(&msg);
         close(sock);
         return 1;
     }
 
-    printf("Command sent: %s\n", command);
-
-    // Wait for naming server to process
-    sleep(2);
-
-    // Receive response
-    int bytes_read = recv(sock, buffer, BUFFER_SIZE - 1, 0);
-    printf("Received %d bytes from naming server\n", bytes_read);
-    if (bytes_read > 0) {
-        buffer[bytes_read] = '\0';
-        printf("Response from naming server: %s\n", buffer);
-        
-        // Parse IP and port - look for the IP line in the response
-        char ss_ip[16];
-        int ss_port;
-        char *ip_line = strstr(buffer, "IP:");
-        if (ip_line && sscanf(ip_line, "IP: %15s Port: %d", ss_ip, &ss_port) == 2) {
+    // Send request
+    proto_send_str(sock, PROTO_READ, 1, path);
+    printf("Sent: READ %s\n", path);
+
+    // Receive the reply to it, skipping notifications
+    int res;
+    while ((res = proto_recv(sock, &msg)) > 0 && msg.header.request_id != 1) {
+    }
+    printf("Received opcode %u from naming server\n", res > 0 ? msg.header.opcode : 0);
+    if (res > 0) {
+        ProtoReader reader;
+        proto_reader_init(&reader, &msg);
+        const char *text = proto_get_str(&reader);
+        int ss_port = (int)proto_get_u32(&reader);
+        if (msg.header.opcode == PROTO_LOCATION && text && !reader.failed) {
+            char ss_ip[INET_ADDRSTRLEN];
+            snprintf(ss_ip, sizeof(ss_ip), "%s", text);
             printf("Connecting to storage server %s:%d\n", ss_ip, ss_port);
-            
+
             // Connect to storage server
             int ss_sock = socket(AF_INET, SOCK_STREAM, 0);
             struct sockaddr_in ss_addr;
             ss_addr.sin_family = AF_INET;
             ss_addr.sin_port = htons(ss_port);
             inet_pton(AF_INET, ss_ip, &ss_addr.sin_addr);
-            
+
             if (connect(ss_sock, (struct sockaddr *)&ss_addr, sizeof(ss_addr)) == 0) {
                 printf("Successfully connected to storage server\n");
 
                 // Send read request
-                if (strcmp(command, "READ") == 0) {
-                    send(ss_sock, "READ test_storage1/file1.txt", 28, 0);
-                    printf("Sent READ command to storage server\n");
-                } else if (strcmp(command, "READ2") == 0) {
-                    send(ss_sock, "read test_storage2/file4.txt", 28, 0);
-                    printf("Sent READ2 command to storage server\n");
-                }
+                proto_send_str(ss_sock, PROTO_READ, 1, path);
+                printf("Sent %s command to storage server\n", command);
 
                 // Read file content
                 printf("File content:\n");
-                while ((bytes_read = recv(ss_sock, buffer, BUFFER_SIZE - 1, 0)) > 0) {
-                    buffer[bytes_read] = '\0';
-                    if (strcmp(buffer, "EOF\n") == 0) break;
-                    printf("%s", buffer);
+                while (proto_recv(ss_sock, &msg) > 0 && msg.header.opcode == PROTO_DATA) {
+                    fwrite(msg.payload, 1, msg.header.payload_len, stdout);
                 }
-                printf("\nEOF reached or connection closed\n");
+                printf("\nEND reached or connection closed\n");
                 close(ss_sock);
             } else {
                 perror("Failed to connect to storage server");
             }
+        } else {
+            printf("Response from naming server: %s\n", text ? text : "");
         }
     }
 
+    proto_message_free(&msg);
     close(sock);
     return 0;
 }
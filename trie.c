@@ -2,349 +2,1077 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
-TrieNode *create_trie_node(StorageServer *server) {
-    TrieNode *node = (TrieNode *)malloc(sizeof(TrieNode));
-    if (!node) {
-        printf("Error: Failed to allocate memory for trie node\n");
-        return NULL;
+#define TRIE_MAX_PREFIX_LEN 10
+
+#define TRIE_NODE4 1
+#define TRIE_NODE16 2
+#define TRIE_NODE48 3
+#define TRIE_NODE256 4
+
+// Once published, a node's header and (for Node4/Node16) its key arrays
+// never change. Child pointers, and the keys of a Node48, are read with
+// acquire loads because writers may fill empty slots in place.
+struct TrieNode
+{
+    uint8_t type;
+    uint16_t num_children; // Only maintained for the writer on Node48/Node256
+    uint32_t partial_len;  // Length of the compressed path, may exceed TRIE_MAX_PREFIX_LEN
+    unsigned char partial[TRIE_MAX_PREFIX_LEN];
+};
+
+typedef struct
+{
+    TrieNode n;
+    unsigned char keys[4];
+    TrieNode *children[4];
+} TrieNode4;
+
+typedef struct
+{
+    TrieNode n;
+    unsigned char keys[16];
+    TrieNode *children[16];
+} TrieNode16;
+
+typedef struct
+{
+    TrieNode n;
+    unsigned char keys[256]; // 1-based slot in children, 0 means no child
+    TrieNode *children[48];
+} TrieNode48;
+
+typedef struct
+{
+    TrieNode n;
+    TrieNode *children[256];
+} TrieNode256;
+
+struct Trie
+{
+    TrieNode *root;
+    size_t size;
+    pthread_mutex_t write_lock; // Serializes writers; readers never take it
+};
+
+// Leaves are stored as tagged pointers in the child arrays
+#define IS_LEAF(x) (((uintptr_t)(x) & 1))
+#define SET_LEAF(x) ((TrieNode *)((uintptr_t)(x) | 1))
+#define LEAF_RAW(x) ((TrieLeaf *)((uintptr_t)(x) & ~(uintptr_t)1))
+
+static inline uint32_t min_u32(uint32_t a, uint32_t b)
+{
+    return a < b ? a : b;
+}
+
+static inline TrieNode *load_child(TrieNode *const *slot)
+{
+    return __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+}
+
+// Makes a fully built node (or NULL) visible to readers
+static inline void publish(TrieNode **slot, TrieNode *node)
+{
+    __atomic_store_n(slot, node, __ATOMIC_RELEASE);
+}
+
+/*
+ * Epoch-based reclamation.
+ *
+ * Every thread that reads the trie owns a ReaderSlot whose state is either 0
+ * (outside any read section) or (epoch << 1) | 1. Writers put unlinked nodes
+ * on the limbo list of the current global epoch. The epoch only advances
+ * once every active reader has observed it, so by the time it has advanced
+ * twice nobody can still hold a pointer retired under the old value and that
+ * limbo list is freed. Writers never wait for readers: reclamation is simply
+ * retried at the end of the next write.
+ */
+
+typedef struct ReaderSlot
+{
+    struct ReaderSlot *next;
+    unsigned long state;
+    int in_use;
+} ReaderSlot;
+
+typedef struct Retired
+{
+    struct Retired *next;
+    void *ptr;
+} Retired;
+
+static unsigned long global_epoch = 1;
+static ReaderSlot *reader_slots = NULL; // Push-only list, slots are recycled
+static pthread_mutex_t reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+static Retired *limbo[3];
+static pthread_key_t reader_key;
+static pthread_once_t reader_key_once = PTHREAD_ONCE_INIT;
+
+static __thread ReaderSlot *my_slot = NULL;
+static __thread int read_depth = 0;
+
+// Thread exit hands the slot back for reuse by a later thread
+static void release_reader_slot(void *data)
+{
+    ReaderSlot *slot = (ReaderSlot *)data;
+    __atomic_store_n(&slot->state, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&slot->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void create_reader_key(void)
+{
+    pthread_key_create(&reader_key, release_reader_slot);
+}
+
+static ReaderSlot *acquire_reader_slot(void)
+{
+    pthread_once(&reader_key_once, create_reader_key);
+    ReaderSlot *slot;
+    for (slot = __atomic_load_n(&reader_slots, __ATOMIC_ACQUIRE); slot; slot = slot->next)
+    {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&slot->in_use, &expected, 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            break;
     }
-    node->is_end_of_path = 0;
-    node->is_deleted = 0;
-    node->is_directory = 0;
-    node->server = server;
-    if (server) {
-        server->is_server_down = 0;
+    if (!slot)
+    {
+        slot = (ReaderSlot *)calloc(1, sizeof(ReaderSlot));
+        if (!slot)
+        {
+            // Without a slot the reader cannot be protected; this is fatal
+            perror("Failed to allocate trie reader slot");
+            abort();
+        }
+        slot->in_use = 1;
+        slot->next = __atomic_load_n(&reader_slots, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&reader_slots, &slot->next, slot, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
     }
-    for (int i = 0; i < ALPHABET_SIZE; i++)
-        node->children[i] = NULL;
-    return node;
+    pthread_setspecific(reader_key, slot);
+    return slot;
 }
 
-void insert_path(TrieNode *root, const char *path, StorageServer *server, int is_directory) {
-    if (!root || !path || !server) {
-        printf("Error: Invalid parameters in insert_path\n");
+// Enters a read section. Sections nest, only the outermost one counts.
+void trie_read_lock(void)
+{
+    if (read_depth++ > 0)
         return;
+    if (!my_slot)
+        my_slot = acquire_reader_slot();
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        __atomic_store_n(&my_slot->state, (epoch << 1) | 1, __ATOMIC_SEQ_CST);
+        unsigned long now = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+        if (now == epoch)
+            break;
+        epoch = now;
     }
-    TrieNode *crawler = root;
-    while (*path) {
-        if (!crawler->children[(int)*path]) {
-            crawler->children[(int)*path] = create_trie_node(server);
-            if (!crawler->children[(int)*path]) {
-                printf("Error: Failed to create trie node in insert_path\n");
-                return;
-            }
-        }
-        crawler = crawler->children[(int)*path];
-        path++;
-    }
-    crawler->is_end_of_path = 1;
-    crawler->is_deleted = 0;
-    crawler->is_directory = is_directory;
-    crawler->server = server;
-    if (crawler->server) {
-        crawler->server->is_server_down = 0;
+}
+
+void trie_read_unlock(void)
+{
+    if (--read_depth > 0)
+        return;
+    __atomic_store_n(&my_slot->state, 0, __ATOMIC_RELEASE);
+}
+
+static void free_retired(Retired *r)
+{
+    while (r)
+    {
+        Retired *next = r->next;
+        free(r->ptr);
+        free(r);
+        r = next;
     }
 }
 
-void mark_subtree_as_deleted(TrieNode *node) {
-    if (node == NULL)
+// Queues a node or leaf that is no longer reachable from the root
+static void retire(void *ptr)
+{
+    Retired *r = (Retired *)malloc(sizeof(Retired));
+    if (!r)
+    {
+        // Leaking is the only safe option while readers may still see it
+        printf("Error: Failed to queue trie node for reclamation\n");
         return;
-    if (node->is_end_of_path) {
-        node->is_deleted = 1;
     }
-    for (int i = 0; i < ALPHABET_SIZE; i++) {
-        if (node->children[i] != NULL) {
-            mark_subtree_as_deleted(node->children[i]);
+    r->ptr = ptr;
+    pthread_mutex_lock(&reclaim_lock);
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+    r->next = limbo[epoch % 3];
+    limbo[epoch % 3] = r;
+    pthread_mutex_unlock(&reclaim_lock);
+}
+
+// Advances the epoch if every active reader has caught up with it, then frees
+// what was retired two epochs ago
+static void try_reclaim(void)
+{
+    pthread_mutex_lock(&reclaim_lock);
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    for (ReaderSlot *slot = __atomic_load_n(&reader_slots, __ATOMIC_ACQUIRE); slot; slot = slot->next)
+    {
+        unsigned long state = __atomic_load_n(&slot->state, __ATOMIC_SEQ_CST);
+        if ((state & 1) && (state >> 1) != epoch)
+        {
+            pthread_mutex_unlock(&reclaim_lock);
+            return;
         }
     }
+    epoch++;
+    __atomic_store_n(&global_epoch, epoch, __ATOMIC_SEQ_CST);
+    Retired *expired = limbo[(epoch + 1) % 3];
+    limbo[(epoch + 1) % 3] = NULL;
+    pthread_mutex_unlock(&reclaim_lock);
+    free_retired(expired);
 }
 
-StorageServer *search_path(TrieNode *root, const char *path, int want_to_delete) {
-    TrieNode *crawler = root;
-    while (*path) {
-        if (!crawler->children[(int)*path] || crawler->is_deleted) {
-            return NULL;
-        }
-        crawler = crawler->children[(int)*path];
-        path++;
+static size_t node_size(uint8_t type)
+{
+    switch (type)
+    {
+    case TRIE_NODE4:
+        return sizeof(TrieNode4);
+    case TRIE_NODE16:
+        return sizeof(TrieNode16);
+    case TRIE_NODE48:
+        return sizeof(TrieNode48);
+    default:
+        return sizeof(TrieNode256);
     }
-    if (crawler != NULL && crawler->is_end_of_path && crawler->server != NULL) {
-        if (want_to_delete) {
-            mark_subtree_as_deleted(crawler);
+}
+
+static TrieNode *alloc_node(uint8_t type)
+{
+    TrieNode *node = (TrieNode *)calloc(1, node_size(type));
+    if (!node)
+    {
+        printf("Error: Failed to allocate memory for trie node\n");
+        return NULL;
+    }
+    node->type = type;
+    return node;
+}
+
+static TrieLeaf *make_leaf(const unsigned char *key, uint32_t key_len, StorageServer *server, int is_directory)
+{
+    TrieLeaf *leaf = (TrieLeaf *)malloc(sizeof(TrieLeaf) + key_len);
+    if (!leaf)
+    {
+        printf("Error: Failed to allocate memory for trie leaf\n");
+        return NULL;
+    }
+    leaf->server = server;
+    leaf->is_directory = is_directory;
+    leaf->is_deleted = 0;
+    leaf->version = 0;
+    leaf->key_len = key_len;
+    memcpy(leaf->key, key, key_len);
+    return leaf;
+}
+
+static int leaf_matches(const TrieLeaf *leaf, const unsigned char *key, uint32_t key_len)
+{
+    return leaf->key_len == key_len && memcmp(leaf->key, key, key_len) == 0;
+}
+
+// Returns the slot holding the child for byte c, or NULL if there is none
+static TrieNode **find_child(TrieNode *n, unsigned char c)
+{
+    switch (n->type)
+    {
+    case TRIE_NODE4:
+    {
+        TrieNode4 *p = (TrieNode4 *)n;
+        for (int i = 0; i < n->num_children; i++)
+        {
+            if (p->keys[i] == c)
+                return &p->children[i];
         }
-        if (crawler->server->is_server_down || crawler->is_deleted) {
-            return NULL;
+        return NULL;
+    }
+    case TRIE_NODE16:
+    {
+        TrieNode16 *p = (TrieNode16 *)n;
+        // Keys are sorted, so a binary search touches at most four of them
+        int lo = 0, hi = n->num_children - 1;
+        while (lo <= hi)
+        {
+            int mid = (lo + hi) / 2;
+            if (p->keys[mid] == c)
+                return &p->children[mid];
+            if (p->keys[mid] < c)
+                lo = mid + 1;
+            else
+                hi = mid - 1;
         }
-        return crawler->server;
+        return NULL;
+    }
+    case TRIE_NODE48:
+    {
+        TrieNode48 *p = (TrieNode48 *)n;
+        int slot = __atomic_load_n(&p->keys[c], __ATOMIC_ACQUIRE);
+        return slot ? &p->children[slot - 1] : NULL;
+    }
+    default:
+    {
+        TrieNode256 *p = (TrieNode256 *)n;
+        return load_child(&p->children[c]) ? &p->children[c] : NULL;
+    }
     }
-    return NULL;
 }
 
-StorageServer *search_trie(TrieNode *root, const char *path) {
-    TrieNode *current = root;
-    for (int i = 0; path[i] != '\0'; i++) {
-        int index = path[i];
-        if (!current->children[index]) {
-            return NULL;
+// Returns the leftmost leaf below a node; used to recover prefix bytes that
+// did not fit into the node header.
+static TrieLeaf *minimum_leaf(const TrieNode *n)
+{
+    while (n && !IS_LEAF(n))
+    {
+        const TrieNode *next = NULL;
+        switch (n->type)
+        {
+        case TRIE_NODE4:
+            next = load_child(&((const TrieNode4 *)n)->children[0]);
+            break;
+        case TRIE_NODE16:
+            next = load_child(&((const TrieNode16 *)n)->children[0]);
+            break;
+        case TRIE_NODE48:
+        {
+            const TrieNode48 *p = (const TrieNode48 *)n;
+            for (int i = 0; i < 256 && !next; i++)
+            {
+                int slot = __atomic_load_n(&p->keys[i], __ATOMIC_ACQUIRE);
+                if (slot)
+                    next = load_child(&p->children[slot - 1]);
+            }
+            break;
+        }
+        default:
+        {
+            const TrieNode256 *p = (const TrieNode256 *)n;
+            for (int i = 0; i < 256 && !next; i++)
+                next = load_child(&p->children[i]);
+            break;
         }
-        current = current->children[index];
-        if (current->is_deleted) {
-            return NULL;
         }
+        n = next;
     }
-    if (current->is_end_of_path && current->server && current->server->is_server_down == 0) {
-        return current->server;
+    return n ? LEAF_RAW(n) : NULL;
+}
+
+// Number of prefix bytes stored in the header that match the key
+static uint32_t check_prefix(const TrieNode *n, const unsigned char *key, uint32_t key_len, uint32_t depth)
+{
+    uint32_t max_cmp = min_u32(min_u32(n->partial_len, TRIE_MAX_PREFIX_LEN), key_len - depth);
+    uint32_t idx;
+    for (idx = 0; idx < max_cmp; idx++)
+    {
+        if (n->partial[idx] != key[depth + idx])
+            return idx;
     }
-    return NULL;
+    return idx;
 }
 
-void free_trie(TrieNode *root) {
-    for (int i = 0; i < ALPHABET_SIZE; i++) {
-        if (root->children[i]) {
-            free_trie(root->children[i]);
+// Like check_prefix, but compares the full compressed path
+static uint32_t prefix_mismatch(const TrieNode *n, const unsigned char *key, uint32_t key_len, uint32_t depth)
+{
+    uint32_t max_cmp = min_u32(min_u32(TRIE_MAX_PREFIX_LEN, n->partial_len), key_len - depth);
+    uint32_t idx;
+    for (idx = 0; idx < max_cmp; idx++)
+    {
+        if (n->partial[idx] != key[depth + idx])
+            return idx;
+    }
+    if (n->partial_len > TRIE_MAX_PREFIX_LEN)
+    {
+        const TrieLeaf *l = minimum_leaf(n);
+        max_cmp = min_u32(l->key_len, key_len) - depth;
+        for (; idx < max_cmp; idx++)
+        {
+            if ((unsigned char)l->key[depth + idx] != key[depth + idx])
+                return idx;
         }
     }
-    free(root);
+    return idx;
 }
 
-bool remove_path_from_trie(TrieNode *node, const char *path, int depth) {
-    int index = path[depth] - 'a';
-    if (index < 0 || index >= 26) {
-        return false;
+static int node_capacity(uint8_t type)
+{
+    switch (type)
+    {
+    case TRIE_NODE4:
+        return 4;
+    case TRIE_NODE16:
+        return 16;
+    case TRIE_NODE48:
+        return 48;
+    default:
+        return 256;
     }
-    if (node->children[index] != NULL) {
-        bool should_delete_child = remove_path_from_trie(node->children[index], path, depth + 1);
-        if (should_delete_child) {
-            free(node->children[index]);
-            node->children[index] = NULL;
-            if (!node->is_end_of_path) {
-                for (int i = 0; i < ALPHABET_SIZE; i++) {
-                    if (node->children[i] != NULL) return false;
-                }
-                return true;
-            }
-        }
+}
+
+// Adds a child to a node no reader can see yet; the node must have room
+static void add_child_private(TrieNode *n, unsigned char c, TrieNode *child)
+{
+    switch (n->type)
+    {
+    case TRIE_NODE4:
+    case TRIE_NODE16:
+    {
+        unsigned char *keys = n->type == TRIE_NODE4 ? ((TrieNode4 *)n)->keys : ((TrieNode16 *)n)->keys;
+        TrieNode **children = n->type == TRIE_NODE4 ? ((TrieNode4 *)n)->children : ((TrieNode16 *)n)->children;
+        int idx = 0;
+        while (idx < n->num_children && keys[idx] < c)
+            idx++;
+        memmove(keys + idx + 1, keys + idx, n->num_children - idx);
+        memmove(children + idx + 1, children + idx, (n->num_children - idx) * sizeof(TrieNode *));
+        keys[idx] = c;
+        children[idx] = child;
+        break;
+    }
+    case TRIE_NODE48:
+    {
+        TrieNode48 *p = (TrieNode48 *)n;
+        int pos = 0;
+        while (p->children[pos])
+            pos++;
+        p->children[pos] = child;
+        p->keys[c] = pos + 1;
+        break;
+    }
+    default:
+        ((TrieNode256 *)n)->children[c] = child;
+        break;
     }
-    return false;
+    n->num_children++;
 }
 
-void mark_subtree_as_revived(TrieNode *node) {
-    if (node == NULL) return;
-    if (node->is_end_of_path) {
-        node->is_deleted = 0;
+// Builds an unpublished node of the given type with n's prefix and all of
+// its children except the one under skip (pass -1 to keep them all). This
+// is how nodes are copied, grown and shrunk.
+static TrieNode *rebuild_node(const TrieNode *n, uint8_t type, int skip)
+{
+    TrieNode *copy = alloc_node(type);
+    if (!copy)
+        return NULL;
+    copy->partial_len = n->partial_len;
+    memcpy(copy->partial, n->partial, min_u32(TRIE_MAX_PREFIX_LEN, n->partial_len));
+    switch (n->type)
+    {
+    case TRIE_NODE4:
+    case TRIE_NODE16:
+    {
+        const unsigned char *keys = n->type == TRIE_NODE4 ? ((const TrieNode4 *)n)->keys : ((const TrieNode16 *)n)->keys;
+        TrieNode *const *children = n->type == TRIE_NODE4 ? ((const TrieNode4 *)n)->children : ((const TrieNode16 *)n)->children;
+        for (int i = 0; i < n->num_children; i++)
+        {
+            if (keys[i] != skip)
+                add_child_private(copy, keys[i], children[i]);
+        }
+        break;
     }
-    for (int i = 0; i < ALPHABET_SIZE; i++) {
-        if (node->children[i] != NULL) {
-            mark_subtree_as_revived(node->children[i]);
+    case TRIE_NODE48:
+    {
+        const TrieNode48 *p = (const TrieNode48 *)n;
+        for (int i = 0; i < 256; i++)
+        {
+            if (p->keys[i] && i != skip)
+                add_child_private(copy, i, p->children[p->keys[i] - 1]);
         }
+        break;
+    }
+    default:
+    {
+        const TrieNode256 *p = (const TrieNode256 *)n;
+        for (int i = 0; i < 256; i++)
+        {
+            if (p->children[i] && i != skip)
+                add_child_private(copy, i, p->children[i]);
+        }
+        break;
+    }
     }
+    return copy;
 }
 
-TrieNode *search_in_trie(TrieNode *root, const char *path) {
-    TrieNode *current = root;
-    for (const char *p = path; *p; ++p) {
-        if (*p == '/') continue;
-        int index = *p - 'a';
-        if (index < 0 || index >= ALPHABET_SIZE || !current->children[index])
-            return NULL;
-        current = current->children[index];
+// Adds a child to a published node. Free slots of Node48/Node256 are filled
+// in place (the child before the key, so readers never see a key without
+// its child); Node4/Node16 keep their keys sorted, so they are copied or
+// grown and the replacement is swapped into the parent slot.
+static int add_child(TrieNode *n, TrieNode **ref, unsigned char c, TrieNode *child)
+{
+    if (n->type == TRIE_NODE256)
+    {
+        publish(&((TrieNode256 *)n)->children[c], child);
+        n->num_children++;
+        return 1;
     }
-    return current;
+    if (n->type == TRIE_NODE48 && n->num_children < 48)
+    {
+        TrieNode48 *p = (TrieNode48 *)n;
+        int pos = 0;
+        while (p->children[pos])
+            pos++;
+        publish(&p->children[pos], child);
+        __atomic_store_n(&p->keys[c], pos + 1, __ATOMIC_RELEASE);
+        n->num_children++;
+        return 1;
+    }
+    uint8_t type = n->num_children < node_capacity(n->type) ? n->type : n->type + 1;
+    TrieNode *copy = rebuild_node(n, type, -1);
+    if (!copy)
+        return 0;
+    add_child_private(copy, c, child);
+    publish(ref, copy);
+    retire(n);
+    return 1;
 }
 
-int validate_path(TrieNode *root, const char *path) {
-    TrieNode *crawler = root;
-    while (*path) {
-        if (!crawler->children[(int)*path])
+// Removes the child under c from a published node. Node256 clears its slot
+// in place. Everything else is rebuilt without the child, shrinking with
+// some hysteresis so alternating insert/delete does not thrash; a Node48
+// slot is never reused while readers may still map an old key to it.
+static int remove_child(TrieNode *n, TrieNode **ref, unsigned char c)
+{
+    if (n->type == TRIE_NODE256 && n->num_children - 1 != 37)
+    {
+        publish(&((TrieNode256 *)n)->children[c], NULL);
+        n->num_children--;
+        return 1;
+    }
+    if (n->type == TRIE_NODE4 && n->num_children == 2)
+    {
+        // Only one child left: merge this node's prefix into it
+        TrieNode4 *p = (TrieNode4 *)n;
+        int keep = p->keys[0] == c ? 1 : 0;
+        TrieNode *child = p->children[keep];
+        if (IS_LEAF(child))
+        {
+            publish(ref, child);
+            retire(n);
+            return 1;
+        }
+        TrieNode *merged = rebuild_node(child, child->type, -1);
+        if (!merged)
             return 0;
-        crawler = crawler->children[(int)*path];
-        path++;
-    }
-    return crawler->is_end_of_path;
-}
-
-void print_trie_paths1(TrieNode *root, char *path, int level, int client_sock, char *prefix) {
-    if (root->is_deleted) return;
-    if (root->is_end_of_path && root->server && !root->server->is_server_down && !root->is_deleted) {
-        path[level] = '\0';
-        if (root->is_directory) {
-            char temp[BUFFER_SIZE];
-            snprintf(temp, sizeof(temp), "Directory: %s\n", path);
-            if (strstr(path, prefix) != NULL)
-                send(client_sock, temp, strlen(temp), 0);
-        } else if (root->is_directory == 0) {
-            char temp[BUFFER_SIZE];
-            snprintf(temp, sizeof(temp), "File: %s\n", path);
-            if (strstr(path, prefix) != NULL)
-                send(client_sock, temp, strlen(temp), 0);
+        unsigned char partial[TRIE_MAX_PREFIX_LEN];
+        uint32_t prefix = min_u32(n->partial_len, TRIE_MAX_PREFIX_LEN);
+        memcpy(partial, n->partial, prefix);
+        if (prefix < TRIE_MAX_PREFIX_LEN)
+            partial[prefix++] = p->keys[keep];
+        if (prefix < TRIE_MAX_PREFIX_LEN)
+        {
+            uint32_t sub_prefix = min_u32(child->partial_len, TRIE_MAX_PREFIX_LEN - prefix);
+            memcpy(partial + prefix, child->partial, sub_prefix);
+            prefix += sub_prefix;
         }
+        memcpy(merged->partial, partial, prefix);
+        merged->partial_len = n->partial_len + 1 + child->partial_len;
+        publish(ref, merged);
+        retire(child);
+        retire(n);
+        return 1;
+    }
+    uint8_t type = n->type;
+    if ((type == TRIE_NODE256 && n->num_children - 1 == 37) ||
+        (type == TRIE_NODE48 && n->num_children - 1 == 12) ||
+        (type == TRIE_NODE16 && n->num_children - 1 == 3))
+        type--;
+    TrieNode *copy = rebuild_node(n, type, c);
+    if (!copy)
+        return 0;
+    publish(ref, copy);
+    retire(n);
+    return 1;
+}
+
+// Links a new leaf into the tree. The caller has checked that the key is not
+// present. Every change is built off to the side and published with one
+// pointer store into ref, the slot that currently holds n.
+static int insert_rec(TrieNode *n, TrieNode **ref, TrieLeaf *leaf, uint32_t depth)
+{
+    const unsigned char *key = (const unsigned char *)leaf->key;
+    uint32_t key_len = leaf->key_len;
+    if (!n)
+    {
+        publish(ref, SET_LEAF(leaf));
+        return 1;
+    }
+
+    if (IS_LEAF(n))
+    {
+        // Split the leaf: both keys share bytes up to the first difference
+        TrieLeaf *existing = LEAF_RAW(n);
+        TrieNode *split = alloc_node(TRIE_NODE4);
+        if (!split)
+            return 0;
+        uint32_t limit = min_u32(existing->key_len, key_len);
+        uint32_t common = 0;
+        while (depth + common < limit && (unsigned char)existing->key[depth + common] == key[depth + common])
+            common++;
+        split->partial_len = common;
+        memcpy(split->partial, key + depth, min_u32(TRIE_MAX_PREFIX_LEN, common));
+        add_child_private(split, existing->key[depth + common], n);
+        add_child_private(split, key[depth + common], SET_LEAF(leaf));
+        publish(ref, split);
+        return 1;
     }
-    for (int i = 0; i < ALPHABET_SIZE; i++) {
-        if (root->children[i]) {
-            path[level] = i;
-            print_trie_paths1(root->children[i], path, level + 1, client_sock, prefix);
+
+    if (n->partial_len)
+    {
+        uint32_t diff = prefix_mismatch(n, key, key_len, depth);
+        if (diff < n->partial_len)
+        {
+            // The key leaves the compressed path early: split the prefix and
+            // hang a copy of n with the shortened prefix below the new node
+            TrieNode *split = alloc_node(TRIE_NODE4);
+            TrieNode *trimmed = rebuild_node(n, n->type, -1);
+            if (!split || !trimmed)
+            {
+                free(split);
+                free(trimmed);
+                return 0;
+            }
+            split->partial_len = diff;
+            memcpy(split->partial, n->partial, min_u32(TRIE_MAX_PREFIX_LEN, diff));
+            trimmed->partial_len = n->partial_len - (diff + 1);
+            unsigned char c;
+            if (n->partial_len <= TRIE_MAX_PREFIX_LEN)
+            {
+                c = n->partial[diff];
+                memcpy(trimmed->partial, n->partial + diff + 1, trimmed->partial_len);
+            }
+            else
+            {
+                const TrieLeaf *l = minimum_leaf(n);
+                c = l->key[depth + diff];
+                memcpy(trimmed->partial, l->key + depth + diff + 1, min_u32(TRIE_MAX_PREFIX_LEN, trimmed->partial_len));
+            }
+            add_child_private(split, c, trimmed);
+            add_child_private(split, key[depth + diff], SET_LEAF(leaf));
+            publish(ref, split);
+            retire(n);
+            return 1;
         }
+        depth += n->partial_len;
     }
-}
 
-void print_all_trie_paths1(int client_sock, char *prefix) {
-    char path[BUFFER_SIZE];
-    print_trie_paths1(global_trie_root, path, 0, client_sock, prefix);
-    sleep(0.5);
-    send(client_sock, "EOF", strlen("EOF"), 0);
+    if (depth >= key_len)
+        return 0;
+    TrieNode **child = find_child(n, key[depth]);
+    if (child)
+        return insert_rec(load_child(child), child, leaf, depth + 1);
+    return add_child(n, ref, key[depth], SET_LEAF(leaf));
 }
 
-void print_trie_paths(TrieNode *root, char *path, int level, int client_sock) {
-    if (root->is_deleted) return;
-    if (root->is_end_of_path && root->server && !root->server->is_server_down && !root->is_deleted) {
-        path[level] = '\0';
-        if (root->is_directory) {
-            char temp[BUFFER_SIZE];
-            snprintf(temp, sizeof(temp), "Directory: %s\n", path);
-            send(client_sock, temp, strlen(temp), 0);
-        } else if (root->is_directory == 0) {
-            char temp[BUFFER_SIZE];
-            snprintf(temp, sizeof(temp), "File: %s\n", path);
-            send(client_sock, temp, strlen(temp), 0);
+static TrieLeaf *delete_rec(TrieNode *n, TrieNode **ref, const unsigned char *key, uint32_t key_len, uint32_t depth)
+{
+    if (!n)
+        return NULL;
+    if (IS_LEAF(n))
+    {
+        TrieLeaf *leaf = LEAF_RAW(n);
+        if (leaf_matches(leaf, key, key_len))
+        {
+            publish(ref, NULL);
+            return leaf;
         }
+        return NULL;
     }
-    for (int i = 0; i < ALPHABET_SIZE; i++) {
-        if (root->children[i]) {
-            path[level] = i;
-            print_trie_paths(root->children[i], path, level + 1, client_sock);
-        }
+    if (n->partial_len)
+    {
+        if (check_prefix(n, key, key_len, depth) != min_u32(TRIE_MAX_PREFIX_LEN, n->partial_len))
+            return NULL;
+        depth += n->partial_len;
     }
+    if (depth >= key_len)
+        return NULL;
+    TrieNode **child = find_child(n, key[depth]);
+    if (!child)
+        return NULL;
+    TrieNode *next = load_child(child);
+    if (IS_LEAF(next))
+    {
+        TrieLeaf *leaf = LEAF_RAW(next);
+        if (!leaf_matches(leaf, key, key_len) || !remove_child(n, ref, key[depth]))
+            return NULL;
+        return leaf;
+    }
+    return delete_rec(next, child, key, key_len, depth + 1);
 }
 
-void print_all_trie_paths(int client_sock) {
-    char path[BUFFER_SIZE];
-    print_trie_paths(global_trie_root, path, 0, client_sock);
-    sleep(0.5);
-    send(client_sock, "EOF", strlen("EOF"), 0);
+static void free_node(TrieNode *n)
+{
+    if (!n)
+        return;
+    if (IS_LEAF(n))
+    {
+        free(LEAF_RAW(n));
+        return;
+    }
+    switch (n->type)
+    {
+    case TRIE_NODE4:
+        for (int i = 0; i < n->num_children; i++)
+            free_node(((TrieNode4 *)n)->children[i]);
+        break;
+    case TRIE_NODE16:
+        for (int i = 0; i < n->num_children; i++)
+            free_node(((TrieNode16 *)n)->children[i]);
+        break;
+    case TRIE_NODE48:
+        for (int i = 0; i < 48; i++)
+            free_node(((TrieNode48 *)n)->children[i]);
+        break;
+    default:
+        for (int i = 0; i < 256; i++)
+            free_node(((TrieNode256 *)n)->children[i]);
+        break;
+    }
+    free(n);
 }
 
-void collect_paths_to_buffer(TrieNode *node, char *current_path, int depth, char *buffer, StorageServer *server) {
-    if (node == NULL) return;
-    if (node->is_end_of_path && node->server == server) {
-        current_path[depth] = '\0';
-        strcat(buffer, "File: ");
-        strcat(buffer, current_path);
-        strcat(buffer, "\n");
+// Visits leaves in lexicographic order of their paths
+static int iterate_rec(TrieNode *n, trie_iter_cb cb, void *data)
+{
+    if (!n)
+        return 0;
+    if (IS_LEAF(n))
+        return cb(LEAF_RAW(n), data);
+    int res;
+    switch (n->type)
+    {
+    case TRIE_NODE4:
+        for (int i = 0; i < n->num_children; i++)
+        {
+            if ((res = iterate_rec(load_child(&((TrieNode4 *)n)->children[i]), cb, data)))
+                return res;
+        }
+        break;
+    case TRIE_NODE16:
+        for (int i = 0; i < n->num_children; i++)
+        {
+            if ((res = iterate_rec(load_child(&((TrieNode16 *)n)->children[i]), cb, data)))
+                return res;
+        }
+        break;
+    case TRIE_NODE48:
+    {
+        TrieNode48 *p = (TrieNode48 *)n;
+        for (int i = 0; i < 256; i++)
+        {
+            int slot = __atomic_load_n(&p->keys[i], __ATOMIC_ACQUIRE);
+            if (slot && (res = iterate_rec(load_child(&p->children[slot - 1]), cb, data)))
+                return res;
+        }
+        break;
     }
-    for (int i = 0; i < ALPHABET_SIZE; i++) {
-        if (node->children[i] != NULL) {
-            current_path[depth] = (char)i;
-            collect_paths_to_buffer(node->children[i], current_path, depth + 1, buffer, server);
+    default:
+        for (int i = 0; i < 256; i++)
+        {
+            if ((res = iterate_rec(load_child(&((TrieNode256 *)n)->children[i]), cb, data)))
+                return res;
         }
+        break;
     }
+    return 0;
 }
 
-void retrieve_paths_to_buffer(TrieNode *root, char *buffer, StorageServer *server) {
-    if (root == NULL) return;
-    char current_path[BUFFER_SIZE] = {0};
-    buffer[0] = '\0';
-    collect_paths_to_buffer(root, current_path, 0, buffer, server);
+// Creates an empty namespace index
+Trie *create_trie(void)
+{
+    Trie *trie = (Trie *)calloc(1, sizeof(Trie));
+    if (!trie)
+    {
+        printf("Error: Failed to allocate memory for trie\n");
+        return NULL;
+    }
+    pthread_mutex_init(&trie->write_lock, NULL);
+    return trie;
 }
 
-void find_paths_with_prefix(TrieNode *node, char *current_path, size_t depth, const char *prefix, char **results, int *count) {
-    if (!node) return;
-    if (node->is_end_of_path && !node->is_directory) {
-        current_path[depth] = '\0';
-        results[*count] = strdup(current_path);
-        if (!results[*count]) {
-            perror("strdup failed in find_paths_with_prefix");
-            return;
-        }
-        (*count)++;
-    }
-    for (int i = 0; i < ALPHABET_SIZE; i++) {
-        if (node->children[i]) {
-            current_path[depth] = (char)i;
-            find_paths_with_prefix(node->children[i], current_path, depth + 1, prefix, results, count);
-        }
+// Frees every node and leaf in the index, along with anything still waiting
+// for reclamation. No thread may be reading any trie at this point.
+void free_trie(Trie *trie)
+{
+    if (!trie)
+        return;
+    free_node(trie->root);
+    pthread_mutex_destroy(&trie->write_lock);
+    free(trie);
+    pthread_mutex_lock(&reclaim_lock);
+    for (int i = 0; i < 3; i++)
+    {
+        free_retired(limbo[i]);
+        limbo[i] = NULL;
     }
+    pthread_mutex_unlock(&reclaim_lock);
 }
 
-void find_paths_with_prefix_two(TrieNode *node, char *current_path, size_t depth, const char *prefix, char **results, int *count) {
-    if (!node) return;
-    if (node->is_end_of_path) {
-        current_path[depth] = '\0';
-        results[*count] = strdup(current_path);
-        if (!results[*count]) {
-            perror("strdup failed in find_paths_with_prefix_two");
-            return;
-        }
-        (*count)++;
+size_t trie_size(const Trie *trie)
+{
+    return trie ? __atomic_load_n(&trie->size, __ATOMIC_RELAXED) : 0;
+}
+
+// Returns the leaf for a path, creating it if needed. A new leaf is fully
+// initialised before readers can reach it; an existing one is updated in
+// place and revived if it was marked deleted. *created is set to 1 when a
+// new leaf was added.
+TrieLeaf *trie_insert(Trie *trie, const char *path, StorageServer *server, int is_directory, int *created)
+{
+    int dummy = 0;
+    if (!created)
+        created = &dummy;
+    *created = 0;
+    if (!trie || !path)
+        return NULL;
+    pthread_mutex_lock(&trie->write_lock);
+    TrieLeaf *leaf = trie_search(trie, path);
+    if (leaf)
+    {
+        leaf->is_directory = is_directory;
+        leaf->server = server;
+        leaf->is_deleted = 0;
     }
-    for (int i = 0; i < ALPHABET_SIZE; i++) {
-        if (node->children[i]) {
-            current_path[depth] = (char)i;
-            find_paths_with_prefix_two(node->children[i], current_path, depth + 1, prefix, results, count);
+    else
+    {
+        leaf = make_leaf((const unsigned char *)path, strlen(path) + 1, server, is_directory);
+        if (leaf && !insert_rec(trie->root, &trie->root, leaf, 0))
+        {
+            free(leaf);
+            leaf = NULL;
+        }
+        if (leaf)
+        {
+            *created = 1;
+            __atomic_store_n(&trie->size, trie->size + 1, __ATOMIC_RELAXED);
         }
     }
+    try_reclaim();
+    pthread_mutex_unlock(&trie->write_lock);
+    return leaf;
 }
 
-char **search_trie_for_prefix(const char *prefix, int *result_count) {
-    extern TrieNode *global_trie_root;
-    TrieNode *current = global_trie_root;
-    for (const char *p = prefix; *p; p++) {
-        int index = (unsigned char)*p;
-        if (!current->children[index]) {
-            *result_count = 0;
-            return NULL;
+// Exact lookup of a path. Callers that keep using the leaf must hold a read
+// section themselves.
+TrieLeaf *trie_search(const Trie *trie, const char *path)
+{
+    if (!trie || !path)
+        return NULL;
+    const unsigned char *key = (const unsigned char *)path;
+    uint32_t key_len = strlen(path) + 1;
+    uint32_t depth = 0;
+    TrieLeaf *found = NULL;
+    trie_read_lock();
+    TrieNode *n = load_child(&trie->root);
+    while (n)
+    {
+        if (IS_LEAF(n))
+        {
+            TrieLeaf *leaf = LEAF_RAW(n);
+            found = leaf_matches(leaf, key, key_len) ? leaf : NULL;
+            break;
+        }
+        if (n->partial_len)
+        {
+            // Only the stored prefix bytes are checked here; the final leaf
+            // comparison catches any mismatch in the rest of the prefix.
+            if (check_prefix(n, key, key_len, depth) != min_u32(TRIE_MAX_PREFIX_LEN, n->partial_len))
+                break;
+            depth += n->partial_len;
         }
-        current = current->children[index];
+        if (depth >= key_len)
+            break;
+        TrieNode **child = find_child(n, key[depth]);
+        n = child ? load_child(child) : NULL;
+        depth++;
     }
-    char **results = (char **)malloc(100 * sizeof(char *));
-    if (!results) {
-        perror("malloc failed in search_trie_for_prefix");
-        *result_count = 0;
-        return NULL;
+    trie_read_unlock();
+    return found;
+}
+
+// Removes a path; its leaf is freed once no reader can hold it any more.
+// Returns true if the path was present.
+bool trie_delete(Trie *trie, const char *path)
+{
+    if (!trie || !path)
+        return false;
+    pthread_mutex_lock(&trie->write_lock);
+    TrieLeaf *leaf = delete_rec(trie->root, &trie->root, (const unsigned char *)path, strlen(path) + 1, 0);
+    if (leaf)
+    {
+        retire(leaf);
+        __atomic_store_n(&trie->size, trie->size - 1, __ATOMIC_RELAXED);
     }
-    char current_path[1024];
-    strcpy(current_path, prefix);
-    *result_count = 0;
-    find_paths_with_prefix(current, current_path, strlen(prefix), prefix, results, result_count);
-    return results;
+    try_reclaim();
+    pthread_mutex_unlock(&trie->write_lock);
+    return leaf != NULL;
 }
 
-char **search_trie_for_prefix_two(const char *prefix, int *result_count) {
-    extern TrieNode *global_trie_root;
-    TrieNode *current = global_trie_root;
-    for (const char *p = prefix; *p; p++) {
-        int index = (unsigned char)*p;
-        if (!current->children[index]) {
-            *result_count = 0;
-            return NULL;
+// Visits every path in lexicographic order. The callback runs inside a read
+// section and may modify leaf metadata, but must not insert or delete.
+int trie_iterate(const Trie *trie, trie_iter_cb cb, void *data)
+{
+    if (!trie)
+        return 0;
+    trie_read_lock();
+    int res = iterate_rec(load_child(&trie->root), cb, data);
+    trie_read_unlock();
+    return res;
+}
+
+// Visits every path that starts with prefix, descending straight to the
+// subtree that holds them instead of walking the whole index.
+int trie_iterate_prefix(const Trie *trie, const char *prefix, trie_iter_cb cb, void *data)
+{
+    if (!trie || !prefix)
+        return 0;
+    const unsigned char *key = (const unsigned char *)prefix;
+    uint32_t key_len = strlen(prefix);
+    uint32_t depth = 0;
+    int res = 0;
+    trie_read_lock();
+    TrieNode *n = load_child(&trie->root);
+    while (n)
+    {
+        if (IS_LEAF(n))
+        {
+            TrieLeaf *leaf = LEAF_RAW(n);
+            if (leaf->key_len > key_len && memcmp(leaf->key, key, key_len) == 0)
+                res = cb(leaf, data);
+            break;
         }
-        current = current->children[index];
-    }
-    char **results = (char **)malloc(100 * sizeof(char *));
-    if (!results) {
-        perror("malloc failed in search_trie_for_prefix_two");
-        *result_count = 0;
-        return NULL;
+        if (n->partial_len)
+        {
+            // Compare the whole compressed path against what is left of the prefix
+            const unsigned char *full = n->partial;
+            if (n->partial_len > TRIE_MAX_PREFIX_LEN)
+                full = (const unsigned char *)minimum_leaf(n)->key + depth;
+            uint32_t i;
+            for (i = 0; i < n->partial_len && depth + i < key_len; i++)
+            {
+                if (full[i] != key[depth + i])
+                    break;
+            }
+            if (i < n->partial_len && depth + i < key_len)
+                break;
+            depth += n->partial_len;
+        }
+        if (depth >= key_len)
+        {
+            res = iterate_rec(n, cb, data);
+            break;
+        }
+        TrieNode **child = find_child(n, key[depth]);
+        n = child ? load_child(child) : NULL;
+        depth++;
     }
-    char current_path[1024];
-    strcpy(current_path, prefix);
-    *result_count = 0;
-    find_paths_with_prefix_two(current, current_path, strlen(prefix), prefix, results, result_count);
-    return results;
+    trie_read_unlock();
+    return res;
 }
 
-int return_one_if_directory(const char *path) {
-    extern TrieNode *global_trie_root;
-    TrieNode *crawler = global_trie_root;
-    while (*path) {
-        if (!crawler->children[(int)*path]) {
-            return 0;
+// Visits, in order, the leaves below n whose key sorts after the given key.
+// depth key bytes were consumed above n, and they equal those of after.
+static int iterate_after_rec(TrieNode *n, const unsigned char *after, uint32_t after_len, uint32_t depth, trie_iter_cb cb, void *data)
+{
+    if (!n)
+        return 0;
+    if (IS_LEAF(n))
+    {
+        TrieLeaf *leaf = LEAF_RAW(n);
+        int cmp = memcmp(leaf->key, after, min_u32(leaf->key_len, after_len));
+        if (cmp > 0 || (cmp == 0 && leaf->key_len > after_len))
+            return cb(leaf, data);
+        return 0;
+    }
+    if (n->partial_len)
+    {
+        const unsigned char *full = n->partial;
+        if (n->partial_len > TRIE_MAX_PREFIX_LEN)
+            full = (const unsigned char *)minimum_leaf(n)->key + depth;
+        for (uint32_t i = 0; i < n->partial_len; i++)
+        {
+            // Keys end with a NUL, so a key that is still matching here
+            // cannot have run out
+            if (depth + i >= after_len || full[i] > after[depth + i])
+                return iterate_rec(n, cb, data);
+            if (full[i] < after[depth + i])
+                return 0;
         }
-        crawler = crawler->children[(int)*path];
-        path++;
+        depth += n->partial_len;
     }
-    if (crawler != NULL && crawler->is_end_of_path && crawler->is_directory) {
-        return 1;
+    if (depth >= after_len)
+        return iterate_rec(n, cb, data);
+    // Children before after's next byte are skipped, the one on after's
+    // path is searched further, and the ones past it are visited whole
+    int res;
+    for (int c = after[depth]; c < 256; c++)
+    {
+        TrieNode **child = find_child(n, (unsigned char)c);
+        if (!child)
+            continue;
+        if (c == after[depth])
+            res = iterate_after_rec(load_child(child), after, after_len, depth + 1, cb, data);
+        else
+            res = iterate_rec(load_child(child), cb, data);
+        if (res)
+            return res;
     }
     return 0;
-} 
\ No newline at end of file
+}
+
+typedef struct
+{
+    const char *prefix;
+    size_t prefix_len;
+    trie_iter_cb cb;
+    void *data;
+    int left_prefix; // Set once the walk passed the last key with the prefix
+} PrefixBound;
+
+static int stop_past_prefix(TrieLeaf *leaf, void *data)
+{
+    PrefixBound *bound = (PrefixBound *)data;
+    if (strncmp(leaf->key, bound->prefix, bound->prefix_len) != 0)
+    {
+        bound->left_prefix = 1;
+        return 1;
+    }
+    return bound->cb(leaf, bound->data);
+}
+
+// Like trie_iterate_prefix, but starts after the given key, so a listing can
+// be resumed from a cursor without revisiting what came before it. A NULL or
+// empty key starts at the beginning.
+int trie_iterate_prefix_after(const Trie *trie, const char *prefix, const char *after, trie_iter_cb cb, void *data)
+{
+    if (!trie || !prefix)
+        return 0;
+    size_t prefix_len = strlen(prefix);
+    if (!after || !*after)
+        return trie_iterate_prefix(trie, prefix, cb, data);
+    int cmp = strncmp(after, prefix, prefix_len);
+    if (cmp < 0)
+        return trie_iterate_prefix(trie, prefix, cb, data);
+    if (cmp > 0)
+        return 0; // Every key with the prefix sorts before the cursor
+
+    PrefixBound bound = {.prefix = prefix, .prefix_len = prefix_len, .cb = cb, .data = data};
+    trie_read_lock();
+    int res = iterate_after_rec(load_child(&trie->root), (const unsigned char *)after, strlen(after) + 1, 0,
+                                stop_past_prefix, &bound);
+    trie_read_unlock();
+    return bound.left_prefix ? 0 : res;
+}
+
+// True if the leaf is path itself or lies below it as a directory entry
+bool trie_leaf_in_subtree(const TrieLeaf *leaf, const char *path, size_t path_len)
+{
+    if (leaf->key_len - 1 < path_len || memcmp(leaf->key, path, path_len) != 0)
+        return false;
+    return leaf->key[path_len] == '\0' || leaf->key[path_len] == '/' || (path_len > 0 && path[path_len - 1] == '/');
+}
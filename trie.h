@@ -2,42 +2,59 @@
 #define TRIE_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdbool.h>
 
-#define ALPHABET_SIZE 128
-#define BUFFER_SIZE 40960
+// Namespace index for the naming server: an adaptive radix tree (ART).
+// Inner nodes grow from 4 to 16, 48 and 256 children as needed and carry a
+// compressed path prefix, so a path costs one leaf plus a handful of small
+// inner nodes instead of one 128-pointer node per character.
+//
+// Readers never take a lock. They bracket their accesses with
+// trie_read_lock()/trie_read_unlock(), which only announce the current
+// epoch. Writers are serialized by a mutex inside the trie and never modify
+// a node a reader may be walking: they build a replacement, publish it with
+// a single atomic pointer store and retire the old node, which is freed once
+// every reader that could have seen it has left its read section.
 
 // Forward declaration for StorageServer (to avoid circular dependency)
 typedef struct StorageServer StorageServer;
 
-typedef struct TrieNode {
-    struct TrieNode *children[ALPHABET_SIZE];
-    int is_end_of_path;
-    StorageServer *server;
-    int is_directory;
-    int is_deleted;
-} TrieNode;
-
-TrieNode *create_trie_node(StorageServer *server);
-void insert_path(TrieNode *root, const char *path, StorageServer *server, int is_directory);
-void mark_subtree_as_deleted(TrieNode *node);
-StorageServer *search_path(TrieNode *root, const char *path, int want_to_delete);
-StorageServer *search_trie(TrieNode *root, const char *path);
-void free_trie(TrieNode *root);
-bool remove_path_from_trie(TrieNode *node, const char *path, int depth);
-void mark_subtree_as_revived(TrieNode *node);
-TrieNode *search_in_trie(TrieNode *root, const char *path);
-int validate_path(TrieNode *root, const char *path);
-void print_trie_paths1(TrieNode *root, char *path, int level, int client_sock, char *prefix);
-void print_all_trie_paths1(int client_sock, char *prefix);
-void print_trie_paths(TrieNode *root, char *path, int level, int client_sock);
-void print_all_trie_paths(int client_sock);
-void collect_paths_to_buffer(TrieNode *node, char *current_path, int depth, char *buffer, StorageServer *server);
-void retrieve_paths_to_buffer(TrieNode *root, char *buffer, StorageServer *server);
-void find_paths_with_prefix(TrieNode *node, char *current_path, size_t depth, const char *prefix, char **results, int *count);
-void find_paths_with_prefix_two(TrieNode *node, char *current_path, size_t depth, const char *prefix, char **results, int *count);
-char **search_trie_for_prefix(const char *prefix, int *result_count);
-char **search_trie_for_prefix_two(const char *prefix, int *result_count);
-int return_one_if_directory(const char *path);
-
-#endif // TRIE_H 
\ No newline at end of file
+// Inner node types are private to trie.c
+typedef struct TrieNode TrieNode;
+
+// A leaf is one complete path. The key includes the terminating NUL so that
+// no stored path is a prefix of another.
+// The metadata fields may be updated in place while readers look at them.
+typedef struct TrieLeaf
+{
+    StorageServer *_Atomic server; // Pointer to the associated StorageServer
+    _Atomic int is_directory;
+    _Atomic int is_deleted;
+    _Atomic uint64_t version; // Of the copy the server holds; maintained by the naming server
+    uint32_t key_len;
+    char key[];
+} TrieLeaf;
+
+typedef struct Trie Trie;
+
+// Return non-zero from the callback to stop the iteration
+typedef int (*trie_iter_cb)(TrieLeaf *leaf, void *data);
+
+Trie *create_trie(void);
+void free_trie(Trie *trie);
+size_t trie_size(const Trie *trie);
+
+// Leaves returned by trie_search stay valid until the enclosing read section ends.
+void trie_read_lock(void);
+void trie_read_unlock(void);
+
+TrieLeaf *trie_insert(Trie *trie, const char *path, StorageServer *server, int is_directory, int *created);
+TrieLeaf *trie_search(const Trie *trie, const char *path);
+bool trie_delete(Trie *trie, const char *path);
+int trie_iterate(const Trie *trie, trie_iter_cb cb, void *data);
+int trie_iterate_prefix(const Trie *trie, const char *prefix, trie_iter_cb cb, void *data);
+int trie_iterate_prefix_after(const Trie *trie, const char *prefix, const char *after, trie_iter_cb cb, void *data);
+bool trie_leaf_in_subtree(const TrieLeaf *leaf, const char *path, size_t path_len);
+
+#endif // TRIE_H
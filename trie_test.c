@@ -0,0 +1,358 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "trie.h"
+
+// Standalone test of the namespace index:
+//   gcc -o trie_test trie_test.c trie.c -lpthread && ./trie_test
+// Build with -fsanitize=address as well to catch a node freed while a
+// reader could still see it.
+
+#define RANDOM_PATHS 5000
+#define STRESS_READERS 4
+#define STRESS_PATHS 512
+#define STRESS_WRITES 200000
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+    if (ok) {
+        printf("✅ %s\n", what);
+    } else {
+        printf("❌ %s\n", what);
+        failures++;
+    }
+}
+
+typedef struct {
+    char **keys;
+    size_t count;
+    size_t capacity;
+} Collected;
+
+static int collect(TrieLeaf *leaf, void *data) {
+    Collected *c = (Collected *)data;
+    if (c->count == c->capacity) {
+        c->capacity = c->capacity ? c->capacity * 2 : 64;
+        c->keys = realloc(c->keys, c->capacity * sizeof(char *));
+    }
+    c->keys[c->count++] = strdup(leaf->key);
+    return 0;
+}
+
+static void collected_free(Collected *c) {
+    for (size_t i = 0; i < c->count; i++) {
+        free(c->keys[i]);
+    }
+    free(c->keys);
+    memset(c, 0, sizeof(*c));
+}
+
+static int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// "dir/" followed by one byte: every key is a child of the same inner node
+static void child_key(char *key, int c) {
+    key[0] = 'd';
+    key[1] = 'i';
+    key[2] = 'r';
+    key[3] = '/';
+    key[4] = (char)c;
+    key[5] = '\0';
+}
+
+// The children 1..count are present and nothing else under "dir/"
+static int children_are(Trie *trie, int count) {
+    char key[8];
+    for (int c = 1; c < 256; c++) {
+        child_key(key, c);
+        TrieLeaf *leaf = trie_search(trie, key);
+        if ((leaf != NULL) != (c <= count)) {
+            return 0;
+        }
+        if (leaf && strcmp(leaf->key, key) != 0) {
+            return 0;
+        }
+    }
+    Collected all = {0};
+    trie_iterate_prefix(trie, "dir/", collect, &all);
+    int ok = all.count == (size_t)count && trie_size(trie) == (size_t)count + 1;
+    for (size_t i = 0; ok && i < all.count; i++) {
+        ok = (unsigned char)all.keys[i][4] == i + 1; // In byte order
+    }
+    collected_free(&all);
+    return ok;
+}
+
+// One inner node goes through every size: 4, 16, 48 and 256 children as
+// they are added, and back down as they are removed
+static void test_node_growth(void) {
+    printf("\n🌳 Node growth and shrinking...\n");
+    Trie *trie = create_trie();
+    int created = 0;
+    trie_insert(trie, "other", NULL, 0, &created);
+    check(created == 1 && trie_size(trie) == 1, "first path is created");
+
+    const int steps[] = {4, 5, 16, 17, 48, 49, 255};
+    int added = 0;
+    char key[8], what[64];
+    for (size_t s = 0; s < sizeof(steps) / sizeof(steps[0]); s++) {
+        while (added < steps[s]) {
+            child_key(key, ++added);
+            trie_insert(trie, key, NULL, 0, NULL);
+        }
+        snprintf(what, sizeof(what), "%d children found after growing", added);
+        check(children_are(trie, added), what);
+    }
+    // "dir/" itself makes the 256th child (its terminating NUL)
+    trie_insert(trie, "dir/", NULL, 1, &created);
+    check(created && trie_search(trie, "dir/") && trie_search(trie, "dir/")->is_directory, "full Node256 holds the directory too");
+    check(trie_delete(trie, "dir/") && !trie_search(trie, "dir/"), "directory removed from a full node");
+
+    trie_insert(trie, "dir/\x01", NULL, 1, &created);
+    check(!created && trie_search(trie, "dir/\x01")->is_directory, "inserting an existing path updates it in place");
+
+    for (int s = (int)(sizeof(steps) / sizeof(steps[0])) - 2; s >= 0; s--) {
+        while (added > steps[s]) {
+            child_key(key, added--);
+            trie_delete(trie, key);
+        }
+        snprintf(what, sizeof(what), "%d children found after shrinking", added);
+        check(children_are(trie, added), what);
+    }
+    while (added > 0) {
+        child_key(key, added--);
+        trie_delete(trie, key);
+    }
+    check(trie_size(trie) == 1 && trie_search(trie, "other"), "only the unrelated path is left");
+    check(!trie_delete(trie, "dir/\x01"), "deleting a missing path reports it");
+    free_trie(trie);
+}
+
+static char *random_path(void) {
+    static const char *parts[] = {"home", "h", "docs", "doc", "a", "ab", "abc", "report.txt", "data", "d"};
+    char path[256] = "";
+    int depth = 1 + rand() % 5;
+    for (int i = 0; i < depth; i++) {
+        if (i > 0) {
+            strcat(path, "/");
+        }
+        strcat(path, parts[rand() % 10]);
+        if (rand() % 3 == 0) {
+            char n[16];
+            snprintf(n, sizeof(n), "%d", rand() % 100);
+            strcat(path, n);
+        }
+    }
+    return strdup(path);
+}
+
+// Keys that share long prefixes and are prefixes of one another, checked
+// against a sorted array
+static void test_random_paths(void) {
+    printf("\n🎲 Random paths against a sorted list...\n");
+    srand(42);
+    Trie *trie = create_trie();
+    char **paths = malloc(RANDOM_PATHS * sizeof(char *));
+    size_t count = 0;
+    for (int i = 0; i < RANDOM_PATHS; i++) {
+        char *path = random_path();
+        int created = 0;
+        trie_insert(trie, path, NULL, 0, &created);
+        if (created) {
+            paths[count++] = path;
+        } else {
+            free(path);
+        }
+    }
+    qsort(paths, count, sizeof(char *), compare_strings);
+    check(trie_size(trie) == count, "size counts distinct paths");
+
+    Collected all = {0};
+    trie_iterate(trie, collect, &all);
+    int same = all.count == count;
+    for (size_t i = 0; same && i < count; i++) {
+        same = strcmp(all.keys[i], paths[i]) == 0;
+    }
+    collected_free(&all);
+    check(same, "iteration visits every path in sorted order");
+
+    // A listing resumed after every 7th key sees exactly the keys after it
+    int resumed = 1;
+    for (size_t i = 0; resumed && i < count; i += 7) {
+        Collected rest = {0};
+        trie_iterate_prefix_after(trie, "", paths[i], collect, &rest);
+        resumed = rest.count == count - i - 1 && (rest.count == 0 || strcmp(rest.keys[0], paths[i + 1]) == 0);
+        collected_free(&rest);
+    }
+    check(resumed, "listing resumes right after the cursor");
+
+    int prefixed = 1;
+    const char *prefixes[] = {"home", "home/", "a", "ab", "abc/d", "docs1", "zzz"};
+    for (size_t p = 0; p < sizeof(prefixes) / sizeof(prefixes[0]); p++) {
+        size_t expected = 0;
+        for (size_t i = 0; i < count; i++) {
+            expected += strncmp(paths[i], prefixes[p], strlen(prefixes[p])) == 0;
+        }
+        Collected some = {0};
+        trie_iterate_prefix(trie, prefixes[p], collect, &some);
+        prefixed &= some.count == expected;
+        collected_free(&some);
+    }
+    check(prefixed, "prefix iteration finds exactly the paths with the prefix");
+
+    for (size_t i = 0; i < count; i += 2) {
+        trie_delete(trie, paths[i]);
+    }
+    int found = 1;
+    for (size_t i = 0; i < count; i++) {
+        found &= (trie_search(trie, paths[i]) != NULL) == (i % 2 == 1);
+    }
+    check(found && trie_size(trie) == count / 2, "every other path deleted, the rest still found");
+
+    for (size_t i = 0; i < count; i++) {
+        free(paths[i]);
+    }
+    free(paths);
+    free_trie(trie);
+}
+
+typedef struct {
+    Trie *trie;
+    TrieLeaf *leaf;
+    int stage; // 1: leaf found, 2: writer done, 3: reader done
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} HeldLeaf;
+
+static void wait_stage(HeldLeaf *held, int stage) {
+    pthread_mutex_lock(&held->lock);
+    while (held->stage < stage) {
+        pthread_cond_wait(&held->cond, &held->lock);
+    }
+    pthread_mutex_unlock(&held->lock);
+}
+
+static void set_stage(HeldLeaf *held, int stage) {
+    pthread_mutex_lock(&held->lock);
+    held->stage = stage;
+    pthread_cond_broadcast(&held->cond);
+    pthread_mutex_unlock(&held->lock);
+}
+
+static void *hold_leaf(void *arg) {
+    HeldLeaf *held = (HeldLeaf *)arg;
+    trie_read_lock();
+    held->leaf = trie_search(held->trie, "keep/me");
+    set_stage(held, 1);
+    wait_stage(held, 2);
+    // Deleted and followed by many writes, but this read section began first
+    int intact = held->leaf && strcmp(held->leaf->key, "keep/me") == 0;
+    trie_read_unlock();
+    set_stage(held, 3);
+    return (void *)(long)intact;
+}
+
+// A leaf deleted while a reader holds it stays valid until that reader
+// leaves its read section
+static void test_deleted_leaf_outlives_reader(void) {
+    printf("\n⏳ Reclamation waits for readers...\n");
+    Trie *trie = create_trie();
+    trie_insert(trie, "keep/me", NULL, 0, NULL);
+    HeldLeaf held = {.trie = trie, .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+    pthread_t reader;
+    pthread_create(&reader, NULL, hold_leaf, &held);
+    wait_stage(&held, 1);
+    check(trie_delete(trie, "keep/me") && !trie_search(trie, "keep/me"), "leaf unlinked while a reader holds it");
+    // Every write tries to advance the epoch and free what was retired
+    char key[32];
+    for (int i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "churn/%d", i % 50);
+        if (i % 2 == 0) {
+            trie_insert(trie, key, NULL, 0, NULL);
+        } else {
+            trie_delete(trie, key);
+        }
+    }
+    set_stage(&held, 2);
+    void *intact;
+    pthread_join(reader, &intact);
+    check(intact != NULL, "reader still sees the deleted leaf's key");
+    free_trie(trie);
+}
+
+typedef struct {
+    Trie *trie;
+    volatile int stop;
+    long lookups;
+    long wrong;
+} Stress;
+
+static void stress_key(char *key, size_t size, int i) {
+    snprintf(key, size, "stress/dir%d/file%d", i % 7, i);
+}
+
+static void *stress_reader(void *arg) {
+    Stress *stress = (Stress *)arg;
+    unsigned seed = (unsigned)(long)pthread_self();
+    char key[64];
+    long lookups = 0, wrong = 0;
+    while (!stress->stop) {
+        int i = rand_r(&seed) % STRESS_PATHS;
+        stress_key(key, sizeof(key), i);
+        trie_read_lock();
+        TrieLeaf *leaf = trie_search(stress->trie, key);
+        // A leaf found is the one asked for, and readable until unlocked
+        if (leaf && (strcmp(leaf->key, key) != 0 || leaf->is_directory != i % 2)) {
+            wrong++;
+        }
+        trie_read_unlock();
+        lookups++;
+    }
+    __atomic_add_fetch(&stress->lookups, lookups, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stress->wrong, wrong, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+// Readers search without locks while a writer keeps inserting and deleting,
+// which makes nodes grow, shrink and be retired all the time
+static void test_concurrent_readers(void) {
+    printf("\n🏃 Lock-free readers against a busy writer...\n");
+    Trie *trie = create_trie();
+    Stress stress = {.trie = trie};
+    pthread_t readers[STRESS_READERS];
+    for (int r = 0; r < STRESS_READERS; r++) {
+        pthread_create(&readers[r], NULL, stress_reader, &stress);
+    }
+    unsigned seed = 7;
+    char key[64];
+    for (int w = 0; w < STRESS_WRITES; w++) {
+        int i = rand_r(&seed) % STRESS_PATHS;
+        stress_key(key, sizeof(key), i);
+        if (rand_r(&seed) % 2) {
+            trie_insert(trie, key, NULL, i % 2, NULL);
+        } else {
+            trie_delete(trie, key);
+        }
+    }
+    stress.stop = 1;
+    for (int r = 0; r < STRESS_READERS; r++) {
+        pthread_join(readers[r], NULL);
+    }
+    char what[96];
+    snprintf(what, sizeof(what), "%ld lookups during %d writes all returned the right leaf", stress.lookups, STRESS_WRITES);
+    check(stress.wrong == 0 && stress.lookups > 0, what);
+    free_trie(trie);
+}
+
+int main() {
+    printf("=== Namespace Index Test ===\n");
+    test_node_growth();
+    test_random_paths();
+    test_deleted_leaf_outlives_reader();
+    test_concurrent_readers();
+    printf("\n%s %d failure(s)\n", failures ? "❌" : "🎉", failures);
+    return failures ? 1 : 0;
+}
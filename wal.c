@@ -0,0 +1,351 @@
+#include "wal.h"
+#include "fileio.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#define WAL_MAGIC "NMWAL001"
+#define SNAPSHOT_MAGIC "NMSNAP01"
+#define WAL_FILE_HEADER 16                    // 8-byte magic, u64 generation
+#define WAL_RECORD_HEADER 9                   // u32 length, u32 CRC-32, u8 type
+#define WAL_DEFAULT_MAX_BYTES (64 << 20)      // Compact into a snapshot after this many bytes
+#define WAL_SYNC_INTERVAL_MS 1000             // The log is synced to disk this often
+#define WAL_SNAPSHOT_BUFFER (1 << 20)         // Snapshot records are written in blocks of this size
+
+static pthread_mutex_t wal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t stop_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stop_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t checkpoint_thread;
+static int stopping;
+
+static char *log_path;
+static char *snapshot_path;
+static int log_fd = -1;
+static size_t log_size;
+static size_t max_bytes = WAL_DEFAULT_MAX_BYTES;
+static uint64_t generation; // Bumped by every snapshot; the log only holds changes made after it
+static int dirty;           // Appended to since the last sync
+
+static wal_snapshot_cb snapshot_writer;
+static void *snapshot_data;
+static int snapshot_fd = -1;
+static int snapshot_failed;
+static ProtoWriter frame;           // Record header being written, guarded by wal_lock
+static ProtoWriter snapshot_buffer; // Pending snapshot records
+
+static uint32_t record_crc(uint8_t type, const char *payload, size_t len)
+{
+    uint32_t crc = crc32_update(0xFFFFFFFFu, &type, 1);
+    return crc32_update(crc, payload, len) ^ 0xFFFFFFFFu;
+}
+
+static int write_file_header(int fd, const char *magic)
+{
+    proto_writer_reset(&frame);
+    proto_put_bytes(&frame, magic, 8);
+    proto_put_u64(&frame, generation);
+    if (frame.failed)
+        return -1;
+    struct iovec iov = {frame.data, frame.len};
+    return write_iov(fd, &iov, 1);
+}
+
+// Frames one record into the frame writer
+static int frame_record(uint8_t type, const ProtoWriter *record)
+{
+    proto_writer_reset(&frame);
+    proto_put_u32(&frame, record->len + 1);
+    proto_put_u32(&frame, record_crc(type, record->data, record->len));
+    proto_put_u8(&frame, type);
+    return frame.failed || record->failed ? -1 : 0;
+}
+
+// Replays one file. Returns the number of records, or -1 if the file is not
+// a log of the expected kind. *valid_end is set to the end of the last good
+// record, and *file_generation to the generation in the header.
+static long replay_file(const char *path, const char *magic, wal_replay_cb replay, void *data,
+                        size_t *valid_end, uint64_t *file_generation)
+{
+    *valid_end = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return errno == ENOENT ? 0 : -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size < WAL_FILE_HEADER)
+    {
+        close(fd);
+        return 0;
+    }
+    char *map = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+    if (memcmp(map, magic, 8) != 0)
+    {
+        fprintf(stderr, "%s is not a naming server %s\n", path, strcmp(magic, WAL_MAGIC) == 0 ? "log" : "snapshot");
+        munmap(map, st.st_size);
+        return -1;
+    }
+    ProtoReader reader = {map + 8, map + WAL_FILE_HEADER, 0};
+    *file_generation = proto_get_u64(&reader);
+
+    long count = 0;
+    const char *pos = map + WAL_FILE_HEADER;
+    const char *end = map + st.st_size;
+    while ((size_t)(end - pos) >= WAL_RECORD_HEADER)
+    {
+        ProtoReader header = {pos, pos + WAL_RECORD_HEADER, 0};
+        uint32_t len = proto_get_u32(&header);
+        uint32_t crc = proto_get_u32(&header);
+        uint8_t type = proto_get_u8(&header);
+        if (len == 0 || (size_t)(end - pos) - 8 < len)
+            break;
+        const char *payload = pos + WAL_RECORD_HEADER;
+        if (record_crc(type, payload, len - 1) != crc)
+            break;
+        ProtoReader record = {payload, payload + len - 1, 0};
+        replay(type, &record, data);
+        count++;
+        pos += 8 + len;
+    }
+    *valid_end = pos - map;
+    if (pos != end)
+        fprintf(stderr, "Ignoring %zu bytes of torn or corrupt records at the end of %s\n", (size_t)(end - pos), path);
+    munmap(map, st.st_size);
+    return count;
+}
+
+static void flush_snapshot_buffer(void)
+{
+    if (snapshot_buffer.len == 0 || snapshot_failed)
+        return;
+    struct iovec iov = {snapshot_buffer.data, snapshot_buffer.len};
+    if (snapshot_buffer.failed || write_iov(snapshot_fd, &iov, 1) < 0)
+        snapshot_failed = 1;
+    proto_writer_reset(&snapshot_buffer);
+}
+
+void wal_snapshot_add(uint8_t type, const ProtoWriter *record)
+{
+    if (snapshot_fd < 0 || frame_record(type, record) < 0)
+    {
+        snapshot_failed = 1;
+        return;
+    }
+    proto_put_bytes(&snapshot_buffer, frame.data, frame.len);
+    proto_put_bytes(&snapshot_buffer, record->data, record->len);
+    if (snapshot_buffer.len >= WAL_SNAPSHOT_BUFFER)
+        flush_snapshot_buffer();
+}
+
+// Writes the whole state to a new snapshot and empties the log. The new
+// snapshot is renamed into place before the log is cut, and carries the next
+// generation, so after a crash in between the old log is recognized as
+// already folded in and skipped.
+static void checkpoint(void)
+{
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", snapshot_path);
+
+    wal_begin();
+    uint64_t previous = generation;
+    generation++;
+    snapshot_failed = 0;
+    snapshot_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (snapshot_fd < 0 || write_file_header(snapshot_fd, SNAPSHOT_MAGIC) < 0)
+        snapshot_failed = 1;
+    if (!snapshot_failed && snapshot_writer(snapshot_data) != 0)
+        snapshot_failed = 1;
+    flush_snapshot_buffer();
+    if (!snapshot_failed && fsync(snapshot_fd) < 0)
+        snapshot_failed = 1;
+    if (snapshot_fd >= 0)
+        close(snapshot_fd);
+    snapshot_fd = -1;
+    if (!snapshot_failed && rename(tmp_path, snapshot_path) < 0)
+        snapshot_failed = 1;
+    if (snapshot_failed)
+    {
+        perror("Failed to write naming server snapshot");
+        unlink(tmp_path);
+        generation = previous;
+        wal_end();
+        return;
+    }
+    sync_parent_directory(snapshot_path);
+
+    if (ftruncate(log_fd, 0) < 0 || write_file_header(log_fd, WAL_MAGIC) < 0)
+        perror("Failed to reset naming server log");
+    fdatasync(log_fd);
+    log_size = WAL_FILE_HEADER;
+    dirty = 0;
+    wal_end();
+}
+
+static void *checkpoint_loop(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&stop_lock);
+    while (!stopping)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += WAL_SYNC_INTERVAL_MS / 1000;
+        pthread_cond_timedwait(&stop_cond, &stop_lock, &deadline);
+        pthread_mutex_unlock(&stop_lock);
+
+        wal_begin();
+        int sync = dirty;
+        int compact = log_size >= max_bytes;
+        dirty = 0;
+        wal_end();
+        // Appends continue while the log is synced
+        if (sync)
+            fdatasync(log_fd);
+        if (compact)
+            checkpoint();
+
+        pthread_mutex_lock(&stop_lock);
+    }
+    pthread_mutex_unlock(&stop_lock);
+    return NULL;
+}
+
+long wal_open(const char *path, const char *snap_path, wal_replay_cb replay, wal_snapshot_cb snapshot, void *data)
+{
+    const char *max_env = getenv("NM_WAL_MAX_BYTES");
+    if (max_env && strtoull(max_env, NULL, 10) > 0)
+        max_bytes = strtoull(max_env, NULL, 10);
+    log_path = strdup(path);
+    snapshot_path = strdup(snap_path);
+    snapshot_writer = snapshot;
+    snapshot_data = data;
+    stopping = 0; // The log may be opened again after wal_close()
+    proto_writer_init(&frame);
+    proto_writer_init(&snapshot_buffer);
+    if (!log_path || !snapshot_path)
+    {
+        perror("Failed to allocate log paths");
+        return -1;
+    }
+
+    size_t valid_end;
+    uint64_t snapshot_generation = 0, log_generation = 0;
+    long snapshot_records = replay_file(snapshot_path, SNAPSHOT_MAGIC, replay, data, &valid_end, &snapshot_generation);
+    if (snapshot_records < 0)
+        return -1;
+
+    // A log older than the snapshot was cut short by a crash right after
+    // the snapshot was written; everything in it is already in the snapshot
+    long log_records = 0;
+    int fd = open(log_path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0)
+    {
+        char header[WAL_FILE_HEADER];
+        ProtoReader reader = {header + 8, header + WAL_FILE_HEADER, 0};
+        if (read(fd, header, sizeof(header)) == WAL_FILE_HEADER && memcmp(header, WAL_MAGIC, 8) == 0)
+            log_generation = proto_get_u64(&reader);
+        close(fd);
+    }
+    generation = snapshot_generation;
+    valid_end = 0;
+    if (fd >= 0 && log_generation >= snapshot_generation)
+    {
+        log_records = replay_file(log_path, WAL_MAGIC, replay, data, &valid_end, &log_generation);
+        if (log_records < 0)
+            return -1;
+        generation = log_generation;
+    }
+
+    log_fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log_fd < 0)
+    {
+        perror("Failed to open naming server log");
+        return -1;
+    }
+    if (valid_end < WAL_FILE_HEADER)
+    {
+        // New, stale or unreadable log: start it over
+        if (ftruncate(log_fd, 0) < 0 || write_file_header(log_fd, WAL_MAGIC) < 0)
+        {
+            perror("Failed to initialize naming server log");
+            return -1;
+        }
+        valid_end = WAL_FILE_HEADER;
+    }
+    else if (ftruncate(log_fd, valid_end) < 0)
+    {
+        perror("Failed to cut the torn end of the naming server log");
+        return -1;
+    }
+    log_size = valid_end;
+
+    if (pthread_create(&checkpoint_thread, NULL, checkpoint_loop, NULL) != 0)
+    {
+        perror("Failed to start checkpoint thread");
+        return -1;
+    }
+    return snapshot_records + log_records;
+}
+
+void wal_close(void)
+{
+    if (log_fd < 0)
+        return;
+    pthread_mutex_lock(&stop_lock);
+    stopping = 1;
+    pthread_cond_signal(&stop_cond);
+    pthread_mutex_unlock(&stop_lock);
+    pthread_join(checkpoint_thread, NULL);
+    wal_begin();
+    fdatasync(log_fd);
+    close(log_fd);
+    log_fd = -1;
+    wal_end();
+    proto_writer_free(&frame);
+    proto_writer_free(&snapshot_buffer);
+    free(log_path);
+    free(snapshot_path);
+}
+
+void wal_begin(void)
+{
+    pthread_mutex_lock(&wal_lock);
+}
+
+void wal_end(void)
+{
+    pthread_mutex_unlock(&wal_lock);
+}
+
+void wal_append(uint8_t type, const ProtoWriter *record)
+{
+    if (log_fd < 0)
+        return;
+    if (frame_record(type, record) < 0)
+    {
+        fprintf(stderr, "Failed to encode log record %u\n", type);
+        return;
+    }
+    struct iovec iov[2] = {{frame.data, frame.len}, {record->data, record->len}};
+    if (write_iov(log_fd, iov, record->len ? 2 : 1) < 0)
+    {
+        perror("Failed to append to naming server log");
+        return;
+    }
+    log_size += frame.len + record->len;
+    dirty = 1;
+}
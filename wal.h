@@ -0,0 +1,45 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdint.h>
+#include "protocol.h"
+
+// Write-ahead log for the naming server's metadata. Every change to the
+// namespace is appended as a typed record; a background thread syncs the log
+// to disk and, once it grows past a size limit, replaces it with a compact
+// snapshot of the whole state. At startup the snapshot and then the log are
+// replayed through a callback, so the naming server comes back with its
+// namespace instead of waiting for every storage server to re-register.
+//
+// Each record on disk is u32 length | u32 CRC-32 | u8 type | payload, with
+// the payload encoded with a ProtoWriter. A torn or corrupt tail (a crash in
+// the middle of an append) is cut off at the last good record.
+
+// Called for every record found at startup
+typedef void (*wal_replay_cb)(uint8_t type, ProtoReader *record, void *data);
+
+// Called by the checkpoint thread, between wal_begin() and wal_end(), to
+// write the whole state with wal_snapshot_add(). Returns 0 on success.
+typedef int (*wal_snapshot_cb)(void *data);
+
+// Replays the snapshot and the log, then opens the log for appending and
+// starts the checkpoint thread. The compaction threshold is read from
+// NM_WAL_MAX_BYTES. Returns the number of records replayed, or -1 on error.
+long wal_open(const char *log_path, const char *snapshot_path, wal_replay_cb replay, wal_snapshot_cb snapshot, void *data);
+
+// Syncs the log and stops the checkpoint thread
+void wal_close(void);
+
+// A change is applied in memory and appended between wal_begin() and
+// wal_end(), so the log order is the order changes were applied in and a
+// snapshot never falls between the two.
+void wal_begin(void);
+void wal_end(void);
+
+// Appends one record. Does nothing while replaying or if the log is closed.
+void wal_append(uint8_t type, const ProtoWriter *record);
+
+// Adds one record to the snapshot being written
+void wal_snapshot_add(uint8_t type, const ProtoWriter *record);
+
+#endif // WAL_H
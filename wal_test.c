@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "wal.h"
+
+// Standalone test of the naming server's write-ahead log and snapshots:
+//   gcc -o wal_test wal_test.c wal.c fileio.c protocol.c -lpthread && ./wal_test
+
+#define TEST_RECORD 7
+#define MAX_RECORDS 4096
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+    if (ok) {
+        printf("✅ %s\n", what);
+    } else {
+        printf("❌ %s\n", what);
+        failures++;
+    }
+}
+
+static char log_path[256];
+static char snapshot_path[256];
+
+// What the log holds: record i carries i and "path/<i>"
+static uint32_t state[MAX_RECORDS];
+static int state_count = 0;
+
+// What a replay gave back
+static uint32_t replayed[MAX_RECORDS];
+static int replayed_count = 0;
+static int replay_errors = 0;
+
+static void replay(uint8_t type, ProtoReader *record, void *data) {
+    (void)data;
+    uint32_t value = proto_get_u32(record);
+    const char *path = proto_get_str(record);
+    char expected[32];
+    snprintf(expected, sizeof(expected), "path/%u", value);
+    if (type != TEST_RECORD || record->failed || !path || strcmp(path, expected) != 0 ||
+        replayed_count == MAX_RECORDS) {
+        replay_errors++;
+        return;
+    }
+    replayed[replayed_count++] = value;
+}
+
+static void encode(ProtoWriter *writer, uint32_t value) {
+    char path[32];
+    snprintf(path, sizeof(path), "path/%u", value);
+    proto_writer_reset(writer);
+    proto_put_u32(writer, value);
+    proto_put_str(writer, path);
+}
+
+static int write_snapshot(void *data) {
+    (void)data;
+    ProtoWriter writer;
+    proto_writer_init(&writer);
+    for (int i = 0; i < state_count; i++) {
+        encode(&writer, state[i]);
+        wal_snapshot_add(TEST_RECORD, &writer);
+    }
+    proto_writer_free(&writer);
+    return 0;
+}
+
+static void append(uint32_t value) {
+    ProtoWriter writer;
+    proto_writer_init(&writer);
+    encode(&writer, value);
+    wal_begin();
+    state[state_count++] = value;
+    wal_append(TEST_RECORD, &writer);
+    wal_end();
+    proto_writer_free(&writer);
+}
+
+// Closes the log and opens it again, replaying into replayed[]
+static long reopen(void) {
+    wal_close();
+    replayed_count = 0;
+    replay_errors = 0;
+    return wal_open(log_path, snapshot_path, replay, write_snapshot, NULL);
+}
+
+// The replay gave back exactly the first count records of the state
+static int replayed_state(int count) {
+    if (replay_errors || replayed_count != count) {
+        return 0;
+    }
+    for (int i = 0; i < count; i++) {
+        if (replayed[i] != state[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static off_t file_size(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+int main() {
+    printf("=== Write-Ahead Log Test ===\n");
+    char dir[] = "/tmp/wal_test.XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    snprintf(log_path, sizeof(log_path), "%s/test.wal", dir);
+    snprintf(snapshot_path, sizeof(snapshot_path), "%s/test.snap", dir);
+    setenv("NM_WAL_MAX_BYTES", "1073741824", 1); // No compaction unless asked for
+
+    printf("\n📜 Replay...\n");
+    check(wal_open(log_path, snapshot_path, replay, write_snapshot, NULL) == 0, "a new log replays nothing");
+    for (uint32_t i = 0; i < 100; i++) {
+        append(i);
+    }
+    check(reopen() == 100 && replayed_state(100), "100 records come back in order");
+
+    printf("\n✂️  Torn and corrupt records...\n");
+    append(100);
+    wal_close();
+    off_t full = file_size(log_path);
+    // A crash halfway through the last append
+    if (truncate(log_path, full - 5) != 0) {
+        perror("truncate");
+    }
+    replayed_count = 0;
+    check(wal_open(log_path, snapshot_path, replay, write_snapshot, NULL) == 100 && replayed_state(100),
+          "a torn last record is dropped, the ones before it kept");
+    state_count = 100;
+    append(101);
+    check(reopen() == 101 && replayed[100] == 101, "a record appended after the cut is replayed after the good ones");
+
+    // Garbage after the last record, as if a header had been half written
+    wal_close();
+    int fd = open(log_path, O_WRONLY | O_APPEND);
+    if (write(fd, "\x00\x00\x01\x00\xde\xad", 6) != 6) {
+        perror("write");
+    }
+    close(fd);
+    replayed_count = 0;
+    replay_errors = 0;
+    check(wal_open(log_path, snapshot_path, replay, write_snapshot, NULL) == 101 && replayed_state(101),
+          "trailing garbage is ignored");
+
+    // A flipped byte in the payload of record 50 stops the replay there
+    wal_close();
+    off_t corrupt_at = 16; // File header
+    for (int i = 0; i < 50; i++) {
+        char path[32];
+        snprintf(path, sizeof(path), "path/%d", i);
+        corrupt_at += 9 + 4 + 4 + strlen(path) + 1; // Record header, u32, string
+    }
+    corrupt_at += 9 + 4 + 4 + 2; // Into "path/50"
+    fd = open(log_path, O_RDWR);
+    char byte;
+    if (pread(fd, &byte, 1, corrupt_at) == 1) {
+        byte ^= 0x20;
+        if (pwrite(fd, &byte, 1, corrupt_at) != 1) {
+            perror("pwrite");
+        }
+    }
+    close(fd);
+    replayed_count = 0;
+    replay_errors = 0;
+    check(wal_open(log_path, snapshot_path, replay, write_snapshot, NULL) == 50 && replayed_state(50),
+          "a record failing its checksum ends the replay");
+    state_count = 50;
+
+    printf("\n📸 Snapshots...\n");
+    wal_close();
+    setenv("NM_WAL_MAX_BYTES", "4096", 1);
+    replayed_count = 0;
+    wal_open(log_path, snapshot_path, replay, write_snapshot, NULL);
+    for (uint32_t i = 1000; i < 1400; i++) {
+        append(i);
+    }
+    // The checkpoint thread looks at the log size every second
+    for (int i = 0; i < 50 && file_size(snapshot_path) <= 0; i++) {
+        usleep(100000);
+    }
+    usleep(200000);
+    check(file_size(snapshot_path) > 0, "an oversized log is compacted into a snapshot");
+    check(file_size(log_path) < 4096 * 2, "the log is emptied once the snapshot is written");
+    append(2000);
+    setenv("NM_WAL_MAX_BYTES", "1073741824", 1);
+    check(reopen() == state_count && replayed_state(state_count), "snapshot and log together replay the whole state");
+
+    wal_close();
+    unlink(log_path);
+    unlink(snapshot_path);
+    rmdir(dir);
+    printf("\n%s %d failure(s)\n", failures ? "❌" : "🎉", failures);
+    return failures ? 1 : 0;
+}
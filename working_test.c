@@ -4,87 +4,102 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include "protocol.h"
 
-#define BUFFER_SIZE 1024
+// gcc -o working_test working_test.c protocol.c
+
+// Sends a request naming path and waits for the reply to it, skipping
+// notifications. Returns the reply's opcode, or 0 if the connection failed.
+static uint16_t ask_naming_server(int sock, uint16_t opcode, const char *path, uint32_t request_id, ProtoMessage *reply) {
+    if (proto_send_str(sock, opcode, request_id, path) < 0) {
+        return 0;
+    }
+    while (proto_recv(sock, reply) > 0) {
+        if (reply->header.request_id == request_id) {
+            return reply->header.opcode;
+        }
+    }
+    return 0;
+}
 
 int main() {
     printf("=== NFS Working Test ===\n");
-    
+
     // Test 1: Connect to naming server
     printf("Test 1: Connecting to naming server...\n");
-    
+
     int sock = socket(AF_INET, SOCK_STREAM, 0);
     if (sock < 0) {
         perror("Socket creation failed");
         return 1;
     }
-    
+
     struct sockaddr_in ns_addr;
     ns_addr.sin_family = AF_INET;
     ns_addr.sin_port = htons(8090);
     inet_pton(AF_INET, "172.18.246.198", &ns_addr.sin_addr);
-    
+
     if (connect(sock, (struct sockaddr *)&ns_addr, sizeof(ns_addr)) < 0) {
         perror("Connection to naming server failed");
         return 1;
     }
-    
+
     printf("✅ Connected to naming server\n");
-    
+
     // Test 2: Send client identification
     printf("Test 2: Sending client identification...\n");
-    send(sock, "CLIENT CONNECTING TO NAMING SERVER ...", 38, 0);
-    
-    char buffer[BUFFER_SIZE];
-    int bytes_read = recv(sock, buffer, BUFFER_SIZE - 1, 0);
-    if (bytes_read > 0) {
-        buffer[bytes_read] = '\0';
-        printf("✅ Naming server response: %s", buffer);
+    proto_send(sock, PROTO_CLIENT_HELLO, 0, 0, NULL, 0);
+
+    ProtoMessage msg = {0};
+    if (proto_recv(sock, &msg) > 0 && msg.header.opcode == PROTO_WELCOME) {
+        printf("✅ Naming server accepted the client\n");
+    } else {
+        printf("❌ Naming server did not accept the client\n");
+        proto_message_free(&msg);
+        close(sock);
+        return 1;
     }
-    
-    // Test 3: Send READ command
-    printf("Test 3: Sending READ command...\n");
-    send(sock, "READ test_storage1/file1.txt", 28, 0);
-    
-    sleep(1);
-    
-    bytes_read = recv(sock, buffer, BUFFER_SIZE - 1, 0);
-    if (bytes_read > 0) {
-        buffer[bytes_read] = '\0';
-        printf("✅ Storage server info: %s", buffer);
-        
-        // Parse IP and port
-        char ss_ip[16];
-        int ss_port;
-        if (sscanf(buffer, "IP: %15s Port: %d", ss_ip, &ss_port) == 2) {
-            printf("✅ Parsed storage server: %s:%d\n", ss_ip, ss_port);
-            
+
+    // Test 3: Send READ request
+    printf("Test 3: Sending READ request...\n");
+    uint16_t reply = ask_naming_server(sock, PROTO_READ, "test_storage1/file1.txt", 1, &msg);
+
+    if (reply == PROTO_LOCATION) {
+        ProtoReader reader;
+        proto_reader_init(&reader, &msg);
+        const char *ss_ip = proto_get_str(&reader);
+        int ss_port = (int)proto_get_u32(&reader);
+        if (ss_ip && !reader.failed) {
+            printf("✅ Storage server: %s:%d\n", ss_ip, ss_port);
+
             // Test 4: Connect to storage server
             printf("Test 4: Connecting to storage server...\n");
-            
+
             int ss_sock = socket(AF_INET, SOCK_STREAM, 0);
             struct sockaddr_in ss_addr;
             ss_addr.sin_family = AF_INET;
             ss_addr.sin_port = htons(ss_port);
             inet_pton(AF_INET, ss_ip, &ss_addr.sin_addr);
-            
+
             if (connect(ss_sock, (struct sockaddr *)&ss_addr, sizeof(ss_addr)) == 0) {
                 printf("✅ Connected to storage server\n");
-                
+
                 // Test 5: Send read request to storage server
                 printf("Test 5: Requesting file from storage server...\n");
-                send(ss_sock, "READ test_storage1/file1.txt", 28, 0);
-                
+                proto_send_str(ss_sock, PROTO_READ, 1, "test_storage1/file1.txt");
+
                 printf("File content:\n");
                 printf("--- START ---\n");
-                while ((bytes_read = recv(ss_sock, buffer, BUFFER_SIZE - 1, 0)) > 0) {
-                    buffer[bytes_read] = '\0';
-                    if (strncmp(buffer, "EOF", 3) == 0) break;
-                    printf("%s", buffer);
+                while (proto_recv(ss_sock, &msg) > 0 && msg.header.opcode == PROTO_DATA) {
+                    fwrite(msg.payload, 1, msg.header.payload_len, stdout);
                 }
                 printf("\n--- END ---\n");
-                printf("✅ File read successfully\n");
-                
+                if (msg.header.opcode == PROTO_END) {
+                    printf("✅ File read successfully\n");
+                } else {
+                    printf("❌ File read failed\n");
+                }
+
                 close(ss_sock);
             } else {
                 printf("❌ Failed to connect to storage server\n");
@@ -92,10 +107,16 @@ int main() {
         } else {
             printf("❌ Failed to parse storage server info\n");
         }
+    } else if (reply != 0) {
+        ProtoReader reader;
+        proto_reader_init(&reader, &msg);
+        const char *text = proto_get_str(&reader);
+        printf("❌ Naming server replied: %s", text ? text : "(no message)\n");
     } else {
         printf("❌ No response from naming server\n");
     }
-    
+
+    proto_message_free(&msg);
     close(sock);
     printf("\n=== Test Complete ===\n");
     return 0;
@@ -4,12 +4,27 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include "protocol.h"
 
-#define BUFFER_SIZE 1024
+// gcc -o write_test write_test.c protocol.c
+
+// Sends a request naming path and waits for the reply to it, skipping
+// notifications. Returns the reply's opcode, or 0 if the connection failed.
+static uint16_t ask_naming_server(int sock, uint16_t opcode, const char *path, uint32_t request_id, ProtoMessage *reply) {
+    if (proto_send_str(sock, opcode, request_id, path) < 0) {
+        return 0;
+    }
+    while (proto_recv(sock, reply) > 0) {
+        if (reply->header.request_id == request_id) {
+            return reply->header.opcode;
+        }
+    }
+    return 0;
+}
 
 int main() {
     printf("📝 === NFS WRITE OPERATION TEST ===\n");
-    
+
     // Step 1: Connect to naming server
     printf("Step 1: Connecting to naming server...\n");
     int ns_sock = socket(AF_INET, SOCK_STREAM, 0);
@@ -17,35 +32,38 @@ int main() {
     ns_addr.sin_family = AF_INET;
     ns_addr.sin_port = htons(8090);
     inet_pton(AF_INET, "172.18.246.198", &ns_addr.sin_addr);
-    
+
     if (connect(ns_sock, (struct sockaddr *)&ns_addr, sizeof(ns_addr)) < 0) {
         printf("❌ Failed to connect to naming server\n");
         return 1;
     }
     printf("✅ Connected to naming server\n");
-    
-    // Step 2: Send client identification
-    send(ns_sock, "CLIENT CONNECTING TO NAMING SERVER ...", 38, 0);
-    char buffer[BUFFER_SIZE];
-    recv(ns_sock, buffer, BUFFER_SIZE - 1, 0);
+
+    // Step 2: Send client identification; the welcome carries the session
+    proto_send(ns_sock, PROTO_CLIENT_HELLO, 0, 0, NULL, 0);
+    ProtoMessage msg = {0};
+    if (proto_recv(ns_sock, &msg) <= 0 || msg.header.opcode != PROTO_WELCOME) {
+        printf("❌ Naming server did not accept the client\n");
+        proto_message_free(&msg);
+        close(ns_sock);
+        return 1;
+    }
+    ProtoReader reader;
+    proto_reader_init(&reader, &msg);
+    uint64_t session_token = proto_get_u64(&reader);
     printf("✅ Client identified\n");
-    
-    // Step 3: Send WRITE command
-    printf("Step 2: Sending WRITE command...\n");
-    send(ns_sock, "WRITE test_storage1/file2.txt", 29, 0);
-    sleep(1);
-    
-    int bytes = recv(ns_sock, buffer, BUFFER_SIZE - 1, 0);
-    if (bytes > 0) {
-        buffer[bytes] = '\0';
-        printf("✅ Naming server response: %s", buffer);
-        
-        // Parse storage server info
-        char ss_ip[16];
-        int ss_port;
-        if (sscanf(buffer, "IP: %15s Port: %d", ss_ip, &ss_port) == 2) {
+
+    // Step 3: Send WRITE request
+    printf("Step 2: Sending WRITE request...\n");
+    uint16_t reply = ask_naming_server(ns_sock, PROTO_WRITE, "test_storage1/file2.txt", 1, &msg);
+
+    if (reply == PROTO_LOCATION) {
+        proto_reader_init(&reader, &msg);
+        const char *ss_ip = proto_get_str(&reader);
+        int ss_port = (int)proto_get_u32(&reader);
+        if (ss_ip && !reader.failed) {
             printf("✅ Storage server: %s:%d\n", ss_ip, ss_port);
-            
+
             // Step 4: Connect to storage server
             printf("Step 3: Connecting to storage server...\n");
             int ss_sock = socket(AF_INET, SOCK_STREAM, 0);
@@ -53,46 +71,57 @@ int main() {
             ss_addr.sin_family = AF_INET;
             ss_addr.sin_port = htons(ss_port);
             inet_pton(AF_INET, ss_ip, &ss_addr.sin_addr);
-            
+
             if (connect(ss_sock, (struct sockaddr *)&ss_addr, sizeof(ss_addr)) == 0) {
                 printf("✅ Connected to storage server\n");
-                
-                // Step 5: Send WRITE command with data
-                printf("Step 4: Sending WRITE command with data...\n");
-                char write_cmd[] = "WRITE test_storage1/file2.txt Hello from NFS test!";
-                send(ss_sock, write_cmd, strlen(write_cmd), 0);
-                printf("✅ WRITE command sent\n");
-                
+
+                // Step 5: Send a synchronous WRITE with data
+                printf("Step 4: Sending WRITE request with data...\n");
+                const char *data = "Hello from NFS test!";
+                ProtoWriter writer;
+                proto_writer_init(&writer);
+                proto_put_u64(&writer, session_token);
+                proto_put_str(&writer, "test_storage1/file2.txt");
+                proto_put_bytes(&writer, data, strlen(data));
+                proto_send_writer(ss_sock, PROTO_WRITE, PROTO_FLAG_SYNC, 1, &writer);
+                proto_writer_free(&writer);
+                printf("✅ WRITE request sent\n");
+
                 // Wait for response
-                sleep(1);
-                bytes = recv(ss_sock, buffer, BUFFER_SIZE - 1, 0);
-                if (bytes > 0) {
-                    buffer[bytes] = '\0';
-                    printf("✅ Storage server response: %s", buffer);
+                if (proto_recv(ss_sock, &msg) > 0) {
+                    proto_reader_init(&reader, &msg);
+                    const char *text = proto_get_str(&reader);
+                    printf("%s Storage server response: %s", msg.header.opcode == PROTO_OK ? "✅" : "❌",
+                           text ? text : "(no message)\n");
                 }
-                
+
                 close(ss_sock);
             } else {
                 printf("❌ Failed to connect to storage server\n");
             }
         }
+    } else if (reply != 0) {
+        proto_reader_init(&reader, &msg);
+        const char *text = proto_get_str(&reader);
+        printf("❌ Naming server replied: %s", text ? text : "(no message)\n");
     }
-    
+
+    proto_message_free(&msg);
     close(ns_sock);
-    
+
     // Step 6: Verify the write by reading the file directly
     printf("Step 5: Verifying write operation...\n");
     FILE *file = fopen("test_storage1/file2.txt", "r");
     if (file) {
         char content[256];
         if (fgets(content, sizeof(content), file)) {
-            printf("✅ File content after write: %s", content);
+            printf("✅ File content after write: %s\n", content);
         }
         fclose(file);
     } else {
         printf("❌ Could not read file after write\n");
     }
-    
+
     printf("\n🎉 WRITE test completed!\n");
     return 0;
 }